@@ -68,20 +68,13 @@
 #include "ipsec/sa.h"
 #include "ipsec/md5.h"
 #include "ipsec/sha1.h"
+#include "ipsec/hash_multi.h"
+#include "ipsec/chksum.h"
 
 #include "ipsec/ah.h"
 
 
 
-__u32 ipsec_ah_bitmap 	= 0;        		/**< save session state to detect replays - must be 32 bits. 
-											 *   Note: must be initialized with zero (0x00000000) when
-											 *         a new SA is established! */
-__u32 ipsec_ah_lastSeq 	= 0;         		/**< save session state to detect replays
-											 *   Note: must be initialized with zero (0x00000000) when
-											 *         a new SA is established! */
-
-
-
 /**
  * Checks AH header and ICV (RFC 2402).
  * Mutable fields of the outer IP header are set to zero prior to the ICV calculation.
@@ -96,43 +89,75 @@ __u32 ipsec_ah_lastSeq 	= 0;         		/**< save session state to detect replays
  * @return IPSEC_STATUS_SUCCESS	        packet could be authenticated
  * @return IPSEC_STATUS_FAILURE         packet is corrupted or ICV does not match
  * @return IPSEC_STATUS_NOT_IMPLEMENTED invalid mode (only IPSEC_TUNNEL mode is implemented)
+ * @return see ipsec_ah_check_chain()
  */
 int ipsec_ah_check(ipsec_ip_header *outer_packet, int *payload_offset, int *payload_size,
  				    sad_entry *sa)
+{
+	ipsec_buffer segment;
+
+	segment.next = NULL;
+	segment.data = (unsigned char *)outer_packet;
+	segment.len  = ipsec_ntohs(outer_packet->len);
+
+	return ipsec_ah_check_chain(&segment, payload_offset, payload_size, sa);
+}
+
+
+/**
+ * First part of the AH check: checks the AH header and the sequence number and sets the 
+ * mutable fields and the ICV to zero, so that the ICV can be calculated.
+ *
+ * @param	chain           first segment of the (outer) IP packet which hast to be checked
+ * @param 	sa              pointer to security association holding the secret authentication key
+ * @param	orig_digest		returns the ICV of the packet (IPSEC_MAX_AUTHKEY_LEN bytes)
+ * @param	ah_offs			returns the offset of the AH header
+ * @param	ah_len			returns the length of the AH header (including the ICV)
+ *
+ * @return IPSEC_STATUS_SUCCESS	        the ICV can be calculated
+ * @return see ipsec_ah_check_chain()
+ */
+static int ipsec_ah_check_start(ipsec_buffer *chain, sad_entry *sa, unsigned char *orig_digest, int *ah_offs, int *ah_len)
 {
 	int ret_val 	= IPSEC_STATUS_NOT_INITIALIZED;	/* by default, the return value is undefined */
+	ipsec_ip_header *outer_packet;
 	ipsec_ah_header *ah_header;
-	int ah_len;
-	int ah_offs;
-	unsigned char orig_digest[IPSEC_MAX_AUTHKEY_LEN];
-	unsigned char digest[IPSEC_MAX_AUTHKEY_LEN];
+	int icv_len;
 
-	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER,
-	              "ipsec_ah_check",
-				  ("outer_packet=%p, *payload_offset=%d, *payload_size=%d sa=%p",
-			      (void *)outer_packet, *payload_offset, *payload_size, (void *)sa)
-				 );
+	/* the SAs are set up on the control path (ipsec_sad_add(), ipsec_spd_load_dbs()), never by a packet */
+	if(sa->key_state != IPSEC_KEYS_READY)
+	{
+		IPSEC_LOG_ERR("ipsec_ah_check_chain", IPSEC_STATUS_BAD_KEY, ("no valid HMAC state for this SA")) ;
+		return IPSEC_STATUS_BAD_KEY;
+	}
 
-	/* The AH header is expected to be 24 bytes since we support only 96 bit authentication values */
-	ah_offs = ((outer_packet->v_hl & 0x0F) << 2);
-	ah_len = (IPSEC_AH_HDR_SIZE - 4) + ( ((ipsec_ah_header *)((unsigned char *)outer_packet + ah_offs))->len << 2 );
+	icv_len = IPSEC_AUTH_ICV_LEN(sa->auth_alg);
+	outer_packet = (ipsec_ip_header *)chain->data;
+	*ah_offs = ((outer_packet->v_hl & 0x0F) << 2);
+	if((chain->len < *ah_offs + IPSEC_AH_HDR_SIZE + icv_len) || (ipsec_buffer_len(chain) < ipsec_ntohs(outer_packet->len)))
+	{
+		IPSEC_LOG_ERR("ipsec_ah_check_chain", IPSEC_STATUS_BAD_PACKET, ("AH packet is truncated or its headers span several segments") );
+		return IPSEC_STATUS_BAD_PACKET;
+	}
+
+	/* The AH header is expected to hold exactly the ICV of the SA's authentication algorithm */
+	*ah_len = (IPSEC_AH_HDR_SIZE - 4) + ( ((ipsec_ah_header *)((unsigned char *)outer_packet + *ah_offs))->len << 2 );
 
 	/* minimal AH header + ICV */
-	if(ah_len != IPSEC_AH_HDR_SIZE + IPSEC_AUTH_ICV)
+	if(*ah_len != IPSEC_AH_HDR_SIZE + icv_len)
 	{
-		IPSEC_LOG_DBG("ipsec_ah_check", IPSEC_STATUS_FAILURE, ("wrong AH header size: ah_len=%d (must be 24 bytes, only 96bit authentication values allowed)", ah_len) );
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_check", ("return = %d", IPSEC_STATUS_FAILURE) );
+		IPSEC_LOG_DBG("ipsec_ah_check_chain", IPSEC_STATUS_FAILURE, ("wrong AH header size: ah_len=%d (must be %d bytes)", *ah_len, IPSEC_AH_HDR_SIZE + icv_len) );
 		return IPSEC_STATUS_FAILURE;
 	}
 	
-	ah_header = ((ipsec_ah_header *)((unsigned char *)outer_packet + ah_offs));
+	ah_header = ((ipsec_ah_header *)((unsigned char *)outer_packet + *ah_offs));
 
-	/* preliminary anti-replay check (without updating the global sequence number window)     */
+	/* preliminary anti-replay check (without updating the SA's sequence number window)     */
 	/* This check prevents useless ICV calculation if the Sequence Number is obviously wrong  */
-	ret_val = ipsec_check_replay_window(ipsec_ntohl(ah_header->sequence), ipsec_ah_lastSeq, ipsec_ah_bitmap);
+	ret_val = ipsec_check_replay_window(ipsec_ntohl(ah_header->sequence), &sa->replay);
 	if(ret_val != IPSEC_AUDIT_SUCCESS)
 	{
-		IPSEC_LOG_AUD("ipsec_ah_check", IPSEC_AUDIT_SEQ_MISMATCH, ("packet rejected by anti-replay check (lastSeq=%08lx, seq=%08lx, window size=%d)", ipsec_ah_lastSeq, ipsec_ntohl(ah_header->sequence), IPSEC_SEQ_MAX_WINDOW) );
+		IPSEC_LOG_AUD("ipsec_ah_check_chain", IPSEC_AUDIT_SEQ_MISMATCH, ("packet rejected by anti-replay check (lastSeq=%08lx, seq=%08lx, window size=%d)", sa->replay.last_seq, ipsec_ntohl(ah_header->sequence), sa->replay.window) );
 		return ret_val;
 	}
 	
@@ -143,59 +168,229 @@ int ipsec_ah_check(ipsec_ip_header *outer_packet, int *payload_offset, int *payl
 	outer_packet->ttl		= 0;
 	outer_packet->chksum	= 0;
 
-	/* backup 96bit HMAC before setting it to 0 */
-	memcpy(orig_digest, ah_header->ah_data, IPSEC_AUTH_ICV);
-	memset(((ipsec_ah_header *)((unsigned char *)outer_packet + ah_offs))->ah_data, '\0', IPSEC_AUTH_ICV);
+	/* backup the truncated HMAC before setting it to 0 */
+	memcpy(orig_digest, ah_header->ah_data, icv_len);
+	memset(((ipsec_ah_header *)((unsigned char *)outer_packet + *ah_offs))->ah_data, '\0', icv_len);
 
 	if(sa->mode != IPSEC_TUNNEL)
 	{
-		IPSEC_LOG_ERR("ipsec_ah_check", IPSEC_STATUS_NOT_IMPLEMENTED, ("Can't handle mode %d. Only mode %d (IPSEC_TUNNEL) is implemented.", sa->mode, IPSEC_TUNNEL) );
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_check", ("return = %d", IPSEC_STATUS_NOT_IMPLEMENTED) );
+		IPSEC_LOG_ERR("ipsec_ah_check_chain", IPSEC_STATUS_NOT_IMPLEMENTED, ("Can't handle mode %d. Only mode %d (IPSEC_TUNNEL) is implemented.", sa->mode, IPSEC_TUNNEL) );
 		return IPSEC_STATUS_NOT_IMPLEMENTED;
 	}
 
+	return IPSEC_STATUS_SUCCESS;
+}
+
+/**
+ * Second part of the AH check: compares the ICV, updates the anti-replay window and returns 
+ * where the inner packet is.
+ *
+ * @param	chain           first segment of the (outer) IP packet which hast to be checked
+ * @param   payload_offset  pointer used to return offset of inner (original) IP packet relative to the start of the chain
+ * @param   payload_size    pointer used to return total size of the inner (original) IP packet
+ * @param 	sa              pointer to security association holding the secret authentication key
+ * @param	orig_digest		ICV of the packet, as returned by ipsec_ah_check_start()
+ * @param	digest			ICV calculated over the packet
+ * @param	ah_offs			offset of the AH header
+ * @param	ah_len			length of the AH header (including the ICV)
+ *
+ * @return IPSEC_STATUS_SUCCESS	        packet could be authenticated
+ * @return see ipsec_ah_check_chain()
+ */
+static int ipsec_ah_check_finish(ipsec_buffer *chain, int *payload_offset, int *payload_size, sad_entry *sa, 
+                                 unsigned char *orig_digest, unsigned char *digest, int ah_offs, int ah_len)
+{
+	int ret_val 	= IPSEC_STATUS_NOT_INITIALIZED;	/* by default, the return value is undefined */
+	ipsec_ip_header inner_header;
+	ipsec_ah_header *ah_header;
+
+	ah_header = ((ipsec_ah_header *)(chain->data + ah_offs));
+
+	if(memcmp(orig_digest, digest, IPSEC_AUTH_ICV_LEN(sa->auth_alg)) != 0) {
+		IPSEC_LOG_ERR("ipsec_ah_check_chain", IPSEC_STATUS_FAILURE, ("AH ICV does not match")) ;
+		return IPSEC_STATUS_FAILURE;
+	}
+	
+	/* post-ICV calculationn anti-replay check (this call will update the SA's sequence number window) */
+	ret_val = ipsec_update_replay_window(ipsec_ntohl(ah_header->sequence), &sa->replay);
+	if(ret_val != IPSEC_AUDIT_SUCCESS)
+	{
+		IPSEC_LOG_AUD("ipsec_ah_check_chain", IPSEC_AUDIT_SEQ_MISMATCH, ("packet rejected by anti-replay update (lastSeq=%08lx, seq=%08lx, window size=%d)", sa->replay.last_seq, ipsec_ntohl(ah_header->sequence), sa->replay.window) );
+		return ret_val;
+	}
+	
+	/* the inner IP header may span two segments */
+	memset(&inner_header, 0, sizeof(inner_header));
+	ipsec_buffer_copy_out(chain, ah_offs + ah_len, sizeof(inner_header), &inner_header);
+
+	*payload_offset = ah_offs + ah_len;
+	*payload_size   = ipsec_ntohs(inner_header.len);
+
+	return IPSEC_STATUS_SUCCESS;
+}
+
+
+/**
+ * Checks AH header and ICV (RFC 2402) of a packet which is stored in a chain of buffers.
+ * The outer IP header and the AH header must be in the first segment. The ICV is calculated
+ * segment by segment.
+ *
+ * @param	chain           first segment of the (outer) IP packet which hast to be checked
+ * @param   payload_offset  pointer used to return offset of inner (original) IP packet relative to the start of the chain
+ * @param   payload_size    pointer used to return total size of the inner (original) IP packet
+ * @param 	sa              pointer to security association holding the secret authentication key
+ *
+ * @return IPSEC_STATUS_SUCCESS	        packet could be authenticated
+ * @return IPSEC_STATUS_FAILURE         packet is corrupted or ICV does not match
+ * @return IPSEC_STATUS_NOT_IMPLEMENTED invalid mode (only IPSEC_TUNNEL mode is implemented)
+ * @return IPSEC_STATUS_BAD_KEY         the HMAC state of the SA is not set up (see ipsec_sad_prepare()) or its key was rejected
+ * @return IPSEC_STATUS_BAD_PACKET      the packet is truncated or its headers span several segments
+ */
+int ipsec_ah_check_chain(ipsec_buffer *chain, int *payload_offset, int *payload_size,
+ 				    	 sad_entry *sa)
+{
+	int ret_val 	= IPSEC_STATUS_NOT_INITIALIZED;	/* by default, the return value is undefined */
+	int ah_len;
+	int ah_offs;
+	int len;
+	unsigned char orig_digest[IPSEC_MAX_AUTHKEY_LEN];
+	unsigned char digest[IPSEC_MAX_AUTHKEY_LEN];
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER,
+	              "ipsec_ah_check_chain",
+				  ("chain=%p, *payload_offset=%d, *payload_size=%d sa=%p",
+			      (void *)chain, *payload_offset, *payload_size, (void *)sa)
+				 );
+
+	ret_val = ipsec_ah_check_start(chain, sa, orig_digest, &ah_offs, &ah_len);
+	if(ret_val != IPSEC_STATUS_SUCCESS)
+	{
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_check_chain", ("return = %d", ret_val) );
+		return ret_val;
+	}
+
+	len = ipsec_ntohs(((ipsec_ip_header *)chain->data)->len);
 	switch(sa->auth_alg) {
 
 		case IPSEC_HMAC_MD5:
-			hmac_md5((unsigned char *)outer_packet, ipsec_ntohs(outer_packet->len),
-			         (unsigned char *)sa->authkey, IPSEC_AUTH_MD5_KEY_LEN, (unsigned char *)&digest);
+			hmac_md5_chain(&sa->auth_ctx.md5, chain, 0, len, (unsigned char *)&digest);
 			break;
 		case IPSEC_HMAC_SHA1:
-			hmac_sha1((unsigned char *)outer_packet, ipsec_ntohs(outer_packet->len),
-			          (unsigned char *)sa->authkey, IPSEC_AUTH_SHA1_KEY_LEN, (unsigned char *)&digest);
+			hmac_sha1_chain(&sa->auth_ctx.sha1, chain, 0, len, (unsigned char *)&digest);
+			break;
+		case IPSEC_HMAC_SHA256:
+			hmac_sha256_chain(&sa->auth_ctx.sha256, chain, 0, len, (unsigned char *)&digest);
+			break;
+		case IPSEC_HMAC_SHA384:
+		case IPSEC_HMAC_SHA512:
+			hmac_sha512_chain(&sa->auth_ctx.sha512, chain, 0, len, (unsigned char *)&digest);
 			break;
 		default:
-			IPSEC_LOG_ERR("ipsec_ah_check", IPSEC_STATUS_FAILURE, ("unknown HASH algorithm for this AH")) ;
-			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_check", ("return = %d", IPSEC_STATUS_FAILURE) );
+			IPSEC_LOG_ERR("ipsec_ah_check_chain", IPSEC_STATUS_FAILURE, ("unknown HASH algorithm for this AH")) ;
+			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_check_chain", ("return = %d", IPSEC_STATUS_FAILURE) );
 			return IPSEC_STATUS_FAILURE;
 	}
 
-	if(memcmp(orig_digest, digest, IPSEC_AUTH_ICV) != 0) {
-		IPSEC_LOG_ERR("ipsec_ah_check", IPSEC_STATUS_FAILURE, ("AH ICV does not match")) ;
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_check", ("return = %d", IPSEC_STATUS_FAILURE) );
-		return IPSEC_STATUS_FAILURE;
+	ret_val = ipsec_ah_check_finish(chain, payload_offset, payload_size, sa, orig_digest, digest, ah_offs, ah_len);
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_check_chain", ("return = %d", ret_val) );
+	return ret_val;
+}
+
+
+/**
+ * Checks the AH headers and ICVs of several packets of the same SA, like ipsec_ah_check_chain().
+ *
+ * With HMAC-MD5 and HMAC-SHA1, the ICVs of the packets are calculated side by side by 
+ * hmac_md5_multi() or hmac_sha1_multi(). The other algorithms check one packet after the other.
+ * The packets are accepted in the order of the array, so the anti-replay window rejects a 
+ * sequence number which appears twice in the batch.
+ *
+ * @param	packets			array of pointers to the packets, returns payload_offset, payload_size and status of every packet (see ipsec_ah_check_chain())
+ * @param	count			number of packets
+ * @param 	sa              pointer to security association of all the packets
+ * @return void
+ */
+void ipsec_ah_check_batch(ipsec_packet **packets, int count, sad_entry *sa)
+{
+	hmac_multi_stream	streams[HASH_MULTI_MAX_LANES];
+	int					ah_offs[HASH_MULTI_MAX_LANES];
+	int					ah_len[HASH_MULTI_MAX_LANES];
+	unsigned char		orig_digest[HASH_MULTI_MAX_LANES][IPSEC_MAX_AUTHKEY_LEN];
+	unsigned char		digest[HASH_MULTI_MAX_LANES][IPSEC_MAX_AUTHKEY_LEN];
+	int					i, n, first;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER,
+	              "ipsec_ah_check_batch",
+				  ("packets=%p, count=%d, sa=%p", (void *)packets, count, (void *)sa)
+				 );
+
+	if((sa->auth_alg != IPSEC_HMAC_MD5) && (sa->auth_alg != IPSEC_HMAC_SHA1))
+	{
+		for(i = 0; i < count; i++)
+			packets[i]->status = ipsec_ah_check_chain(packets[i]->chain, &packets[i]->payload_offset, &packets[i]->payload_size, sa);
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_check_batch", ("void") );
+		return;
 	}
-	
-	/* post-ICV calculationn anti-replay check (this call will update the global sequence number window) */
-	ret_val = ipsec_update_replay_window(ipsec_ntohl(ah_header->sequence), (__u32 *)&ipsec_ah_lastSeq, (__u32 *)&ipsec_ah_bitmap);
-	if(ret_val != IPSEC_AUDIT_SUCCESS)
+
+	for(first = 0; first < count; first += HASH_MULTI_MAX_LANES)
 	{
-		IPSEC_LOG_AUD("ipsec_ah_check", IPSEC_AUDIT_SEQ_MISMATCH, ("packet rejected by anti-replay update (lastSeq=%08lx, seq=%08lx, window size=%d)", ipsec_ah_lastSeq, ipsec_ntohl(ah_header->sequence), IPSEC_SEQ_MAX_WINDOW) );
-		return ret_val;
+		n = count - first;
+		if(n > HASH_MULTI_MAX_LANES)
+			n = HASH_MULTI_MAX_LANES;
+
+		for(i = 0; i < n; i++)
+		{
+			packets[first+i]->status = ipsec_ah_check_start(packets[first+i]->chain, sa, orig_digest[i], &ah_offs[i], &ah_len[i]);
+
+			/* packets which failed already are hashed with a length of 0 */
+			streams[i].hctx = (sa->auth_alg == IPSEC_HMAC_MD5) ? (void *)&sa->auth_ctx.md5 : (void *)&sa->auth_ctx.sha1;
+			streams[i].chain = packets[first+i]->chain;
+			streams[i].offset = 0;
+			streams[i].len = 0;
+			streams[i].digest = digest[i];
+			if(packets[first+i]->status == IPSEC_STATUS_SUCCESS)
+				streams[i].len = ipsec_ntohs(((ipsec_ip_header *)packets[first+i]->chain->data)->len);
+		}
+
+		if(sa->auth_alg == IPSEC_HMAC_MD5)
+			hmac_md5_multi(streams, n);
+		else
+			hmac_sha1_multi(streams, n);
+
+		for(i = 0; i < n; i++)
+		{
+			if(packets[first+i]->status == IPSEC_STATUS_SUCCESS)
+				packets[first+i]->status = ipsec_ah_check_finish(packets[first+i]->chain, &packets[first+i]->payload_offset, &packets[first+i]->payload_size, 
+				                                                 sa, orig_digest[i], digest[i], ah_offs[i], ah_len[i]);
+		}
 	}
-	
-	*payload_offset = ah_offs + ah_len;
-	*payload_size   = ipsec_ntohs(((ipsec_ip_header *)((unsigned char *)outer_packet + ah_offs + ah_len))->len);
 
-	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_check", ("return = %d", IPSEC_STATUS_NOT_IMPLEMENTED) );
-	return IPSEC_STATUS_SUCCESS;
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_check_batch", ("void") );
+}
+
+
+/**
+ * Returns the worst-case room ipsec_ah_encapsulate() needs around an IP packet for a certain SA.
+ *
+ * AH only adds the outer IP header and the AH header (including the ICV) in front of the packet.
+ *
+ * @param 	sa              pointer to the SA
+ * @param	headroom		pointer used to return the number of bytes needed in front of the packet
+ * @param	tailroom		pointer used to return the number of bytes needed after the packet
+ * @return void
+ */
+void ipsec_ah_get_overhead(sad_entry *sa, int *headroom, int *tailroom)
+{
+	*headroom = IPSEC_MIN_IPHDR_SIZE + IPSEC_AH_HDR_SIZE + IPSEC_AUTH_ICV_LEN(sa->auth_alg) ;
+	*tailroom = 0 ;
 }
 
 
 /**
  * Adds AH and outer IP header, calculates ICV (RFC 2402).
  *
- * @warning Attention: this function requires room (IPSEC_AH_HDR_SIZE + IPSEC_AUTH_ICV + IPSEC_MIN_IPHDR_SIZE)
+ * @warning Attention: this function requires room (IPSEC_AH_HDR_SIZE + ICV + IPSEC_MIN_IPHDR_SIZE, see ipsec_ah_get_overhead())
  *          in front of the inner_packet pointer to add outer IP header and AH header. Depending on the
  *          TCP/IP stack implementation, additional space for the Link layer (Ethernet header) should be added).
  *
@@ -210,100 +405,146 @@ int ipsec_ah_check(ipsec_ip_header *outer_packet, int *payload_offset, int *payl
  * @return IPSEC_STATUS_SUCCESS	        packet could be authenticated
  * @return IPSEC_STATUS_FAILURE         packet is corrupted or ICV does not match
  * @return IPSEC_STATUS_NOT_IMPLEMENTED invalid mode (only IPSEC_TUNNEL mode is implemented)
+ * @return see ipsec_ah_encapsulate_chain()
  */
 int ipsec_ah_encapsulate(ipsec_ip_header *inner_packet, int *payload_offset, int *payload_size,
 						 sad_entry *sa, __u32 src, __u32 dst
 			             )
+{
+	ipsec_buffer segment;
+
+	segment.next = NULL;
+	segment.data = (unsigned char *)inner_packet;
+	segment.len  = ipsec_ntohs(inner_packet->len);
+
+	return ipsec_ah_encapsulate_chain(&segment, payload_offset, payload_size, sa, src, dst, 0);
+}
+
+
+/**
+ * Adds AH and outer IP header to a packet which is stored in a chain of buffers, calculates ICV (RFC 2402).
+ *
+ * The headers are written in front of the first segment (see ipsec_ah_get_overhead()) and the inner 
+ * IP header must be in the first segment. The ICV is calculated segment by segment.
+ *
+ * @param	chain           first segment of the inner (original) IP packet
+ * @param   payload_offset  pointer used to return offset of the outer IP header relative to the start of the chain
+ * @param   payload_size    pointer used to return total size of the new IP packet
+ * @param 	sa              pointer to security association holding the secret authentication key
+ * @param   src             IP address of the local tunnel start point (external IP address)
+ * @param   dst             IP address of the remote tunnel end point (external IP address)
+ * @param   sequence        sequence number of the packet reserved by ipsec_sad_next_sequence(), 0 to reserve the next one
+ * @return IPSEC_STATUS_SUCCESS	        packet could be authenticated
+ * @return IPSEC_STATUS_FAILURE         packet is corrupted or ICV does not match
+ * @return IPSEC_STATUS_NOT_IMPLEMENTED invalid mode (only IPSEC_TUNNEL mode is implemented)
+ * @return IPSEC_STATUS_BAD_KEY         the HMAC state of the SA is not set up (see ipsec_sad_prepare()) or its key was rejected
+ * @return IPSEC_STATUS_SEQ_EXHAUSTED   the sequence numbers of the SA are used up
+ */
+int ipsec_ah_encapsulate_chain(ipsec_buffer *chain, int *payload_offset, int *payload_size,
+						 	   sad_entry *sa, __u32 src, __u32 dst, __u32 sequence
+			                   )
 {
 	int ret_val = IPSEC_STATUS_NOT_INITIALIZED;			/* by default, the return value is undefined */
+	ipsec_ip_header		*inner_packet ;
 	ipsec_ip_header		*new_ip_header ;
 	ipsec_ah_header		*new_ah_header;
+	ipsec_buffer		head ;
+	int					icv_len ;
 	unsigned char 		digest[IPSEC_MAX_AUTHKEY_LEN];
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER,
-	              "ipsec_ah_encapsulate",
-				  ("inner_packet=%p, *payload_offset=%d, *payload_size=%d sa=%p, src=%lu, dst=%lu",
-			      (void *)inner_packet, *payload_offset, *payload_size, (void *)sa, src, dst)
+	              "ipsec_ah_encapsulate_chain",
+				  ("chain=%p, *payload_offset=%d, *payload_size=%d sa=%p, src=%lu, dst=%lu, sequence=%lu",
+			      (void *)chain, *payload_offset, *payload_size, (void *)sa, src, dst, sequence)
 				 );
 
+	inner_packet = (ipsec_ip_header *)chain->data ;
+
+	/* the SAs are set up on the control path (ipsec_sad_add(), ipsec_spd_load_dbs()), never by a packet */
+	if(sa->key_state != IPSEC_KEYS_READY)
+	{
+		IPSEC_LOG_ERR("ipsec_ah_encapsulate_chain", IPSEC_STATUS_BAD_KEY, ("no valid HMAC state for this SA")) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_encapsulate_chain", ("return = %d", IPSEC_STATUS_BAD_KEY) );
+		return IPSEC_STATUS_BAD_KEY;
+	}
 
 	/* set new packet header pointers */
-	new_ip_header = (ipsec_ip_header*)(((char*)inner_packet) - IPSEC_AH_HDR_SIZE - IPSEC_AUTH_ICV - IPSEC_MIN_IPHDR_SIZE) ;
-	new_ah_header = (ipsec_ah_header*)(((char*)inner_packet) - IPSEC_AUTH_ICV - IPSEC_AH_HDR_SIZE) ;
-
-	/* decrement and check TTL */
-	/** @todo fix TTL update and checksum calculation */
-	// inner_packet->ttl--;
-	// inner_packet->chksum = ip_chksum(inner_packet, sizeof(ip_header));
-	if (inner_packet->ttl == 0)
+	icv_len = IPSEC_AUTH_ICV_LEN(sa->auth_alg) ;
+	new_ip_header = (ipsec_ip_header*)(((char*)inner_packet) - IPSEC_AH_HDR_SIZE - icv_len - IPSEC_MIN_IPHDR_SIZE) ;
+	new_ah_header = (ipsec_ah_header*)(((char*)inner_packet) - icv_len - IPSEC_AH_HDR_SIZE) ;
+
+	/* check TTL */
+	if ((inner_packet->ttl == 0) || (IPSEC_TUNNEL_DEC_TTL && (inner_packet->ttl == 1)))
 	{
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_encapsulate", ("return = %d", IPSEC_STATUS_TTL_EXPIRED) );
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_encapsulate_chain", ("return = %d", IPSEC_STATUS_TTL_EXPIRED) );
 		return IPSEC_STATUS_TTL_EXPIRED;
 	}
 
-	if(IPSEC_AUTH_ICV != 12)
+
+	/* increment Sequence Number Field by 1 for each AH packet (1st packet has squ==1) */
+	if((sequence == 0) && (ipsec_sad_next_sequence(sa, 1, &sequence) != IPSEC_STATUS_SUCCESS))
 	{
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_encapsulate", ("return = %d", IPSEC_STATUS_NOT_IMPLEMENTED) );
-		return IPSEC_STATUS_NOT_IMPLEMENTED;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_encapsulate_chain", ("return = %d", IPSEC_STATUS_SEQ_EXHAUSTED) );
+		return IPSEC_STATUS_SEQ_EXHAUSTED;
 	}
 
+#if IPSEC_TUNNEL_DEC_TTL
+	/* decrement TTL, the checksum is updated and not computed again */
+	ipsec_ip_dec_ttl(inner_packet) ;
+#endif
 
-	/* increment Sequence Number Field by 1 for each AH packet (1st packet has squ==1) */
-	sa->sequence_number++;
-
-	/* set header fields */
-	new_ah_header->nexthdr	= 0x04;	/* IP in IP */
-	new_ah_header->len  	= 0x04; /* length is 4 for AH with 96bit ICV */
-	new_ah_header->reserved	= 0x0000;
-	new_ah_header->spi		= sa->spi;
-	new_ah_header->sequence = ipsec_htonl(sa->sequence_number);
-	memset(new_ah_header->ah_data, '\0', IPSEC_AUTH_ICV);
-
-	/* setup IP header and zero all mutable fields prior to ICV calculation */
-	/* mutable fields according to RFC2402, 3.3.3.1.1.1. */
-	new_ip_header->v_hl 	= 0x45;
-	new_ip_header->tos 		= 0;
-	new_ip_header->len 		= ipsec_htons(ipsec_ntohs(inner_packet->len) + IPSEC_AH_HDR_SIZE + IPSEC_AUTH_ICV + IPSEC_MIN_IPHDR_SIZE);
-	new_ip_header->id 		= 1000 ;	/**@todo id must be generated properly and incremented */
-	new_ip_header->offset 	= 0;
+	/* outer IP header and AH header up to the SPI from the template of the SA */
+	ipsec_sad_outer_header(sa, new_ip_header, src, dst, (__u16)(ipsec_ntohs(inner_packet->len) + IPSEC_AH_HDR_SIZE + icv_len + IPSEC_MIN_IPHDR_SIZE), sequence) ;
+	new_ah_header->sequence = ipsec_htonl(sequence);
+	memset(new_ah_header->ah_data, '\0', icv_len);
+
+	/* zero all mutable fields prior to ICV calculation (RFC2402, 3.3.3.1.1.1.), TOS, offset and checksum are 0 already */
 	new_ip_header->ttl 		= 0;
-	new_ip_header->protocol = IPSEC_PROTO_AH;
-	new_ip_header->chksum 	= 0;
-	new_ip_header->src 		= src;
-	new_ip_header->dest 	= dst;
+
+	/* the new headers in front of the first segment are authenticated too */
+	head.next = chain->next ;
+	head.data = (unsigned char *)new_ip_header ;
+	head.len  = chain->len + IPSEC_AH_HDR_SIZE + icv_len + IPSEC_MIN_IPHDR_SIZE ;
 
 	/* calculate AH according the SA */
 	switch(sa->auth_alg) {
 
 		case IPSEC_HMAC_MD5:
-			hmac_md5((unsigned char *)new_ip_header, ipsec_ntohs(new_ip_header->len),
-			         (unsigned char *)sa->authkey, IPSEC_AUTH_MD5_KEY_LEN, (unsigned char *)&digest);
+			hmac_md5_chain(&sa->auth_ctx.md5, &head, 0, ipsec_ntohs(new_ip_header->len),
+			               (unsigned char *)&digest);
 			break;
 		case IPSEC_HMAC_SHA1:
-			hmac_sha1((unsigned char *)new_ip_header, ipsec_ntohs(new_ip_header->len),
-			          (unsigned char *)sa->authkey, IPSEC_AUTH_SHA1_KEY_LEN, (unsigned char *)&digest);
+			hmac_sha1_chain(&sa->auth_ctx.sha1, &head, 0, ipsec_ntohs(new_ip_header->len),
+			                (unsigned char *)&digest);
+			break;
+		case IPSEC_HMAC_SHA256:
+			hmac_sha256_chain(&sa->auth_ctx.sha256, &head, 0, ipsec_ntohs(new_ip_header->len),
+			                  (unsigned char *)&digest);
+			break;
+		case IPSEC_HMAC_SHA384:
+		case IPSEC_HMAC_SHA512:
+			hmac_sha512_chain(&sa->auth_ctx.sha512, &head, 0, ipsec_ntohs(new_ip_header->len),
+			                  (unsigned char *)&digest);
 			break;
 		default:
-			IPSEC_LOG_ERR("ipsec_ah_encapsulate", IPSEC_STATUS_FAILURE, ("unknown HASH algorithm for this AH") );
-			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_encapsulate", ("return = %d", IPSEC_STATUS_FAILURE) );
+			IPSEC_LOG_ERR("ipsec_ah_encapsulate_chain", IPSEC_STATUS_FAILURE, ("unknown HASH algorithm for this AH") );
+			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_encapsulate_chain", ("return = %d", IPSEC_STATUS_FAILURE) );
 			return IPSEC_STATUS_FAILURE;
 
 	}
 
 	/* insert ICV */
-	memcpy(new_ah_header->ah_data, digest, IPSEC_AUTH_ICV);
+	memcpy(new_ah_header->ah_data, digest, icv_len);
 
-	/* update outer IP header */
+	/* update outer IP header, the checksum is completed from the one of the template */
 	new_ip_header->tos = inner_packet->tos ;
-	new_ip_header->ttl = 64 ;
-
-	/* set checksum */
-	new_ip_header->chksum = ipsec_ip_chksum(new_ip_header, sizeof(ipsec_ip_header)) ;
+	new_ip_header->ttl = IPSEC_OUTER_TTL ;
+	ipsec_sad_outer_chksum(sa, new_ip_header) ;
 
 	/* setup return values */
 	*payload_size 	= ipsec_ntohs(new_ip_header->len);
 	*payload_offset = (((char*)new_ip_header) - ((char*)inner_packet)) ;
 
-	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_encapsulate", ("return = %d", IPSEC_STATUS_SUCCESS) );
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_ah_encapsulate_chain", ("return = %d", IPSEC_STATUS_SUCCESS) );
 	return IPSEC_STATUS_SUCCESS;
 }
@@ -0,0 +1,761 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file chacha.c
+ *  @brief ChaCha20 and the ChaCha20-Poly1305 combined mode (RFC 8439) as used by ESP (RFC 7634)
+ *
+ *  <B>OUTLINE:</B>
+ *  The following functions are implemented in this module:
+ *   - cipher_chacha_set_key(): loads a 256 bit key
+ *   - cipher_chacha20(): en- or decrypts a buffer with ChaCha20
+ *   - cipher_chacha_poly(): en- or decrypts and authenticates a buffer with ChaCha20-Poly1305
+ *   - cipher_chacha_poly_chain(): the same on a part of a chain of buffers in place
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *  The ciphertext is authenticated in strides of CHACHA_STRIDE bytes right after they were en- 
+ *  or before they are decrypted, so the payload is only walked through once.
+ *
+ *  If IPSEC_CHACHA_SIMD is defined (default with GCC on x86), the key stream is generated four 
+ *  blocks at a time with SSE2 or eight blocks at a time with AVX2. The engine is selected on the 
+ *  first call of cipher_chacha_set_key() with the CPU features, cipher_chacha_set_engine() can be 
+ *  used to select another one. 
+ *
+ *  Poly1305 works on 26 bit limbs with 64 bit products if IPSEC_POLY1305_64 is defined (default 
+ *  with GCC), and on 13 bit limbs with 32 bit products otherwise (targets without 64 bit types).
+ *
+ *  <B>NOTES:</B>
+ *  The caller compares the tag. On decryption, the payload is decrypted even if the tag turns
+ *  out to be wrong and must be dropped then.
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/chacha.h"
+#include "ipsec/util.h"
+#include "ipsec/debug.h"
+
+#ifdef IPSEC_CHACHA_SIMD
+#include <immintrin.h>
+#endif
+
+
+#define CHACHA_STRIDE		(8*CHACHA_BLOCK_SIZE)	/**< bytes en- or decrypted before they are authenticated */
+
+#ifdef IPSEC_POLY1305_64
+#define POLY1305_LIMBS		(5)
+#define POLY1305_LIMB_BITS	(26)
+#else
+#define POLY1305_LIMBS		(10)
+#define POLY1305_LIMB_BITS	(13)
+#endif
+#define POLY1305_LIMB_MASK	((1UL << POLY1305_LIMB_BITS) - 1)
+
+#define CHACHA_LOAD(p)		(((__u32)(p)[0])|((__u32)(p)[1]<<8)|((__u32)(p)[2]<<16)|((__u32)(p)[3]<<24))
+#define CHACHA_STORE(p,v)	((p)[0]=(__u8)(v), (p)[1]=(__u8)((v)>>8), (p)[2]=(__u8)((v)>>16), (p)[3]=(__u8)((v)>>24))
+
+#define CHACHA_ROTL(v,n)	((((v) << (n)) | ((v) >> (32-(n)))) & 0xffffffffUL)
+#define CHACHA_QR(x,a,b,c,d)	{ x[a] = (x[a] + x[b]) & 0xffffffffUL ; x[d] = CHACHA_ROTL(x[d] ^ x[a], 16) ; \
+								  x[c] = (x[c] + x[d]) & 0xffffffffUL ; x[b] = CHACHA_ROTL(x[b] ^ x[c], 12) ; \
+								  x[a] = (x[a] + x[b]) & 0xffffffffUL ; x[d] = CHACHA_ROTL(x[d] ^ x[a], 8) ; \
+								  x[c] = (x[c] + x[d]) & 0xffffffffUL ; x[b] = CHACHA_ROTL(x[b] ^ x[c], 7) ; }
+
+
+static int cipher_chacha_engine = -1 ;		/**< engine used for new keys, -1 until it was selected */
+
+/** State of a Poly1305 authentication */
+typedef struct poly1305_state_struct
+{
+	__u32	r[POLY1305_LIMBS] ;			/**< clamped key r */
+	__u32	h[POLY1305_LIMBS] ;			/**< accumulator */
+	__u32	pad[4] ;					/**< key s as little endian words */
+} poly1305_state ;
+
+/** State of one ChaCha20-Poly1305 en- or decryption */
+typedef struct chacha_poly_state_struct
+{
+	chacha_key		*ck ;				/**< key */
+	int				mode ;				/**< CHACHA_ENCRYPT or CHACHA_DECRYPT */
+	__u32			state[16] ;			/**< ChaCha20 input block of the next key stream block */
+	poly1305_state	poly ;				/**< Poly1305 state */
+	__u32			text_len ;			/**< number of bytes en- or decrypted so far */
+} chacha_poly_state ;
+
+
+#ifdef IPSEC_CHACHA_SIMD
+
+#define CHACHA_SSE2_ROTL(v,n)		_mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32-(n)))
+#define CHACHA_SSE2_QR(x,a,b,c,d)	{ x[a] = _mm_add_epi32(x[a], x[b]) ; x[d] = CHACHA_SSE2_ROTL(_mm_xor_si128(x[d], x[a]), 16) ; \
+									  x[c] = _mm_add_epi32(x[c], x[d]) ; x[b] = CHACHA_SSE2_ROTL(_mm_xor_si128(x[b], x[c]), 12) ; \
+									  x[a] = _mm_add_epi32(x[a], x[b]) ; x[d] = CHACHA_SSE2_ROTL(_mm_xor_si128(x[d], x[a]), 8) ; \
+									  x[c] = _mm_add_epi32(x[c], x[d]) ; x[b] = CHACHA_SSE2_ROTL(_mm_xor_si128(x[b], x[c]), 7) ; }
+#define CHACHA_SSE2_XOR(in,out,off,v)	_mm_storeu_si128((__m128i *)((out)+(off)), _mm_xor_si128(_mm_loadu_si128((__m128i *)((in)+(off))), v))
+
+#define CHACHA_AVX2_ROTL(v,n)		_mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32-(n)))
+#define CHACHA_AVX2_QR(x,a,b,c,d)	{ x[a] = _mm256_add_epi32(x[a], x[b]) ; x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot16) ; \
+									  x[c] = _mm256_add_epi32(x[c], x[d]) ; x[b] = CHACHA_AVX2_ROTL(_mm256_xor_si256(x[b], x[c]), 12) ; \
+									  x[a] = _mm256_add_epi32(x[a], x[b]) ; x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot8) ; \
+									  x[c] = _mm256_add_epi32(x[c], x[d]) ; x[b] = CHACHA_AVX2_ROTL(_mm256_xor_si256(x[b], x[c]), 7) ; }
+#define CHACHA_AVX2_XOR(in,out,off,v)	_mm256_storeu_si256((__m256i *)((out)+(off)), _mm256_xor_si256(_mm256_loadu_si256((__m256i *)((in)+(off))), v))
+
+/**
+ * En- or decrypts groups of four blocks with SSE2 (every vector holds one word of four blocks).
+ *
+ * @return number of blocks processed (a multiple of four)
+ */
+__attribute__((target("sse2")))
+static int cipher_chacha_sse2(__u32 *state, unsigned char *in, unsigned char *out, int blocks)
+{
+	__m128i	x[16], t0, t1, t2, t3 ;
+	int		i, done ;
+
+	for(done = 0; blocks - done >= 4; done += 4)
+	{
+		for(i = 0; i < 16; i++)
+			x[i] = _mm_set1_epi32((int)state[i]) ;
+		x[12] = _mm_add_epi32(x[12], _mm_set_epi32(3, 2, 1, 0)) ;
+
+		for(i = 0; i < 10; i++)
+		{
+			CHACHA_SSE2_QR(x, 0, 4,  8, 12) ;
+			CHACHA_SSE2_QR(x, 1, 5,  9, 13) ;
+			CHACHA_SSE2_QR(x, 2, 6, 10, 14) ;
+			CHACHA_SSE2_QR(x, 3, 7, 11, 15) ;
+			CHACHA_SSE2_QR(x, 0, 5, 10, 15) ;
+			CHACHA_SSE2_QR(x, 1, 6, 11, 12) ;
+			CHACHA_SSE2_QR(x, 2, 7,  8, 13) ;
+			CHACHA_SSE2_QR(x, 3, 4,  9, 14) ;
+		}
+
+		for(i = 0; i < 16; i++)
+			x[i] = _mm_add_epi32(x[i], _mm_set1_epi32((int)state[i])) ;
+		x[12] = _mm_add_epi32(x[12], _mm_set_epi32(3, 2, 1, 0)) ;
+
+		/* transpose four words of the four blocks at a time */
+		for(i = 0; i < 16; i += 4)
+		{
+			t0 = _mm_unpacklo_epi32(x[i], x[i+1]) ;
+			t1 = _mm_unpacklo_epi32(x[i+2], x[i+3]) ;
+			t2 = _mm_unpackhi_epi32(x[i], x[i+1]) ;
+			t3 = _mm_unpackhi_epi32(x[i+2], x[i+3]) ;
+			CHACHA_SSE2_XOR(in, out, 4*i, _mm_unpacklo_epi64(t0, t1)) ;
+			CHACHA_SSE2_XOR(in, out, 4*i + CHACHA_BLOCK_SIZE, _mm_unpackhi_epi64(t0, t1)) ;
+			CHACHA_SSE2_XOR(in, out, 4*i + 2*CHACHA_BLOCK_SIZE, _mm_unpacklo_epi64(t2, t3)) ;
+			CHACHA_SSE2_XOR(in, out, 4*i + 3*CHACHA_BLOCK_SIZE, _mm_unpackhi_epi64(t2, t3)) ;
+		}
+
+		state[12] = (state[12] + 4) & 0xffffffffUL ;
+		in += 4*CHACHA_BLOCK_SIZE ;
+		out += 4*CHACHA_BLOCK_SIZE ;
+	}
+	return done ;
+}
+
+/**
+ * En- or decrypts groups of eight blocks with AVX2 (every vector holds one word of eight blocks).
+ *
+ * @return number of blocks processed (a multiple of eight)
+ */
+__attribute__((target("avx2")))
+static int cipher_chacha_avx2(__u32 *state, unsigned char *in, unsigned char *out, int blocks)
+{
+	__m256i	x[16], q[4][4], t0, t1, t2, t3, rot16, rot8, inc ;
+	int		i, k, done ;
+
+	rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+	                        13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2) ;
+	rot8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+	                       14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3) ;
+	inc = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0) ;
+
+	for(done = 0; blocks - done >= 8; done += 8)
+	{
+		for(i = 0; i < 16; i++)
+			x[i] = _mm256_set1_epi32((int)state[i]) ;
+		x[12] = _mm256_add_epi32(x[12], inc) ;
+
+		for(i = 0; i < 10; i++)
+		{
+			CHACHA_AVX2_QR(x, 0, 4,  8, 12) ;
+			CHACHA_AVX2_QR(x, 1, 5,  9, 13) ;
+			CHACHA_AVX2_QR(x, 2, 6, 10, 14) ;
+			CHACHA_AVX2_QR(x, 3, 7, 11, 15) ;
+			CHACHA_AVX2_QR(x, 0, 5, 10, 15) ;
+			CHACHA_AVX2_QR(x, 1, 6, 11, 12) ;
+			CHACHA_AVX2_QR(x, 2, 7,  8, 13) ;
+			CHACHA_AVX2_QR(x, 3, 4,  9, 14) ;
+		}
+
+		for(i = 0; i < 16; i++)
+			x[i] = _mm256_add_epi32(x[i], _mm256_set1_epi32((int)state[i])) ;
+		x[12] = _mm256_add_epi32(x[12], inc) ;
+
+		/* transpose in both 128 bit lanes: q[i/4][k] holds words i..i+3 of block k (low lane) and block k+4 (high lane) */
+		for(i = 0; i < 16; i += 4)
+		{
+			t0 = _mm256_unpacklo_epi32(x[i], x[i+1]) ;
+			t1 = _mm256_unpacklo_epi32(x[i+2], x[i+3]) ;
+			t2 = _mm256_unpackhi_epi32(x[i], x[i+1]) ;
+			t3 = _mm256_unpackhi_epi32(x[i+2], x[i+3]) ;
+			q[i/4][0] = _mm256_unpacklo_epi64(t0, t1) ;
+			q[i/4][1] = _mm256_unpackhi_epi64(t0, t1) ;
+			q[i/4][2] = _mm256_unpacklo_epi64(t2, t3) ;
+			q[i/4][3] = _mm256_unpackhi_epi64(t2, t3) ;
+		}
+		for(k = 0; k < 4; k++)
+		{
+			CHACHA_AVX2_XOR(in, out, k*CHACHA_BLOCK_SIZE, _mm256_permute2x128_si256(q[0][k], q[1][k], 0x20)) ;
+			CHACHA_AVX2_XOR(in, out, k*CHACHA_BLOCK_SIZE + 32, _mm256_permute2x128_si256(q[2][k], q[3][k], 0x20)) ;
+			CHACHA_AVX2_XOR(in, out, (k+4)*CHACHA_BLOCK_SIZE, _mm256_permute2x128_si256(q[0][k], q[1][k], 0x31)) ;
+			CHACHA_AVX2_XOR(in, out, (k+4)*CHACHA_BLOCK_SIZE + 32, _mm256_permute2x128_si256(q[2][k], q[3][k], 0x31)) ;
+		}
+
+		state[12] = (state[12] + 8) & 0xffffffffUL ;
+		in += 8*CHACHA_BLOCK_SIZE ;
+		out += 8*CHACHA_BLOCK_SIZE ;
+	}
+	return done ;
+}
+
+#endif
+
+
+/**
+ * Computes one key stream block and increments the block counter.
+ *
+ * @param state		ChaCha20 input block (constants, key, counter, nonce)
+ * @param stream	key stream block which is filled up
+ * @return void
+ */
+static void cipher_chacha_block(__u32 *state, unsigned char *stream)
+{
+	__u32	x[16] ;
+	int		i ;
+
+	for(i = 0; i < 16; i++)
+		x[i] = state[i] ;
+	for(i = 0; i < 10; i++)
+	{
+		CHACHA_QR(x, 0, 4,  8, 12) ;
+		CHACHA_QR(x, 1, 5,  9, 13) ;
+		CHACHA_QR(x, 2, 6, 10, 14) ;
+		CHACHA_QR(x, 3, 7, 11, 15) ;
+		CHACHA_QR(x, 0, 5, 10, 15) ;
+		CHACHA_QR(x, 1, 6, 11, 12) ;
+		CHACHA_QR(x, 2, 7,  8, 13) ;
+		CHACHA_QR(x, 3, 4,  9, 14) ;
+	}
+	for(i = 0; i < 16; i++)
+		CHACHA_STORE(stream + 4*i, (x[i] + state[i]) & 0xffffffffUL) ;
+	state[12] = (state[12] + 1) & 0xffffffffUL ;
+}
+
+/**
+ * Sets up the ChaCha20 input block (RFC 8439, 2.3).
+ */
+static void cipher_chacha_init(chacha_key *ck, unsigned char *nonce, __u32 counter, __u32 *state)
+{
+	int i ;
+
+	state[0] = 0x61707865UL ;		/* "expand 32-byte k" */
+	state[1] = 0x3320646eUL ;
+	state[2] = 0x79622d32UL ;
+	state[3] = 0x6b206574UL ;
+	for(i = 0; i < 8; i++)
+		state[4+i] = ck->key[i] ;
+	state[12] = counter ;
+	for(i = 0; i < 3; i++)
+		state[13+i] = CHACHA_LOAD(nonce + 4*i) ;
+}
+
+/**
+ * En- or decrypts data with the engine of the key. Only the last call for a packet may pass a partial block.
+ */
+static void cipher_chacha_xor(chacha_key *ck, __u32 *state, unsigned char *in, int len, unsigned char *out)
+{
+	unsigned char	stream[CHACHA_BLOCK_SIZE] ;
+	int				i, n ;
+
+#ifdef IPSEC_CHACHA_SIMD
+	if(ck->engine == CIPHER_CHACHA_AVX2)
+	{
+		n = cipher_chacha_avx2(state, in, out, len / CHACHA_BLOCK_SIZE) * CHACHA_BLOCK_SIZE ;
+		in += n ;
+		out += n ;
+		len -= n ;
+	}
+	if(ck->engine != CIPHER_CHACHA_PORTABLE)
+	{
+		n = cipher_chacha_sse2(state, in, out, len / CHACHA_BLOCK_SIZE) * CHACHA_BLOCK_SIZE ;
+		in += n ;
+		out += n ;
+		len -= n ;
+	}
+#endif
+
+	while(len > 0)
+	{
+		cipher_chacha_block(state, stream) ;
+		n = (len < CHACHA_BLOCK_SIZE) ? len : CHACHA_BLOCK_SIZE ;
+		for(i = 0; i < n; i++)
+			out[i] = in[i] ^ stream[i] ;
+		in += n ;
+		out += n ;
+		len -= n ;
+	}
+}
+
+/**
+ * Sets up Poly1305 with a one-time key (r is clamped, RFC 8439, 2.5).
+ */
+static void cipher_poly1305_init(poly1305_state *st, unsigned char *key)
+{
+	unsigned char	r[16] ;
+	int				i ;
+
+	memcpy(r, key, sizeof(r)) ;
+	r[3] &= 15 ; r[7] &= 15 ; r[11] &= 15 ; r[15] &= 15 ;
+	r[4] &= 252 ; r[8] &= 252 ; r[12] &= 252 ;
+
+#ifdef IPSEC_POLY1305_64
+	st->r[0] = CHACHA_LOAD(r) & 0x3ffffff ;
+	st->r[1] = (CHACHA_LOAD(r+3) >> 2) & 0x3ffffff ;
+	st->r[2] = (CHACHA_LOAD(r+6) >> 4) & 0x3ffffff ;
+	st->r[3] = (CHACHA_LOAD(r+9) >> 6) & 0x3ffffff ;
+	st->r[4] = (CHACHA_LOAD(r+12) >> 8) ;
+#else
+	for(i = 0; i < POLY1305_LIMBS; i++)
+		st->r[i] = ((((__u32)r[(13*i)/8] | ((__u32)r[(13*i)/8+1] << 8) | 
+		             (((13*i)/8 + 2 < 16) ? ((__u32)r[(13*i)/8+2] << 16) : 0)) >> ((13*i)%8))) & POLY1305_LIMB_MASK ;
+#endif
+
+	for(i = 0; i < POLY1305_LIMBS; i++)
+		st->h[i] = 0 ;
+	for(i = 0; i < 4; i++)
+		st->pad[i] = CHACHA_LOAD(key + 16 + 4*i) ;
+}
+
+#ifdef IPSEC_POLY1305_64
+
+/**
+ * Authenticates whole 16 byte blocks: h = (h + block + 2^128) * r mod 2^130-5.
+ */
+static void cipher_poly1305_blocks(poly1305_state *st, unsigned char *m, int blocks)
+{
+	__u32				r0, r1, r2, r3, r4, s1, s2, s3, s4 ;
+	__u32				h0, h1, h2, h3, h4, c ;
+	unsigned long long	d0, d1, d2, d3, d4 ;
+
+	r0 = st->r[0] ; r1 = st->r[1] ; r2 = st->r[2] ; r3 = st->r[3] ; r4 = st->r[4] ;
+	s1 = r1 * 5 ; s2 = r2 * 5 ; s3 = r3 * 5 ; s4 = r4 * 5 ;
+	h0 = st->h[0] ; h1 = st->h[1] ; h2 = st->h[2] ; h3 = st->h[3] ; h4 = st->h[4] ;
+
+	for(; blocks > 0; blocks--)
+	{
+		h0 += CHACHA_LOAD(m) & 0x3ffffff ;
+		h1 += (CHACHA_LOAD(m+3) >> 2) & 0x3ffffff ;
+		h2 += (CHACHA_LOAD(m+6) >> 4) & 0x3ffffff ;
+		h3 += (CHACHA_LOAD(m+9) >> 6) & 0x3ffffff ;
+		h4 += (CHACHA_LOAD(m+12) >> 8) | (1UL << 24) ;
+
+		d0 = (unsigned long long)h0*r0 + (unsigned long long)h1*s4 + (unsigned long long)h2*s3 + (unsigned long long)h3*s2 + (unsigned long long)h4*s1 ;
+		d1 = (unsigned long long)h0*r1 + (unsigned long long)h1*r0 + (unsigned long long)h2*s4 + (unsigned long long)h3*s3 + (unsigned long long)h4*s2 ;
+		d2 = (unsigned long long)h0*r2 + (unsigned long long)h1*r1 + (unsigned long long)h2*r0 + (unsigned long long)h3*s4 + (unsigned long long)h4*s3 ;
+		d3 = (unsigned long long)h0*r3 + (unsigned long long)h1*r2 + (unsigned long long)h2*r1 + (unsigned long long)h3*r0 + (unsigned long long)h4*s4 ;
+		d4 = (unsigned long long)h0*r4 + (unsigned long long)h1*r3 + (unsigned long long)h2*r2 + (unsigned long long)h3*r1 + (unsigned long long)h4*r0 ;
+
+		/* partial reduction, h stays below 2^131 */
+		c = (__u32)(d0 >> 26) ; h0 = (__u32)d0 & 0x3ffffff ;
+		d1 += c ; c = (__u32)(d1 >> 26) ; h1 = (__u32)d1 & 0x3ffffff ;
+		d2 += c ; c = (__u32)(d2 >> 26) ; h2 = (__u32)d2 & 0x3ffffff ;
+		d3 += c ; c = (__u32)(d3 >> 26) ; h3 = (__u32)d3 & 0x3ffffff ;
+		d4 += c ; c = (__u32)(d4 >> 26) ; h4 = (__u32)d4 & 0x3ffffff ;
+		h0 += c * 5 ; c = h0 >> 26 ; h0 &= 0x3ffffff ;
+		h1 += c ;
+
+		m += POLY1305_TAG_SIZE ;
+	}
+
+	st->h[0] = h0 ; st->h[1] = h1 ; st->h[2] = h2 ; st->h[3] = h3 ; st->h[4] = h4 ;
+}
+
+#else
+
+/**
+ * Authenticates whole 16 byte blocks: h = (h + block + 2^128) * r mod 2^130-5.
+ */
+static void cipher_poly1305_blocks(poly1305_state *st, unsigned char *m, int blocks)
+{
+	__u32	t[8], d[POLY1305_LIMBS], c ;
+	int		i, j ;
+
+	for(; blocks > 0; blocks--)
+	{
+		for(i = 0; i < 8; i++)
+			t[i] = (__u32)m[2*i] | ((__u32)m[2*i+1] << 8) ;
+		st->h[0] += t[0] & 0x1fff ;
+		st->h[1] += ((t[0] >> 13) | (t[1] << 3)) & 0x1fff ;
+		st->h[2] += ((t[1] >> 10) | (t[2] << 6)) & 0x1fff ;
+		st->h[3] += ((t[2] >> 7) | (t[3] << 9)) & 0x1fff ;
+		st->h[4] += ((t[3] >> 4) | (t[4] << 12)) & 0x1fff ;
+		st->h[5] += (t[4] >> 1) & 0x1fff ;
+		st->h[6] += ((t[4] >> 14) | (t[5] << 2)) & 0x1fff ;
+		st->h[7] += ((t[5] >> 11) | (t[6] << 5)) & 0x1fff ;
+		st->h[8] += ((t[6] >> 8) | (t[7] << 8)) & 0x1fff ;
+		st->h[9] += (t[7] >> 5) | (1 << 11) ;
+
+		/* h * r with 2^130 = 5, the sum is carried halfway so that it fits into 32 bits */
+		for(i = 0, c = 0; i < POLY1305_LIMBS; i++)
+		{
+			d[i] = c ;
+			for(j = 0; j < POLY1305_LIMBS; j++)
+			{
+				d[i] += st->h[j] * ((j <= i) ? st->r[i-j] : (5 * st->r[i+POLY1305_LIMBS-j])) ;
+				if(j == 4)
+				{
+					c = d[i] >> 13 ;
+					d[i] &= 0x1fff ;
+				}
+			}
+			c += d[i] >> 13 ;
+			d[i] &= 0x1fff ;
+		}
+		c = c * 5 + d[0] ;
+		d[0] = c & 0x1fff ;
+		d[1] += c >> 13 ;
+
+		for(i = 0; i < POLY1305_LIMBS; i++)
+			st->h[i] = d[i] ;
+		m += POLY1305_TAG_SIZE ;
+	}
+}
+
+#endif
+
+/**
+ * Authenticates data, a partial last block is padded with zeros (RFC 8439, 2.8).
+ */
+static void cipher_poly1305_hash(poly1305_state *st, unsigned char *data, int len)
+{
+	unsigned char	block[POLY1305_TAG_SIZE] ;
+
+	cipher_poly1305_blocks(st, data, len / POLY1305_TAG_SIZE) ;
+	if((len % POLY1305_TAG_SIZE) != 0)
+	{
+		memset(block, 0, sizeof(block)) ;
+		memcpy(block, data + len - (len % POLY1305_TAG_SIZE), len % POLY1305_TAG_SIZE) ;
+		cipher_poly1305_blocks(st, block, 1) ;
+	}
+}
+
+/**
+ * Reduces h completely and computes the tag (h + s) mod 2^128.
+ */
+static void cipher_poly1305_finish(poly1305_state *st, unsigned char *tag)
+{
+	__u32	g[POLY1305_LIMBS], w[4], c, mask, lo, hi ;
+	int		i, j, pass, shift ;
+
+	/* carry through all limbs (twice, the 2nd pass folds the carry of the 1st one) */
+	for(pass = 0; pass < 2; pass++)
+	{
+		for(i = 0, c = 0; i < POLY1305_LIMBS; i++)
+		{
+			st->h[i] += c ;
+			c = st->h[i] >> POLY1305_LIMB_BITS ;
+			st->h[i] &= POLY1305_LIMB_MASK ;
+		}
+		st->h[0] += c * 5 ;
+	}
+
+	/* g = h + 5 - 2^130, used if there is a carry out of 2^130 (h >= 2^130-5) */
+	for(i = 0, c = 5; i < POLY1305_LIMBS; i++)
+	{
+		g[i] = st->h[i] + c ;
+		c = g[i] >> POLY1305_LIMB_BITS ;
+		g[i] &= POLY1305_LIMB_MASK ;
+	}
+	mask = (0 - c) & 0xffffffffUL ;
+	for(i = 0; i < POLY1305_LIMBS; i++)
+		st->h[i] = (st->h[i] & ~mask) | (g[i] & mask) ;
+
+	/* h mod 2^128 as little endian words */
+	for(j = 0; j < 4; j++)
+	{
+		w[j] = 0 ;
+		for(i = 0; i < POLY1305_LIMBS; i++)
+		{
+			shift = i*POLY1305_LIMB_BITS - 32*j ;
+			if((shift >= 0) && (shift < 32))
+				w[j] |= (st->h[i] << shift) & 0xffffffffUL ;
+			else if((shift < 0) && (-shift < POLY1305_LIMB_BITS))
+				w[j] |= st->h[i] >> (-shift) ;
+		}
+	}
+
+	/* + s, 16 bits at a time */
+	for(j = 0, c = 0; j < 4; j++)
+	{
+		lo = (w[j] & 0xffff) + (st->pad[j] & 0xffff) + c ;
+		hi = (w[j] >> 16) + (st->pad[j] >> 16) + (lo >> 16) ;
+		c = hi >> 16 ;
+		w[j] = ((hi & 0xffff) << 16) | (lo & 0xffff) ;
+		CHACHA_STORE(tag + 4*j, w[j]) ;
+	}
+}
+
+/**
+ * Sets up the state for a new en- or decryption: the Poly1305 key is the first half of key stream 
+ * block 0, the payload is en- or decrypted from block 1 on. The additional authenticated data is
+ * authenticated right away.
+ */
+static void cipher_chacha_poly_start(chacha_poly_state *st, chacha_key *ck, unsigned char *nonce, unsigned char *aad, int aad_len, int mode)
+{
+	unsigned char	block[CHACHA_BLOCK_SIZE] ;
+
+	st->ck = ck ;
+	st->mode = mode ;
+	st->text_len = 0 ;
+	cipher_chacha_init(ck, nonce, 0, st->state) ;
+	cipher_chacha_block(st->state, block) ;
+	cipher_poly1305_init(&st->poly, block) ;
+	cipher_poly1305_hash(&st->poly, aad, aad_len) ;
+}
+
+/**
+ * En- or decrypts and authenticates data. Only the last call for a packet may pass a partial block.
+ */
+static void cipher_chacha_poly_update(chacha_poly_state *st, unsigned char *in, int len, unsigned char *out)
+{
+	int	n ;
+
+	st->text_len += len ;
+	while(len > 0)
+	{
+		n = (len < CHACHA_STRIDE) ? len : CHACHA_STRIDE ;
+		if(st->mode == CHACHA_DECRYPT)
+			cipher_poly1305_hash(&st->poly, in, n) ;
+		cipher_chacha_xor(st->ck, st->state, in, n, out) ;
+		if(st->mode == CHACHA_ENCRYPT)
+			cipher_poly1305_hash(&st->poly, out, n) ;
+		in += n ;
+		out += n ;
+		len -= n ;
+	}
+}
+
+/**
+ * Authenticates the lengths and computes the tag.
+ */
+static void cipher_chacha_poly_finish(chacha_poly_state *st, int aad_len, unsigned char *tag)
+{
+	unsigned char	block[POLY1305_TAG_SIZE] ;
+
+	/* lengths in bytes as two little endian 64 bit numbers */
+	memset(block, 0, sizeof(block)) ;
+	CHACHA_STORE(block, (__u32)aad_len) ;
+	CHACHA_STORE(block+8, st->text_len) ;
+	cipher_poly1305_blocks(&st->poly, block, 1) ;
+	cipher_poly1305_finish(&st->poly, tag) ;
+}
+
+/**
+ * Returns the engine which is used when an engine is requested.
+ *
+ * @param engine	CIPHER_CHACHA_PORTABLE, CIPHER_CHACHA_SSE2 or CIPHER_CHACHA_AVX2
+ * @return the requested engine or the next slower one if it is not compiled in or not supported by the CPU
+ */
+static int cipher_chacha_select(int engine)
+{
+#ifdef IPSEC_CHACHA_SIMD
+	__builtin_cpu_init() ;
+	if((engine == CIPHER_CHACHA_AVX2) && __builtin_cpu_supports("avx2"))
+		return CIPHER_CHACHA_AVX2 ;
+	if((engine >= CIPHER_CHACHA_SSE2) && __builtin_cpu_supports("sse2"))
+		return CIPHER_CHACHA_SSE2 ;
+#endif
+	return CIPHER_CHACHA_PORTABLE ;
+}
+
+/**
+ * Selects the engine used for keys set up from now on. By default, the fastest engine which was 
+ * compiled in and is supported by the CPU is used.
+ *
+ * @param engine	CIPHER_CHACHA_PORTABLE, CIPHER_CHACHA_SSE2 or CIPHER_CHACHA_AVX2
+ * @return the engine used so far
+ */
+int cipher_chacha_set_engine(int engine)
+{
+	int previous ;
+
+	if(cipher_chacha_engine < 0)
+		cipher_chacha_engine = cipher_chacha_select(CIPHER_CHACHA_AVX2) ;
+	previous = cipher_chacha_engine ;
+	cipher_chacha_engine = cipher_chacha_select(engine) ;
+	return previous ;
+}
+
+/**
+ * Loads a ChaCha20 key.
+ *
+ * @param key		pointer to the key (CHACHA_KEY_SIZE bytes)
+ * @param ck		pointer to the key structure which is filled up
+ * @return void
+ */
+void cipher_chacha_set_key(unsigned char *key, chacha_key *ck)
+{
+	int i ;
+
+	/* select the engine on first use (CPU features) */
+	if(cipher_chacha_engine < 0)
+		cipher_chacha_engine = cipher_chacha_select(CIPHER_CHACHA_AVX2) ;
+
+	for(i = 0; i < 8; i++)
+		ck->key[i] = CHACHA_LOAD(key + 4*i) ;
+	ck->engine = cipher_chacha_engine ;
+}
+
+/**
+ * ChaCha20 en- or decryption of a buffer (both are the same).
+ *
+ * @param text		pointer to input data (may be the same as output)
+ * @param text_len	length of input data
+ * @param ck		pointer to the key
+ * @param nonce		nonce (CHACHA_NONCE_SIZE bytes)
+ * @param counter	block counter of the first block
+ * @param output	en- or decrypted input data
+ * @return void
+ */
+void cipher_chacha20(unsigned char *text, int text_len, chacha_key *ck, unsigned char *nonce, __u32 counter, unsigned char *output)
+{
+	__u32	state[16] ;
+
+	cipher_chacha_init(ck, nonce, counter, state) ;
+	cipher_chacha_xor(ck, state, text, text_len, output) ;
+}
+
+/**
+ * ChaCha20-Poly1305 en- or decryption and authentication of a buffer.
+ *
+ * @param text		pointer to input data (may be the same as output)
+ * @param text_len	length of input data
+ * @param ck		pointer to the key
+ * @param nonce		nonce (CHACHA_NONCE_SIZE bytes)
+ * @param aad		additional authenticated data (not encrypted)
+ * @param aad_len	length of the additional authenticated data
+ * @param mode		CHACHA_ENCRYPT or CHACHA_DECRYPT
+ * @param output	en- or decrypted input data
+ * @param tag		authentication tag (POLY1305_TAG_SIZE bytes) which is calculated
+ * @return void
+ */
+void cipher_chacha_poly(unsigned char *text, int text_len, chacha_key *ck, unsigned char *nonce, unsigned char *aad, int aad_len, int mode, unsigned char *output, unsigned char *tag)
+{
+	chacha_poly_state	st ;
+
+	cipher_chacha_poly_start(&st, ck, nonce, aad, aad_len, mode) ;
+	cipher_chacha_poly_update(&st, text, text_len, output) ;
+	cipher_chacha_poly_finish(&st, aad_len, tag) ;
+}
+
+/**
+ * ChaCha20-Poly1305 function which en- or decrypts and authenticates a part of a chain of buffers 
+ * in place. The blocks inside a segment are processed directly. Only a block which spans two 
+ * segments is gathered into a local block and scattered back after processing.
+ *
+ * @param chain		first segment of the chain
+ * @param offset	offset of the first byte to process relative to the start of the chain
+ * @param len		number of bytes to process
+ * @param ck		pointer to the key
+ * @param nonce		nonce (CHACHA_NONCE_SIZE bytes)
+ * @param aad		additional authenticated data (not encrypted)
+ * @param aad_len	length of the additional authenticated data
+ * @param mode		CHACHA_ENCRYPT or CHACHA_DECRYPT
+ * @param tag		authentication tag (POLY1305_TAG_SIZE bytes) which is calculated
+ * @return void
+ */
+void cipher_chacha_poly_chain(ipsec_buffer *chain, int offset, int len, chacha_key *ck, unsigned char *nonce, unsigned char *aad, int aad_len, int mode, unsigned char *tag)
+{
+	chacha_poly_state	st ;
+	unsigned char		block[CHACHA_BLOCK_SIZE] ;
+	int					n ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "cipher_chacha_poly_chain", 
+				  ("chain=%p, offset=%d, len=%d, ck=%p, nonce=%p, aad=%p, aad_len=%d, mode=%d, tag=%p",
+			      (void *)chain, offset, len, (void *)ck, (void *)nonce, (void *)aad, aad_len, mode, (void *)tag)
+				 );
+
+	cipher_chacha_poly_start(&st, ck, nonce, aad, aad_len, mode) ;
+
+	while((chain != NULL) && (offset >= chain->len))
+	{
+		offset -= chain->len ;
+		chain = chain->next ;
+	}
+
+	while((chain != NULL) && (len > 0))
+	{
+		/* whole blocks inside this segment (and the partial last block if it is in there) */
+		n = chain->len - offset ;
+		if(n < len) 
+			n &= ~(CHACHA_BLOCK_SIZE-1) ;
+		else
+			n = len ;
+		if(n > 0)
+		{
+			cipher_chacha_poly_update(&st, chain->data + offset, n, chain->data + offset) ;
+			offset += n ;
+			len -= n ;
+		}
+
+		/* block which spans the end of this segment */
+		if((len > 0) && (offset < chain->len))
+		{
+			n = (len < CHACHA_BLOCK_SIZE) ? len : CHACHA_BLOCK_SIZE ;
+			ipsec_buffer_copy_out(chain, offset, n, block) ;
+			cipher_chacha_poly_update(&st, block, n, block) ;
+			ipsec_buffer_copy_in(chain, offset, n, block) ;
+			offset += n ;
+			len -= n ;
+		}
+
+		while((chain != NULL) && (offset >= chain->len))
+		{
+			offset -= chain->len ;
+			chain = chain->next ;
+		}
+	}
+
+	cipher_chacha_poly_finish(&st, aad_len, tag) ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "cipher_chacha_poly_chain", ("void") );
+}
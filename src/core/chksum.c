@@ -0,0 +1,234 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file chksum.c
+ *  @brief Internet checksum (RFC 1071) of buffers and incremental updates of IP headers (RFC 1624)
+ *
+ *  <B>OUTLINE:</B>
+ *  The following functions are implemented in this module:
+ *   - ipsec_chksum_add(): one's complement sum of a buffer
+ *   - ipsec_chksum_fold(): folds a sum to 16 bits
+ *   - ipsec_chksum_adjust(): updates a checksum for a changed 16 bit word
+ *   - ipsec_ip_set_word(): changes a 16 bit word of an IP header and its checksum
+ *   - ipsec_ip_dec_ttl(): decrements the TTL of an IP header and updates its checksum
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *  The one's complement sum does not depend on the byte order and can be built from wider words 
+ *  (RFC 1071, 2): 32 bit words are added and the carries out of the accumulator are counted 
+ *  (2^32 is 1 in one's complement arithmetic). With SSE2, eight 16 bit words at a time are 
+ *  widened to 32 bits and added side by side. A field which changes is not summed again: 
+ *  HC' = ~(~HC + ~m + m') (RFC 1624, 3), which also gets the -0 case right.
+ *
+ *  <B>NOTES:</B>
+ *  All words are in the byte order of the buffer (network order for headers), so the sums can be 
+ *  stored without conversion. A sum which is continued by another ipsec_chksum_add() call must 
+ *  end on an even number of bytes.
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/chksum.h"
+#include "ipsec/util.h"
+#include "ipsec/debug.h"
+
+#ifdef IPSEC_CHKSUM_SSE2
+#include <emmintrin.h>
+
+#define IPSEC_CHKSUM_SSE2_MIN		(64)		/**< shortest buffer summed with SSE2 */
+#define IPSEC_CHKSUM_SSE2_ROUNDS	(16384)		/**< 16 byte rounds before the 32 bit lanes could overflow are folded */
+
+/**
+ * Sums the 16 byte blocks of a buffer with SSE2.
+ *
+ * @param data		buffer
+ * @param blocks	number of 16 byte blocks
+ * @param carry		counts the carries out of the returned sum
+ * @return sum of the blocks (32 bit words, see ipsec_chksum_add())
+ */
+static __u32 ipsec_chksum_sse2(const unsigned char *data, int blocks, __u32 *carry)
+{
+	__m128i		zero = _mm_setzero_si128() ;
+	__m128i		acc ;
+	__m128i		block ;
+	unsigned int	lanes[4] ;		/* SSE2 is only used by GCC on x86, where unsigned int is 32 bits wide */
+	__u32		sum = 0 ;
+	int			n, i ;
+
+	while(blocks > 0)
+	{
+		n = (blocks > IPSEC_CHKSUM_SSE2_ROUNDS) ? IPSEC_CHKSUM_SSE2_ROUNDS : blocks ;
+		blocks -= n ;
+		acc = zero ;
+		for(; n > 0; n--, data += 16)
+		{
+			block = _mm_loadu_si128((const __m128i *)data) ;
+			acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(block, zero)) ;
+			acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(block, zero)) ;
+		}
+		_mm_storeu_si128((__m128i *)lanes, acc) ;
+		for(i = 0; i < 4; i++)
+		{
+			sum = (sum + lanes[i]) & 0xffffffffUL ;
+			*carry += (sum < lanes[i]) ;
+		}
+	}
+	return sum ;
+}
+#endif
+
+/**
+ * Adds the 16 bit words of a buffer to a one's complement sum (see ipsec_chksum_fold()).
+ * An odd byte at the end is padded with zero (RFC 1071, 4.1).
+ *
+ * @param dataptr	buffer
+ * @param len		length of the buffer
+ * @param sum		sum of the previous buffers as returned by this function (0 for the first one)
+ * @return sum of the previous buffers and this one (not folded yet)
+ */
+__u32 ipsec_chksum_add(void *dataptr, int len, __u32 sum)
+{
+	const unsigned char	*data = (const unsigned char *)dataptr ;
+	__u32				acc = 0 ;
+	__u32				carry = 0 ;
+	__u32				word ;
+	__u16				half[IPSEC_MIN_IPHDR_SIZE/2] ;
+
+	/* IP headers without options are summed without a loop, 10 words cannot overflow */
+	if(len == IPSEC_MIN_IPHDR_SIZE)
+	{
+		memcpy(half, data, IPSEC_MIN_IPHDR_SIZE) ;
+		return sum + half[0] + half[1] + half[2] + half[3] + half[4] + 
+		             half[5] + half[6] + half[7] + half[8] + half[9] ;
+	}
+
+#ifdef IPSEC_CHKSUM_SSE2
+	if(len >= IPSEC_CHKSUM_SSE2_MIN)
+	{
+		word = ipsec_chksum_sse2(data, len/16, &carry) ;
+		acc = (acc + word) & 0xffffffffUL ;
+		carry += (acc < word) ;
+		data += len & ~15 ;
+		len &= 15 ;
+	}
+#endif
+
+	/* 32 bit words are built from two 16 bit words, so neither the width of __u32 nor the 
+	 * byte order matters, and acc is kept to 32 bits so that its carries can be counted */
+	for(; len >= 4; len -= 4, data += 4)
+	{
+		memcpy(half, data, 4) ;
+		word = half[0] + ((__u32)half[1] << 16) ;
+		acc = (acc + word) & 0xffffffffUL ;
+		carry += (acc < word) ;
+	}
+	if(len >= 2)
+	{
+		memcpy(half, data, 2) ;
+		acc = (acc + half[0]) & 0xffffffffUL ;
+		carry += (acc < half[0]) ;
+		data += 2 ;
+		len -= 2 ;
+	}
+	if(len == 1)
+	{
+		half[0] = ipsec_htons((__u16)(*data << 8)) ;
+		acc = (acc + half[0]) & 0xffffffffUL ;
+		carry += (acc < half[0]) ;
+	}
+
+	/* the carries are added back in (end-around carry) */
+	return sum + (acc >> 16) + (acc & 0xffffUL) + carry ;
+}
+
+/**
+ * Folds a sum of ipsec_chksum_add() to 16 bits. The checksum is the complement of it.
+ *
+ * @param sum		sum of 16 bit words
+ * @return one's complement sum (16 bits)
+ */
+__u16 ipsec_chksum_fold(__u32 sum)
+{
+	while(sum >> 16)
+		sum = (sum >> 16) + (sum & 0xffffUL) ;
+	return (__u16)sum ;
+}
+
+/**
+ * Updates a checksum for a 16 bit word of the data which changed (RFC 1624, 3, eqn. 3).
+ *
+ * @param chksum	current checksum
+ * @param old_word	old value of the word
+ * @param new_word	new value of the word
+ * @return checksum of the changed data
+ */
+__u16 ipsec_chksum_adjust(__u16 chksum, __u16 old_word, __u16 new_word)
+{
+	__u32 sum ;
+
+	sum = (__u32)(__u16)~chksum + (__u16)~old_word + new_word ;
+	return (__u16)~ipsec_chksum_fold(sum) ;
+}
+
+/**
+ * Changes a 16 bit word of an IP header and updates the header checksum without summing the 
+ * header again (e.g. for the total length or the identification).
+ *
+ * @param header	IP header
+ * @param word		word of the header which is changed (e.g. &header->len)
+ * @param value		new value of the word (network order)
+ * @return void
+ */
+void ipsec_ip_set_word(ipsec_ip_header *header, __u16 *word, __u16 value)
+{
+	header->chksum = ipsec_chksum_adjust(header->chksum, *word, value) ;
+	*word = value ;
+}
+
+/**
+ * Decrements the TTL of an IP header and updates the header checksum without summing the 
+ * header again. The TTL must not be 0.
+ *
+ * @param header	IP header
+ * @return void
+ */
+void ipsec_ip_dec_ttl(ipsec_ip_header *header)
+{
+	__u16 old_word ;
+	__u16 new_word ;
+
+	/* the TTL is the first byte of the word it shares with the protocol */
+	memcpy(&old_word, &header->ttl, 2) ;
+	header->ttl-- ;
+	memcpy(&new_word, &header->ttl, 2) ;
+	header->chksum = ipsec_chksum_adjust(header->chksum, old_word, new_word) ;
+}
@@ -55,6 +55,7 @@
 #include <string.h>
 
 #include "ipsec/des.h"
+#include "ipsec/util.h"
 #include "ipsec/debug.h"
 
 
@@ -614,6 +615,234 @@ void DES_decrypt3(DES_LONG *data, DES_key_schedule *ks1,
 	data[0]=l;
 	data[1]=r;
 }
+
+/* D_ENCRYPT() of two independent blocks, the table lookups of both blocks can be executed in parallel */
+#define D_ENCRYPT2(LL0,R0,LL1,R1,S) {\
+	u0=R0^s0[S  ]; \
+	t0=R0^s0[S+1]; \
+	u1=R1^s1[S  ]; \
+	t1=R1^s1[S+1]; \
+	t0=ROTATE(t0,4); \
+	t1=ROTATE(t1,4); \
+	LL0^=\
+		DES_SPtrans[0][(u0>> 2L)&0x3f]^ \
+		DES_SPtrans[2][(u0>>10L)&0x3f]^ \
+		DES_SPtrans[4][(u0>>18L)&0x3f]^ \
+		DES_SPtrans[6][(u0>>26L)&0x3f]^ \
+		DES_SPtrans[1][(t0>> 2L)&0x3f]^ \
+		DES_SPtrans[3][(t0>>10L)&0x3f]^ \
+		DES_SPtrans[5][(t0>>18L)&0x3f]^ \
+		DES_SPtrans[7][(t0>>26L)&0x3f]; \
+	LL1^=\
+		DES_SPtrans[0][(u1>> 2L)&0x3f]^ \
+		DES_SPtrans[2][(u1>>10L)&0x3f]^ \
+		DES_SPtrans[4][(u1>>18L)&0x3f]^ \
+		DES_SPtrans[6][(u1>>26L)&0x3f]^ \
+		DES_SPtrans[1][(t1>> 2L)&0x3f]^ \
+		DES_SPtrans[3][(t1>>10L)&0x3f]^ \
+		DES_SPtrans[5][(t1>>18L)&0x3f]^ \
+		DES_SPtrans[7][(t1>>26L)&0x3f]; }
+
+/**
+ * DES rounds of two independent blocks at once (interleaved DES_encrypt2()).
+ *
+ * @param data0		1st block (after IP)
+ * @param ks0		key schedule of the 1st block
+ * @param data1		2nd block (after IP)
+ * @param ks1		key schedule of the 2nd block
+ * @param enc		DES_ENCRYPT or DES_DECRYPT
+ * @return void
+ */
+static void DES_encrypt2x2(DES_LONG *data0, DES_key_schedule *ks0, DES_LONG *data1, DES_key_schedule *ks1, int enc)
+{
+	DES_LONG l0,r0,t0,u0;
+	DES_LONG l1,r1,t1,u1;
+	DES_LONG *s0,*s1;
+	int i;
+	r0=data0[0];
+	l0=data0[1];
+	r1=data1[0];
+	l1=data1[1];
+	r0=ROTATE(r0,29)&0xffffffffL;
+	l0=ROTATE(l0,29)&0xffffffffL;
+	r1=ROTATE(r1,29)&0xffffffffL;
+	l1=ROTATE(l1,29)&0xffffffffL;
+	s0=ks0->ks->deslong;
+	s1=ks1->ks->deslong;
+	if (enc)
+		{
+		for (i=0; i<32; i+=4)
+			{
+			D_ENCRYPT2(l0,r0,l1,r1,i+0);
+			D_ENCRYPT2(r0,l0,r1,l1,i+2);
+			}
+		}
+	else
+		{
+		for (i=30; i>0; i-=4)
+			{
+			D_ENCRYPT2(l0,r0,l1,r1,i-0);
+			D_ENCRYPT2(r0,l0,r1,l1,i-2);
+			}
+		}
+	data0[0]=ROTATE(l0,3)&0xffffffffL;
+	data0[1]=ROTATE(r0,3)&0xffffffffL;
+	data1[0]=ROTATE(l1,3)&0xffffffffL;
+	data1[1]=ROTATE(r1,3)&0xffffffffL;
+}
+
+/**
+ * 3DES en- or decryption of two independent blocks at once (interleaved DES_encrypt3() and DES_decrypt3()).
+ *
+ * @param data0		1st block
+ * @param ks0		array of the 3 key schedules of the 1st block
+ * @param data1		2nd block
+ * @param ks1		array of the 3 key schedules of the 2nd block
+ * @param enc		DES_ENCRYPT or DES_DECRYPT
+ * @return void
+ */
+static void DES_crypt3x2(DES_LONG *data0, DES_key_schedule *ks0, DES_LONG *data1, DES_key_schedule *ks1, int enc)
+{
+	DES_LONG l,r;
+	l=data0[0];
+	r=data0[1];
+	IP(l,r);
+	data0[0]=l;
+	data0[1]=r;
+	l=data1[0];
+	r=data1[1];
+	IP(l,r);
+	data1[0]=l;
+	data1[1]=r;
+	if (enc)
+		{
+		DES_encrypt2x2(data0,&ks0[0],data1,&ks1[0],DES_ENCRYPT);
+		DES_encrypt2x2(data0,&ks0[1],data1,&ks1[1],DES_DECRYPT);
+		DES_encrypt2x2(data0,&ks0[2],data1,&ks1[2],DES_ENCRYPT);
+		}
+	else
+		{
+		DES_encrypt2x2(data0,&ks0[2],data1,&ks1[2],DES_DECRYPT);
+		DES_encrypt2x2(data0,&ks0[1],data1,&ks1[1],DES_ENCRYPT);
+		DES_encrypt2x2(data0,&ks0[0],data1,&ks1[0],DES_DECRYPT);
+		}
+	l=data0[0];
+	r=data0[1];
+	FP(r,l);
+	data0[0]=l;
+	data0[1]=r;
+	l=data1[0];
+	r=data1[1];
+	FP(r,l);
+	data1[0]=l;
+	data1[1]=r;
+}
+
+/**
+ * 3DES-CBC decryption of two blocks at once. CBC decryption of a block does not depend on the 
+ * decryption of the previous one, so the blocks are decrypted pairwise with DES_crypt3x2().
+ *
+ * @param input		cipher text (may be the same as output)
+ * @param output	plain text
+ * @param length	number of bytes (a multiple of 16)
+ * @param ks		array of 3 key schedules
+ * @param ivec		initialization vector, holds the last cipher block when the function returns
+ * @return void
+ */
+static void DES_ede3_cbc_decrypt2(const unsigned char *input, unsigned char *output,
+			  long length, DES_key_schedule *ks, DES_cblock *ivec)
+{
+	DES_LONG a[2],b[2];
+	DES_LONG xor0,xor1,c0,c1,d0,d1;
+	const unsigned char *in=input;
+	unsigned char *out=output;
+	unsigned char *iv;
+
+	iv = &(*ivec)[0];
+	c2l(iv,xor0);
+	c2l(iv,xor1);
+	for (; length>=16; length-=16)
+		{
+		c2l(in,a[0]);
+		c2l(in,a[1]);
+		c2l(in,b[0]);
+		c2l(in,b[1]);
+		c0=a[0];
+		c1=a[1];
+		d0=b[0];
+		d1=b[1];
+		DES_crypt3x2(a,ks,b,ks,DES_DECRYPT);
+		a[0]^=xor0;
+		a[1]^=xor1;
+		b[0]^=c0;
+		b[1]^=c1;
+		l2c(a[0],out);
+		l2c(a[1],out);
+		l2c(b[0],out);
+		l2c(b[1],out);
+		xor0=d0;
+		xor1=d1;
+		}
+	iv = &(*ivec)[0];
+	l2c(xor0,iv);
+	l2c(xor1,iv);
+	a[0]=a[1]=b[0]=b[1]=0;
+}
+
+/**
+ * 3DES-CBC encryption of two independent streams at once (e.g. two packets). Each block of a stream 
+ * depends on the previous one, so the blocks of the two streams are interleaved with DES_crypt3x2().
+ *
+ * @param in0		input of the 1st stream (may be the same as out0)
+ * @param out0		output of the 1st stream
+ * @param ks0		array of the 3 key schedules of the 1st stream
+ * @param ivec0		initialization vector of the 1st stream, holds its last cipher block when the function returns
+ * @param in1		input of the 2nd stream (may be the same as out1)
+ * @param out1		output of the 2nd stream
+ * @param ks1		array of the 3 key schedules of the 2nd stream
+ * @param ivec1		initialization vector of the 2nd stream, holds its last cipher block when the function returns
+ * @param length	number of bytes of each stream (a multiple of 8)
+ * @return void
+ */
+static void DES_ede3_cbc_encrypt2(const unsigned char *in0, unsigned char *out0, DES_key_schedule *ks0, DES_cblock *ivec0,
+			  const unsigned char *in1, unsigned char *out1, DES_key_schedule *ks1, DES_cblock *ivec1,
+			  long length)
+{
+	DES_LONG a[2],b[2];
+	DES_LONG tin0,tin1;
+	unsigned char *iv;
+
+	iv = &(*ivec0)[0];
+	c2l(iv,a[0]);
+	c2l(iv,a[1]);
+	iv = &(*ivec1)[0];
+	c2l(iv,b[0]);
+	c2l(iv,b[1]);
+	for (; length>=8; length-=8)
+		{
+		c2l(in0,tin0);
+		c2l(in0,tin1);
+		a[0]^=tin0;
+		a[1]^=tin1;
+		c2l(in1,tin0);
+		c2l(in1,tin1);
+		b[0]^=tin0;
+		b[1]^=tin1;
+		DES_crypt3x2(a,ks0,b,ks1,DES_ENCRYPT);
+		l2c(a[0],out0);
+		l2c(a[1],out0);
+		l2c(b[0],out1);
+		l2c(b[1],out1);
+		}
+	iv = &(*ivec0)[0];
+	l2c(a[0],iv);
+	l2c(a[1],iv);
+	iv = &(*ivec1)[0];
+	l2c(b[0],iv);
+	l2c(b[1],iv);
+	tin0=tin1=0;
+}
+
 #ifndef DES_DEFAULT_OPTIONS
 //#undef CBC_ENC_C__DONT_UPDATE_IV
 
@@ -1052,8 +1281,232 @@ int DES_key_sched(const_DES_cblock *key, DES_key_schedule *schedule)
 
 
 
+/**
+ * Expands a 3DES key (3 x 64 bits) into the three DES key schedules used by cipher_3des_cbc_ks().
+ * The parity and weak-key checks of DES_set_key_checked() are done once here, so the resulting
+ * schedules can be stored (e.g. in the SAD entry) and reused for every packet.
+ *
+ * @param key		pointer to encryption key (192 bits)
+ * @param ks		pointer to an array of 3 key schedules which is filled up
+ * @return 0 	if the key schedules were properly set up
+ * @return -1	if one of the DES keys had a wrong parity
+ * @return -2	if one of the DES keys was weak
+ */
+int cipher_3des_set_key(unsigned char* key, DES_key_schedule* ks)
+{
+	int ret_val;
+	int i;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "cipher_3des_set_key", 
+				  ("key=%p, ks=%p",
+			      (void *)key, (void *)ks)
+				 );
+
+	for(i = 0; i < 3; i++)
+	{
+		ret_val = DES_set_key_checked((const_DES_cblock*)(key + i*8), &ks[i]);
+		if(ret_val != 0) {
+			IPSEC_LOG_ERR("cipher_3des_set_key", IPSEC_STATUS_BAD_KEY, ("DES_set_key_checked() could not set 3DES key %d - ret_val = %d\n", i+1, ret_val)) ;
+			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "cipher_3des_set_key", ("return = %d", ret_val) );
+			return ret_val;
+		}
+	}
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "cipher_3des_set_key", ("return = %d", 0) );
+	return 0;
+}
+
+static int cipher_3des_engine = CIPHER_3DES_DEFAULT_ENGINE ;	/**< 3DES engine used by the cipher_3des_xxx() functions */
+
+/**
+ * Selects the 3DES engine at run-time. Both engines produce the same output, CIPHER_3DES_SERIAL 
+ * (the original code) is the fallback for targets where the interleaved code is slower.
+ *
+ * @param engine	CIPHER_3DES_SERIAL or CIPHER_3DES_INTERLEAVED
+ * @return the engine used so far
+ */
+int cipher_3des_set_engine(int engine)
+{
+	int previous = cipher_3des_engine ;
+
+	cipher_3des_engine = (engine == CIPHER_3DES_INTERLEAVED) ? CIPHER_3DES_INTERLEAVED : CIPHER_3DES_SERIAL ;
+	return previous ;
+}
+
+/**
+ * 3DES-CBC en- or decryption of a buffer with the selected engine. Only decryption is interleaved,
+ * the blocks of one encrypted stream depend on each other.
+ *
+ * @param in		input data (may be the same as out)
+ * @param out		en- or decrypted data
+ * @param len		length of input data
+ * @param ks		pointer to an array of 3 key schedules
+ * @param iv		initialization vector, holds the last cipher block when the function returns
+ * @param mode		defines whether encryption or decryption should be performed
+ * @return void
+ */
+static void cipher_3des_cbc_blocks(unsigned char *in, unsigned char *out, int len, 
+                                   DES_key_schedule *ks, unsigned char *iv, int mode)
+{
+	int n ;
+
+	if((mode == DES_DECRYPT) && (cipher_3des_engine == CIPHER_3DES_INTERLEAVED) && (len >= 16))
+	{
+		n = len & ~15 ;
+		DES_ede3_cbc_decrypt2(in, out, n, ks, (DES_cblock*)iv) ;
+		in += n ;
+		out += n ;
+		len -= n ;
+	}
+
+	if(len > 0)
+		DES_ede3_cbc_encrypt(in, out, len, &ks[0], &ks[1], &ks[2], (DES_cblock*)iv, mode) ;
+}
+
+/**
+ * 3DES-CBC function which en- or decrypts a data buffer using already expanded key schedules
+ * (see cipher_3des_set_key()).
+ *
+ * @param text		pointer to input data
+ * @param text_len	length of input data
+ * @param ks		pointer to an array of 3 key schedules
+ * @param iv		initialization vector
+ * @param mode		defines whether encryption or decryption should be performed
+ * @param output	en- or decrypted input data
+ * @return void
+ *
+ */
+void cipher_3des_cbc_ks(unsigned char* text, int text_len, 
+                        DES_key_schedule* ks, unsigned char* iv, int mode, unsigned char*  output)
+{
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "cipher_3des_cbc_ks", 
+				  ("text=%p, text_len=%d, ks=%p, iv=%p, mode=%d, output=%p",
+			      (void *)text, text_len, (void *)ks, (void *)iv, mode, (void *)output)
+				 );
+
+	cipher_3des_cbc_blocks(text, output, text_len, ks, iv, mode);
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "cipher_3des_cbc_ks", ("void") );
+}
+
+/**
+ * 3DES-CBC function which en- or decrypts several independent buffers (e.g. the payloads of a batch 
+ * of packets) using already expanded key schedules (see cipher_3des_set_key()).
+ *
+ * With CIPHER_3DES_INTERLEAVED, the buffers are encrypted pairwise with the blocks of both buffers 
+ * interleaved, so the CBC dependency of one buffer does not stall the CPU. The result is the same 
+ * as calling cipher_3des_cbc_ks() for every buffer.
+ *
+ * @param streams	array of buffers to process (each with its own key schedules and IV)
+ * @param count		number of buffers in the array
+ * @param mode		defines whether encryption or decryption should be performed
+ * @return void
+ *
+ */
+void cipher_3des_cbc_multi(cipher_3des_stream *streams, int count, int mode)
+{
+	cipher_3des_stream	*a, *b ;
+	int					i, n ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "cipher_3des_cbc_multi", 
+				  ("streams=%p, count=%d, mode=%d",
+			      (void *)streams, count, mode)
+				 );
+
+	for(i = 0; i < count; i++)
+	{
+		a = &streams[i] ;
+		n = 0 ;
+		if((mode == DES_ENCRYPT) && (cipher_3des_engine == CIPHER_3DES_INTERLEAVED) && (i+1 < count))
+		{
+			/* the common part of two buffers is encrypted interleaved */
+			b = &streams[++i] ;
+			n = ((a->len < b->len) ? a->len : b->len) & ~7 ;
+			DES_ede3_cbc_encrypt2(a->text, a->output, a->ks, (DES_cblock*)a->iv, b->text, b->output, b->ks, (DES_cblock*)b->iv, n) ;
+			cipher_3des_cbc_blocks(b->text + n, b->output + n, b->len - n, b->ks, b->iv, mode) ;
+		}
+		cipher_3des_cbc_blocks(a->text + n, a->output + n, a->len - n, a->ks, a->iv, mode) ;
+	}
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "cipher_3des_cbc_multi", ("void") );
+}
+
+/**
+ * 3DES-CBC function which en- or decrypts a part of a chain of buffers in place using already 
+ * expanded key schedules (see cipher_3des_set_key()).
+ *
+ * The blocks inside a segment are processed directly. Only a block which spans two segments 
+ * is gathered into a local block and scattered back after processing.
+ *
+ * @param chain		first segment of the chain
+ * @param offset	offset of the first byte to process relative to the start of the chain
+ * @param len		number of bytes to process (a multiple of the block size)
+ * @param ks		pointer to an array of 3 key schedules
+ * @param iv		initialization vector, holds the last cipher block when the function returns
+ * @param mode		defines whether encryption or decryption should be performed
+ * @return void
+ *
+ */
+void cipher_3des_cbc_chain(ipsec_buffer *chain, int offset, int len, 
+                           DES_key_schedule* ks, unsigned char* iv, int mode)
+{
+	unsigned char	block[8];
+	int				n;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "cipher_3des_cbc_chain", 
+				  ("chain=%p, offset=%d, len=%d, ks=%p, iv=%p, mode=%d",
+			      (void *)chain, offset, len, (void *)ks, (void *)iv, mode)
+				 );
+
+	while((chain != NULL) && (offset >= chain->len))
+	{
+		offset -= chain->len;
+		chain = chain->next;
+	}
+
+	while((chain != NULL) && (len > 0))
+	{
+		/* whole blocks inside this segment */
+		n = chain->len - offset;
+		if(n > len) n = len;
+		n &= ~7;
+		if(n > 0)
+		{
+			cipher_3des_cbc_blocks(chain->data + offset, chain->data + offset, n, ks, iv, mode);
+			offset += n;
+			len -= n;
+		}
+
+		/* block which spans the end of this segment */
+		if((len > 0) && (offset < chain->len))
+		{
+			n = (len < 8) ? len : 8;
+			memset(block, 0, sizeof(block));
+			ipsec_buffer_copy_out(chain, offset, n, block);
+			DES_ede3_cbc_encrypt(block, block, n, &ks[0], &ks[1], &ks[2], (DES_cblock*)iv, mode);
+			ipsec_buffer_copy_in(chain, offset, n, block);
+			offset += n;
+			len -= n;
+		}
+
+		while((chain != NULL) && (offset >= chain->len))
+		{
+			offset -= chain->len;
+			chain = chain->next;
+		}
+	}
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "cipher_3des_cbc_chain", ("void") );
+}
+
 /**
  * 3DES-CBC function calculates a digest from a given data buffer and a given key.
+ * The key schedules are set up on every call. Use cipher_3des_set_key() and cipher_3des_cbc_ks()
+ * if the same key is used more than once.
  *
  * @param text		pointer to input data
  * @param text_len	length of input data
@@ -1067,8 +1520,7 @@ int DES_key_sched(const_DES_cblock *key, DES_key_schedule *schedule)
 void cipher_3des_cbc(unsigned char* text, int text_len, 
                      unsigned char* key, unsigned char* iv, int mode, unsigned char*  output)
 {
-	int ret_val;
-	DES_key_schedule ks1, ks2, ks3;
+	DES_key_schedule ks[3];
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
 	              "cipher_3des_cbc", 
@@ -1076,28 +1528,12 @@ void cipher_3des_cbc(unsigned char* text, int text_len,
 			      (void *)text, text_len, (void *)key, (void *)iv, mode, (void *)output)
 				 );
 
-	ret_val = DES_set_key_checked((const_DES_cblock*)(key + 0*8), &ks1);
-	if(ret_val != 0) {
-		IPSEC_LOG_ERR("ipsec_esp_decapsulate", IPSEC_STATUS_BAD_KEY, ("DES_set_key_checked(&cbc1_key,&ks1) could not set 1st 3DES key - ret_val = %d\n", ret_val)) ;
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "cipher_3des_cbc", ("void") );
-		return;
-	}
-
-	ret_val = DES_set_key_checked((const_DES_cblock*)(key + 1*8), &ks2);
-	if(ret_val != 0) {
-		IPSEC_LOG_ERR("ipsec_esp_decapsulate", IPSEC_STATUS_BAD_KEY, ("DES_set_key_checked(&cbc2_key,&ks2) could not set 2nd 3DES key - ret_val = %d\n", ret_val)) ;
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "cipher_3des_cbc", ("void") );
-		return;
-	}
-
-	ret_val = DES_set_key_checked((const_DES_cblock*)(key + 2*8), &ks3);
-	if(ret_val != 0) {
-		IPSEC_LOG_ERR("ipsec_esp_decapsulate", IPSEC_STATUS_BAD_KEY, ("DES_set_key_checked(&cbc3_key,&ks3) could not set 3rd 3DES key - ret_val = %d\n", ret_val)) ;
+	if(cipher_3des_set_key(key, ks) != 0) {
 		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "cipher_3des_cbc", ("void") );
 		return;
 	}
 
-	DES_ede3_cbc_encrypt(text, output, text_len, (DES_key_schedule *)&ks1 ,(DES_key_schedule *)&ks2, (DES_key_schedule *)&ks3, (DES_cblock*)iv, mode);
+	cipher_3des_cbc_ks(text, text_len, ks, iv, mode, output);
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "cipher_3des_cbc", ("void") );
 }
@@ -43,11 +43,11 @@
  *  <pre>
  *                              | pointer to packet header
  *     ________________________\/________________________________________________
- *    |                                                     padd        ev. |
- *    | Ethernet  newIP  ESP     original (inner) packet    next-proto  ICV |
- *    |_____________________________________________________________________|
- *                                                                             
- *    <-room for new headers-->                             <-   room tail  -> 
+ *    |          ¦       ¦      ¦                             ¦ padd       ¦ ev. |
+ *    | Ethernet ¦ newIP ¦ ESP  ¦   original (inner) packet   ¦ next-proto ¦ ICV |
+ *    |__________¦_______¦______¦_____________________________¦____________¦_____|
+ *    ¦                         ¦                             ¦                  ¦ 
+ *    ¦<-room for new headers-->¦                             ¦<-   room tail  ->¦ 
  *  </pre>
  *
  * This document is part of <EM>embedded IPsec<BR>
@@ -66,37 +66,390 @@
 
 #include "ipsec/sa.h"
 #include "ipsec/des.h"
+#include "ipsec/aes.h"
+#include "ipsec/gcm.h"
+#include "ipsec/chacha.h"
 #include "ipsec/md5.h"
 #include "ipsec/sha1.h"
+#include "ipsec/hash_multi.h"
+#include "ipsec/ivgen.h"
+#include "ipsec/chksum.h"
 
 #include "ipsec/esp.h"
 
 
-__u32 ipsec_esp_bitmap 	= 0;        		/**< save session state to detect replays - must be 32 bits. 
-											 *   Note: must be initialized with zero (0x00000000) when
-											 *         a new SA is established! */
-__u32 ipsec_esp_lastSeq	= 0;         		/**< save session state to detect replays
-											 *   Note: must be initialized with zero (0x00000000) when
-											 *         a new SA is established! */
+#define IPSEC_ESP_STITCH_SIZE	(512)	/**< bytes en- or decrypted and then hashed at a time by ipsec_esp_stitch(), a multiple of the cipher and hash block sizes */
 
+/** inner hash of the HMAC of an ESP packet which is calculated piece by piece (see ipsec_esp_stitch()) */
+typedef union ipsec_esp_auth_union
+{
+	MD5_CTX		md5 ;
+	SHA_CTX		sha1 ;
+	SHA256_CTX	sha256 ;
+	SHA512_CTX	sha512 ;
+} ipsec_esp_auth ;
+
+/** ESP packet between ipsec_esp_encapsulate_frame() and ipsec_esp_encapsulate_finish() */
+typedef struct ipsec_esp_frame_struct
+{
+	ipsec_ip_header		*ip ;				/**< new outer IP header */
+	ipsec_esp_header	*esp ;				/**< new ESP header, followed by the IV */
+	ipsec_buffer		*last ;				/**< segment which holds the ESP trailer */
+	int					payload_offset ;	/**< offset of the inner packet relative to the outer IP header */
+	int					text_len ;			/**< length of the inner packet, the padding and the trailer (the encrypted part) */
+	int					payload_len ;		/**< length of the ESP header, the IV and the encrypted part */
+	int					iv_size ;			/**< size of the IV */
+	int					icv_len ;			/**< size of the ICV */
+	__u8				tos ;				/**< TOS of the inner IP header */
+	unsigned char 		cbc_iv[AES_BLOCK_SIZE] ;		/**< IV or counter block of the cipher (see ipsec_esp_cipher_iv()) */
+	unsigned char 		digest[IPSEC_MAX_AUTHKEY_LEN] ;	/**< ICV of the packet */
+} ipsec_esp_frame ;
+
+static ipsec_status ipsec_esp_decapsulate_hmac(ipsec_buffer *, int *, int *, sad_entry *, unsigned char *) ;
 
 
 /**
  * Returns the number of padding needed for a certain ESP packet size 
  *
  * @param	len		the length of the packet
+ * @param	block	the block size the payload must be aligned to
  * @return	the length of padding needed
  */
-__u8 ipsec_esp_get_padding(int len)
+__u8 ipsec_esp_get_padding(int len, int block)
 {
 	int padding ;
 
-	for(padding = 0; padding < 8; padding++)
-		if(((len+padding) % 8) == 0)
+	for(padding = 0; padding < block; padding++)
+		if(((len+padding) % block) == 0)
 			break ;
 	return padding ;
 }
 
+/**
+ * Returns the IV size and the block size the payload is aligned to for the encryption algorithm of an SA.
+ *
+ * @param	sa			pointer to the SA
+ * @param	iv_size		pointer used to return the size of the IV in front of the payload
+ * @param	block_size	pointer used to return the block size (AES-CTR and the combined modes only need 4 byte alignment, RFC 3686, 3.2)
+ * @return	void
+ */
+static void ipsec_esp_get_cipher(sad_entry *sa, int *iv_size, int *block_size)
+{
+	switch(sa->enc_alg)
+	{
+		case IPSEC_AES_128_CBC:
+		case IPSEC_AES_256_CBC:
+			*iv_size = AES_BLOCK_SIZE ;
+			*block_size = AES_BLOCK_SIZE ;
+			break ;
+		case IPSEC_AES_128_CTR:
+		case IPSEC_AES_256_CTR:
+		case IPSEC_AES_128_GCM_8:
+		case IPSEC_AES_128_GCM_12:
+		case IPSEC_AES_128_GCM_16:
+		case IPSEC_AES_256_GCM_8:
+		case IPSEC_AES_256_GCM_12:
+		case IPSEC_AES_256_GCM_16:
+		case IPSEC_CHACHA20_POLY1305:
+			*iv_size = IPSEC_ESP_IV_SIZE ;
+			*block_size = 4 ;
+			break ;
+		default:
+			*iv_size = IPSEC_ESP_IV_SIZE ;
+			*block_size = 8 ;
+			break ;
+	}
+}
+
+/**
+ * Returns the size of the ICV appended to the packets of an SA.
+ *
+ * @param	sa			pointer to the SA
+ * @return	the ICV size of a combined mode or of the authentication algorithm (IPSEC_AUTH_ICV_LEN()), 0 if none is used
+ */
+static int ipsec_esp_get_icv(sad_entry *sa)
+{
+	switch(sa->enc_alg)
+	{
+		case IPSEC_AES_128_GCM_8:
+		case IPSEC_AES_256_GCM_8:
+			return 8 ;
+		case IPSEC_AES_128_GCM_12:
+		case IPSEC_AES_256_GCM_12:
+			return 12 ;
+		case IPSEC_AES_128_GCM_16:
+		case IPSEC_AES_256_GCM_16:
+		case IPSEC_CHACHA20_POLY1305:
+			return 16 ;
+		default:
+			return (sa->auth_alg != 0) ? IPSEC_AUTH_ICV_LEN(sa->auth_alg) : 0 ;
+	}
+}
+
+/**
+ * Sets up the nonce of an AES-GCM or ChaCha20-Poly1305 SA for one packet (RFC 4106, 4 and 
+ * RFC 7634, 2): salt and IV.
+ *
+ * @param	sa			pointer to the SA (the salt follows the key)
+ * @param	iv			IV of the packet
+ * @param	nonce		nonce which is filled up (12 bytes)
+ * @return	void
+ */
+static void ipsec_esp_aead_nonce(sad_entry *sa, unsigned char *iv, unsigned char *nonce)
+{
+	int key_len ;
+
+	if(sa->enc_alg == IPSEC_CHACHA20_POLY1305)
+		key_len = IPSEC_CHACHA20_KEY_LEN ;
+	else
+		key_len = (sa->enc_alg <= IPSEC_AES_128_GCM_16) ? IPSEC_AES_128_KEY_LEN : IPSEC_AES_256_KEY_LEN ;
+	memcpy(nonce, sa->enckey + key_len, IPSEC_AES_GCM_SALT_LEN) ;
+	memcpy(nonce + IPSEC_AES_GCM_SALT_LEN, iv, IPSEC_ESP_IV_SIZE) ;
+}
+
+/**
+ * Sets up the counter block of an AES-CTR SA for one packet (RFC 3686, 4): nonce, IV and a block
+ * counter which starts with 1.
+ *
+ * @param	sa			pointer to the SA (the nonce follows the key)
+ * @param	iv			IV of the packet
+ * @param	counter		counter block which is filled up
+ * @return	void
+ */
+static void ipsec_esp_ctr_block(sad_entry *sa, unsigned char *iv, unsigned char *counter)
+{
+	int key_len ;
+
+	key_len = (sa->enc_alg == IPSEC_AES_128_CTR) ? IPSEC_AES_128_KEY_LEN : IPSEC_AES_256_KEY_LEN ;
+	memcpy(counter, sa->enckey + key_len, IPSEC_AES_CTR_NONCE_LEN) ;
+	memcpy(counter + IPSEC_AES_CTR_NONCE_LEN, iv, IPSEC_ESP_IV_SIZE) ;
+	counter[12] = 0 ;
+	counter[13] = 0 ;
+	counter[14] = 0 ;
+	counter[15] = 1 ;
+}
+
+/**
+ * Sets up the CBC IV or the CTR counter block of a packet from the IV in front of the payload.
+ *
+ * @param	sa			pointer to the SA
+ * @param	iv			IV of the packet
+ * @param	cbc_iv		IV or counter block which is filled up (AES_BLOCK_SIZE bytes)
+ * @return	void
+ */
+static void ipsec_esp_cipher_iv(sad_entry *sa, unsigned char *iv, unsigned char *cbc_iv)
+{
+	switch(sa->enc_alg)
+	{
+		case IPSEC_3DES:
+			memcpy(cbc_iv, iv, IPSEC_ESP_IV_SIZE) ;
+			break ;
+		case IPSEC_AES_128_CBC:
+		case IPSEC_AES_256_CBC:
+			memcpy(cbc_iv, iv, AES_BLOCK_SIZE) ;
+			break ;
+		case IPSEC_AES_128_CTR:
+		case IPSEC_AES_256_CTR:
+			ipsec_esp_ctr_block(sa, iv, cbc_iv) ;
+			break ;
+		default:
+			break ;
+	}
+}
+
+/**
+ * En- or decrypts a part of a chain of buffers with the cipher of an SA which is not a combined mode.
+ * The part can be processed piece by piece if all the pieces but the last one are multiples of 16 bytes.
+ *
+ * @param	sa			pointer to the SA
+ * @param	chain		first segment of the packet
+ * @param	offset		offset of the first byte relative to the start of the chain
+ * @param	len			number of bytes
+ * @param	cbc_iv		IV or counter block (see ipsec_esp_cipher_iv()), updated for the next piece
+ * @param	encrypt		1 to encrypt, 0 to decrypt
+ * @return	void
+ */
+static void ipsec_esp_cipher(sad_entry *sa, ipsec_buffer *chain, int offset, int len, unsigned char *cbc_iv, int encrypt)
+{
+	switch(sa->enc_alg)
+	{
+		case IPSEC_3DES:
+			cipher_3des_cbc_chain(chain, offset, len, sa->enc_ctx.des, cbc_iv, encrypt ? DES_ENCRYPT : DES_DECRYPT) ;
+			break ;
+		case IPSEC_AES_128_CBC:
+		case IPSEC_AES_256_CBC:
+			cipher_aes_cbc_chain(chain, offset, len, &sa->enc_ctx.aes, cbc_iv, encrypt ? AES_ENCRYPT : AES_DECRYPT) ;
+			break ;
+		case IPSEC_AES_128_CTR:
+		case IPSEC_AES_256_CTR:
+			cipher_aes_ctr_chain(chain, offset, len, &sa->enc_ctx.aes, cbc_iv) ;
+			break ;
+		default:
+			break ;
+	}
+}
+
+/**
+ * Adds a part of a chain of buffers to the inner hash of an HMAC.
+ *
+ * @param	sa			pointer to the SA (auth_alg)
+ * @param	ctx			inner hash context
+ * @param	chain		first segment of the packet
+ * @param	offset		offset of the first byte relative to the start of the chain
+ * @param	len			number of bytes
+ * @return	void
+ */
+static void ipsec_esp_auth_update(sad_entry *sa, ipsec_esp_auth *ctx, ipsec_buffer *chain, int offset, int len)
+{
+	int n ;
+
+	for(; (chain != NULL) && (len > 0); chain = chain->next)
+	{
+		if(offset >= chain->len)
+		{
+			offset -= chain->len ;
+			continue ;
+		}
+		n = chain->len - offset ;
+		if(n > len) n = len ;
+		switch(sa->auth_alg)
+		{
+			case IPSEC_HMAC_MD5:
+				MD5_Update(&ctx->md5, chain->data + offset, n) ;
+				break ;
+			case IPSEC_HMAC_SHA1:
+				SHA1_Update(&ctx->sha1, chain->data + offset, n) ;
+				break ;
+			case IPSEC_HMAC_SHA256:
+				SHA256_Update(&ctx->sha256, chain->data + offset, n) ;
+				break ;
+			default:
+				SHA512_Update(&ctx->sha512, chain->data + offset, n) ;
+				break ;
+		}
+		len -= n ;
+		offset = 0 ;
+	}
+}
+
+/**
+ * En- or decrypts the payload of an ESP packet and calculates its HMAC in one pass (encrypt-then-MAC).
+ *
+ * The payload is processed in pieces of IPSEC_ESP_STITCH_SIZE bytes. Every piece of ciphertext is 
+ * hashed right after it was encrypted or right before it is decrypted, while it is still in the cache, 
+ * instead of passing the whole packet through the cache twice. The result is the one of 
+ * ipsec_esp_cipher() followed by hmac_xxx_chain().
+ *
+ * @param	sa			pointer to the SA
+ * @param	header		ESP header followed by the IV (authenticated, not encrypted)
+ * @param	header_len	length of the ESP header and the IV
+ * @param	chain		first segment of the packet
+ * @param	offset		offset of the payload relative to the start of the chain
+ * @param	len			length of the payload
+ * @param	cbc_iv		IV or counter block (see ipsec_esp_cipher_iv())
+ * @param	encrypt		1 to encrypt, 0 to decrypt
+ * @param	digest		returns the HMAC (IPSEC_MAX_AUTHKEY_LEN bytes)
+ * @return IPSEC_STATUS_SUCCESS		if the payload was processed
+ * @return IPSEC_STATUS_FAILURE		if the authentication algorithm of the SA is unknown (nothing was processed)
+ */
+static ipsec_status ipsec_esp_stitch(sad_entry *sa, unsigned char *header, int header_len, ipsec_buffer *chain, int offset, int len, 
+                                     unsigned char *cbc_iv, int encrypt, unsigned char *digest)
+{
+	ipsec_esp_auth	ctx ;
+	ipsec_buffer	head ;
+	int				n ;
+
+	head.next = NULL ;
+	head.data = header ;
+	head.len = header_len ;
+
+	switch(sa->auth_alg)
+	{
+		case IPSEC_HMAC_MD5:
+			memcpy(&ctx.md5, &sa->auth_ctx.md5.inner, sizeof(MD5_CTX)) ;
+			break ;
+		case IPSEC_HMAC_SHA1:
+			memcpy(&ctx.sha1, &sa->auth_ctx.sha1.inner, sizeof(SHA_CTX)) ;
+			break ;
+		case IPSEC_HMAC_SHA256:
+			memcpy(&ctx.sha256, &sa->auth_ctx.sha256.inner, sizeof(SHA256_CTX)) ;
+			break ;
+		case IPSEC_HMAC_SHA384:
+		case IPSEC_HMAC_SHA512:
+			memcpy(&ctx.sha512, &sa->auth_ctx.sha512.inner, sizeof(SHA512_CTX)) ;
+			break ;
+		default:
+			return IPSEC_STATUS_FAILURE ;
+	}
+	ipsec_esp_auth_update(sa, &ctx, &head, 0, header_len) ;
+
+	for(; len > 0; offset += n, len -= n)
+	{
+		n = (len < IPSEC_ESP_STITCH_SIZE) ? len : IPSEC_ESP_STITCH_SIZE ;
+		if(encrypt)
+		{
+			ipsec_esp_cipher(sa, chain, offset, n, cbc_iv, 1) ;
+			ipsec_esp_auth_update(sa, &ctx, chain, offset, n) ;
+		}
+		else
+		{
+			ipsec_esp_auth_update(sa, &ctx, chain, offset, n) ;
+			ipsec_esp_cipher(sa, chain, offset, n, cbc_iv, 0) ;
+		}
+	}
+
+	/* outer hash over the inner digest */
+	switch(sa->auth_alg)
+	{
+		case IPSEC_HMAC_MD5:
+			MD5_Final(digest, &ctx.md5) ;
+			memcpy(&ctx.md5, &sa->auth_ctx.md5.outer, sizeof(MD5_CTX)) ;
+			MD5_Update(&ctx.md5, digest, MD5_DIGEST_LENGTH) ;
+			MD5_Final(digest, &ctx.md5) ;
+			break ;
+		case IPSEC_HMAC_SHA1:
+			SHA1_Final(digest, &ctx.sha1) ;
+			memcpy(&ctx.sha1, &sa->auth_ctx.sha1.outer, sizeof(SHA_CTX)) ;
+			SHA1_Update(&ctx.sha1, digest, SHA_DIGEST_LENGTH) ;
+			SHA1_Final(digest, &ctx.sha1) ;
+			break ;
+		case IPSEC_HMAC_SHA256:
+			SHA256_Final(digest, &ctx.sha256) ;
+			memcpy(&ctx.sha256, &sa->auth_ctx.sha256.outer, sizeof(SHA256_CTX)) ;
+			SHA256_Update(&ctx.sha256, digest, SHA256_DIGEST_LENGTH) ;
+			SHA256_Final(digest, &ctx.sha256) ;
+			break ;
+		default:
+			SHA512_Final(digest, &ctx.sha512) ;
+			memcpy(&ctx.sha512, &sa->auth_ctx.sha512.outer, sizeof(SHA512_CTX)) ;
+			SHA512_Update(&ctx.sha512, digest, ctx.sha512.md_len) ;
+			SHA512_Final(digest, &ctx.sha512) ;
+			break ;
+	}
+
+	return IPSEC_STATUS_SUCCESS ;
+}
+
+/**
+ * Returns the worst-case room ipsec_esp_encapsulate() needs around an IP packet for a certain SA.
+ *
+ * The headroom is used for the outer IP header, the ESP header and the IV. The tailroom is 
+ * used for the padding, the padding length, the next header field and the ICV.
+ *
+ * @param	sa			pointer to the SA
+ * @param	headroom	pointer used to return the number of bytes needed in front of the packet
+ * @param	tailroom	pointer used to return the number of bytes needed after the packet
+ * @return	void
+ */
+void ipsec_esp_get_overhead(sad_entry *sa, int *headroom, int *tailroom)
+{
+	int iv_size, block_size ;
+
+	ipsec_esp_get_cipher(sa, &iv_size, &block_size) ;
+	*headroom = IPSEC_MIN_IPHDR_SIZE + IPSEC_ESP_HDR_SIZE + iv_size ;
+	*tailroom = block_size - 1 + IPSEC_ESP_TRAILER_SIZE + ipsec_esp_get_icv(sa) ;
+}
+
 /**
  * Decapsulates an IP packet containing an ESP header.
  *
@@ -104,116 +457,275 @@ __u8 ipsec_esp_get_padding(int len)
  * @param 	offset	pointer to the offset which is passed back
  * @param 	len		pointer to the length of the decapsulated packet
  * @param 	sa		pointer to the SA
+ * @return see ipsec_esp_decapsulate_chain()
+ */
+ipsec_status ipsec_esp_decapsulate(ipsec_ip_header *packet, int *offset, int *len, sad_entry *sa)
+ {
+	ipsec_buffer		segment ;
+
+	segment.next = NULL ;
+	segment.data = (unsigned char *)packet ;
+	segment.len = ipsec_ntohs(packet->len) ;
+
+	return ipsec_esp_decapsulate_chain(&segment, offset, len, sa) ;
+ }
+
+/**
+ * Decapsulates an IP packet containing an ESP header which is stored in a chain of buffers.
+ *
+ * The outer IP header, the ESP header and the IV must be in the first segment. The payload is 
+ * authenticated and decrypted in place, segment by segment. The ICV is calculated and the payload 
+ * is decrypted in one pass (see ipsec_esp_stitch() and the combined modes), so the payload is 
+ * already decrypted when an ICV mismatch is reported.
+ *
+ * @param	chain 	first segment of the packet (starts with the outer IP header)
+ * @param 	offset	pointer to the offset of the decapsulated packet relative to the start of the chain
+ * @param 	len		pointer to the length of the decapsulated packet
+ * @param 	sa		pointer to the SA
  * @return IPSEC_STATUS_SUCCESS 	if the packet could be decapsulated properly
  * @return IPSEC_STATUS_FAILURE		if the SA's authentication algorithm was invalid or if ICV comparison failed
- * @return IPSEC_STATUS_BAD_PACKET	if the decryption gave back a strange packet
+ * @return IPSEC_STATUS_BAD_PACKET	if the packet is truncated, its headers span several segments or the decryption gave back a strange packet
+ * @return IPSEC_STATUS_BAD_KEY		if the key schedules or HMAC state of the SA are not set up (see ipsec_sad_prepare()) or its key was rejected
  */
-ipsec_status ipsec_esp_decapsulate(ipsec_ip_header *packet, int *offset, int *len, sad_entry *sa)
+ipsec_status ipsec_esp_decapsulate_chain(ipsec_buffer *chain, int *offset, int *len, sad_entry *sa)
+ {
+	return ipsec_esp_decapsulate_hmac(chain, offset, len, sa, NULL) ;
+ }
+
+/**
+ * Decapsulates an ESP packet like ipsec_esp_decapsulate_chain(), optionally with an HMAC which was
+ * already calculated by ipsec_esp_decapsulate_batch().
+ *
+ * @param	chain 	first segment of the packet (starts with the outer IP header)
+ * @param 	offset	pointer to the offset of the decapsulated packet relative to the start of the chain
+ * @param 	len		pointer to the length of the decapsulated packet
+ * @param 	sa		pointer to the SA
+ * @param	hmac	HMAC of the packet (at least the ICV), NULL to calculate it here
+ * @return see ipsec_esp_decapsulate_chain()
+ */
+static ipsec_status ipsec_esp_decapsulate_hmac(ipsec_buffer *chain, int *offset, int *len, sad_entry *sa, unsigned char *hmac)
  {
 	int ret_val = IPSEC_STATUS_NOT_INITIALIZED;			/* by default, the return value is undefined */
  	__u8 				ip_header_len ;
 	int					local_len ;
 	int					payload_offset ;
 	int					payload_len ;
-	ipsec_ip_header		*new_ip_packet ;
+	ipsec_ip_header		*packet ;
+	ipsec_ip_header		new_ip_header ;
 	esp_packet			*esp_header ;			
-	char 				cbc_iv[IPSEC_ESP_IV_SIZE] ;
+	unsigned char		cbc_iv[AES_BLOCK_SIZE] ;
+	unsigned char		icv[IPSEC_ESP_MAX_ICV_SIZE] ;
 	unsigned char 		digest[IPSEC_MAX_AUTHKEY_LEN];
+	int					iv_size ;
+	int					block_size ;
+	int					icv_len ;
+	int					decrypted = 0 ;
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
-	              "ipsec_esp_decapsulate", 
-				  ("packet=%p, *offset=%d, *len=%d sa=%p",
-			      (void *)packet, *offset, *len, (void *)sa)
+	              "ipsec_esp_decapsulate_chain", 
+				  ("chain=%p, *offset=%d, *len=%d sa=%p",
+			      (void *)chain, *offset, *len, (void *)sa)
 				 );
+
+	/* the SAs are set up on the control path (ipsec_sad_add(), ipsec_spd_load_dbs()), never by a packet */
+	if(sa->key_state != IPSEC_KEYS_READY)
+	{
+		IPSEC_LOG_ERR("ipsec_esp_decapsulate_chain", IPSEC_STATUS_BAD_KEY, ("no valid key schedule or HMAC state for this SA")) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_decapsulate_chain", ("return = %d", IPSEC_STATUS_BAD_KEY) );
+		return IPSEC_STATUS_BAD_KEY;
+	}
 	
+	packet = (ipsec_ip_header *)chain->data ;
 	ip_header_len = (packet->v_hl & 0x0f) * 4 ;
 	esp_header = (esp_packet*)(((char*)packet)+ip_header_len) ; 
 	payload_offset = ip_header_len + IPSEC_ESP_SPI_SIZE + IPSEC_ESP_SEQ_SIZE ;
 	payload_len = ipsec_ntohs(packet->len) - ip_header_len - IPSEC_ESP_HDR_SIZE ;
+	ipsec_esp_get_cipher(sa, &iv_size, &block_size) ;
+	icv_len = ipsec_esp_get_icv(sa) ;
 
+	if((chain->len < payload_offset + iv_size) || (payload_len < iv_size + icv_len) || 
+	   (ipsec_buffer_len(chain) < ipsec_ntohs(packet->len)))
+	{
+		IPSEC_LOG_ERR("ipsec_esp_decapsulate_chain", IPSEC_STATUS_BAD_PACKET, ("ESP packet is truncated or its headers span several segments")) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_decapsulate_chain", ("return = %d", IPSEC_STATUS_BAD_PACKET) );
+		return IPSEC_STATUS_BAD_PACKET;
+	}
 
-	if(sa->auth_alg != 0)
+
+	if(icv_len != 0)
 	{
 
-		/* preliminary anti-replay check (without updating the global sequence number window)     */
+		/* preliminary anti-replay check (without updating the SA's sequence number window)     */
 		/* This check prevents useless ICV calculation if the Sequence Number is obviously wrong  */
-		ret_val = ipsec_check_replay_window(ipsec_ntohl(esp_header->sequence), ipsec_esp_lastSeq, ipsec_esp_bitmap);
+		ret_val = ipsec_check_replay_window(ipsec_ntohl(esp_header->sequence), &sa->replay);
 		if(ret_val != IPSEC_AUDIT_SUCCESS)
 		{
-			IPSEC_LOG_AUD("ipsec_esp_decapsulate", IPSEC_AUDIT_SEQ_MISMATCH, ("packet rejected by anti-replay check (lastSeq=%08lx, seq=%08lx, window size=%d)", ipsec_esp_lastSeq, ipsec_ntohl(esp_header->sequence), IPSEC_SEQ_MAX_WINDOW) );
+			IPSEC_LOG_AUD("ipsec_esp_decapsulate_chain", IPSEC_AUDIT_SEQ_MISMATCH, ("packet rejected by anti-replay check (lastSeq=%08lx, seq=%08lx, window size=%d)", sa->replay.last_seq, ipsec_ntohl(esp_header->sequence), sa->replay.window) );
 			return ret_val;
 		}
 
-		/* recalcualte ICV */
-		switch(sa->auth_alg) {
-
-		case IPSEC_HMAC_MD5: 
-			hmac_md5((unsigned char *)esp_header, payload_len-IPSEC_AUTH_ICV+IPSEC_ESP_HDR_SIZE,
-			         (unsigned char *)sa->authkey, IPSEC_AUTH_MD5_KEY_LEN, (unsigned char *)&digest);
-			ret_val = IPSEC_STATUS_SUCCESS; 
-			break;
-		case IPSEC_HMAC_SHA1: 
-			hmac_sha1((unsigned char *)esp_header, payload_len-IPSEC_AUTH_ICV+IPSEC_ESP_HDR_SIZE,
-			          (unsigned char *)sa->authkey, IPSEC_AUTH_SHA1_KEY_LEN, (unsigned char *)&digest);
-			ret_val = IPSEC_STATUS_SUCCESS; 
-			break;
-		default:
-			IPSEC_LOG_ERR("ipsec_esp_decapsulate", IPSEC_STATUS_FAILURE, ("unknown HASH algorithm for this ESP")) ;
-			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_decapsulate", ("return = %d", IPSEC_STATUS_FAILURE) );
-			return IPSEC_STATUS_FAILURE;
+		if(IPSEC_IS_AES_GCM(sa->enc_alg))
+		{
+			/* combined mode: decrypt and calculate the ICV in one pass, the SPI and the sequence number are authenticated too */
+			ipsec_esp_aead_nonce(sa, ((unsigned char*)packet)+payload_offset, cbc_iv) ;
+			cipher_gcm_chain(chain, payload_offset + IPSEC_ESP_IV_SIZE, payload_len-IPSEC_ESP_IV_SIZE-icv_len, &sa->enc_ctx.gcm, cbc_iv,
+			                 (unsigned char *)esp_header, IPSEC_ESP_HDR_SIZE, AES_DECRYPT, digest) ;
+		}
+		else if(sa->enc_alg == IPSEC_CHACHA20_POLY1305)
+		{
+			ipsec_esp_aead_nonce(sa, ((unsigned char*)packet)+payload_offset, cbc_iv) ;
+			cipher_chacha_poly_chain(chain, payload_offset + IPSEC_ESP_IV_SIZE, payload_len-IPSEC_ESP_IV_SIZE-icv_len, &sa->enc_ctx.chacha, cbc_iv,
+			                         (unsigned char *)esp_header, IPSEC_ESP_HDR_SIZE, CHACHA_DECRYPT, digest) ;
+		}
+		else if(hmac != NULL)
+		{
+			/* ICV calculated together with other packets of the batch */
+			memcpy(digest, hmac, icv_len) ;
+		}
+		else
+		{
+			/* recalcualte ICV and decrypt in one pass, the ESP header and the IV are authenticated too */
+			ipsec_esp_cipher_iv(sa, ((unsigned char*)packet)+payload_offset, cbc_iv) ;
+			if(ipsec_esp_stitch(sa, (unsigned char *)esp_header, IPSEC_ESP_HDR_SIZE + iv_size, chain, payload_offset + iv_size, payload_len-iv_size-icv_len, 
+			                    cbc_iv, 0, digest) != IPSEC_STATUS_SUCCESS)
+			{
+				IPSEC_LOG_ERR("ipsec_esp_decapsulate_chain", IPSEC_STATUS_FAILURE, ("unknown HASH algorithm for this ESP")) ;
+				IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_decapsulate_chain", ("return = %d", IPSEC_STATUS_FAILURE) );
+				return IPSEC_STATUS_FAILURE;
+			}
+			decrypted = 1 ;
 		}
 		
-		/* compare ICV */
-		if(memcmp(((char*)esp_header)+IPSEC_ESP_HDR_SIZE+payload_len-IPSEC_AUTH_ICV, digest, IPSEC_AUTH_ICV) != 0) {
-			IPSEC_LOG_ERR("ipsec_esp_decapsulate", IPSEC_STATUS_FAILURE, ("ESP ICV does not match")) ;
-			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_decapsulate", ("return = %d", IPSEC_STATUS_FAILURE) );
+		/* compare ICV (it may span two segments) */
+		ipsec_buffer_copy_out(chain, ip_header_len+IPSEC_ESP_HDR_SIZE+payload_len-icv_len, icv_len, icv) ;
+		if(memcmp(icv, digest, icv_len) != 0) {
+			IPSEC_LOG_ERR("ipsec_esp_decapsulate_chain", IPSEC_STATUS_FAILURE, ("ESP ICV does not match")) ;
+			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_decapsulate_chain", ("return = %d", IPSEC_STATUS_FAILURE) );
 			return IPSEC_STATUS_FAILURE;
 		}
 
 		/* reduce payload by ICV */
-		payload_len -= IPSEC_AUTH_ICV ;
+		payload_len -= icv_len ;
 
-		/* post-ICV calculationn anti-replay check (this call will update the global sequence number window) */
-		ret_val = ipsec_update_replay_window(ipsec_ntohl(esp_header->sequence), (__u32 *)&ipsec_esp_lastSeq, (__u32 *)&ipsec_esp_bitmap);
+		/* post-ICV calculationn anti-replay check (this call will update the SA's sequence number window) */
+		ret_val = ipsec_update_replay_window(ipsec_ntohl(esp_header->sequence), &sa->replay);
 		if(ret_val != IPSEC_AUDIT_SUCCESS)
 		{
-			IPSEC_LOG_AUD("ipsec_esp_decapsulate", IPSEC_AUDIT_SEQ_MISMATCH, ("packet rejected by anti-replay update (lastSeq=%08lx, seq=%08lx, window size=%d)", ipsec_esp_lastSeq, ipsec_ntohl(esp_header->sequence), IPSEC_SEQ_MAX_WINDOW) );
+			IPSEC_LOG_AUD("ipsec_esp_decapsulate_chain", IPSEC_AUDIT_SEQ_MISMATCH, ("packet rejected by anti-replay update (lastSeq=%08lx, seq=%08lx, window size=%d)", sa->replay.last_seq, ipsec_ntohl(esp_header->sequence), sa->replay.window) );
 			return ret_val;
 		}
 
 	}
 
 
-	/* decapsulate the packet according the SA */
-	if(sa->enc_alg == IPSEC_3DES)
+	/* decapsulate the packet according the SA (unless it was decrypted together with the ICV check) */
+	if(!decrypted && !IPSEC_IS_COMBINED(sa->enc_alg))
 	{
-		/* copy IV from ESP payload */
-		memcpy(cbc_iv, ((char*)packet)+payload_offset, IPSEC_ESP_IV_SIZE);
-
-		/* decrypt ESP packet */
-		cipher_3des_cbc(((char*)packet)+payload_offset + IPSEC_ESP_IV_SIZE, payload_len-IPSEC_ESP_IV_SIZE, (unsigned char *)sa->enckey, (char*)&cbc_iv,
-						 DES_DECRYPT, ((char*)packet)+payload_offset + IPSEC_ESP_IV_SIZE);
+		ipsec_esp_cipher_iv(sa, ((unsigned char*)packet)+payload_offset, cbc_iv) ;
+		ipsec_esp_cipher(sa, chain, payload_offset + iv_size, payload_len-iv_size, cbc_iv, 0) ;
 	}
 
-	*offset = payload_offset+IPSEC_ESP_IV_SIZE ;
+	*offset = payload_offset+iv_size ;
 
-	new_ip_packet = (ipsec_ip_header*)(((char*)packet) + payload_offset + IPSEC_ESP_IV_SIZE) ;
-	local_len = ipsec_ntohs(new_ip_packet->len) ;
+	/* the decapsulated IP header may span two segments */
+	memset(&new_ip_header, 0, sizeof(new_ip_header)) ;
+	ipsec_buffer_copy_out(chain, *offset, sizeof(new_ip_header), &new_ip_header) ;
+	local_len = ipsec_ntohs(new_ip_header.len) ;
 
 	if( (local_len < IPSEC_MIN_IPHDR_SIZE) || (local_len > IPSEC_MTU))
 	{
-		IPSEC_LOG_ERR("ipsec_esp_decapsulate", IPSEC_STATUS_FAILURE, ("decapsulated strange packet")) ;
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_decapsulate", ("return = %d", IPSEC_STATUS_BAD_PACKET) );
+		IPSEC_LOG_ERR("ipsec_esp_decapsulate_chain", IPSEC_STATUS_FAILURE, ("decapsulated strange packet")) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_decapsulate_chain", ("return = %d", IPSEC_STATUS_BAD_PACKET) );
 		return IPSEC_STATUS_BAD_PACKET;
 	}
 	*len = local_len ;
 
-	sa->sequence_number++ ;
-
-	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_decapsulate", ("return = %d", IPSEC_STATUS_SUCCESS) );
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_decapsulate_chain", ("return = %d", IPSEC_STATUS_SUCCESS) );
 	return IPSEC_STATUS_SUCCESS;
  }
 
+/**
+ * Decapsulates several ESP packets of the same SA, like ipsec_esp_decapsulate_chain().
+ *
+ * With HMAC-MD5 and HMAC-SHA1 (and no combined mode), the ICVs of the packets are calculated side by 
+ * side by hmac_md5_multi() or hmac_sha1_multi() before the packets are checked and decrypted one after 
+ * the other. Otherwise every packet is decapsulated on its own. The packets are accepted in the order 
+ * of the array, so the anti-replay window rejects a sequence number which appears twice in the batch.
+ *
+ * @param	packets	array of pointers to the packets, returns payload_offset, payload_size and status of every packet (see ipsec_esp_decapsulate_chain())
+ * @param	count	number of packets
+ * @param 	sa		pointer to the SA of all the packets
+ * @return	void
+ */
+void ipsec_esp_decapsulate_batch(ipsec_packet **packets, int count, sad_entry *sa)
+ {
+	hmac_multi_stream	streams[HASH_MULTI_MAX_LANES] ;
+	unsigned char		digest[HASH_MULTI_MAX_LANES][IPSEC_MAX_AUTHKEY_LEN] ;
+	ipsec_ip_header		*packet ;
+	esp_packet			*esp_header ;
+	__u8 				ip_header_len ;
+	int					payload_len ;
+	int					iv_size ;
+	int					block_size ;
+	int					icv_len ;
+	int					i, n, first ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsec_esp_decapsulate_batch", 
+				  ("packets=%p, count=%d, sa=%p", (void *)packets, count, (void *)sa)
+				 );
+
+	icv_len = ipsec_esp_get_icv(sa) ;
+
+	if((sa->key_state != IPSEC_KEYS_READY) || (icv_len == 0) || IPSEC_IS_AES_GCM(sa->enc_alg) || (sa->enc_alg == IPSEC_CHACHA20_POLY1305) || 
+	   ((sa->auth_alg != IPSEC_HMAC_MD5) && (sa->auth_alg != IPSEC_HMAC_SHA1)))
+	{
+		for(i = 0; i < count; i++)
+			packets[i]->status = ipsec_esp_decapsulate_chain(packets[i]->chain, &packets[i]->payload_offset, &packets[i]->payload_size, sa) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_decapsulate_batch", ("void") );
+		return ;
+	}
+	ipsec_esp_get_cipher(sa, &iv_size, &block_size) ;
+
+	for(first = 0; first < count; first += HASH_MULTI_MAX_LANES)
+	{
+		n = count - first ;
+		if(n > HASH_MULTI_MAX_LANES)
+			n = HASH_MULTI_MAX_LANES ;
+
+		for(i = 0; i < n; i++)
+		{
+			packet = (ipsec_ip_header *)packets[first+i]->chain->data ;
+			ip_header_len = (packet->v_hl & 0x0f) * 4 ;
+			esp_header = (esp_packet*)(((char*)packet)+ip_header_len) ; 
+			payload_len = ipsec_ntohs(packet->len) - ip_header_len - IPSEC_ESP_HDR_SIZE ;
+
+			streams[i].hctx = (sa->auth_alg == IPSEC_HMAC_MD5) ? (void *)&sa->auth_ctx.md5 : (void *)&sa->auth_ctx.sha1 ;
+			streams[i].chain = packets[first+i]->chain ;
+			streams[i].offset = ip_header_len ;
+			streams[i].len = 0 ;
+			streams[i].digest = digest[i] ;
+
+			/* packets which will be rejected anyway are hashed with a length of 0, ipsec_esp_decapsulate_hmac() reports them */
+			if((packets[first+i]->chain->len >= ip_header_len + IPSEC_ESP_HDR_SIZE + iv_size) && (payload_len >= iv_size + icv_len) && 
+			   (ipsec_buffer_len(packets[first+i]->chain) >= ipsec_ntohs(packet->len)) && 
+			   (ipsec_check_replay_window(ipsec_ntohl(esp_header->sequence), &sa->replay) == IPSEC_AUDIT_SUCCESS))
+				streams[i].len = payload_len-icv_len+IPSEC_ESP_HDR_SIZE ;
+		}
+
+		if(sa->auth_alg == IPSEC_HMAC_MD5)
+			hmac_md5_multi(streams, n) ;
+		else
+			hmac_sha1_multi(streams, n) ;
+
+		for(i = 0; i < n; i++)
+			packets[first+i]->status = ipsec_esp_decapsulate_hmac(packets[first+i]->chain, &packets[first+i]->payload_offset, &packets[first+i]->payload_size, 
+			                                                      sa, (streams[i].len != 0) ? digest[i] : NULL) ;
+	}
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_decapsulate_batch", ("void") );
+ }
+
 /**
  * Encapsulates an IP packet into an ESP packet which will again be added to an IP packet.
  * 
@@ -223,54 +735,88 @@ ipsec_status ipsec_esp_decapsulate(ipsec_ip_header *packet, int *offset, int *le
  * @param 	sa			pointer to the SA
  * @param 	src_addr	source IP address of the outer IP header
  * @param 	dest_addr	destination IP address of the outer IP header 
- * @return 	IPSEC_STATUS_SUCCESS		if the packet was properly encapsulated
- * @return 	IPSEC_STATUS_TTL_EXPIRED	if the TTL expired
- * @return  IPSEC_STATUS_FAILURE		if the SA contained a bad authentication algorithm
+ * @return 	see ipsec_esp_encapsulate_chain()
  */
  ipsec_status ipsec_esp_encapsulate(ipsec_ip_header *packet, int *offset, int *len, sad_entry *sa, __u32 src_addr, __u32 dest_addr)
  {
-	int ret_val = IPSEC_STATUS_NOT_INITIALIZED;			/* by default, the return value is undefined */
-	__u8				tos ;
+	ipsec_buffer		segment ;
+
+	segment.next = NULL ;
+	segment.data = (unsigned char *)packet ;
+	segment.len = ipsec_ntohs(packet->len) ;
+
+	return ipsec_esp_encapsulate_chain(&segment, offset, len, sa, src_addr, dest_addr, 0) ;
+ }
+
+/**
+ * Writes the headers, the IV and the trailer of an ESP packet around an IP packet which is stored in a 
+ * chain of buffers (the first part of ipsec_esp_encapsulate_chain()). The combined modes are encrypted
+ * and authenticated here, the other ciphers are left to the caller (see ipsec_esp_encapsulate_seal()).
+ *
+ * @param	chain		first segment of the IP packet 
+ * @param 	sa			pointer to the SA with valid key schedules and a known authentication algorithm
+ * @param 	src_addr	source IP address of the outer IP header
+ * @param 	dest_addr	destination IP address of the outer IP header 
+ * @param	sequence	sequence number of the packet reserved by ipsec_sad_next_sequence(), 0 to reserve the next one
+ * @param	frame		returns where the packet has to be encrypted and finished
+ * @return 	IPSEC_STATUS_SUCCESS		if the headers and the trailer were written
+ * @return 	IPSEC_STATUS_TTL_EXPIRED	if the TTL expired (the packet is unchanged)
+ * @return 	IPSEC_STATUS_SEQ_EXHAUSTED	if the sequence numbers of the SA are used up (the packet is unchanged)
+ * @return 	IPSEC_STATUS_BAD_PACKET		if the chain is shorter than the IP packet (the packet is unchanged)
+ */
+static ipsec_status ipsec_esp_encapsulate_frame(ipsec_buffer *chain, sad_entry *sa, __u32 src_addr, __u32 dest_addr, __u32 sequence, 
+                                                ipsec_esp_frame *frame)
+{
 	int					inner_len ;
-	int					payload_offset ;
-	int					payload_len ;
+	int					remaining ;
 	__u8				padd_len ;
 	__u8				*pos ;
 	__u8				padd ;
-	ipsec_ip_header		*new_ip_header ;
-	ipsec_esp_header	*new_esp_header ;
-	unsigned char 		iv[IPSEC_ESP_IV_SIZE] = {0xD4, 0xDB, 0xAB, 0x9A, 0x9A, 0xDB, 0xD1, 0x94} ;
-	unsigned char 		cbc_iv[IPSEC_ESP_IV_SIZE] ;
-	unsigned char 		digest[IPSEC_MAX_AUTHKEY_LEN];
-
-	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
-	              "ipsec_esp_encapsulate", 
-				  ("packet=%p, *offset=%d, *len=%d, sa=%p, src_addr=%lu, dest_addr=%lu",
-			      (void *)packet, *offset, *len, (void *)sa, src_addr, dest_addr)
-				 );
+	ipsec_ip_header		*packet ;
+	unsigned char 		iv[IPSEC_ESP_MAX_IV_SIZE] ;
+	int					block_size ;
 
 	/* set new packet header pointers */
-	new_ip_header = (ipsec_ip_header*)(((char*)packet) - IPSEC_ESP_IV_SIZE - IPSEC_ESP_HDR_SIZE - IPSEC_MIN_IPHDR_SIZE) ;
-	new_esp_header = (ipsec_esp_header*)(((char*)packet) - IPSEC_ESP_IV_SIZE - IPSEC_ESP_HDR_SIZE) ;
-	payload_offset = (((char*)packet) - ((char*)new_ip_header)) ;
+	ipsec_esp_get_cipher(sa, &frame->iv_size, &block_size) ;
+	frame->icv_len = ipsec_esp_get_icv(sa) ;
+	packet = (ipsec_ip_header *)chain->data ;
+	frame->ip = (ipsec_ip_header*)(((char*)packet) - frame->iv_size - IPSEC_ESP_HDR_SIZE - IPSEC_MIN_IPHDR_SIZE) ;
+	frame->esp = (ipsec_esp_header*)(((char*)packet) - frame->iv_size - IPSEC_ESP_HDR_SIZE) ;
+	frame->payload_offset = (((char*)packet) - ((char*)frame->ip)) ;
 
 	inner_len = ipsec_ntohs(packet->len) ;
 
+	/* find the segment which holds the end of the inner packet */
+	remaining = inner_len ;
+	for(frame->last = chain; remaining > frame->last->len; frame->last = frame->last->next)
+	{
+		remaining -= frame->last->len ;
+		if(frame->last->next == NULL)
+		{
+			IPSEC_LOG_ERR("ipsec_esp_encapsulate_frame", IPSEC_STATUS_BAD_PACKET, ("chain is shorter than the IP packet")) ;
+			return IPSEC_STATUS_BAD_PACKET;
+		}
+	}
+
 	/* save TOS from inner header */
-	tos = packet->tos ;
+	frame->tos = packet->tos ;
 
-	/** @todo fix TTL update and checksum calculation */
-	// packet->ttl--;
-	// packet->chksum = ip_chksum(packet, sizeof(ip_header));
-	if (packet->ttl == 0)
-	{
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_encapsulate", ("return = %d", IPSEC_STATUS_TTL_EXPIRED) );
+	/* check TTL */
+	if ((packet->ttl == 0) || (IPSEC_TUNNEL_DEC_TTL && (packet->ttl == 1)))
 		return IPSEC_STATUS_TTL_EXPIRED;
-	}
+
+	/* 1st packet needs to be sent out with seq = 1 */
+	if((sequence == 0) && (ipsec_sad_next_sequence(sa, 1, &sequence) != IPSEC_STATUS_SUCCESS))
+		return IPSEC_STATUS_SEQ_EXHAUSTED;
+
+#if IPSEC_TUNNEL_DEC_TTL
+	/* decrement TTL, the checksum is updated and not computed again */
+	ipsec_ip_dec_ttl(packet) ;
+#endif
 	
  	/* add padding if needed */
-	padd_len = ipsec_esp_get_padding(inner_len+2) ;	
-	pos = ((char*)packet)+inner_len ;
+	padd_len = ipsec_esp_get_padding(inner_len+2, block_size) ;	
+	pos = frame->last->data + remaining ;
 	if(padd_len != 0)
 	{
 		padd = 1 ;
@@ -282,79 +828,241 @@ ipsec_status ipsec_esp_decapsulate(ipsec_ip_header *packet, int *offset, int *le
 	*pos++ = padd_len ;
 	/* in tunnel mode the next protocol field is always IP */
 	*pos = 0x04 ; 
+	frame->last->len = remaining + padd_len + 2 ;
 
-	payload_len = inner_len+IPSEC_ESP_HDR_SIZE+IPSEC_ESP_IV_SIZE + padd_len + 2 ;
+	frame->text_len = inner_len + padd_len + 2 ;
+	frame->payload_len = frame->text_len + IPSEC_ESP_HDR_SIZE + frame->iv_size ;
 
-	/* decapsulate the packet according the SA */
-	if(sa->enc_alg == IPSEC_3DES)
-	{
-		/* get IV from SA */
-		memcpy(cbc_iv, iv, IPSEC_ESP_IV_SIZE);
+	/* outer IP header and SPI from the template of the SA, the sequence number completes the ESP header 
+	   (the combined modes authenticate it together with the encryption) */
+	ipsec_sad_outer_header(sa, frame->ip, src_addr, dest_addr, (__u16)(frame->payload_len + frame->icv_len + IPSEC_MIN_IPHDR_SIZE), sequence) ;
+	frame->esp->sequence_number = ipsec_htonl(sequence) ;
 
-		/* encrypt ESP packet */
-		cipher_3des_cbc((__u8 *)packet, inner_len+padd_len+2, (__u8 *)sa->enckey, (__u8 *)&cbc_iv,
-						 DES_ENCRYPT, (__u8 *)packet);
+	/* set up the IV (the combined modes encrypt and authenticate here) */
+	ipsec_ivgen_packet(sa, sequence, iv) ;
+	switch(sa->enc_alg)
+	{
+		case IPSEC_AES_128_GCM_8:
+		case IPSEC_AES_128_GCM_12:
+		case IPSEC_AES_128_GCM_16:
+		case IPSEC_AES_256_GCM_8:
+		case IPSEC_AES_256_GCM_12:
+		case IPSEC_AES_256_GCM_16:
+			ipsec_esp_aead_nonce(sa, iv, frame->cbc_iv) ;
+			cipher_gcm_chain(chain, 0, frame->text_len, &sa->enc_ctx.gcm, frame->cbc_iv,
+			                 (unsigned char *)frame->esp, IPSEC_ESP_HDR_SIZE, AES_ENCRYPT, frame->digest) ;
+			break ;
+		case IPSEC_CHACHA20_POLY1305:
+			ipsec_esp_aead_nonce(sa, iv, frame->cbc_iv) ;
+			cipher_chacha_poly_chain(chain, 0, frame->text_len, &sa->enc_ctx.chacha, frame->cbc_iv,
+			                         (unsigned char *)frame->esp, IPSEC_ESP_HDR_SIZE, CHACHA_ENCRYPT, frame->digest) ;
+			break ;
+		default:
+			ipsec_esp_cipher_iv(sa, iv, frame->cbc_iv) ;
+			break ;
 	}
 
 	/* insert IV in fron of packet */
-	memcpy( ((char*)packet)-IPSEC_ESP_IV_SIZE, iv, IPSEC_ESP_IV_SIZE) ;
+	memcpy( ((char*)packet)-frame->iv_size, iv, frame->iv_size) ;
 
-	/* setup ESP header */
-	new_esp_header->spi = sa->spi;
-	/** 1st packet needs to be sent out with squ = 1 */
-	sa->sequence_number++ ;
-	new_esp_header->sequence_number = ipsec_htonl(sa->sequence_number) ;
+	return IPSEC_STATUS_SUCCESS;
+}
+
+/**
+ * Encrypts and authenticates an ESP packet set up by ipsec_esp_encapsulate_frame() with a cipher which 
+ * is not a combined mode (nothing is done for the combined modes).
+ *
+ * @param	chain		first segment of the IP packet 
+ * @param 	sa			pointer to the SA
+ * @param	frame		packet set up by ipsec_esp_encapsulate_frame(), returns the ICV
+ * @return	void
+ */
+static void ipsec_esp_encapsulate_seal(ipsec_buffer *chain, sad_entry *sa, ipsec_esp_frame *frame)
+{
+	if(IPSEC_IS_COMBINED(sa->enc_alg))
+		return ;
 
-	/* calculate the ICV if needed */
+	/* encrypt and calculate the ICV in one pass, the ESP header and the IV in front of the first segment are authenticated too
+	   (ipsec_esp_encapsulate_frame() was only called with a known authentication algorithm) */
 	if(sa->auth_alg != 0)
+		ipsec_esp_stitch(sa, (unsigned char *)frame->esp, IPSEC_ESP_HDR_SIZE + frame->iv_size, chain, 0, frame->text_len, frame->cbc_iv, 1, frame->digest) ;
+	else
+		ipsec_esp_cipher(sa, chain, 0, frame->text_len, frame->cbc_iv, 1) ;
+}
+
+/**
+ * Appends the ICV of an encrypted ESP packet and completes the outer IP header (the last part of 
+ * ipsec_esp_encapsulate_chain()).
+ *
+ * @param 	sa			pointer to the SA
+ * @param	frame		packet set up by ipsec_esp_encapsulate_frame() and encrypted
+ * @param 	offset		pointer to the offset which will point to the new encapsulated packet (relative to the first segment)
+ * @param 	len			pointer to the length of the new encapsulated packet
+ * @return	void
+ */
+static void ipsec_esp_encapsulate_finish(sad_entry *sa, ipsec_esp_frame *frame, int *offset, int *len)
+{
+	if(frame->icv_len != 0)
 	{
-		/* recalcualte ICV */
-		switch(sa->auth_alg) {
-
-		case IPSEC_HMAC_MD5: 
-			hmac_md5((unsigned char *)new_esp_header, payload_len,
-			         (unsigned char *)sa->authkey, IPSEC_AUTH_MD5_KEY_LEN, (unsigned char *)&digest);
-			ret_val = IPSEC_STATUS_SUCCESS; 
-			break;
-		case IPSEC_HMAC_SHA1: 
-			hmac_sha1((unsigned char *)new_esp_header, payload_len,
-			          (unsigned char *)sa->authkey, IPSEC_AUTH_SHA1_KEY_LEN, (unsigned char *)&digest);
-			ret_val = IPSEC_STATUS_SUCCESS; 
-			break;
-		default:
-			IPSEC_LOG_ERR("ipsec_esp_encapsulate", IPSEC_STATUS_FAILURE, ("unknown HASH algorithm for this ESP")) ;
-			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_encapsulate", ("return = %d", IPSEC_STATUS_FAILURE) );
-			return IPSEC_STATUS_FAILURE;
-		}
-		
 		/* set ICV */
-		memcpy(((char*)new_esp_header)+payload_len, digest, IPSEC_AUTH_ICV);
+		memcpy(frame->last->data + frame->last->len, frame->digest, frame->icv_len);
+		frame->last->len += frame->icv_len ;
 		
 		/* increase payload by ICV */
-		payload_len += IPSEC_AUTH_ICV ;
+		frame->payload_len += frame->icv_len ;
 	}
 
-	/* setup IP header */
-	new_ip_header->v_hl = 0x45 ;
-	new_ip_header->tos = tos ;
-	//new_ip_header->len = ipsec_htons(inner_len+padd_len+2+IPSEC_ESP_IV_SIZE+IPSEC_ESP_HDR_SIZE+IPSEC_MIN_IPHDR_SIZE) ; /**@todo when auth enables the size changes */
-	new_ip_header->len = ipsec_htons(payload_len+ IPSEC_MIN_IPHDR_SIZE); 
-	new_ip_header->id = 1000 ;	/**@todo id must be generated properly and incremented */
-	new_ip_header->offset = 0 ;
-	new_ip_header->ttl = 64 ;
-	new_ip_header->protocol = IPSEC_PROTO_ESP ;
-	new_ip_header->chksum = 0 ;
-	new_ip_header->src = src_addr ;
-	new_ip_header->dest = dest_addr ;
-
-	/* set checksum */
-	new_ip_header->chksum = ipsec_ip_chksum(new_ip_header, sizeof(ipsec_ip_header)) ;
+	/* the outer IP header only lacks the TOS of the inner header and the checksum */
+	frame->ip->tos = frame->tos ;
+	ipsec_sad_outer_chksum(sa, frame->ip) ;
 
 	/* setup return values */
-	*offset = payload_offset*(-1) ;
-	*len = payload_len + IPSEC_MIN_IPHDR_SIZE ;
+	*offset = frame->payload_offset*(-1) ;
+	*len = frame->payload_len + IPSEC_MIN_IPHDR_SIZE ;
+}
+
+/**
+ * Encapsulates an IP packet which is stored in a chain of buffers into an ESP packet which will again be added to an IP packet.
+ *
+ * The new headers are written in front of the first segment and the inner IP header must be in the first 
+ * segment. The ESP trailer and the ICV are appended to the segment holding the end of the inner packet 
+ * and the length of this segment is increased accordingly (see ipsec_esp_get_overhead()).
+ * The payload is encrypted and authenticated in place, segment by segment.
+ * 
+ * @param	chain		first segment of the IP packet 
+ * @param 	offset		pointer to the offset which will point to the new encapsulated packet (relative to the first segment)
+ * @param 	len			pointer to the length of the new encapsulated packet
+ * @param 	sa			pointer to the SA
+ * @param 	src_addr	source IP address of the outer IP header
+ * @param 	dest_addr	destination IP address of the outer IP header 
+ * @param	sequence	sequence number of the packet reserved by ipsec_sad_next_sequence(), 0 to reserve the next one
+ * @return 	IPSEC_STATUS_SUCCESS		if the packet was properly encapsulated
+ * @return 	IPSEC_STATUS_TTL_EXPIRED	if the TTL expired
+ * @return 	IPSEC_STATUS_SEQ_EXHAUSTED	if the sequence numbers of the SA are used up
+ * @return  IPSEC_STATUS_FAILURE		if the SA contained a bad authentication algorithm
+ * @return 	IPSEC_STATUS_BAD_KEY		if the key schedules or HMAC state of the SA are not set up (see ipsec_sad_prepare()) or its key was rejected
+ * @return 	IPSEC_STATUS_BAD_PACKET		if the chain is shorter than the IP packet
+ */
+ ipsec_status ipsec_esp_encapsulate_chain(ipsec_buffer *chain, int *offset, int *len, sad_entry *sa, __u32 src_addr, __u32 dest_addr, __u32 sequence)
+ {
+	int ret_val = IPSEC_STATUS_NOT_INITIALIZED;			/* by default, the return value is undefined */
+	ipsec_esp_frame		frame ;
 
-	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_encapsulate", ("return = %d", IPSEC_STATUS_SUCCESS) );
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsec_esp_encapsulate_chain", 
+				  ("chain=%p, *offset=%d, *len=%d, sa=%p, src_addr=%lu, dest_addr=%lu, sequence=%lu",
+			      (void *)chain, *offset, *len, (void *)sa, src_addr, dest_addr, sequence)
+				 );
+
+	/* the SAs are set up on the control path (ipsec_sad_add(), ipsec_spd_load_dbs()), never by a packet */
+	if(sa->key_state != IPSEC_KEYS_READY)
+	{
+		IPSEC_LOG_ERR("ipsec_esp_encapsulate_chain", IPSEC_STATUS_BAD_KEY, ("no valid key schedule or HMAC state for this SA")) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_encapsulate_chain", ("return = %d", IPSEC_STATUS_BAD_KEY) );
+		return IPSEC_STATUS_BAD_KEY;
+	}
+
+	/* refuse an unknown authentication algorithm before a sequence number is used up or the packet is changed */
+	if(!IPSEC_IS_COMBINED(sa->enc_alg) && (sa->auth_alg != 0) && !IPSEC_IS_HMAC(sa->auth_alg))
+	{
+		IPSEC_LOG_ERR("ipsec_esp_encapsulate_chain", IPSEC_STATUS_FAILURE, ("unknown HASH algorithm for this ESP")) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_encapsulate_chain", ("return = %d", IPSEC_STATUS_FAILURE) );
+		return IPSEC_STATUS_FAILURE;
+	}
+
+	ret_val = ipsec_esp_encapsulate_frame(chain, sa, src_addr, dest_addr, sequence, &frame) ;
+	if(ret_val != IPSEC_STATUS_SUCCESS)
+	{
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_encapsulate_chain", ("return = %d", ret_val) );
+		return ret_val;
+	}
+	ipsec_esp_encapsulate_seal(chain, sa, &frame) ;
+	ipsec_esp_encapsulate_finish(sa, &frame, offset, len) ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_encapsulate_chain", ("return = %d", IPSEC_STATUS_SUCCESS) );
 	return IPSEC_STATUS_SUCCESS;
  }
 
+/**
+ * Encapsulates several IP packets with the same SA, like ipsec_esp_encapsulate_chain().
+ *
+ * With 3DES-CBC, the headers of up to IPSEC_ESP_BATCH_SIZE packets are written first, then the packets 
+ * which are stored in one segment are encrypted together by cipher_3des_cbc_multi() (two packets at a 
+ * time with the interleaved engine) and finally authenticated one after the other. Packets of several 
+ * segments and the other ciphers are encapsulated one by one.
+ *
+ * @param	packets		array of pointers to the packets, returns payload_offset, payload_size and status of every packet (see ipsec_esp_encapsulate_chain())
+ * @param	count		number of packets
+ * @param 	sa			pointer to the SA of all the packets
+ * @param 	src_addr	source IP address of the outer IP headers
+ * @param 	dest_addr	destination IP address of the outer IP headers
+ * @param	sequence	sequence number of the first packet, the packets get consecutive numbers reserved by ipsec_sad_next_sequence() (0 to reserve them one by one)
+ * @return	void
+ */
+void ipsec_esp_encapsulate_batch(ipsec_packet **packets, int count, sad_entry *sa, __u32 src_addr, __u32 dest_addr, __u32 sequence)
+ {
+	ipsec_esp_frame		frames[IPSEC_ESP_BATCH_SIZE] ;
+	cipher_3des_stream	streams[IPSEC_ESP_BATCH_SIZE] ;
+	ipsec_packet		*packet ;
+	int					i, n, m, first ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsec_esp_encapsulate_batch", 
+				  ("packets=%p, count=%d, sa=%p, src_addr=%lu, dest_addr=%lu, sequence=%lu", 
+				  (void *)packets, count, (void *)sa, src_addr, dest_addr, sequence)
+				 );
+
+	if((sa->key_state != IPSEC_KEYS_READY) || (sa->enc_alg != IPSEC_3DES) || (sequence == 0) || ((sa->auth_alg != 0) && !IPSEC_IS_HMAC(sa->auth_alg)))
+	{
+		for(i = 0; i < count; i++)
+			packets[i]->status = ipsec_esp_encapsulate_chain(packets[i]->chain, &packets[i]->payload_offset, &packets[i]->payload_size, 
+			                                                 sa, src_addr, dest_addr, (sequence != 0) ? sequence + i : 0) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_encapsulate_batch", ("void") );
+		return ;
+	}
+
+	for(first = 0; first < count; first += IPSEC_ESP_BATCH_SIZE)
+	{
+		n = count - first ;
+		if(n > IPSEC_ESP_BATCH_SIZE)
+			n = IPSEC_ESP_BATCH_SIZE ;
+
+		m = 0 ;
+		for(i = 0; i < n; i++)
+		{
+			packet = packets[first+i] ;
+			packet->status = ipsec_esp_encapsulate_frame(packet->chain, sa, src_addr, dest_addr, sequence + first + i, &frames[i]) ;
+			if(packet->status != IPSEC_STATUS_SUCCESS)
+				continue ;
+
+			if(frames[i].last != packet->chain)
+			{
+				ipsec_esp_encapsulate_seal(packet->chain, sa, &frames[i]) ;
+				continue ;
+			}
+			streams[m].text = packet->chain->data ;
+			streams[m].output = packet->chain->data ;
+			streams[m].len = frames[i].text_len ;
+			streams[m].ks = sa->enc_ctx.des ;
+			streams[m].iv = frames[i].cbc_iv ;
+			m++ ;
+		}
+
+		cipher_3des_cbc_multi(streams, m, DES_ENCRYPT) ;
+
+		for(i = 0; i < n; i++)
+		{
+			packet = packets[first+i] ;
+			if(packet->status != IPSEC_STATUS_SUCCESS)
+				continue ;
+
+			/* the packets encrypted together are authenticated now: ESP header, IV and ciphertext are contiguous */
+			if((frames[i].last == packet->chain) && (sa->auth_alg != 0))
+				ipsec_esp_stitch(sa, (unsigned char *)frames[i].esp, frames[i].payload_len, NULL, 0, 0, frames[i].cbc_iv, 1, frames[i].digest) ;
+			ipsec_esp_encapsulate_finish(sa, &frames[i], &packet->payload_offset, &packet->payload_size) ;
+		}
+	}
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_esp_encapsulate_batch", ("void") );
+ }
+
@@ -0,0 +1,515 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file gcm.c
+ *  @brief AES-GCM combined mode (NIST SP 800-38D) as used by ESP (RFC 4106)
+ *
+ *  <B>OUTLINE:</B>
+ *  The following functions are implemented in this module:
+ *   - cipher_gcm_set_key(): expands the AES key and precomputes the hash key
+ *   - cipher_gcm(): en- or decrypts and authenticates a buffer
+ *   - cipher_gcm_chain(): en- or decrypts and authenticates a part of a chain of buffers in place
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *  Encryption is AES-CTR with a 32 bit block counter (see cipher_aes_ctr()), the ciphertext is
+ *  hashed with GHASH in strides of GCM_STRIDE bytes right after it was en- or before it is
+ *  decrypted, so the payload is only walked through once.
+ *
+ *  The portable GHASH engine multiplies by the hash key 4 bits at a time with a table of 16
+ *  multiples of H (Shoup's method). If IPSEC_GCM_CLMUL is defined (default with GCC on x86),
+ *  the PCLMULQDQ engine is selected on the first call of cipher_gcm_set_key() when CPUID reports
+ *  the instruction. cipher_gcm_set_engine() can be used to select the portable engine.
+ *
+ *  <B>NOTES:</B>
+ *  The caller compares the tag. On decryption, the payload is decrypted even if the tag turns
+ *  out to be wrong and must be dropped then.
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/gcm.h"
+#include "ipsec/util.h"
+#include "ipsec/debug.h"
+
+#ifdef IPSEC_GCM_CLMUL
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#endif
+
+
+#define GCM_STRIDE			(4*AES_BLOCK_SIZE)	/**< bytes en- or decrypted before they are hashed */
+
+#define GCM_LOAD(p)			(((__u32)(p)[0]<<24)|((__u32)(p)[1]<<16)|((__u32)(p)[2]<<8)|((__u32)(p)[3]))
+#define GCM_STORE(p,v)		((p)[0]=(__u8)((v)>>24), (p)[1]=(__u8)((v)>>16), (p)[2]=(__u8)((v)>>8), (p)[3]=(__u8)(v))
+
+/** reduction of the 4 bits shifted out of a field element (x^128 = x^7 + x^2 + x + 1) */
+static const __u32 gcm_rem_4bit[16] = {
+	0x00000000UL, 0x1c200000UL, 0x38400000UL, 0x24600000UL, 0x70800000UL, 0x6ca00000UL, 0x48c00000UL, 0x54e00000UL,
+	0xe1000000UL, 0xfd200000UL, 0xd9400000UL, 0xc5600000UL, 0x91800000UL, 0x8da00000UL, 0xa9c00000UL, 0xb5e00000UL
+} ;
+
+/** multiplies z by x^4 and adds the multiple of H selected by a nibble */
+#define GCM_STEP(z, table, nibble)	{ __u32 rem = z[3] & 0x0f ; \
+									  z[3] = ((z[3] >> 4) | (z[2] << 28)) & 0xffffffffUL ; \
+									  z[2] = ((z[2] >> 4) | (z[1] << 28)) & 0xffffffffUL ; \
+									  z[1] = ((z[1] >> 4) | (z[0] << 28)) & 0xffffffffUL ; \
+									  z[0] = (z[0] >> 4) ^ gcm_rem_4bit[rem] ; \
+									  z[0] ^= table[nibble][0] ; z[1] ^= table[nibble][1] ; \
+									  z[2] ^= table[nibble][2] ; z[3] ^= table[nibble][3] ; }
+
+
+static int cipher_gcm_engine = -1 ;		/**< engine used for new keys, -1 until it was selected */
+
+/** State of one en- or decryption */
+typedef struct gcm_state_struct
+{
+	gcm_key			*gk ;					/**< key */
+	int				mode ;					/**< AES_ENCRYPT or AES_DECRYPT */
+	unsigned char	y[AES_BLOCK_SIZE] ;		/**< GHASH value so far */
+	unsigned char	counter[AES_BLOCK_SIZE] ;	/**< counter block of the next key stream block */
+	unsigned char	j0[AES_BLOCK_SIZE] ;	/**< counter block used to encrypt the tag */
+	__u32			text_len ;				/**< number of bytes en- or decrypted so far */
+} gcm_state ;
+
+
+#ifdef IPSEC_GCM_CLMUL
+
+/**
+ * Checks if the CPU supports PCLMULQDQ (and SSSE3 which is used to reverse the byte order).
+ */
+static int cipher_gcm_clmul_available(void)
+{
+	unsigned int eax, ebx, ecx, edx ;
+
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0 ;
+	return ((ecx & bit_PCLMUL) != 0) && ((ecx & bit_SSSE3) != 0) ;
+}
+
+/**
+ * Multiplies two field elements with reversed byte order (carry-less multiplication and
+ * reduction of the bit reflected product, Intel white paper "Carry-Less Multiplication and
+ * Its Usage for Computing the GCM Mode", algorithm 5).
+ */
+__attribute__((target("pclmul,sse2")))
+static __m128i cipher_gcm_clmul_mult(__m128i a, __m128i b)
+{
+	__m128i	t2, t3, t4, t5, t6, t7, t8, t9 ;
+
+	/* 256 bit product t6:t3 */
+	t3 = _mm_clmulepi64_si128(a, b, 0x00) ;
+	t4 = _mm_clmulepi64_si128(a, b, 0x10) ;
+	t5 = _mm_clmulepi64_si128(a, b, 0x01) ;
+	t6 = _mm_clmulepi64_si128(a, b, 0x11) ;
+	t4 = _mm_xor_si128(t4, t5) ;
+	t5 = _mm_slli_si128(t4, 8) ;
+	t4 = _mm_srli_si128(t4, 8) ;
+	t3 = _mm_xor_si128(t3, t5) ;
+	t6 = _mm_xor_si128(t6, t4) ;
+
+	/* shift left by one bit (the operands are bit reflected) */
+	t7 = _mm_srli_epi32(t3, 31) ;
+	t8 = _mm_srli_epi32(t6, 31) ;
+	t3 = _mm_slli_epi32(t3, 1) ;
+	t6 = _mm_slli_epi32(t6, 1) ;
+	t9 = _mm_srli_si128(t7, 12) ;
+	t8 = _mm_slli_si128(t8, 4) ;
+	t7 = _mm_slli_si128(t7, 4) ;
+	t3 = _mm_or_si128(t3, t7) ;
+	t6 = _mm_or_si128(t6, t8) ;
+	t6 = _mm_or_si128(t6, t9) ;
+
+	/* reduction modulo x^128 + x^7 + x^2 + x + 1 */
+	t7 = _mm_slli_epi32(t3, 31) ;
+	t8 = _mm_slli_epi32(t3, 30) ;
+	t9 = _mm_slli_epi32(t3, 25) ;
+	t7 = _mm_xor_si128(t7, t8) ;
+	t7 = _mm_xor_si128(t7, t9) ;
+	t8 = _mm_srli_si128(t7, 4) ;
+	t7 = _mm_slli_si128(t7, 12) ;
+	t3 = _mm_xor_si128(t3, t7) ;
+	t2 = _mm_srli_epi32(t3, 1) ;
+	t4 = _mm_srli_epi32(t3, 2) ;
+	t5 = _mm_srli_epi32(t3, 7) ;
+	t2 = _mm_xor_si128(t2, t4) ;
+	t2 = _mm_xor_si128(t2, t5) ;
+	t2 = _mm_xor_si128(t2, t8) ;
+	t3 = _mm_xor_si128(t3, t2) ;
+	return _mm_xor_si128(t6, t3) ;
+}
+
+/**
+ * Hashes whole blocks with PCLMULQDQ.
+ */
+__attribute__((target("pclmul,ssse3,sse2")))
+static void cipher_gcm_clmul_ghash(gcm_key *gk, unsigned char *y, unsigned char *data, int blocks)
+{
+	__m128i	swap, h, x ;
+
+	swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15) ;
+	h = _mm_loadu_si128((__m128i *)gk->h) ;
+	x = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)y), swap) ;
+	for(; blocks > 0; blocks--)
+	{
+		x = _mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)data), swap)) ;
+		x = cipher_gcm_clmul_mult(x, h) ;
+		data += AES_BLOCK_SIZE ;
+	}
+	_mm_storeu_si128((__m128i *)y, _mm_shuffle_epi8(x, swap)) ;
+}
+
+#endif
+
+
+/**
+ * Hashes whole blocks: y = (y ^ block) * H for every block.
+ *
+ * @param gk		pointer to the key
+ * @param y			GHASH value, updated
+ * @param data		blocks to hash
+ * @param blocks	number of blocks
+ * @return void
+ */
+static void cipher_gcm_ghash(gcm_key *gk, unsigned char *y, unsigned char *data, int blocks)
+{
+	__u32	x[4], z[4] ;
+	int		i ;
+	__u8	b ;
+
+#ifdef IPSEC_GCM_CLMUL
+	if(gk->engine == CIPHER_GHASH_CLMUL)
+	{
+		cipher_gcm_clmul_ghash(gk, y, data, blocks) ;
+		return ;
+	}
+#endif
+
+	z[0] = GCM_LOAD(y) ;
+	z[1] = GCM_LOAD(y+4) ;
+	z[2] = GCM_LOAD(y+8) ;
+	z[3] = GCM_LOAD(y+12) ;
+	for(; blocks > 0; blocks--)
+	{
+		x[0] = z[0] ^ GCM_LOAD(data) ;
+		x[1] = z[1] ^ GCM_LOAD(data+4) ;
+		x[2] = z[2] ^ GCM_LOAD(data+8) ;
+		x[3] = z[3] ^ GCM_LOAD(data+12) ;
+
+		/* Horner's rule from the last to the first nibble */
+		z[0] = z[1] = z[2] = z[3] = 0 ;
+		for(i = 15; i >= 0; i--)
+		{
+			b = (__u8)(x[i>>2] >> (8*(3-(i&3)))) ;
+			GCM_STEP(z, gk->htable, b & 0x0f) ;
+			GCM_STEP(z, gk->htable, b >> 4) ;
+		}
+		data += AES_BLOCK_SIZE ;
+	}
+	GCM_STORE(y, z[0]) ;
+	GCM_STORE(y+4, z[1]) ;
+	GCM_STORE(y+8, z[2]) ;
+	GCM_STORE(y+12, z[3]) ;
+}
+
+/**
+ * Hashes data, a partial last block is padded with zeros.
+ */
+static void cipher_gcm_hash(gcm_key *gk, unsigned char *y, unsigned char *data, int len)
+{
+	unsigned char	block[AES_BLOCK_SIZE] ;
+
+	cipher_gcm_ghash(gk, y, data, len / AES_BLOCK_SIZE) ;
+	if((len % AES_BLOCK_SIZE) != 0)
+	{
+		memset(block, 0, sizeof(block)) ;
+		memcpy(block, data + len - (len % AES_BLOCK_SIZE), len % AES_BLOCK_SIZE) ;
+		cipher_gcm_ghash(gk, y, block, 1) ;
+	}
+}
+
+/**
+ * Sets up the state for a new en- or decryption and hashes the additional authenticated data.
+ */
+static void cipher_gcm_start(gcm_state *st, gcm_key *gk, unsigned char *iv, unsigned char *aad, int aad_len, int mode)
+{
+	st->gk = gk ;
+	st->mode = mode ;
+	st->text_len = 0 ;
+	memset(st->y, 0, AES_BLOCK_SIZE) ;
+	memcpy(st->j0, iv, GCM_IV_SIZE) ;
+	st->j0[12] = 0 ;
+	st->j0[13] = 0 ;
+	st->j0[14] = 0 ;
+	st->j0[15] = 1 ;
+	memcpy(st->counter, st->j0, AES_BLOCK_SIZE) ;
+	st->counter[15] = 2 ;
+	cipher_gcm_hash(gk, st->y, aad, aad_len) ;
+}
+
+/**
+ * En- or decrypts and hashes data. Only the last call for a packet may pass a partial block.
+ */
+static void cipher_gcm_update(gcm_state *st, unsigned char *in, int len, unsigned char *out)
+{
+	int	n ;
+
+	st->text_len += len ;
+	while(len > 0)
+	{
+		n = (len < GCM_STRIDE) ? len : GCM_STRIDE ;
+		if(st->mode == AES_DECRYPT)
+			cipher_gcm_hash(st->gk, st->y, in, n) ;
+		cipher_aes_ctr(in, n, &st->gk->aes, st->counter, out) ;
+		if(st->mode == AES_ENCRYPT)
+			cipher_gcm_hash(st->gk, st->y, out, n) ;
+		in += n ;
+		out += n ;
+		len -= n ;
+	}
+}
+
+/**
+ * Hashes the lengths and computes the tag.
+ */
+static void cipher_gcm_finish(gcm_state *st, int aad_len, unsigned char *tag)
+{
+	unsigned char	block[AES_BLOCK_SIZE] ;
+	int				i ;
+
+	/* lengths in bits as two 64 bit numbers */
+	memset(block, 0, sizeof(block)) ;
+	GCM_STORE(block+4, (__u32)aad_len << 3) ;
+	block[11] = (__u8)(st->text_len >> 29) ;
+	GCM_STORE(block+12, st->text_len << 3) ;
+	cipher_gcm_ghash(st->gk, st->y, block, 1) ;
+
+	cipher_aes_encrypt(&st->gk->aes, st->j0, tag) ;
+	for(i = 0; i < GCM_TAG_SIZE; i++)
+		tag[i] ^= st->y[i] ;
+}
+
+/**
+ * Returns the GHASH engine which is used when an engine is requested.
+ *
+ * @param engine	CIPHER_GHASH_PORTABLE or CIPHER_GHASH_CLMUL
+ * @return CIPHER_GHASH_CLMUL if requested, compiled in and supported by the CPU, CIPHER_GHASH_PORTABLE otherwise
+ */
+static int cipher_gcm_select(int engine)
+{
+#ifdef IPSEC_GCM_CLMUL
+	if((engine == CIPHER_GHASH_CLMUL) && cipher_gcm_clmul_available())
+		return CIPHER_GHASH_CLMUL ;
+#endif
+	return CIPHER_GHASH_PORTABLE ;
+}
+
+/**
+ * Selects the GHASH engine used for keys set up from now on. By default, CIPHER_GHASH_CLMUL is used
+ * if it was compiled in and the CPU supports it. The AES engine is selected by cipher_aes_set_engine().
+ *
+ * @param engine	CIPHER_GHASH_PORTABLE or CIPHER_GHASH_CLMUL
+ * @return the engine used so far
+ */
+int cipher_gcm_set_engine(int engine)
+{
+	int previous ;
+
+	if(cipher_gcm_engine < 0)
+		cipher_gcm_engine = cipher_gcm_select(CIPHER_GHASH_CLMUL) ;
+	previous = cipher_gcm_engine ;
+	cipher_gcm_engine = cipher_gcm_select(engine) ;
+	return previous ;
+}
+
+/**
+ * Expands an AES key and precomputes the hash key H = E(K, 0) for the GHASH engine.
+ *
+ * @param key		pointer to the key
+ * @param key_len	length of the key in bytes (16, 24 or 32)
+ * @param gk		pointer to the GCM key which is filled up
+ * @return 0 	if the key was expanded
+ * @return -1	if the key length is not supported
+ */
+int cipher_gcm_set_key(unsigned char *key, int key_len, gcm_key *gk)
+{
+	unsigned char	h[AES_BLOCK_SIZE] ;
+	__u32			v[4], carry ;
+	int				i, j ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "cipher_gcm_set_key", 
+				  ("key=%p, key_len=%d, gk=%p",
+			      (void *)key, key_len, (void *)gk)
+				 );
+
+	if(cipher_aes_set_key(key, key_len, &gk->aes) != 0)
+	{
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "cipher_gcm_set_key", ("return = %d", -1) );
+		return -1 ;
+	}
+
+	/* select the engine on first use (CPUID) */
+	if(cipher_gcm_engine < 0)
+		cipher_gcm_engine = cipher_gcm_select(CIPHER_GHASH_CLMUL) ;
+	gk->engine = cipher_gcm_engine ;
+
+	memset(h, 0, sizeof(h)) ;
+	cipher_aes_encrypt(&gk->aes, h, h) ;
+	for(i = 0; i < AES_BLOCK_SIZE; i++)
+		gk->h[i] = h[AES_BLOCK_SIZE-1-i] ;
+
+	/* htable[8] = H, htable[4] = H*x, htable[2] = H*x^2, htable[1] = H*x^3, the others are sums */
+	v[0] = GCM_LOAD(h) ;
+	v[1] = GCM_LOAD(h+4) ;
+	v[2] = GCM_LOAD(h+8) ;
+	v[3] = GCM_LOAD(h+12) ;
+	memset(gk->htable[0], 0, sizeof(gk->htable[0])) ;
+	for(i = 8; i > 0; i >>= 1)
+	{
+		memcpy(gk->htable[i], v, sizeof(v)) ;
+		carry = v[3] & 1 ;
+		v[3] = ((v[3] >> 1) | (v[2] << 31)) & 0xffffffffUL ;
+		v[2] = ((v[2] >> 1) | (v[1] << 31)) & 0xffffffffUL ;
+		v[1] = ((v[1] >> 1) | (v[0] << 31)) & 0xffffffffUL ;
+		v[0] = (v[0] >> 1) ^ (carry ? 0xe1000000UL : 0) ;
+	}
+	for(i = 2; i < 16; i <<= 1)
+		for(j = 1; j < i; j++)
+		{
+			gk->htable[i+j][0] = gk->htable[i][0] ^ gk->htable[j][0] ;
+			gk->htable[i+j][1] = gk->htable[i][1] ^ gk->htable[j][1] ;
+			gk->htable[i+j][2] = gk->htable[i][2] ^ gk->htable[j][2] ;
+			gk->htable[i+j][3] = gk->htable[i][3] ^ gk->htable[j][3] ;
+		}
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "cipher_gcm_set_key", ("return = %d", 0) );
+	return 0 ;
+}
+
+/**
+ * AES-GCM en- or decryption and authentication of a buffer.
+ *
+ * @param text		pointer to input data (may be the same as output)
+ * @param text_len	length of input data
+ * @param gk		pointer to the GCM key
+ * @param iv		IV (GCM_IV_SIZE bytes)
+ * @param aad		additional authenticated data (not encrypted)
+ * @param aad_len	length of the additional authenticated data
+ * @param mode		AES_ENCRYPT or AES_DECRYPT
+ * @param output	en- or decrypted input data
+ * @param tag		authentication tag (GCM_TAG_SIZE bytes) which is calculated
+ * @return void
+ */
+void cipher_gcm(unsigned char *text, int text_len, gcm_key *gk, unsigned char *iv, unsigned char *aad, int aad_len, int mode, unsigned char *output, unsigned char *tag)
+{
+	gcm_state	st ;
+
+	cipher_gcm_start(&st, gk, iv, aad, aad_len, mode) ;
+	cipher_gcm_update(&st, text, text_len, output) ;
+	cipher_gcm_finish(&st, aad_len, tag) ;
+}
+
+/**
+ * AES-GCM function which en- or decrypts and authenticates a part of a chain of buffers in place.
+ * The blocks inside a segment are processed directly. Only a block which spans two segments is 
+ * gathered into a local block and scattered back after processing.
+ *
+ * @param chain		first segment of the chain
+ * @param offset	offset of the first byte to process relative to the start of the chain
+ * @param len		number of bytes to process
+ * @param gk		pointer to the GCM key
+ * @param iv		IV (GCM_IV_SIZE bytes)
+ * @param aad		additional authenticated data (not encrypted)
+ * @param aad_len	length of the additional authenticated data
+ * @param mode		AES_ENCRYPT or AES_DECRYPT
+ * @param tag		authentication tag (GCM_TAG_SIZE bytes) which is calculated
+ * @return void
+ */
+void cipher_gcm_chain(ipsec_buffer *chain, int offset, int len, gcm_key *gk, unsigned char *iv, unsigned char *aad, int aad_len, int mode, unsigned char *tag)
+{
+	gcm_state		st ;
+	unsigned char	block[AES_BLOCK_SIZE] ;
+	int				n ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "cipher_gcm_chain", 
+				  ("chain=%p, offset=%d, len=%d, gk=%p, iv=%p, aad=%p, aad_len=%d, mode=%d, tag=%p",
+			      (void *)chain, offset, len, (void *)gk, (void *)iv, (void *)aad, aad_len, mode, (void *)tag)
+				 );
+
+	cipher_gcm_start(&st, gk, iv, aad, aad_len, mode) ;
+
+	while((chain != NULL) && (offset >= chain->len))
+	{
+		offset -= chain->len ;
+		chain = chain->next ;
+	}
+
+	while((chain != NULL) && (len > 0))
+	{
+		/* whole blocks inside this segment (and the partial last block if it is in there) */
+		n = chain->len - offset ;
+		if(n < len) 
+			n &= ~(AES_BLOCK_SIZE-1) ;
+		else
+			n = len ;
+		if(n > 0)
+		{
+			cipher_gcm_update(&st, chain->data + offset, n, chain->data + offset) ;
+			offset += n ;
+			len -= n ;
+		}
+
+		/* block which spans the end of this segment */
+		if((len > 0) && (offset < chain->len))
+		{
+			n = (len < AES_BLOCK_SIZE) ? len : AES_BLOCK_SIZE ;
+			ipsec_buffer_copy_out(chain, offset, n, block) ;
+			cipher_gcm_update(&st, block, n, block) ;
+			ipsec_buffer_copy_in(chain, offset, n, block) ;
+			offset += n ;
+			len -= n ;
+		}
+
+		while((chain != NULL) && (offset >= chain->len))
+		{
+			offset -= chain->len ;
+			chain = chain->next ;
+		}
+	}
+
+	cipher_gcm_finish(&st, aad_len, tag) ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "cipher_gcm_chain", ("void") );
+}
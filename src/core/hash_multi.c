@@ -0,0 +1,617 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file hash_multi.c
+ *  @brief Multi-buffer HMAC-MD5 and HMAC-SHA1: the packets of a batch hashed side by side
+ *
+ *  <B>OUTLINE:</B>
+ *  The following functions are implemented in this module:
+ *   - hash_multi_set_engine(): selects the engine
+ *   - hash_multi_lanes(): tells how many packets the engine hashes at a time
+ *   - hmac_md5_multi(): HMAC-MD5 of several parts of chains of buffers
+ *   - hmac_sha1_multi(): HMAC-SHA1 of several parts of chains of buffers
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *  Every hash has a serial dependency chain, so one packet cannot be hashed faster than the 
+ *  latency of the rounds allows. The SIMD engines instead run one packet per vector lane: every 
+ *  vector holds the same word of the state or of the message block of 4 (SSE2), 8 (AVX2) or 16 
+ *  (AVX-512) packets. Each lane is fed with the blocks of its packet followed by the padding; 
+ *  lanes whose packet is shorter get zero blocks and their inner digest is taken when their 
+ *  last block was hashed. The outer hash is a single block for all lanes.
+ *
+ *  The rounds are written once for the GCC vector types (hash_vN) and instantiated for every 
+ *  vector width with HASH_MULTI_MD5_BLOCK() and HASH_MULTI_SHA1_BLOCK(). The engine is selected 
+ *  on first use with the CPU features, hash_multi_set_engine() can be used to select another one.
+ *  HMAC-SHA1 keeps to the serial code if it uses the SHA extensions, unless AVX-512 is available.
+ *
+ *  <B>NOTES:</B>
+ *  The results are the same as the ones of hmac_md5_chain() and hmac_sha1_chain(), which are 
+ *  used if IPSEC_HASH_MULTI is not defined.
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/hash_multi.h"
+#include "ipsec/debug.h"
+
+
+#define HASH_MULTI_MD5		(0)		/**< algorithm hashed by hash_multi_hmac(): HMAC-MD5 */
+#define HASH_MULTI_SHA1		(1)		/**< algorithm hashed by hash_multi_hmac(): HMAC-SHA1 */
+#define HASH_MULTI_BLOCK	(64)	/**< block size of MD5 and SHA1 */
+
+static int hash_multi_engine = -1 ;		/**< engine used, -1 until it was selected */
+
+
+#ifdef IPSEC_HASH_MULTI
+
+typedef unsigned int hash_v4 __attribute__((vector_size(16))) ;		/**< one word of 4 lanes */
+typedef unsigned int hash_v8 __attribute__((vector_size(32))) ;		/**< one word of 8 lanes */
+typedef unsigned int hash_v16 __attribute__((vector_size(64))) ;	/**< one word of 16 lanes */
+
+/** state of all lanes, one row per word (unsigned int is 32 bit on x86) */
+typedef unsigned int hash_multi_state[5][HASH_MULTI_MAX_LANES] ;
+
+/** hashes one block in every lane */
+typedef void (*hash_multi_block_fn)(hash_multi_state, const unsigned char **) ;
+
+/** Input of one lane: the data of a packet followed by the padding */
+typedef struct hash_lane_struct
+{
+	ipsec_buffer	*seg ;							/**< segment holding the next byte of the data */
+	int				seg_off ;						/**< offset of the next byte in seg */
+	int				full ;							/**< number of full data blocks left */
+	int				tail ;							/**< number of data bytes in the first padding block */
+	int				pads ;							/**< number of padding blocks (1 or 2) */
+	int				pad ;							/**< number of padding blocks left */
+	int				blocks ;						/**< total number of blocks */
+	__u32			bits_lo, bits_hi ;				/**< length of the hashed message in bits (including the HMAC pad block) */
+	int				big_endian ;					/**< byte order of the length (1 for SHA1, 0 for MD5) */
+	unsigned char	buf[2*HASH_MULTI_BLOCK] ;		/**< a block which spans segments, or the padding blocks */
+} hash_lane ;
+
+static const unsigned char hash_multi_zero[HASH_MULTI_BLOCK] = { 0 } ;	/**< block for idle lanes */
+
+static const unsigned int md5_t[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+} ;
+
+static const int md5_s[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+} ;
+
+/* x86 is little endian and allows unaligned loads */
+#define HASH_MULTI_LOAD_LE(w,p)	memcpy(&(w), (p), 4)
+#define HASH_MULTI_LOAD_BE(w,p)	{ memcpy(&(w), (p), 4) ; (w) = __builtin_bswap32(w) ; }
+#define HASH_MULTI_STORE_BE(p,v)	((p)[0] = (unsigned char)((v) >> 24), (p)[1] = (unsigned char)((v) >> 16), (p)[2] = (unsigned char)((v) >> 8), (p)[3] = (unsigned char)(v))
+#define HASH_MULTI_STORE_LE(p,v)	((p)[0] = (unsigned char)(v), (p)[1] = (unsigned char)((v) >> 8), (p)[2] = (unsigned char)((v) >> 16), (p)[3] = (unsigned char)((v) >> 24))
+#define HASH_MULTI_ROTL(v,n)	(((v) << (n)) | ((v) >> (32-(n))))
+
+/* the round functions of md5.c and sha1.c, on vectors */
+#define HASH_MD5_F(b,c,d)		((((c) ^ (d)) & (b)) ^ (d))
+#define HASH_MD5_G(b,c,d)		((((b) ^ (c)) & (d)) ^ (c))
+#define HASH_MD5_H(b,c,d)		((b) ^ (c) ^ (d))
+#define HASH_MD5_I(b,c,d)		(((~(d)) | (b)) ^ (c))
+#define HASH_SHA1_F0(b,c,d)		((((c) ^ (d)) & (b)) ^ (d))
+#define HASH_SHA1_F1(b,c,d)		((b) ^ (c) ^ (d))
+#define HASH_SHA1_F2(b,c,d)		(((b) & (c)) | (((b) | (c)) & (d)))
+
+/* loads word i of the block of every lane into v */
+#define HASH_MULTI_GATHER(v, vec, lanes, load, i) \
+	{ \
+		unsigned int word[lanes] ; \
+		for(l = 0; l < (lanes); l++) \
+			load(word[l], blk[l] + 4*(i)) ; \
+		memcpy(&(v), word, sizeof(vec)) ; \
+	}
+
+/* defines a function hashing one MD5 block in every lane of vectors of type vec */
+#define HASH_MULTI_MD5_BLOCK(name, vec, lanes, isa) \
+__attribute__((target(isa))) \
+static void name(hash_multi_state st, const unsigned char **blk) \
+{ \
+	vec		a, b, c, d, f, x[16] ; \
+	vec		a0, b0, c0, d0 ; \
+	int		i, l ; \
+	\
+	for(i = 0; i < 16; i++) \
+		HASH_MULTI_GATHER(x[i], vec, lanes, HASH_MULTI_LOAD_LE, i) \
+	memcpy(&a, st[0], sizeof(vec)) ; \
+	memcpy(&b, st[1], sizeof(vec)) ; \
+	memcpy(&c, st[2], sizeof(vec)) ; \
+	memcpy(&d, st[3], sizeof(vec)) ; \
+	a0 = a ; b0 = b ; c0 = c ; d0 = d ; \
+	\
+	for(i = 0; i < 64; i++) \
+	{ \
+		if(i < 16) \
+			f = HASH_MD5_F(b, c, d) + x[i] ; \
+		else if(i < 32) \
+			f = HASH_MD5_G(b, c, d) + x[(5*i+1) & 15] ; \
+		else if(i < 48) \
+			f = HASH_MD5_H(b, c, d) + x[(3*i+5) & 15] ; \
+		else \
+			f = HASH_MD5_I(b, c, d) + x[(7*i) & 15] ; \
+		f = f + a + md5_t[i] ; \
+		a = d ; \
+		d = c ; \
+		c = b ; \
+		b = b + HASH_MULTI_ROTL(f, md5_s[i]) ; \
+	} \
+	\
+	a += a0 ; b += b0 ; c += c0 ; d += d0 ; \
+	memcpy(st[0], &a, sizeof(vec)) ; \
+	memcpy(st[1], &b, sizeof(vec)) ; \
+	memcpy(st[2], &c, sizeof(vec)) ; \
+	memcpy(st[3], &d, sizeof(vec)) ; \
+}
+
+/* defines a function hashing one SHA1 block in every lane of vectors of type vec */
+#define HASH_MULTI_SHA1_BLOCK(name, vec, lanes, isa) \
+__attribute__((target(isa))) \
+static void name(hash_multi_state st, const unsigned char **blk) \
+{ \
+	vec		a, b, c, d, e, t, x[16] ; \
+	vec		a0, b0, c0, d0, e0 ; \
+	int		i, l ; \
+	\
+	for(i = 0; i < 16; i++) \
+		HASH_MULTI_GATHER(x[i], vec, lanes, HASH_MULTI_LOAD_BE, i) \
+	memcpy(&a, st[0], sizeof(vec)) ; \
+	memcpy(&b, st[1], sizeof(vec)) ; \
+	memcpy(&c, st[2], sizeof(vec)) ; \
+	memcpy(&d, st[3], sizeof(vec)) ; \
+	memcpy(&e, st[4], sizeof(vec)) ; \
+	a0 = a ; b0 = b ; c0 = c ; d0 = d ; e0 = e ; \
+	\
+	for(i = 0; i < 80; i++) \
+	{ \
+		if(i >= 16) \
+		{ \
+			t = x[(i+13) & 15] ^ x[(i+8) & 15] ^ x[(i+2) & 15] ^ x[i & 15] ; \
+			x[i & 15] = HASH_MULTI_ROTL(t, 1) ; \
+		} \
+		if(i < 20) \
+			t = HASH_SHA1_F0(b, c, d) + 0x5a827999U ; \
+		else if(i < 40) \
+			t = HASH_SHA1_F1(b, c, d) + 0x6ed9eba1U ; \
+		else if(i < 60) \
+			t = HASH_SHA1_F2(b, c, d) + 0x8f1bbcdcU ; \
+		else \
+			t = HASH_SHA1_F1(b, c, d) + 0xca62c1d6U ; \
+		t = t + e + x[i & 15] + HASH_MULTI_ROTL(a, 5) ; \
+		e = d ; \
+		d = c ; \
+		c = HASH_MULTI_ROTL(b, 30) ; \
+		b = a ; \
+		a = t ; \
+	} \
+	\
+	a += a0 ; b += b0 ; c += c0 ; d += d0 ; e += e0 ; \
+	memcpy(st[0], &a, sizeof(vec)) ; \
+	memcpy(st[1], &b, sizeof(vec)) ; \
+	memcpy(st[2], &c, sizeof(vec)) ; \
+	memcpy(st[3], &d, sizeof(vec)) ; \
+	memcpy(st[4], &e, sizeof(vec)) ; \
+}
+
+HASH_MULTI_MD5_BLOCK(hash_md5_block_sse2, hash_v4, 4, "sse2")
+HASH_MULTI_MD5_BLOCK(hash_md5_block_avx2, hash_v8, 8, "avx2")
+HASH_MULTI_MD5_BLOCK(hash_md5_block_avx512, hash_v16, 16, "avx512f")
+HASH_MULTI_SHA1_BLOCK(hash_sha1_block_sse2, hash_v4, 4, "sse2")
+HASH_MULTI_SHA1_BLOCK(hash_sha1_block_avx2, hash_v8, 8, "avx2")
+HASH_MULTI_SHA1_BLOCK(hash_sha1_block_avx512, hash_v16, 16, "avx512f")
+
+
+/**
+ * Copies n bytes of the data of a lane and advances the lane. Bytes beyond the end of the chain
+ * are left as they are.
+ */
+static void hash_lane_copy(hash_lane *lane, unsigned char *dst, int n)
+{
+	int k ;
+
+	while((n > 0) && (lane->seg != NULL))
+	{
+		if(lane->seg_off >= lane->seg->len)
+		{
+			lane->seg = lane->seg->next ;
+			lane->seg_off = 0 ;
+			continue ;
+		}
+		k = lane->seg->len - lane->seg_off ;
+		if(k > n) k = n ;
+		memcpy(dst, lane->seg->data + lane->seg_off, k) ;
+		lane->seg_off += k ;
+		dst += k ;
+		n -= k ;
+	}
+}
+
+/**
+ * Sets up a lane for len bytes of a chain starting at offset.
+ *
+ * @param lane			lane to set up
+ * @param chain			first segment of the data
+ * @param offset		offset of the first byte relative to the start of the chain
+ * @param len			number of bytes
+ * @param nl			number of bits already hashed (the HMAC pad block), least significant word
+ * @param nh			most significant word of it
+ * @param big_endian	1 if the length is stored as big endian number (SHA1), 0 otherwise (MD5)
+ */
+static void hash_lane_init(hash_lane *lane, ipsec_buffer *chain, int offset, int len, __u32 nl, __u32 nh, int big_endian)
+{
+	for(; (chain != NULL) && (offset >= chain->len); chain = chain->next)
+		offset -= chain->len ;
+	lane->seg = chain ;
+	lane->seg_off = offset ;
+	lane->full = len / HASH_MULTI_BLOCK ;
+	lane->tail = len % HASH_MULTI_BLOCK ;
+	lane->pads = (lane->tail + 9 > HASH_MULTI_BLOCK) ? 2 : 1 ;
+	lane->pad = lane->pads ;
+	lane->blocks = lane->full + lane->pads ;
+	lane->bits_lo = (nl + ((__u32)len << 3)) & 0xffffffffUL ;
+	lane->bits_hi = (nh + ((__u32)len >> 29) + (lane->bits_lo < (nl & 0xffffffffUL))) & 0xffffffffUL ;
+	lane->big_endian = big_endian ;
+}
+
+/**
+ * Returns the next block of a lane.
+ */
+static const unsigned char *hash_lane_next(hash_lane *lane)
+{
+	const unsigned char	*p ;
+	unsigned char		*len ;
+
+	if(lane->full > 0)
+	{
+		lane->full-- ;
+		while((lane->seg != NULL) && (lane->seg_off >= lane->seg->len))
+		{
+			lane->seg = lane->seg->next ;
+			lane->seg_off = 0 ;
+		}
+		/* blocks which are in one segment are hashed where they are */
+		if((lane->seg != NULL) && (lane->seg->len - lane->seg_off >= HASH_MULTI_BLOCK))
+		{
+			p = lane->seg->data + lane->seg_off ;
+			lane->seg_off += HASH_MULTI_BLOCK ;
+			return p ;
+		}
+		memset(lane->buf, 0, HASH_MULTI_BLOCK) ;
+		hash_lane_copy(lane, lane->buf, HASH_MULTI_BLOCK) ;
+		return lane->buf ;
+	}
+
+	if(lane->pad == lane->pads)
+	{
+		/* the rest of the data, 0x80, zeros and the length */
+		memset(lane->buf, 0, sizeof(lane->buf)) ;
+		hash_lane_copy(lane, lane->buf, lane->tail) ;
+		lane->buf[lane->tail] = 0x80 ;
+		len = lane->buf + lane->pads*HASH_MULTI_BLOCK - 8 ;
+		if(lane->big_endian)
+		{
+			HASH_MULTI_STORE_BE(len, lane->bits_hi) ;
+			HASH_MULTI_STORE_BE(len + 4, lane->bits_lo) ;
+		}
+		else
+		{
+			HASH_MULTI_STORE_LE(len, lane->bits_lo) ;
+			HASH_MULTI_STORE_LE(len + 4, lane->bits_hi) ;
+		}
+	}
+	p = lane->buf + (lane->pads - lane->pad)*HASH_MULTI_BLOCK ;
+	lane->pad-- ;
+	return p ;
+}
+
+/**
+ * Hashes the streams in groups of as many packets as the engine has lanes.
+ *
+ * @param alg		HASH_MULTI_MD5 or HASH_MULTI_SHA1
+ * @param streams	packets to authenticate
+ * @param count		number of packets
+ */
+static void hash_multi_hmac(int alg, hmac_multi_stream *streams, int count)
+{
+	hash_multi_state	st ;
+	hash_lane			lane[HASH_MULTI_MAX_LANES] ;
+	const unsigned char	*blk[HASH_MULTI_MAX_LANES] ;
+	unsigned char		outer[HASH_MULTI_MAX_LANES][HASH_MULTI_BLOCK] ;
+	hash_multi_block_fn	block ;
+	HMAC_MD5_CTX		*md5 ;
+	HMAC_SHA1_CTX		*sha1 ;
+	int					lanes, words, digest_len ;
+	int					first, n, steps, step ;
+	int					i, l ;
+
+	switch(hash_multi_engine)
+	{
+		case HASH_MULTI_AVX512:
+			lanes = 16 ;
+			block = (alg == HASH_MULTI_SHA1) ? hash_sha1_block_avx512 : hash_md5_block_avx512 ;
+			break ;
+		case HASH_MULTI_AVX2:
+			lanes = 8 ;
+			block = (alg == HASH_MULTI_SHA1) ? hash_sha1_block_avx2 : hash_md5_block_avx2 ;
+			break ;
+		default:
+			lanes = 4 ;
+			block = (alg == HASH_MULTI_SHA1) ? hash_sha1_block_sse2 : hash_md5_block_sse2 ;
+			break ;
+	}
+	words = (alg == HASH_MULTI_SHA1) ? 5 : 4 ;
+	digest_len = (alg == HASH_MULTI_SHA1) ? SHA_DIGEST_LENGTH : MD5_DIGEST_LENGTH ;
+
+	for(first = 0; first < count; first += lanes)
+	{
+		n = count - first ;
+		if(n > lanes) n = lanes ;
+
+		/* inner hash: the state after the inner pad, then the data and the padding */
+		memset(st, 0, sizeof(st)) ;
+		steps = 0 ;
+		for(l = 0; l < n; l++)
+		{
+			if(alg == HASH_MULTI_SHA1)
+			{
+				sha1 = (HMAC_SHA1_CTX *)streams[first+l].hctx ;
+				st[0][l] = (unsigned int)sha1->inner.h0 ;
+				st[1][l] = (unsigned int)sha1->inner.h1 ;
+				st[2][l] = (unsigned int)sha1->inner.h2 ;
+				st[3][l] = (unsigned int)sha1->inner.h3 ;
+				st[4][l] = (unsigned int)sha1->inner.h4 ;
+				hash_lane_init(&lane[l], streams[first+l].chain, streams[first+l].offset, streams[first+l].len, sha1->inner.Nl, sha1->inner.Nh, 1) ;
+			}
+			else
+			{
+				md5 = (HMAC_MD5_CTX *)streams[first+l].hctx ;
+				st[0][l] = (unsigned int)md5->inner.A ;
+				st[1][l] = (unsigned int)md5->inner.B ;
+				st[2][l] = (unsigned int)md5->inner.C ;
+				st[3][l] = (unsigned int)md5->inner.D ;
+				hash_lane_init(&lane[l], streams[first+l].chain, streams[first+l].offset, streams[first+l].len, md5->inner.Nl, md5->inner.Nh, 0) ;
+			}
+			if(lane[l].blocks > steps)
+				steps = lane[l].blocks ;
+		}
+		for(l = n; l < lanes; l++)
+			blk[l] = hash_multi_zero ;
+
+		for(step = 0; step < steps; step++)
+		{
+			for(l = 0; l < n; l++)
+				blk[l] = (step < lane[l].blocks) ? hash_lane_next(&lane[l]) : hash_multi_zero ;
+			block(st, blk) ;
+
+			/* the inner digest of a lane which is done becomes the start of its outer block */
+			for(l = 0; l < n; l++)
+			{
+				if(step != lane[l].blocks - 1)
+					continue ;
+				for(i = 0; i < words; i++)
+				{
+					if(alg == HASH_MULTI_SHA1)
+						HASH_MULTI_STORE_BE(&outer[l][4*i], st[i][l]) ;
+					else
+						HASH_MULTI_STORE_LE(&outer[l][4*i], st[i][l]) ;
+				}
+			}
+		}
+
+		/* outer hash: the state after the outer pad, then one block with the inner digest */
+		for(l = 0; l < n; l++)
+		{
+			memset(&outer[l][digest_len], 0, HASH_MULTI_BLOCK - digest_len) ;
+			outer[l][digest_len] = 0x80 ;
+			if(alg == HASH_MULTI_SHA1)
+			{
+				sha1 = (HMAC_SHA1_CTX *)streams[first+l].hctx ;
+				st[0][l] = (unsigned int)sha1->outer.h0 ;
+				st[1][l] = (unsigned int)sha1->outer.h1 ;
+				st[2][l] = (unsigned int)sha1->outer.h2 ;
+				st[3][l] = (unsigned int)sha1->outer.h3 ;
+				st[4][l] = (unsigned int)sha1->outer.h4 ;
+				HASH_MULTI_STORE_BE(&outer[l][HASH_MULTI_BLOCK-4], (sha1->outer.Nl + 8*SHA_DIGEST_LENGTH) & 0xffffffffUL) ;
+			}
+			else
+			{
+				md5 = (HMAC_MD5_CTX *)streams[first+l].hctx ;
+				st[0][l] = (unsigned int)md5->outer.A ;
+				st[1][l] = (unsigned int)md5->outer.B ;
+				st[2][l] = (unsigned int)md5->outer.C ;
+				st[3][l] = (unsigned int)md5->outer.D ;
+				HASH_MULTI_STORE_LE(&outer[l][HASH_MULTI_BLOCK-8], (md5->outer.Nl + 8*MD5_DIGEST_LENGTH) & 0xffffffffUL) ;
+			}
+			blk[l] = outer[l] ;
+		}
+		block(st, blk) ;
+
+		for(l = 0; l < n; l++)
+		{
+			for(i = 0; i < words; i++)
+			{
+				if(alg == HASH_MULTI_SHA1)
+					HASH_MULTI_STORE_BE(streams[first+l].digest + 4*i, st[i][l]) ;
+				else
+					HASH_MULTI_STORE_LE(streams[first+l].digest + 4*i, st[i][l]) ;
+			}
+		}
+	}
+}
+
+#endif
+
+
+/**
+ * Returns the engine which is used when an engine is requested.
+ *
+ * @param engine	HASH_MULTI_PORTABLE, HASH_MULTI_SSE2, HASH_MULTI_AVX2 or HASH_MULTI_AVX512
+ * @return the requested engine or the next slower one if it is not compiled in or not supported by the CPU
+ */
+static int hash_multi_select(int engine)
+{
+#ifdef IPSEC_HASH_MULTI
+	__builtin_cpu_init() ;
+	if((engine == HASH_MULTI_AVX512) && __builtin_cpu_supports("avx512f"))
+		return HASH_MULTI_AVX512 ;
+	if((engine >= HASH_MULTI_AVX2) && __builtin_cpu_supports("avx2"))
+		return HASH_MULTI_AVX2 ;
+	if((engine >= HASH_MULTI_SSE2) && __builtin_cpu_supports("sse2"))
+		return HASH_MULTI_SSE2 ;
+#endif
+	return HASH_MULTI_PORTABLE ;
+}
+
+/**
+ * Selects the multi-buffer engine. By default, the fastest engine which was compiled in and is 
+ * supported by the CPU is used.
+ *
+ * @param engine	HASH_MULTI_PORTABLE, HASH_MULTI_SSE2, HASH_MULTI_AVX2 or HASH_MULTI_AVX512
+ * @return the engine used so far
+ */
+int hash_multi_set_engine(int engine)
+{
+	int previous ;
+
+	if(hash_multi_engine < 0)
+		hash_multi_engine = hash_multi_select(HASH_MULTI_AVX512) ;
+	previous = hash_multi_engine ;
+	hash_multi_engine = hash_multi_select(engine) ;
+	return previous ;
+}
+
+/**
+ * Tells how many packets the selected engine hashes at a time. Batches of this size (or a 
+ * multiple of it) use the engine best.
+ *
+ * @return number of lanes (1 for HASH_MULTI_PORTABLE)
+ */
+int hash_multi_lanes(void)
+{
+	if(hash_multi_engine < 0)
+		hash_multi_engine = hash_multi_select(HASH_MULTI_AVX512) ;
+
+	switch(hash_multi_engine)
+	{
+		case HASH_MULTI_AVX512:
+			return 16 ;
+		case HASH_MULTI_AVX2:
+			return 8 ;
+		case HASH_MULTI_SSE2:
+			return 4 ;
+		default:
+			return 1 ;
+	}
+}
+
+/**
+ * Calculates the HMAC-MD5 digests of several parts of chains of buffers, using states 
+ * precomputed by hmac_md5_init(). The digests are the same as the ones of hmac_md5_chain().
+ *
+ * @param streams	array of packets (hctx points to an HMAC_MD5_CTX), returns the digests
+ * @param count		number of packets
+ * @return void
+ */
+void hmac_md5_multi(hmac_multi_stream *streams, int count)
+{
+	int i ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "hmac_md5_multi", 
+				  ("streams=%p, count=%d", (void *)streams, count)
+				 );
+
+	if(hash_multi_engine < 0)
+		hash_multi_engine = hash_multi_select(HASH_MULTI_AVX512) ;
+
+#ifdef IPSEC_HASH_MULTI
+	/* a single packet is hashed faster by the serial code */
+	if((hash_multi_engine != HASH_MULTI_PORTABLE) && (count > 1))
+	{
+		hash_multi_hmac(HASH_MULTI_MD5, streams, count) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_md5_multi", ("void") );
+		return ;
+	}
+#endif
+	for(i = 0; i < count; i++)
+		hmac_md5_chain((HMAC_MD5_CTX *)streams[i].hctx, streams[i].chain, streams[i].offset, streams[i].len, streams[i].digest) ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_md5_multi", ("void") );
+}
+
+/**
+ * Calculates the HMAC-SHA1 digests of several parts of chains of buffers, using states 
+ * precomputed by hmac_sha1_init(). The digests are the same as the ones of hmac_sha1_chain().
+ *
+ * @param streams	array of packets (hctx points to an HMAC_SHA1_CTX), returns the digests
+ * @param count		number of packets
+ * @return void
+ */
+void hmac_sha1_multi(hmac_multi_stream *streams, int count)
+{
+	int i ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "hmac_sha1_multi", 
+				  ("streams=%p, count=%d", (void *)streams, count)
+				 );
+
+	if(hash_multi_engine < 0)
+		hash_multi_engine = hash_multi_select(HASH_MULTI_AVX512) ;
+
+#ifdef IPSEC_HASH_MULTI
+	/* with the SHA extensions, one packet is hashed about as fast as eight lanes of AVX2 */
+	if((hash_multi_engine != HASH_MULTI_PORTABLE) && (count > 1) && 
+	   ((hash_multi_engine == HASH_MULTI_AVX512) || (sha1_get_engine() != HASH_SHA1_NI)))
+	{
+		hash_multi_hmac(HASH_MULTI_SHA1, streams, count) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_sha1_multi", ("void") );
+		return ;
+	}
+#endif
+	for(i = 0; i < count; i++)
+		hmac_sha1_chain((HMAC_SHA1_CTX *)streams[i].hctx, streams[i].chain, streams[i].offset, streams[i].len, streams[i].digest) ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_sha1_multi", ("void") );
+}
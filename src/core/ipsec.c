@@ -53,6 +53,8 @@
 
 
 
+#include <string.h>
+
 #include "ipsec/debug.h"
 
 #include "ipsec/ipsec.h"
@@ -60,96 +62,109 @@
 #include "ipsec/sa.h"
 #include "ipsec/ah.h"
 #include "ipsec/esp.h"
+#include "ipsec/hash_multi.h"
 
 
 
 /**
- * IPsec input processing
+ * IPsec input processing of a packet whose SA has already been looked up
  *
- * This function is called by the ipsec device driver when a packet arrives having AH or ESP in the 
- * protocol field. A SA lookup gets the appropriate SA which is then passed to the packet processing 
- * funciton ipsec_ah_check() or ipsec_esp_decapsulate(). After successfully processing an IPsec packet
- * an check together with an SPD lookup verifies if the packet was processed acording the right SA.
+ * Decapsulates (ESP) or checks (AH) the packet. The caller must verify the result with 
+ * ipsec_input_check_policy() before the packet is accepted (see ipsec_input_chain()).
+ * Only the SA is accessed, so packets of different SAs may be processed concurrently.
  *
- * @param  packet         pointer used to access the intercepted original packet
- * @param  packet_size    length of the intercepted packet
- * @param  payload_offset pointer used to return offset of the new IP packet relative to original packet pointer
+ * @param  chain          first segment of the intercepted original packet
+ * @param  payload_offset pointer used to return offset of the new IP packet relative to the start of the chain
  * @param  payload_size   pointer used to return total size of the new IP packet
- * @param  databases      Collection of all security policy databases for the active IPsec device 
+ * @param  sa_ptr         SA (sad_entry) found for the packet (may be NULL)
  * @return int 			  return status code
  */
-int ipsec_input(unsigned char *packet, int packet_size, 
-                int *payload_offset, int *payload_size, 
-				db_set_netif *databases)
+int ipsec_input_sa(ipsec_buffer *chain, int *payload_offset, int *payload_size, void *sa_ptr)
 {
 	int ret_val 	= IPSEC_STATUS_NOT_INITIALIZED;	/* by default, the return value is undefined  */
-	int dummy   	= packet_size; 					/* dummy operation to avoid compiler warnings */
-	sad_entry 		*sa ;
-	spd_entry		*spd ;
-	ipsec_ip_header	*ip ;
-	ipsec_ip_header	*inner_ip ;
-	__u32			spi ;
+	sad_entry		*sa = (sad_entry *)sa_ptr ;
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
-	              "ipsec_input", 
-				  ("*packet=%p, packet_size=%d, len=%u, *payload_offset=%d, *payload_size=%d databases=%p",
-			      (void *)packet, packet_size, (int)*payload_offset, (int)*payload_size, (void *)databases)
+	              "ipsec_input_sa", 
+				  ("chain=%p, sa=%p", (void *)chain, (void *)sa)
 				 );
 
-	IPSEC_DUMP_BUFFER(" INBOUND ESP or AH:", packet, 0, packet_size);
-	
-	ip = (ipsec_ip_header*)packet ;
-	spi = ipsec_sad_get_spi(ip) ;
-	sa = ipsec_sad_lookup(ip->dest, ip->protocol, spi, &databases->inbound_sad) ;
-
 	if(sa == NULL)
 	{
-		IPSEC_LOG_AUD("ipsec_input", IPSEC_AUDIT_FAILURE, ("no matching SA found")) ;
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input", ("return = %d", IPSEC_STATUS_FAILURE) );
+		IPSEC_LOG_AUD("ipsec_input_sa", IPSEC_AUDIT_FAILURE, ("no matching SA found")) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input_sa", ("return = %d", IPSEC_STATUS_FAILURE) );
 		return IPSEC_STATUS_FAILURE;
 	}
 
 	if(sa->mode != IPSEC_TUNNEL) 
 	{
-		IPSEC_LOG_ERR("ipsec_input", IPSEC_STATUS_FAILURE, ("unsupported transmission mode (only IPSEC_TUNNEL is supported)") );
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input", ("return = %d", IPSEC_STATUS_FAILURE) );
+		IPSEC_LOG_ERR("ipsec_input_sa", IPSEC_STATUS_FAILURE, ("unsupported transmission mode (only IPSEC_TUNNEL is supported)") );
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input_sa", ("return = %d", IPSEC_STATUS_FAILURE) );
 		return IPSEC_STATUS_FAILURE;
 	}
 
 	if(sa->protocol == IPSEC_PROTO_AH)
 	{
-		ret_val = ipsec_ah_check((ipsec_ip_header *)packet, payload_offset, payload_size, sa);
+		ret_val = ipsec_ah_check_chain(chain, payload_offset, payload_size, sa);
 		if(ret_val != IPSEC_STATUS_SUCCESS) 
 		{
-			IPSEC_LOG_ERR("ipsec_input", ret_val, ("ah_packet_check() failed") );
-			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input", ("ret_val=%d", ret_val) );
+			IPSEC_LOG_ERR("ipsec_input_sa", ret_val, ("ah_packet_check() failed") );
+			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input_sa", ("ret_val=%d", ret_val) );
 			return ret_val;
 		}
 
 	} else if (sa->protocol == IPSEC_PROTO_ESP)
 	{
-		ret_val = ipsec_esp_decapsulate((ipsec_ip_header *)packet, payload_offset, payload_size, sa);
+		ret_val = ipsec_esp_decapsulate_chain(chain, payload_offset, payload_size, sa);
 		if(ret_val != IPSEC_STATUS_SUCCESS) 
 		{
-			IPSEC_LOG_ERR("ipsec_input", ret_val, ("ipsec_esp_decapsulate() failed") );
-			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input", ("ret_val=%d", ret_val) );
+			IPSEC_LOG_ERR("ipsec_input_sa", ret_val, ("ipsec_esp_decapsulate() failed") );
+			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input_sa", ("ret_val=%d", ret_val) );
 			return ret_val;
 		}
 
 	} else
 	{
-		IPSEC_LOG_ERR("ipsec_input", IPSEC_STATUS_FAILURE, ("invalid protocol from SA") );
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input", ("ret_val=%d", IPSEC_STATUS_FAILURE) );
+		IPSEC_LOG_ERR("ipsec_input_sa", IPSEC_STATUS_FAILURE, ("invalid protocol from SA") );
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input_sa", ("ret_val=%d", IPSEC_STATUS_FAILURE) );
 		return IPSEC_STATUS_FAILURE;
 	}
 
-	inner_ip = (ipsec_ip_header *)(((unsigned char *)ip) + *payload_offset) ;
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input_sa", ("return = %d", IPSEC_STATUS_SUCCESS) );
+	return IPSEC_STATUS_SUCCESS;
+}
+
 
-	spd = ipsec_spd_lookup(inner_ip, &databases->inbound_spd) ;
+/**
+ * Verifies with an SPD lookup that a decapsulated packet was processed according to the right SA
+ *
+ * @param  chain          first segment of the packet processed by ipsec_input_sa()
+ * @param  payload_offset offset of the inner IP packet relative to the start of the chain
+ * @param  sa_ptr         SA (sad_entry) the packet was processed with
+ * @param  dbs            Collection of all security policy databases for the active IPsec device (db_set_netif)
+ * @return int 			  return status code
+ */
+int ipsec_input_check_policy(ipsec_buffer *chain, int payload_offset, void *sa_ptr, void *dbs)
+{
+	sad_entry		*sa = (sad_entry *)sa_ptr ;
+	db_set_netif	*databases = (db_set_netif *)dbs ;
+	spd_entry		*spd ;
+	__u32			inner_ip[(60 + 4)/sizeof(__u32)] ;	/* copy of the inner IP header (with options) and the ports */
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsec_input_check_policy", 
+				  ("chain=%p, payload_offset=%d, sa=%p, databases=%p", (void *)chain, payload_offset, (void *)sa, (void *)databases)
+				 );
+
+	/* the inner IP header may span two segments */
+	memset(inner_ip, 0, sizeof(inner_ip)) ;
+	ipsec_buffer_copy_out(chain, payload_offset, sizeof(inner_ip), inner_ip) ;
+
+	spd = ipsec_spd_lookup((ipsec_ip_header *)inner_ip, &databases->inbound_spd) ;
 	if(spd == NULL)
 	{
-		IPSEC_LOG_AUD("ipsec_input", IPSEC_AUDIT_FAILURE, ("no matching SPD found")) ;
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input", ("ret_val=%d", IPSEC_STATUS_FAILURE) );
+		IPSEC_LOG_AUD("ipsec_input_check_policy", IPSEC_AUDIT_FAILURE, ("no matching SPD found")) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input_check_policy", ("ret_val=%d", IPSEC_STATUS_FAILURE) );
 		return IPSEC_STATUS_FAILURE;
 	}
 	
@@ -157,23 +172,232 @@ int ipsec_input(unsigned char *packet, int packet_size,
 	{
 		if(spd->sa != sa)
 		{
-			IPSEC_LOG_AUD("ipsec_input", IPSEC_AUDIT_SPI_MISMATCH, ("SPI mismatch") );
-			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input", ("return = %d", IPSEC_AUDIT_SPI_MISMATCH) );
+			IPSEC_LOG_AUD("ipsec_input_check_policy", IPSEC_AUDIT_SPI_MISMATCH, ("SPI mismatch") );
+			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input_check_policy", ("return = %d", IPSEC_AUDIT_SPI_MISMATCH) );
 			return IPSEC_STATUS_FAILURE;
 		}
 	}
 	else
 	{
-			IPSEC_LOG_AUD("ipsec_input", IPSEC_AUDIT_POLICY_MISMATCH, ("matching SPD does not permit IPsec processing") );
-			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input", ("return = %d", IPSEC_STATUS_FAILURE) );
+			IPSEC_LOG_AUD("ipsec_input_check_policy", IPSEC_AUDIT_POLICY_MISMATCH, ("matching SPD does not permit IPsec processing") );
+			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input_check_policy", ("return = %d", IPSEC_STATUS_FAILURE) );
 			return IPSEC_STATUS_FAILURE;
 	}
 
-	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input", ("return = %d", IPSEC_STATUS_SUCCESS) );
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input_check_policy", ("return = %d", IPSEC_STATUS_SUCCESS) );
 	return IPSEC_STATUS_SUCCESS;
 }
 
 
+/**
+ * IPsec input processing
+ *
+ * This function is called by the ipsec device driver when a packet arrives having AH or ESP in the 
+ * protocol field. A SA lookup gets the appropriate SA which is then passed to the packet processing 
+ * funciton ipsec_ah_check() or ipsec_esp_decapsulate(). After successfully processing an IPsec packet
+ * an check together with an SPD lookup verifies if the packet was processed acording the right SA.
+ *
+ * @param  packet         pointer used to access the intercepted original packet
+ * @param  packet_size    length of the intercepted packet
+ * @param  payload_offset pointer used to return offset of the new IP packet relative to original packet pointer
+ * @param  payload_size   pointer used to return total size of the new IP packet
+ * @param  databases      Collection of all security policy databases for the active IPsec device 
+ * @return int 			  return status code (see ipsec_input_chain())
+ */
+int ipsec_input(unsigned char *packet, int packet_size, 
+                int *payload_offset, int *payload_size, 
+				db_set_netif *databases)
+{
+	ipsec_buffer	segment ;
+
+	segment.next = NULL ;
+	segment.data = packet ;
+	segment.len = packet_size ;
+
+	return ipsec_input_chain(&segment, payload_offset, payload_size, databases) ;
+}
+
+
+/**
+ * IPsec input processing of a packet which is stored in a chain of buffers
+ *
+ * Works like ipsec_input(). The outer IP header and the AH or ESP header must be in the first
+ * segment, the rest of the packet may be spread over any number of segments.
+ *
+ * @param  chain          first segment of the intercepted original packet
+ * @param  payload_offset pointer used to return offset of the new IP packet relative to the start of the chain
+ * @param  payload_size   pointer used to return total size of the new IP packet
+ * @param  dbs            Collection of all security policy databases for the active IPsec device (db_set_netif)
+ * @return int 			  return status code
+ */
+int ipsec_input_chain(ipsec_buffer *chain, 
+                	  int *payload_offset, int *payload_size, 
+					  void *dbs)
+{
+	int ret_val 	= IPSEC_STATUS_NOT_INITIALIZED;	/* by default, the return value is undefined  */
+	db_set_netif	*databases = (db_set_netif *)dbs ;
+	sad_entry 		*sa ;
+	ipsec_ip_header	*ip ;
+	__u32			spi ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsec_input_chain", 
+				  ("chain=%p, *payload_offset=%d, *payload_size=%d databases=%p",
+			      (void *)chain, (int)*payload_offset, (int)*payload_size, (void *)databases)
+				 );
+
+	IPSEC_DUMP_BUFFER(" INBOUND ESP or AH:", chain->data, 0, chain->len);
+
+	if(chain->len < IPSEC_MIN_IPHDR_SIZE + 8)
+	{
+		IPSEC_LOG_DBG("ipsec_input_chain", IPSEC_STATUS_BAD_PACKET, ("IP and IPsec header must be in the first segment (%d bytes)", chain->len) );
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input_chain", ("return = %d", IPSEC_STATUS_BAD_PACKET) );
+		return IPSEC_STATUS_BAD_PACKET;
+	}
+	
+	ip = (ipsec_ip_header*)chain->data ;
+	spi = ipsec_sad_get_spi(ip) ;
+	sa = ipsec_sad_lookup(ip->dest, ip->protocol, spi, &databases->inbound_sad) ;
+
+	ret_val = ipsec_input_sa(chain, payload_offset, payload_size, sa) ;
+	if(ret_val == IPSEC_STATUS_SUCCESS)
+		ret_val = ipsec_input_check_policy(chain, *payload_offset, sa, databases) ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input_chain", ("return = %d", ret_val) );
+	return ret_val;
+}
+
+
+/**
+ * IPsec input processing of a batch of packets
+ *
+ * Every packet is processed like by ipsec_input_chain(), but the packets are grouped by SA: 
+ * the SA is looked up once for the first packet of a group and all the other packets of the
+ * batch with the same destination, protocol and SPI are processed together with it. This keeps 
+ * the SA (key schedule, HMAC state, replay window) in cache and lets ipsec_ah_check_batch() and 
+ * ipsec_esp_decapsulate_batch() calculate the HMACs of the group side by side. Within a group 
+ * the packets are processed in their original order.
+ *
+ * @param  packets        array of packets, returns payload_offset, payload_size and status of every packet
+ * @param  count          number of packets in the array
+ * @param  dbs            Collection of all security policy databases for the active IPsec device (db_set_netif)
+ * @return int 			  number of successfully processed packets
+ */
+int ipsec_input_batch(ipsec_packet *packets, int count, void *dbs)
+{
+	db_set_netif	*databases = (db_set_netif *)dbs ;
+	sad_entry 		*sa ;
+	ipsec_ip_header	*ip ;
+	ipsec_ip_header	*ip_next ;
+	ipsec_packet	*group[HASH_MULTI_MAX_LANES] ;
+	__u32			spi ;
+	int				i, j, n ;
+	int				processed = 0 ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsec_input_batch", 
+				  ("packets=%p, count=%d, databases=%p", (void *)packets, count, (void *)databases)
+				 );
+
+	for(i = 0; i < count; i++)
+		packets[i].status = IPSEC_STATUS_NOT_INITIALIZED ;
+
+	for(i = 0; i < count; i++)
+	{
+		/* packet was already processed as part of an earlier group */
+		if(packets[i].status != IPSEC_STATUS_NOT_INITIALIZED)
+			continue ;
+
+		if(packets[i].chain->len < IPSEC_MIN_IPHDR_SIZE + 8)
+		{
+			IPSEC_LOG_DBG("ipsec_input_batch", IPSEC_STATUS_BAD_PACKET, ("IP and IPsec header must be in the first segment (%d bytes)", packets[i].chain->len) );
+			packets[i].status = IPSEC_STATUS_BAD_PACKET ;
+			continue ;
+		}
+
+		ip = (ipsec_ip_header*)packets[i].chain->data ;
+		spi = ipsec_sad_get_spi(ip) ;
+		sa = ipsec_sad_lookup(ip->dest, ip->protocol, spi, &databases->inbound_sad) ;
+
+		/* the packets of a group are collected first, a larger group is split into several ones */
+		group[0] = &packets[i] ;
+		n = 1 ;
+		for(j = i + 1; (j < count) && (n < HASH_MULTI_MAX_LANES); j++)
+		{
+			if((packets[j].status != IPSEC_STATUS_NOT_INITIALIZED) || (packets[j].chain->len < IPSEC_MIN_IPHDR_SIZE + 8))
+				continue ;
+			ip_next = (ipsec_ip_header*)packets[j].chain->data ;
+			if((ip_next->dest != ip->dest) || (ip_next->protocol != ip->protocol) || (ipsec_sad_get_spi(ip_next) != spi))
+				continue ;
+			group[n++] = &packets[j] ;
+		}
+
+		if((n > 1) && (sa != NULL) && (sa->mode == IPSEC_TUNNEL) && (sa->protocol == IPSEC_PROTO_AH))
+			ipsec_ah_check_batch(group, n, sa) ;
+		else if((n > 1) && (sa != NULL) && (sa->mode == IPSEC_TUNNEL) && (sa->protocol == IPSEC_PROTO_ESP))
+			ipsec_esp_decapsulate_batch(group, n, sa) ;
+		else
+		{
+			for(j = 0; j < n; j++)
+				group[j]->status = ipsec_input_sa(group[j]->chain, &group[j]->payload_offset, &group[j]->payload_size, sa) ;
+		}
+
+		for(j = 0; j < n; j++)
+		{
+			if(group[j]->status == IPSEC_STATUS_SUCCESS)
+				group[j]->status = ipsec_input_check_policy(group[j]->chain, group[j]->payload_offset, sa, databases) ;
+			if(group[j]->status == IPSEC_STATUS_SUCCESS)
+				processed++ ;
+		}
+	}
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_input_batch", ("return = %d", processed) );
+	return processed ;
+}
+
+
+/**
+ * Returns the room ipsec_output() needs around an outbound packet
+ *
+ * The network device uses this to check whether a packet can be encapsulated in place or
+ * whether it must be copied into a larger buffer first. The values are the worst case for
+ * the SA of the SPD entry (e.g. maximum ESP padding).
+ *
+ * @param  spd            pointer to the SPD entry (spd_entry) which will be passed to ipsec_output()
+ * @param  headroom       pointer used to return the number of bytes needed in front of the packet
+ * @param  tailroom       pointer used to return the number of bytes needed after the packet
+ * @return IPSEC_STATUS_SUCCESS       if headroom and tailroom are set
+ * @return IPSEC_STATUS_NO_SA_FOUND   if the SPD entry has no SA
+ * @return IPSEC_STATUS_BAD_PROTOCOL  if the SA uses neither AH nor ESP
+ */
+int ipsec_output_overhead(void *spd, int *headroom, int *tailroom)
+{
+	sad_entry *sa ;
+
+	*headroom = 0 ;
+	*tailroom = 0 ;
+
+	if(spd == NULL)
+		return IPSEC_STATUS_NO_SA_FOUND ;
+	/* the SA of the policy is removed when it is deleted, so it is read once */
+	sa = *(sad_entry * volatile *)&((spd_entry *)spd)->sa ;
+	if(sa == NULL)
+		return IPSEC_STATUS_NO_SA_FOUND ;
+
+	switch(sa->protocol) {
+		case IPSEC_PROTO_AH:
+			ipsec_ah_get_overhead(sa, headroom, tailroom) ;
+			break ;
+		case IPSEC_PROTO_ESP:
+			ipsec_esp_get_overhead(sa, headroom, tailroom) ;
+			break ;
+		default:
+			return IPSEC_STATUS_BAD_PROTOCOL ;
+	}
+	return IPSEC_STATUS_SUCCESS ;
+}
+
+
 /**
  *  IPsec output processing
  *
@@ -188,68 +412,285 @@ int ipsec_input(unsigned char *packet, int packet_size,
  * @param  src            IP address of the local tunnel start point (external IP address)
  * @param  dst            IP address of the remote tunnel end point (external IP address)
  * @param  spd            pointer to security policy database where the rules for IPsec processing are stored
- * @return int 			  return status code
+ * @return int 			  return status code (see ipsec_output_chain())
  */
 int ipsec_output(unsigned char *packet, int packet_size, int *payload_offset, int *payload_size,
                  __u32 src, __u32 dst, spd_entry *spd)
+{
+	ipsec_buffer	segment ;
+
+	if(packet == NULL)
+	{
+		IPSEC_LOG_DBG("ipsec_output", IPSEC_STATUS_BAD_PACKET, ("bad packet ip=%p", (void *)packet) );
+ 	    return IPSEC_STATUS_BAD_PACKET;
+	}
+
+	segment.next = NULL ;
+	segment.data = packet ;
+	segment.len = packet_size ;
+
+	return ipsec_output_chain(&segment, payload_offset, payload_size, src, dst, spd) ;
+}
+
+
+/**
+ * Returns the SA of an SPD entry.
+ *
+ * The SA of an SPD entry may be replaced at any time by ipsec_spd_add_sa(), so the pointer is read 
+ * exactly once and the caller uses this snapshot for everything it does with the packet.
+ *
+ * @param  spd            pointer to the SPD entry (may be NULL)
+ * @return sad_entry *    SA of the SPD entry, NULL if there is none
+ */
+static sad_entry *ipsec_output_get_sa(spd_entry *spd)
+{
+	if(spd == NULL)
+		return NULL ;
+	return *(sad_entry * volatile *)&spd->sa ;
+}
+
+
+/**
+ * Checks whether an outbound packet can be encapsulated: the inner IP header must be in the first 
+ * segment and the chain must hold the whole packet.
+ *
+ * @param  chain          first segment of the intercepted original packet
+ * @return IPSEC_STATUS_SUCCESS      if the packet can be encapsulated
+ * @return IPSEC_STATUS_BAD_PACKET   if the packet is truncated or its IP header is not in the first segment
+ */
+static int ipsec_output_check(ipsec_buffer *chain)
+{
+	ipsec_ip_header		*ip = (ipsec_ip_header*)chain->data ;
+
+	if((ip == NULL) || (chain->len < IPSEC_MIN_IPHDR_SIZE) || (ipsec_ntohs(ip->len) > ipsec_buffer_len(chain)))
+		return IPSEC_STATUS_BAD_PACKET ;
+	return IPSEC_STATUS_SUCCESS ;
+}
+
+
+/**
+ *  IPsec output processing of a packet with a given SA
+ *
+ * Encapsulates the packet like ipsec_output_chain(), but with the SA which the caller read from the
+ * SPD entry (and used e.g. to reserve the sequence number). Only the SA is accessed, so packets of 
+ * different SAs may be processed concurrently.
+ *
+ * @param  chain          first segment of the intercepted original packet
+ * @param  payload_offset pointer used to return offset of the new IP packet relative to the first segment
+ * @param  payload_size   pointer used to return total size of the new IP packet
+ * @param  src            IP address of the local tunnel start point (external IP address)
+ * @param  dst            IP address of the remote tunnel end point (external IP address)
+ * @param  sa_ptr         SA (sad_entry) of the SPD entry which applies to the packet (may be NULL)
+ * @param  sequence       sequence number reserved by ipsec_sad_next_sequence() on this SA, 0 to reserve the next one of the SA
+ * @return int 			  return status code
+ */
+int ipsec_output_sa(ipsec_buffer *chain, int *payload_offset, int *payload_size,
+                 	__u32 src, __u32 dst, void *sa_ptr, __u32 sequence)
 {
 	int ret_val = IPSEC_STATUS_NOT_INITIALIZED;		/* by default, the return value is undefined */
-	ipsec_ip_header		*ip ;
+	sad_entry			*sa = (sad_entry *)sa_ptr ;
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
-	              "ipsec_output", 
-				  ("*packet=%p, packet_size=%d, len=%u, *payload_offset=%d, *payload_size=%d src=%lx dst=%lx *spd=%p",
-			      (void *)packet, packet_size, *payload_offset, *payload_size, (__u32) src, (__u32) dst, (void *)spd)
+	              "ipsec_output_sa", 
+				  ("chain=%p, *payload_offset=%d, *payload_size=%d src=%lx dst=%lx *sa=%p sequence=%lu",
+			      (void *)chain, *payload_offset, *payload_size, (__u32) src, (__u32) dst, (void *)sa, sequence)
 				 );
 
-	ip = (ipsec_ip_header*)packet;
-
-	if((ip == NULL) || (ipsec_ntohs(ip->len) > packet_size)) 
+	if(ipsec_output_check(chain) != IPSEC_STATUS_SUCCESS) 
 	{
-		IPSEC_LOG_DBG("ipsec_output", IPSEC_STATUS_NOT_IMPLEMENTED, ("bad packet ip=%p, ip->len=%d (must not be >%d bytes)", (void *)ip, ipsec_ntohs(ip->len), packet_size) );
+		IPSEC_LOG_DBG("ipsec_output_sa", IPSEC_STATUS_NOT_IMPLEMENTED, ("bad packet ip=%p (must not be longer than the chain of %d bytes)", (void *)chain->data, ipsec_buffer_len(chain)) );
 
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_output", ("return = %d", IPSEC_STATUS_BAD_PACKET) );
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_output_sa", ("return = %d", IPSEC_STATUS_BAD_PACKET) );
  	    return IPSEC_STATUS_BAD_PACKET;
 	}
 	
-	if((spd == NULL) || (spd->sa == NULL))
+	if(sa == NULL)
 	{
 		/** @todo invoke IKE to generate a proper SA for this SPD entry */
-		IPSEC_LOG_DBG("ipsec_output", IPSEC_STATUS_NOT_IMPLEMENTED, ("unable to generate dynamically an SA (IKE not implemented)") );
+		IPSEC_LOG_DBG("ipsec_output_sa", IPSEC_STATUS_NOT_IMPLEMENTED, ("unable to generate dynamically an SA (IKE not implemented)") );
 
-		IPSEC_LOG_AUD("ipsec_output", IPSEC_STATUS_NO_SA_FOUND, ("no SA or SPD defined")) ;
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_output", ("return = %d", IPSEC_STATUS_NO_SA_FOUND) );
+		IPSEC_LOG_AUD("ipsec_output_sa", IPSEC_STATUS_NO_SA_FOUND, ("no SA or SPD defined")) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_output_sa", ("return = %d", IPSEC_STATUS_NO_SA_FOUND) );
  	    return IPSEC_STATUS_NO_SA_FOUND;
 	}
 
-	switch(spd->sa->protocol) {
+	switch(sa->protocol) {
 		case IPSEC_PROTO_AH:
-				IPSEC_LOG_MSG("ipsec_output", ("have to encapsulate an AH packet")) ;
-				ret_val = ipsec_ah_encapsulate((ipsec_ip_header *)packet, payload_offset, payload_size, spd->sa, src, dst);
+				IPSEC_LOG_MSG("ipsec_output_sa", ("have to encapsulate an AH packet")) ;
+				ret_val = ipsec_ah_encapsulate_chain(chain, payload_offset, payload_size, sa, src, dst, sequence);
 		
 				if(ret_val != IPSEC_STATUS_SUCCESS) 
 				{
-					IPSEC_LOG_ERR("ipsec_output", ret_val, ("ipsec_ah_encapsulate() failed"));
+					IPSEC_LOG_ERR("ipsec_output_sa", ret_val, ("ipsec_ah_encapsulate() failed"));
 				}
 			break;
 
 		case IPSEC_PROTO_ESP:
-				IPSEC_LOG_MSG("ipsec_output", ("have to encapsulate an ESP packet")) ;
-				ret_val = ipsec_esp_encapsulate((ipsec_ip_header *)packet, payload_offset, payload_size, spd->sa, src, dst);
+				IPSEC_LOG_MSG("ipsec_output_sa", ("have to encapsulate an ESP packet")) ;
+				ret_val = ipsec_esp_encapsulate_chain(chain, payload_offset, payload_size, sa, src, dst, sequence);
 			
 				if(ret_val != IPSEC_STATUS_SUCCESS) 
 				{
-					IPSEC_LOG_ERR("ipsec_output", ret_val, ("ipsec_esp_encapsulate() failed"));
+					IPSEC_LOG_ERR("ipsec_output_sa", ret_val, ("ipsec_esp_encapsulate() failed"));
 				}
 			break;
 
 		default:
 				ret_val = IPSEC_STATUS_BAD_PROTOCOL;
-				IPSEC_LOG_ERR("ipsec_output", ret_val, ("unsupported protocol '%d' in spd->sa->protocol", spd->sa->protocol));
+				IPSEC_LOG_ERR("ipsec_output_sa", ret_val, ("unsupported protocol '%d' in sa->protocol", sa->protocol));
 	}
 
-	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_output", ("ret_val=%d", ret_val) );
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_output_sa", ("ret_val=%d", ret_val) );
 	return ret_val;
 }
 
 
+/**
+ *  IPsec output processing of a packet which is stored in a chain of buffers
+ *
+ * Works like ipsec_output(). The inner IP header must be in the first segment. The new headers
+ * are written in front of the first segment and ESP appends its trailer to the segment holding 
+ * the end of the packet (see ipsec_output_overhead()).
+ *
+ * @param  chain          first segment of the intercepted original packet
+ * @param  payload_offset pointer used to return offset of the new IP packet relative to the first segment
+ * @param  payload_size   pointer used to return total size of the new IP packet
+ * @param  src            IP address of the local tunnel start point (external IP address)
+ * @param  dst            IP address of the remote tunnel end point (external IP address)
+ * @param  policy         pointer to the SPD entry (spd_entry) where the rules for IPsec processing are stored
+ * @return int 			  return status code
+ */
+int ipsec_output_chain(ipsec_buffer *chain, int *payload_offset, int *payload_size,
+                 	   __u32 src, __u32 dst, void *policy)
+{
+	return ipsec_output_sa(chain, payload_offset, payload_size, src, dst, ipsec_output_get_sa((spd_entry *)policy), 0) ;
+}
+
+
+/**
+ * Counts the successfully processed packets of a part of a batch.
+ *
+ * @param  packets        array of pointers to the packets
+ * @param  count          number of packets in the array
+ * @return int 			  number of packets with the status IPSEC_STATUS_SUCCESS
+ */
+static int ipsec_output_count(ipsec_packet **packets, int count)
+{
+	int i, n = 0 ;
+
+	for(i = 0; i < count; i++)
+	{
+		if(packets[i]->status == IPSEC_STATUS_SUCCESS)
+			n++ ;
+	}
+	return n ;
+}
+
+
+/**
+ * IPsec output processing of a batch of packets
+ *
+ * Every packet is processed like by ipsec_output_chain() with the SPD entry given in 
+ * packets[i].spd. The packets are grouped by SA: all packets of the batch which use the same 
+ * SA are encapsulated right after each other (in their original order), so the key schedule 
+ * and the HMAC state stay in cache. The sequence numbers of a group are reserved as one block 
+ * (ipsec_sad_next_sequence()), if the SA has not enough of them left, all packets of the group 
+ * fail with IPSEC_STATUS_SEQ_EXHAUSTED. The ESP packets of a group are passed to 
+ * ipsec_esp_encapsulate_batch() (up to IPSEC_ESP_BATCH_SIZE at a time).
+ *
+ * @param  packets        array of packets, returns payload_offset, payload_size and status of every packet
+ * @param  count          number of packets in the array
+ * @param  src            IP address of the local tunnel start point (external IP address)
+ * @param  dst            IP address of the remote tunnel end point (external IP address)
+ * @return int 			  number of successfully processed packets
+ */
+int ipsec_output_batch(ipsec_packet *packets, int count, __u32 src, __u32 dst)
+{
+	sad_entry 		*sa ;
+	int				i, j ;
+	int				group ;
+	ipsec_packet	*batch[IPSEC_ESP_BATCH_SIZE] ;
+	int				n ;
+	__u32			sequence ;
+	__u32			batch_sequence = 0 ;
+	int				processed = 0 ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsec_output_batch", 
+				  ("packets=%p, count=%d, src=%lx dst=%lx", (void *)packets, count, (__u32) src, (__u32) dst)
+				 );
+
+	/* the SA of every packet is read once, the sequence numbers are reserved on the SA it is encapsulated with */
+	for(i = 0; i < count; i++)
+	{
+		packets[i].status = IPSEC_STATUS_NOT_INITIALIZED ;
+		packets[i].sa = ipsec_output_get_sa((spd_entry *)packets[i].spd) ;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		/* packet was already processed as part of an earlier group */
+		if(packets[i].status != IPSEC_STATUS_NOT_INITIALIZED)
+			continue ;
+
+		sa = (sad_entry *)packets[i].sa ;
+
+		/* reserve the sequence numbers of the whole group at once */
+		sequence = 0 ;
+		if(sa != NULL)
+		{
+			group = 0 ;
+			for(j = i; j < count; j++)
+			{
+				if((packets[j].status == IPSEC_STATUS_NOT_INITIALIZED) && (packets[j].sa == sa))
+					group++ ;
+			}
+			if(ipsec_sad_next_sequence(sa, group, &sequence) != IPSEC_STATUS_SUCCESS)
+				sequence = 0 ;
+		}
+
+		n = 0 ;
+		for(j = i; j < count; j++)
+		{
+			if((j != i) && ((packets[j].status != IPSEC_STATUS_NOT_INITIALIZED) || (packets[j].sa != sa)))
+				continue ;
+
+			if((sa != NULL) && (sequence == 0))
+			{
+				packets[j].status = IPSEC_STATUS_SEQ_EXHAUSTED ;
+				continue ;
+			}
+
+			/* the ESP packets of the group are encapsulated together (3DES-CBC encrypts them side by side) */
+			if((sa != NULL) && (sa->protocol == IPSEC_PROTO_ESP) && (ipsec_output_check(packets[j].chain) == IPSEC_STATUS_SUCCESS))
+			{
+				if(n == 0)
+					batch_sequence = sequence ;
+				batch[n++] = &packets[j] ;
+				sequence++ ;
+				if(n == IPSEC_ESP_BATCH_SIZE)
+				{
+					ipsec_esp_encapsulate_batch(batch, n, sa, src, dst, batch_sequence) ;
+					processed += ipsec_output_count(batch, n) ;
+					n = 0 ;
+				}
+				continue ;
+			}
+
+			packets[j].status = ipsec_output_sa(packets[j].chain, &packets[j].payload_offset, &packets[j].payload_size, 
+			                                    src, dst, sa, sequence) ;
+			if(sequence != 0)
+				sequence++ ;
+			if(packets[j].status == IPSEC_STATUS_SUCCESS)
+				processed++ ;
+		}
+		if(n > 0)
+		{
+			ipsec_esp_encapsulate_batch(batch, n, sa, src, dst, batch_sequence) ;
+			processed += ipsec_output_count(batch, n) ;
+		}
+	}
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_output_batch", ("return = %d", processed) );
+	return processed ;
+}
@@ -0,0 +1,351 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file ivgen.c
+ *  @brief Random number generator (buffered CTR-DRBG) and per-packet IV generator
+ *
+ *  <B>OUTLINE:</B>
+ *  The following functions are implemented in this module:
+ *   - ipsec_drbg_set_entropy(): sets the entropy source used to seed the generators
+ *   - ipsec_drbg_seed(): (re)seeds a generator
+ *   - ipsec_drbg_generate(): returns random bytes from the buffer of a generator
+ *   - ipsec_ivgen_random(): returns random bytes from the generator of a thread
+ *   - ipsec_ivgen_prepare(): draws the secret IV salt of an SA
+ *   - ipsec_ivgen_packet(): returns the IV of an outbound packet
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *  The generator is the CTR-DRBG of NIST SP 800-90A with AES-128 and without derivation function. 
+ *  A refill runs one generate call for IPSEC_DRBG_BUFFER_SIZE bytes at a time, so most requests 
+ *  are a copy from the buffer. New entropy is fetched after IPSEC_DRBG_RESEED_INTERVAL refills. 
+ *  There is one generator per thread (IPSEC_IVGEN_CONTEXTS), so no locks are needed.
+ *
+ *  The IV of a packet does not use the generator at all: a CBC IV is the encryption of the 
+ *  sequence number XORed into the random salt of the SA (NIST SP 800-38A, appendix C), which 
+ *  is unpredictable and costs one block of the cipher. CTR, GCM and ChaCha20-Poly1305 only need 
+ *  a unique IV, the sequence number is used. The sequence numbers are reserved atomically, so the 
+ *  IVs of one SA can be built by several threads at the same time.
+ *
+ *  <B>NOTES:</B>
+ *  The entropy source defaults to getrandom() on Linux. Embedded targets must set one with 
+ *  ipsec_drbg_set_entropy() (e.g. a hardware RNG), without it the salts stay zero and the IVs 
+ *  repeat after a restart if the keys are configured statically.
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/ivgen.h"
+#include "ipsec/des.h"
+#include "ipsec/esp.h"
+#include "ipsec/debug.h"
+
+#ifdef IPSEC_DRBG_GETRANDOM
+#include <errno.h>
+#include <sys/random.h>
+#endif
+
+
+#ifdef IPSEC_DRBG_GETRANDOM
+/**
+ * Default entropy source on Linux: the kernel's random number generator.
+ *
+ * @param buffer	returns the random bytes
+ * @param len		number of bytes needed
+ * @return 0 if the buffer was filled, -1 otherwise
+ */
+static int ipsec_drbg_getrandom(unsigned char *buffer, int len)
+{
+	int done = 0 ;
+	int ret ;
+
+	while(done < len)
+	{
+		ret = (int)getrandom(buffer + done, len - done, 0) ;
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue ;
+			return -1 ;
+		}
+		done += ret ;
+	}
+	return 0 ;
+}
+
+static ipsec_entropy_hook ipsec_drbg_entropy = ipsec_drbg_getrandom ;	/**< entropy source used to seed the generators */
+#else
+static ipsec_entropy_hook ipsec_drbg_entropy = NULL ;					/**< entropy source used to seed the generators */
+#endif
+
+static ipsec_drbg ipsec_ivgen_ctx[IPSEC_IVGEN_CONTEXTS] ;		/**< generators of the threads (see ipsec_ivgen_random()) */
+
+
+/**
+ * Increments the counter V of a DRBG (a 128 bit big endian number).
+ *
+ * @param v		counter
+ * @return void
+ */
+static void ipsec_drbg_increment(unsigned char *v)
+{
+	int i ;
+
+	for(i = AES_BLOCK_SIZE-1; i >= 0; i--)
+		if(++v[i] != 0)
+			break ;
+}
+
+/**
+ * Update function of the CTR-DRBG (SP 800-90A, 10.2.1.2): derives a new key and V from the 
+ * current ones and the provided data.
+ *
+ * @param drbg		generator
+ * @param data		IPSEC_DRBG_SEED_LEN bytes which are mixed in (NULL for zeros)
+ * @return void
+ */
+static void ipsec_drbg_update(ipsec_drbg *drbg, unsigned char *data)
+{
+	unsigned char temp[IPSEC_DRBG_SEED_LEN] ;
+	int i ;
+
+	for(i = 0; i < IPSEC_DRBG_SEED_LEN; i += AES_BLOCK_SIZE)
+	{
+		ipsec_drbg_increment(drbg->v) ;
+		cipher_aes_encrypt(&drbg->key, drbg->v, temp + i) ;
+	}
+	if(data != NULL)
+		for(i = 0; i < IPSEC_DRBG_SEED_LEN; i++)
+			temp[i] ^= data[i] ;
+
+	cipher_aes_set_key(temp, AES_BLOCK_SIZE, &drbg->key) ;
+	memcpy(drbg->v, temp + AES_BLOCK_SIZE, AES_BLOCK_SIZE) ;
+	memset(temp, 0, sizeof(temp)) ;
+}
+
+/**
+ * Sets the entropy source used to seed the generators.
+ *
+ * @param hook	entropy source (NULL: no entropy, the generators cannot be seeded)
+ * @return the entropy source used before
+ */
+ipsec_entropy_hook ipsec_drbg_set_entropy(ipsec_entropy_hook hook)
+{
+	ipsec_entropy_hook previous = ipsec_drbg_entropy ;
+
+	ipsec_drbg_entropy = hook ;
+	return previous ;
+}
+
+/**
+ * Seeds a generator with IPSEC_DRBG_SEED_LEN bytes from the entropy source (SP 800-90A, 
+ * 10.2.1.3.1), or reseeds it if it was seeded before (10.2.1.4.1). The buffer is emptied.
+ *
+ * @param drbg		generator
+ * @param data		personalization string or additional input which is mixed in (may be NULL)
+ * @param len		length of data (at most IPSEC_DRBG_SEED_LEN bytes are used)
+ * @return IPSEC_STATUS_SUCCESS		if the generator was seeded
+ * @return IPSEC_STATUS_FAILURE		if there is no entropy source or it failed (the generator is not seeded then)
+ */
+ipsec_status ipsec_drbg_seed(ipsec_drbg *drbg, unsigned char *data, int len)
+{
+	unsigned char seed[IPSEC_DRBG_SEED_LEN] ;
+	unsigned char zero[AES_BLOCK_SIZE] ;
+	int i ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsec_drbg_seed", 
+				  ("drbg=%p, data=%p, len=%d",
+			      (void *)drbg, (void *)data, len)
+				 );
+
+	if((ipsec_drbg_entropy == NULL) || (ipsec_drbg_entropy(seed, IPSEC_DRBG_SEED_LEN) != 0))
+	{
+		drbg->seeded = 0 ;
+		IPSEC_LOG_ERR("ipsec_drbg_seed", IPSEC_STATUS_FAILURE, ("no entropy to seed the random number generator")) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_drbg_seed", ("return = %d", IPSEC_STATUS_FAILURE) );
+		return IPSEC_STATUS_FAILURE ;
+	}
+
+	if(data != NULL)
+		for(i = 0; (i < len) && (i < IPSEC_DRBG_SEED_LEN); i++)
+			seed[i] ^= data[i] ;
+
+	if(!drbg->seeded)
+	{
+		/* instantiate: key and V start at zero */
+		memset(zero, 0, AES_BLOCK_SIZE) ;
+		memset(drbg->v, 0, AES_BLOCK_SIZE) ;
+		cipher_aes_set_key(zero, AES_BLOCK_SIZE, &drbg->key) ;
+	}
+	ipsec_drbg_update(drbg, seed) ;
+	memset(seed, 0, sizeof(seed)) ;
+
+	drbg->pos = IPSEC_DRBG_BUFFER_SIZE ;
+	drbg->refills = 0 ;
+	drbg->seeded = 1 ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_drbg_seed", ("return = %d", IPSEC_STATUS_SUCCESS) );
+	return IPSEC_STATUS_SUCCESS ;
+}
+
+/**
+ * Returns random bytes of a generator. They are taken from the buffer, which is refilled by one 
+ * generate call of the CTR-DRBG (SP 800-90A, 10.2.1.5.1) when it runs empty. The generator is 
+ * seeded on first use and reseeded after IPSEC_DRBG_RESEED_INTERVAL refills.
+ *
+ * A generator must not be used by several threads at the same time.
+ *
+ * @param drbg		generator
+ * @param output	returns the random bytes
+ * @param len		number of bytes needed
+ * @return IPSEC_STATUS_SUCCESS		if len random bytes were returned
+ * @return IPSEC_STATUS_FAILURE		if the generator could not be seeded
+ */
+ipsec_status ipsec_drbg_generate(ipsec_drbg *drbg, unsigned char *output, int len)
+{
+	int n ;
+	int i ;
+
+	while(len > 0)
+	{
+		/* a generator which was never seeded (e.g. zero initialized) has no valid buffer either */
+		if(!drbg->seeded || (drbg->pos == IPSEC_DRBG_BUFFER_SIZE))
+		{
+			if((!drbg->seeded || (drbg->refills == IPSEC_DRBG_RESEED_INTERVAL)) && 
+			   (ipsec_drbg_seed(drbg, NULL, 0) != IPSEC_STATUS_SUCCESS))
+				return IPSEC_STATUS_FAILURE ;
+
+			for(i = 0; i < IPSEC_DRBG_BUFFER_SIZE; i += AES_BLOCK_SIZE)
+			{
+				ipsec_drbg_increment(drbg->v) ;
+				cipher_aes_encrypt(&drbg->key, drbg->v, drbg->buffer + i) ;
+			}
+			/* backtracking resistance: the state which produced the buffer is replaced */
+			ipsec_drbg_update(drbg, NULL) ;
+			drbg->refills++ ;
+			drbg->pos = 0 ;
+		}
+
+		n = IPSEC_DRBG_BUFFER_SIZE - drbg->pos ;
+		if(n > len)
+			n = len ;
+		memcpy(output, drbg->buffer + drbg->pos, n) ;
+		/* bytes which were handed out are not kept */
+		memset(drbg->buffer + drbg->pos, 0, n) ;
+		drbg->pos += n ;
+		output += n ;
+		len -= n ;
+	}
+
+	return IPSEC_STATUS_SUCCESS ;
+}
+
+/**
+ * Returns random bytes from the generator of a thread.
+ *
+ * @param context	generator: the reader number of the calling thread (see ipsec_db_enter()) or 
+ *                  IPSEC_IVGEN_SETUP (ipsec_sad_prepare())
+ * @param output	returns the random bytes
+ * @param len		number of bytes needed
+ * @return IPSEC_STATUS_SUCCESS		if len random bytes were returned
+ * @return IPSEC_STATUS_FAILURE		if the generator could not be seeded or context is out of range
+ */
+ipsec_status ipsec_ivgen_random(int context, unsigned char *output, int len)
+{
+	if((context < 0) || (context >= IPSEC_IVGEN_CONTEXTS))
+		return IPSEC_STATUS_FAILURE ;
+
+	return ipsec_drbg_generate(&ipsec_ivgen_ctx[context], output, len) ;
+}
+
+/**
+ * Draws the random IV salt of an SA (see ipsec_ivgen_packet()). Called by ipsec_sad_prepare().
+ *
+ * @param sa		SA
+ * @return IPSEC_STATUS_SUCCESS		if the salt is random
+ * @return IPSEC_STATUS_FAILURE		if there was no entropy, the salt is zero then
+ */
+ipsec_status ipsec_ivgen_prepare(sad_entry *sa)
+{
+	if(ipsec_ivgen_random(IPSEC_IVGEN_SETUP, sa->iv_salt, AES_BLOCK_SIZE) != IPSEC_STATUS_SUCCESS)
+	{
+		memset(sa->iv_salt, 0, AES_BLOCK_SIZE) ;
+		return IPSEC_STATUS_FAILURE ;
+	}
+	return IPSEC_STATUS_SUCCESS ;
+}
+
+/**
+ * Returns the IV of an outbound ESP packet. CBC IVs must be unpredictable (RFC 2451, 3 and 
+ * RFC 3602, 3): the sequence number XORed into the salt of the SA is encrypted with the key of 
+ * the SA. CTR, GCM and ChaCha20-Poly1305 IVs must never repeat for a key (RFC 3686, 2.1, 
+ * RFC 4106, 3.1 and RFC 7634, 2): the sequence number is used.
+ *
+ * @param sa		SA with key schedules (see ipsec_sad_prepare())
+ * @param sequence	sequence number of the packet
+ * @param iv		returns the IV (as long as the IV size of the algorithm)
+ * @return void
+ */
+void ipsec_ivgen_packet(sad_entry *sa, __u32 sequence, unsigned char *iv)
+{
+	unsigned char block[AES_BLOCK_SIZE] ;
+	unsigned char zero[IPSEC_ESP_IV_SIZE] ;
+
+	switch(sa->enc_alg)
+	{
+		case IPSEC_3DES:
+			memcpy(block, sa->iv_salt, IPSEC_ESP_IV_SIZE) ;
+			block[4] ^= (unsigned char)(sequence >> 24) ;
+			block[5] ^= (unsigned char)(sequence >> 16) ;
+			block[6] ^= (unsigned char)(sequence >> 8) ;
+			block[7] ^= (unsigned char)sequence ;
+			memset(zero, 0, IPSEC_ESP_IV_SIZE) ;
+			cipher_3des_cbc_ks(block, IPSEC_ESP_IV_SIZE, sa->enc_ctx.des, zero, DES_ENCRYPT, iv) ;
+			break ;
+		case IPSEC_AES_128_CBC:
+		case IPSEC_AES_256_CBC:
+			memcpy(block, sa->iv_salt, AES_BLOCK_SIZE) ;
+			block[12] ^= (unsigned char)(sequence >> 24) ;
+			block[13] ^= (unsigned char)(sequence >> 16) ;
+			block[14] ^= (unsigned char)(sequence >> 8) ;
+			block[15] ^= (unsigned char)sequence ;
+			cipher_aes_encrypt(&sa->enc_ctx.aes, block, iv) ;
+			break ;
+		default:
+			memset(iv, 0, IPSEC_ESP_IV_SIZE) ;
+			iv[4] = (unsigned char)(sequence >> 24) ;
+			iv[5] = (unsigned char)(sequence >> 16) ;
+			iv[6] = (unsigned char)(sequence >> 8) ;
+			iv[7] = (unsigned char)sequence ;
+			break ;
+	}
+}
@@ -103,6 +103,11 @@ void md5_block_data_order (MD5_CTX *c, const void *p,int num);
 #define ROTATE(a,n)	_lrol_(a,n)
 #endif
 
+// *** any other compiler ***
+#ifndef ROTATE
+#define ROTATE(a,n)	((((a)<<(n))|(((a)&0xffffffffUL)>>(32-(n))))&0xffffffffUL)
+#endif
+
 
 #ifdef ROTATE
 /* 5 instructions with rotate instruction, else 9 */
@@ -215,9 +220,9 @@ void MD5_Update (MD5_CTX *c, const void *data_, unsigned long len)
 	sw=(int) (len/MD5_CBLOCK);
 	if (sw > 0)
 		{
-		if ((((unsigned long)data)%4) == 0)
+		if ((sizeof(MD5_LONG) == 4) && ((((unsigned long)data)%4) == 0))
 			{
-			/* data is properly aligned so that we can cast it: */
+			/* data is properly aligned (and the words are 32 bit wide) so that we can cast it: */
 			md5_block_host_order (c,(MD5_LONG *)data,sw);
 			sw*=MD5_CBLOCK;
 			data+=sw;
@@ -250,8 +255,8 @@ void MD5_Update (MD5_CTX *c, const void *data_, unsigned long len)
 
 void MD5_Transform (MD5_CTX *c, const unsigned char *data)
 {
-	if ((((unsigned long)data)%4) == 0)
-		/* data is properly aligned so that we can cast it: */
+	if ((sizeof(MD5_LONG) == 4) && ((((unsigned long)data)%4) == 0))
+		/* data is properly aligned (and the words are 32 bit wide) so that we can cast it: */
 		md5_block_host_order (c,(MD5_LONG *)data,1);
 	else
 	md5_block_data_order (c,data,1);
@@ -545,32 +550,31 @@ void md5_block_data_order (MD5_CTX *c, const void *data_, int num)
 
 
 
- /**
- * RFC 2104 hmac_md5 function calculates a digest from a given data buffer and a given key.
+/**
+ * Precomputes the HMAC-MD5 state of a key (RFC 2104). The key is padded and XORed with ipad 
+ * and opad and both pad blocks are absorbed into a MD5 context. The resulting state can be stored
+ * (e.g. in the SAD entry) and used by hmac_md5_precomputed() for every packet, which saves two
+ * MD5 block operations per packet.
  *
- * @param text		pointer to data stream
- * @param text_len	length of data stream
+ * @param hctx		pointer to the HMAC context which is set up
  * @param key		pointer to authentication key
  * @param key_len	length of authentication key
- * @param digest	caller digest to be filled in 128-bit
  * @return void
  *
  */
-void hmac_md5(unsigned char* text, int text_len, unsigned char*  key, int key_len, unsigned char*  digest)
+void hmac_md5_init(HMAC_MD5_CTX* hctx, unsigned char*  key, int key_len)
 {
-    MD5_CTX context;
     unsigned char k_ipad[65];    /* inner padding - key XORd with ipad */
     unsigned char k_opad[65];    /* outer padding - key XORd with opad */
     unsigned char tk[16];	 	 /* L=16 for MD5 (RFC 2141, 2. Definition of HMAC) */
     int i;
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
-	              "hmac_md5", 
-				  ("text=%p, text_len=%d, key=%p, key_len=%d, digest=%p",
-			      (void *)text, text_len, (void *)key, key_len, (void *)digest)
+	              "hmac_md5_init", 
+				  ("hctx=%p, key=%p, key_len=%d",
+			      (void *)hctx, (void *)key, key_len)
 				 );
 
-
     /* if key is longer than 64 bytes reset it to key=MD5(key) */
     if (key_len > 64) {
 
@@ -584,46 +588,153 @@ void hmac_md5(unsigned char* text, int text_len, unsigned char*  key, int key_le
             key_len = 16;
     }
 
-    /*
-     * the HMAC_MD5 transform looks like:
-     *
-     * MD5(K XOR opad, MD5(K XOR ipad, text))
-     *
-     * where K is an n byte key
-     * ipad is the byte 0x36 repeated 64 times
-     * opad is the byte 0x5c repeated 64 times
-     * and text is the data being protected
-     */
-
     /* start out by storing key in pads */
     memset(k_ipad, '\0', sizeof(k_ipad));
     memset(k_opad, '\0', sizeof(k_opad));
     memcpy(k_ipad, key, key_len);
     memcpy(k_opad, key, key_len);
 
-
     /* XOR key with ipad and opad values */
     for (i=0; i<64; i++) {
             k_ipad[i] ^= 0x36;
             k_opad[i] ^= 0x5c;
     }
+
+    MD5_Init(&hctx->inner);              /* inner context starts with inner pad */
+    MD5_Update(&hctx->inner, k_ipad, 64);
+    MD5_Init(&hctx->outer);              /* outer context starts with outer pad */
+    MD5_Update(&hctx->outer, k_opad, 64);
+
+	/* do not leave key material on the stack */
+    memset(k_ipad, '\0', sizeof(k_ipad));
+    memset(k_opad, '\0', sizeof(k_opad));
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_md5_init", ("void") );
+}
+
+/**
+ * Calculates an HMAC-MD5 digest using a state precomputed by hmac_md5_init().
+ * The precomputed state is not modified, so it can be used for any number of digests.
+ *
+ * @param hctx		pointer to the precomputed HMAC context
+ * @param text		pointer to data stream
+ * @param text_len	length of data stream
+ * @param digest	caller digest to be filled in (128-bit)
+ * @return void
+ *
+ */
+void hmac_md5_precomputed(HMAC_MD5_CTX* hctx, unsigned char* text, int text_len, unsigned char*  digest)
+{
+    MD5_CTX context;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "hmac_md5_precomputed", 
+				  ("hctx=%p, text=%p, text_len=%d, digest=%p",
+			      (void *)hctx, (void *)text, text_len, (void *)digest)
+				 );
+
+    /*
+     * perform inner MD5
+     */
+    memcpy(&context, &hctx->inner, sizeof(MD5_CTX));
+    MD5_Update(&context, text, text_len);       /* text of datagram */
+    MD5_Final(digest, &context);                /* finish up 1st pass */
+    /*
+     * perform outer MD5
+     */
+    memcpy(&context, &hctx->outer, sizeof(MD5_CTX));
+    MD5_Update(&context, digest, 16);          /* results of 1st hash */
+    MD5_Final(digest, &context);                /* finish up 2nd pass */
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_md5_precomputed", ("void") );
+}
+
+/**
+ * Calculates an HMAC-MD5 digest over a part of a chain of buffers using a state precomputed 
+ * by hmac_md5_init(). The segments are hashed one after the other, so the data need not be 
+ * contiguous.
+ *
+ * @param hctx		pointer to the precomputed HMAC context
+ * @param chain		first segment of the chain
+ * @param offset	offset of the first byte to hash relative to the start of the chain
+ * @param len		number of bytes to hash
+ * @param digest	caller digest to be filled in (128-bit)
+ * @return void
+ *
+ */
+void hmac_md5_chain(HMAC_MD5_CTX* hctx, ipsec_buffer *chain, int offset, int len, unsigned char*  digest)
+{
+    MD5_CTX context;
+	int n;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "hmac_md5_chain", 
+				  ("hctx=%p, chain=%p, offset=%d, len=%d, digest=%p",
+			      (void *)hctx, (void *)chain, offset, len, (void *)digest)
+				 );
+
     /*
      * perform inner MD5
      */
-    MD5_Init(&context);                  /* init context for 1st
-                                          * pass */
-    MD5_Update(&context, k_ipad, 64);    /* start with inner pad */
-    MD5_Update(&context, text, text_len);/* then text of datagram */
-    MD5_Final(digest, &context);         /* finish up 1st pass */
+    memcpy(&context, &hctx->inner, sizeof(MD5_CTX));
+	for(; (chain != NULL) && (len > 0); chain = chain->next)
+	{
+		if(offset >= chain->len)
+		{
+			offset -= chain->len;
+			continue;
+		}
+		n = chain->len - offset;
+		if(n > len) n = len;
+	    MD5_Update(&context, chain->data + offset, n);	/* text of datagram in this segment */
+		len -= n;
+		offset = 0;
+	}
+    MD5_Final(digest, &context);                /* finish up 1st pass */
     /*
      * perform outer MD5
      */
-    MD5_Init(&context);                  /* init context for 2nd
-                                          * pass */
-    MD5_Update(&context, k_opad, 64);    /* start with outer pad */
-    MD5_Update(&context, digest, 16);    /* then results of 1st
-                                          * hash */
-    MD5_Final(digest, &context);         /* finish up 2nd pass */
+    memcpy(&context, &hctx->outer, sizeof(MD5_CTX));
+    MD5_Update(&context, digest, 16);          /* results of 1st hash */
+    MD5_Final(digest, &context);                /* finish up 2nd pass */
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_md5_chain", ("void") );
+}
+
+/**
+ * RFC 2104 hmac_md5 function calculates a digest from a given data buffer and a given key.
+ * If the same key is used more than once, use hmac_md5_init() and hmac_md5_precomputed() instead.
+ *
+ * @param text		pointer to data stream
+ * @param text_len	length of data stream
+ * @param key		pointer to authentication key
+ * @param key_len	length of authentication key
+ * @param digest	caller digest to be filled in (128-bit)
+ * @return void
+ *
+ */
+void hmac_md5(unsigned char* text, int text_len, unsigned char*  key, int key_len, unsigned char*  digest)
+{
+    HMAC_MD5_CTX hctx;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "hmac_md5", 
+				  ("text=%p, text_len=%d, key=%p, key_len=%d, digest=%p",
+			      (void *)text, text_len, (void *)key, key_len, (void *)digest)
+				 );
+
+    /*
+     * the HMAC_MD5 transform looks like:
+     *
+     * MD5(K XOR opad, MD5(K XOR ipad, text))
+     *
+     * where K is an n byte key
+     * ipad is the byte 0x36 repeated 64 times
+     * opad is the byte 0x5c repeated 64 times
+     * and text is the data being protected
+     */
+    hmac_md5_init(&hctx, key, key_len);
+    hmac_md5_precomputed(&hctx, text, text_len, digest);
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_md5", ("void") );
 }
@@ -0,0 +1,331 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file pipeline.c
+ *  @brief Pipelined IPsec engine: classification, crypto workers and collection
+ *
+ *  <B>OUTLINE:</B>
+ *  The following functions are implemented in this module:
+ *   - ipsec_ring_put() / ipsec_ring_get(): lock-free single producer / single consumer ring
+ *   - ipsec_pipeline_dispatch(): classifies a packet (SA lookup) and queues it for a worker
+ *   - ipsec_pipeline_work(): processes the queued packets of one worker (AH/ESP crypto)
+ *   - ipsec_pipeline_collect(): returns the processed packets (inbound SPD check done here)
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *  ipsec_pipeline_dispatch() and ipsec_pipeline_collect() must be called from the same thread
+ *  (the lwIP thread), every worker calls ipsec_pipeline_work() from its own thread. Every ring has
+ *  exactly one producer and one consumer, so no locks are needed.
+ *
+ *  A packet is queued to the worker selected by the SPI of its SA. All packets of an SA are
+ *  processed by one worker in the order they were dispatched: the sequence numbers of an SA are
+ *  assigned strictly in order, the replay window of an SA is only updated by one thread and the
+ *  packets of an SA leave the pipeline in order. Packets of different SAs may overtake each other.
+ *  Workers only access the SA of a packet, which the dispatcher looked up; the SPD (and its lookup 
+ *  cache) is only used by the dispatcher and the collector.
+ *
+ *  Every job keeps the database epoch in which its SA was found (see ipsec_db_entered()) and the 
+ *  pipeline holds the oldest epoch of the jobs in flight for the dispatcher's reader (see ipsec_db_hold()). 
+ *  So the SPD and SAD can be changed while packets are in the pipeline: the SA of a job is not reused 
+ *  before the job was collected, and entries deleted later are reused as soon as the jobs which were 
+ *  dispatched before the deletion are collected, even if the pipeline never runs empty.
+ *
+ *  <B>NOTES:</B>
+ *  Every pipeline needs its own reader number, because a reader holds only one epoch.
+ *
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/debug.h"
+#include "ipsec/util.h"
+#include "ipsec/ipsec.h"
+#include "ipsec/sa.h"
+#include "ipsec/pipeline.h"
+
+
+/**
+ * Adds an item to a ring (called by the producer only).
+ *
+ * @param  ring  ring to add the item to
+ * @param  item  item to add
+ * @return 1 if the item was added, 0 if the ring is full
+ */
+int ipsec_ring_put(ipsec_ring *ring, void *item)
+{
+	unsigned int head = ring->head ;
+
+	if(head - ring->tail == IPSEC_PIPELINE_WINDOW)
+		return 0 ;
+
+	ring->slot[head & (IPSEC_PIPELINE_WINDOW-1)] = item ;
+	/* the item must be visible before the consumer sees the new head */
+	IPSEC_MEMORY_BARRIER() ;
+	ring->head = head + 1 ;
+	return 1 ;
+}
+
+
+/**
+ * Removes the oldest item from a ring (called by the consumer only).
+ *
+ * @param  ring  ring to remove the item from
+ * @return the oldest item, NULL if the ring is empty
+ */
+void *ipsec_ring_get(ipsec_ring *ring)
+{
+	unsigned int tail = ring->tail ;
+	void *item ;
+
+	if(tail == ring->head)
+		return NULL ;
+
+	IPSEC_MEMORY_BARRIER() ;
+	item = ring->slot[tail & (IPSEC_PIPELINE_WINDOW-1)] ;
+	/* the slot must be read before the producer may reuse it */
+	IPSEC_MEMORY_BARRIER() ;
+	ring->tail = tail + 1 ;
+	return item ;
+}
+
+
+/**
+ * Initializes a pipeline.
+ *
+ * @param  pipeline    pipeline to initialize
+ * @param  databases   SPD and SA configuration (db_set_netif) used for the packets
+ * @param  tunnel_src  IP address of the local tunnel start point (used for outbound packets)
+ * @param  tunnel_dst  IP address of the remote tunnel end point (used for outbound packets)
+ * @param  reader      reader number (see ipsec_db_enter()) of the thread calling ipsec_pipeline_dispatch() and ipsec_pipeline_collect(), 
+ *                     not used by another pipeline
+ * @return IPSEC_STATUS_SUCCESS
+ */
+ipsec_status ipsec_pipeline_init(ipsec_pipeline *pipeline, void *databases, __u32 tunnel_src, __u32 tunnel_dst, int reader)
+{
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER,
+	              "ipsec_pipeline_init",
+				  ("pipeline=%p, databases=%p, tunnel_src=%lx, tunnel_dst=%lx, reader=%d", (void *)pipeline, databases, tunnel_src, tunnel_dst, reader)
+				 );
+
+	memset(pipeline, 0, sizeof(ipsec_pipeline)) ;
+	pipeline->databases = databases ;
+	pipeline->tunnel_src = tunnel_src ;
+	pipeline->tunnel_dst = tunnel_dst ;
+	pipeline->reader = reader ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_pipeline_init", ("return = %d", IPSEC_STATUS_SUCCESS) );
+	return IPSEC_STATUS_SUCCESS ;
+}
+
+
+/**
+ * Holds the oldest database epoch of the jobs in flight (see ipsec_db_hold()).
+ *
+ * @param  pipeline  pipeline whose jobs are held
+ * @return void
+ */
+static void ipsec_pipeline_hold(ipsec_pipeline *pipeline)
+{
+	/* the leading epochs without jobs are done */
+	while((pipeline->epochs != 0) && (pipeline->epoch_jobs[pipeline->epoch_first] == 0))
+	{
+		pipeline->epoch_first = (pipeline->epoch_first + 1) % IPSEC_PIPELINE_WINDOW ;
+		pipeline->epochs-- ;
+	}
+	ipsec_db_hold(pipeline->reader, (pipeline->epochs != 0) ? pipeline->epoch[pipeline->epoch_first] : 0) ;
+}
+
+
+/**
+ * Classifies a packet and queues it for the worker of its SA.
+ *
+ * Inbound packets (job->packet.chain) are looked up in the inbound SAD, outbound packets use the SA
+ * of their SPD entry (job->packet.spd). If the packet is not queued, job->packet.status tells why.
+ *
+ * @param  pipeline  pipeline to queue the packet in
+ * @param  job       packet to process (the job must stay valid until it is returned by ipsec_pipeline_collect())
+ * @return IPSEC_STATUS_SUCCESS if the packet was queued
+ * @return IPSEC_STATUS_BUSY if there is no room in the pipeline (try again after ipsec_pipeline_collect())
+ * @return IPSEC_STATUS_BAD_PACKET, IPSEC_STATUS_NO_SA_FOUND if the packet can not be processed
+ */
+ipsec_status ipsec_pipeline_dispatch(ipsec_pipeline *pipeline, ipsec_job *job)
+{
+	sad_entry		*sa = NULL ;
+	ipsec_ip_header	*ip ;
+	int				worker ;
+	int				last ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER,
+	              "ipsec_pipeline_dispatch",
+				  ("pipeline=%p, job=%p", (void *)pipeline, (void *)job)
+				 );
+
+	if(pipeline->in_flight == IPSEC_PIPELINE_WINDOW)
+	{
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_pipeline_dispatch", ("return = %d", IPSEC_STATUS_BUSY) );
+		return IPSEC_STATUS_BUSY ;
+	}
+
+	/* the SA must stay valid until the job is collected (see ipsec_pipeline_hold()) */
+	ipsec_db_enter(pipeline->reader) ;
+
+	if(job->direction == IPSEC_PIPELINE_INBOUND)
+	{
+		if(job->packet.chain->len < IPSEC_MIN_IPHDR_SIZE + 8)
+		{
+			IPSEC_LOG_DBG("ipsec_pipeline_dispatch", IPSEC_STATUS_BAD_PACKET, ("IP and IPsec header must be in the first segment (%d bytes)", job->packet.chain->len) );
+			job->packet.status = IPSEC_STATUS_BAD_PACKET ;
+			ipsec_db_leave(pipeline->reader) ;
+			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_pipeline_dispatch", ("return = %d", job->packet.status) );
+			return job->packet.status ;
+		}
+		ip = (ipsec_ip_header *)job->packet.chain->data ;
+		sa = ipsec_sad_lookup(ip->dest, ip->protocol, ipsec_sad_get_spi(ip), &((db_set_netif *)pipeline->databases)->inbound_sad) ;
+	}
+	else if(job->packet.spd != NULL)
+	{
+		/* the worker encapsulates with this SA, even if the SPD entry gets a new one in the meantime */
+		sa = *(sad_entry * volatile *)&((spd_entry *)job->packet.spd)->sa ;
+	}
+
+	if(sa == NULL)
+	{
+		IPSEC_LOG_AUD("ipsec_pipeline_dispatch", IPSEC_AUDIT_FAILURE, ("no matching SA found")) ;
+		job->packet.status = IPSEC_STATUS_NO_SA_FOUND ;
+		ipsec_db_leave(pipeline->reader) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_pipeline_dispatch", ("return = %d", job->packet.status) );
+		return job->packet.status ;
+	}
+
+	job->sa = sa ;
+	job->packet.status = IPSEC_STATUS_NOT_INITIALIZED ;
+	job->epoch = ipsec_db_entered(pipeline->reader) ;
+	worker = (int)(ipsec_ntohl(sa->spi) % IPSEC_PIPELINE_WORKERS) ;
+
+	/* the epochs only grow, so the job either belongs to the newest epoch in flight or starts a new one */
+	last = (pipeline->epoch_first + pipeline->epochs - 1) % IPSEC_PIPELINE_WINDOW ;
+	if((pipeline->epochs == 0) || (pipeline->epoch[last] != job->epoch))
+	{
+		last = (pipeline->epoch_first + pipeline->epochs) % IPSEC_PIPELINE_WINDOW ;
+		pipeline->epoch[last] = job->epoch ;
+		pipeline->epoch_jobs[last] = 0 ;
+		pipeline->epochs++ ;
+	}
+	pipeline->epoch_jobs[last]++ ;
+	ipsec_pipeline_hold(pipeline) ;
+	ipsec_db_leave(pipeline->reader) ;
+
+	/* can not fail: no ring holds more than the IPSEC_PIPELINE_WINDOW jobs in flight */
+	ipsec_ring_put(&pipeline->work[worker], job) ;
+	pipeline->in_flight++ ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_pipeline_dispatch", ("return = %d", IPSEC_STATUS_SUCCESS) );
+	return IPSEC_STATUS_SUCCESS ;
+}
+
+
+/**
+ * Processes the packets queued for a worker.
+ *
+ * This is the only function called by the worker threads. It returns when the worker's queue is empty.
+ *
+ * @param  pipeline  pipeline the worker belongs to
+ * @param  worker    number of the worker (0..IPSEC_PIPELINE_WORKERS-1)
+ * @return number of processed packets
+ */
+int ipsec_pipeline_work(ipsec_pipeline *pipeline, int worker)
+{
+	ipsec_job	*job ;
+	int			processed = 0 ;
+
+	while((job = (ipsec_job *)ipsec_ring_get(&pipeline->work[worker])) != NULL)
+	{
+		if(job->direction == IPSEC_PIPELINE_INBOUND)
+			job->packet.status = ipsec_input_sa(job->packet.chain, &job->packet.payload_offset, &job->packet.payload_size, job->sa) ;
+		else
+			job->packet.status = ipsec_output_sa(job->packet.chain, &job->packet.payload_offset, &job->packet.payload_size,
+			                                     pipeline->tunnel_src, pipeline->tunnel_dst, job->sa, 0) ;
+
+		ipsec_ring_put(&pipeline->done[worker], job) ;
+		processed++ ;
+	}
+
+	return processed ;
+}
+
+
+/**
+ * Returns a processed packet.
+ *
+ * The inbound policy check (ipsec_input_check_policy()) of decapsulated packets is done here.
+ * Packets of the same SA are returned in the order they were dispatched.
+ *
+ * @param  pipeline  pipeline to collect the packet from
+ * @return processed job (job->packet.status holds the result), NULL if no packet is ready
+ */
+ipsec_job *ipsec_pipeline_collect(ipsec_pipeline *pipeline)
+{
+	ipsec_job	*job = NULL ;
+	int			i ;
+	int			entry ;
+
+	/* look at the workers round-robin, so a busy worker can not hold back the others */
+	for(i = 0; (i < IPSEC_PIPELINE_WORKERS) && (job == NULL); i++)
+	{
+		job = (ipsec_job *)ipsec_ring_get(&pipeline->done[pipeline->next_done]) ;
+		pipeline->next_done = (pipeline->next_done + 1) % IPSEC_PIPELINE_WORKERS ;
+	}
+	if(job == NULL)
+		return NULL ;
+
+	pipeline->in_flight-- ;
+
+	ipsec_db_enter(pipeline->reader) ;
+
+	if((job->direction == IPSEC_PIPELINE_INBOUND) && (job->packet.status == IPSEC_STATUS_SUCCESS))
+		job->packet.status = ipsec_input_check_policy(job->packet.chain, job->packet.payload_offset, job->sa, pipeline->databases) ;
+
+	/* the SA of the job is no longer used, the hold moves on once the older jobs are collected too */
+	for(i = 0; i < pipeline->epochs; i++)
+	{
+		entry = (pipeline->epoch_first + i) % IPSEC_PIPELINE_WINDOW ;
+		if(pipeline->epoch[entry] == job->epoch)
+		{
+			pipeline->epoch_jobs[entry]-- ;
+			break ;
+		}
+	}
+	ipsec_pipeline_hold(pipeline) ;
+
+	ipsec_db_leave(pipeline->reader) ;
+	return job ;
+}
@@ -60,12 +60,39 @@
  * -# array for storing data:	spd_entry inbound_spd_data[size] ;
  *
  * The 1st object holds the structure of the database (linked-list) while the second one is memory
- * for storing the objects.
+ * for storing the objects. The size of the array is IPSEC_MAX_SPD_ENTRIES/IPSEC_MAX_SAD_ENTRIES if 
+ * ipsec_spd_load_dbs() is used, but it can also be chosen at run-time by using ipsec_spd_init_dbs() 
+ * or ipsec_spd_create_dbs(). The free records of an array are chained (by their next pointer) to 
+ * the free list of the table, so getting or releasing a record never needs to search the array.
+ *
+ * Every SPD table is compiled into a classifier (see ipsec_spd_compile()), so that ipsec_spd_lookup()
+ * does not need to check every entry of the table for every packet. 
+ * Every SAD table additionally keeps an index over the SPI (IPSEC_SAD_HASH_SIZE buckets, chained by
+ * sad_entry.hash_next), so that ipsec_sad_lookup() does not need to walk the whole table for every
+ * inbound packet. The index is maintained by ipsec_spd_load_dbs(), ipsec_sad_add(), ipsec_sad_del()
+ * and ipsec_sad_flush(). Therefore the SPI of an SA must not be changed while it is in a table.
+ *
+ * The lookup functions (ipsec_spd_lookup(), ipsec_sad_lookup()) take no locks, so packets can be 
+ * processed on other threads or cores while the tables are changed. A thread reads the tables between
+ * ipsec_db_enter() and ipsec_db_leave(). The functions which change the tables (the writers) never 
+ * change anything a reader may be looking at:
+ * -# A new SA is set up completely before it is linked into the SPI index with a single pointer.
+ * -# An SPD table is compiled into a second classifier version which is then published by switching 
+ * spd_table.version. The old version is only rebuilt once no reader uses it any more.
+ * -# Deleted entries are moved to the retired list of their table. They keep their contents and 
+ * links and only go back to the free list when every reader which may have seen them has left.
+ * For this, the writers advance an epoch counter and every reader remembers the epoch in which it 
+ * entered. Work which outlives a read section (e.g. the packets in a pipeline) keeps the epoch in 
+ * which its entries were found and holds the oldest one with ipsec_db_hold() instead of staying in 
+ * the read section. The writers must be serialized by the caller (e.g. all called from the same thread). They
+ * never wait for the readers: an SPD change returns IPSEC_STATUS_BUSY (or NULL) as long as the 
+ * previous classifier version is still in use and must be repeated later.
  *
  *  <B>NOTES:</B>
  * To create and use a database you should guaranty the following sequence.
  * -# ipsec_spd_load_dbs(): to initialize the table
  * -# ipsec_spd_add(): to fill up as many records as the size (usually IPSEC_MAX_SA_ENTRIES) permits 
+ * -# ipsec_spd_compile(): only needed if the selectors of an entry are changed directly
  * -# ipsec_spd_del(): to remove entries if required
  * -# ipsec_spd_lookup(): to check packets for a matching entry
  * -# ipsec_spd_release_dbs(): to clean up
@@ -86,6 +113,8 @@
 #include "ipsec/sa.h"
 #include "ipsec/ah.h"
 #include "ipsec/esp.h"
+#include "ipsec/ivgen.h"
+#include "ipsec/chksum.h"
 
 
 /** 
@@ -95,6 +124,23 @@
  */
 db_set_netif	db_sets[IPSEC_NR_NETIFS] ;
 
+/**
+ * Generation of the databases. It is changed by every function which modifies an SPD or SAD, so 
+ * that the results in the SPD lookup caches which were stored by an older generation are no longer
+ * used. Generation 0 is never used, so that cleared cache entries are never valid.
+ */
+static volatile __u32	db_generation = 1 ;
+
+/**
+ * Current epoch of the databases. It is advanced whenever entries or a classifier version are 
+ * retired (see ipsec_db_advance()). Epoch 0 is never used, it marks readers which do not read.
+ */
+static volatile __u32	db_epoch = 1 ;
+
+static volatile __u32	db_reader_epoch[IPSEC_DB_READERS] ;	/**< epoch in which every reader entered, 0 if it does not read the tables */
+static int				db_reader_depth[IPSEC_DB_READERS] ;	/**< number of nested ipsec_db_enter() calls of every reader */
+static volatile __u32	db_reader_held[IPSEC_DB_READERS] ;	/**< oldest epoch held by every reader after it left (see ipsec_db_hold()), 0 if none */
+
 typedef struct ipsec_in_ip_struct /**< IPsec in IP structure - used to access headers inside SA */
 {
 	ipsec_ip_header 	 ip ;	/**< IPv4 header */
@@ -108,32 +154,422 @@ typedef struct ipsec_in_ip_struct /**< IPsec in IP structure - used to access he
 } ipsec_in_ip ;
 
 
+/**
+ * Invalidates the SPD lookup caches of all tables. Must be called whenever an SPD or SAD is modified.
+ *
+ * @return void
+ */
+static void ipsec_db_changed(void)
+{
+	db_generation++ ;
+	if(db_generation == 0)
+		db_generation = 1 ;
+}
+
+/**
+ * Adds 1 to a statistics counter which may be counted by several readers at once.
+ *
+ * @param counter	pointer to the counter
+ * @return void
+ */
+static void ipsec_db_count(volatile __u32 *counter)
+{
+	__u32	value ;
+
+	do
+	{
+		value = *counter ;
+	}
+	while(!IPSEC_ATOMIC_CAS(counter, value, value + 1)) ;
+}
+
+/**
+ * Marks the start of lookups by a reader. Until the matching ipsec_db_leave(), no entry or 
+ * classifier version which the reader may find is reused by a writer, so the entries returned by 
+ * ipsec_spd_lookup() and ipsec_sad_lookup() (and the SA of an SPD entry) stay valid.
+ * The calls can be nested. Every thread which looks up the databases must use its own reader number.
+ *
+ * @param reader	number of the reader (0..IPSEC_DB_READERS-1)
+ * @return void
+ */
+void ipsec_db_enter(int reader)
+{
+	if(db_reader_depth[reader]++ == 0)
+	{
+		db_reader_epoch[reader] = db_epoch ;
+		/* the writers must see the epoch before the tables are read */
+		IPSEC_MEMORY_BARRIER() ;
+	}
+}
+
+/**
+ * Marks the end of lookups by a reader (see ipsec_db_enter()).
+ *
+ * @param reader	number of the reader (0..IPSEC_DB_READERS-1)
+ * @return void
+ */
+void ipsec_db_leave(int reader)
+{
+	if(--db_reader_depth[reader] == 0)
+	{
+		/* all reads of the tables must be done before the writers may reuse the entries */
+		IPSEC_MEMORY_BARRIER() ;
+		db_reader_epoch[reader] = 0 ;
+	}
+}
+
+/**
+ * Returns the epoch in which a reader entered (see ipsec_db_enter()). Entries the reader found 
+ * in its current read section stay valid as long as this epoch is held (see ipsec_db_hold()).
+ *
+ * @param reader	number of the reader (0..IPSEC_DB_READERS-1), between ipsec_db_enter() and ipsec_db_leave()
+ * @return epoch in which the reader entered
+ */
+__u32 ipsec_db_entered(int reader)
+{
+	return db_reader_epoch[reader] ;
+}
+
+/**
+ * Holds the entries found in an epoch beyond the read section in which they were found (e.g. the 
+ * SAs of the packets in a pipeline): nothing retired in this or a later epoch is reused until the 
+ * hold is moved on. A reader holds one epoch at a time, it should be the oldest one still in use. 
+ * The hold must be set before the reader leaves the read section in which the entries were found.
+ *
+ * @param reader	number of the reader (0..IPSEC_DB_READERS-1)
+ * @param epoch		oldest epoch still in use (see ipsec_db_entered()), 0 to release the hold
+ * @return void
+ */
+void ipsec_db_hold(int reader, __u32 epoch)
+{
+	/* all reads of entries which are released must be done before the writers may reuse them */
+	IPSEC_MEMORY_BARRIER() ;
+	db_reader_held[reader] = epoch ;
+	IPSEC_MEMORY_BARRIER() ;
+}
+
+/**
+ * Ends the current epoch. Must be called by a writer after it unlinked entries or replaced a
+ * classifier version, and before it may reuse them.
+ *
+ * @return epoch which was ended (the retired data may be reused when ipsec_db_unused() returns 1 for it)
+ */
+static __u32 ipsec_db_advance(void)
+{
+	__u32	epoch ;
+
+	/* the readers which enter in the new epoch must not find the retired data any more */
+	IPSEC_MEMORY_BARRIER() ;
+	epoch = db_epoch ;
+	db_epoch = (epoch + 1 == 0) ? 1 : epoch + 1 ;
+	IPSEC_MEMORY_BARRIER() ;
+
+	return epoch ;
+}
+
+/**
+ * Tells whether data retired in a given epoch may be reused, which is the case if no reader 
+ * entered in this or an earlier epoch is still reading and no reader holds such an epoch.
+ *
+ * @param epoch		epoch returned by ipsec_db_advance() (0 if the data was never retired)
+ * @return 1 if no reader can use the data any more
+ * @return 0 if the data may still be used
+ */
+static int ipsec_db_unused(__u32 epoch)
+{
+	__u32	entered ;
+	int		reader ;
+
+	if(epoch == 0)
+		return 1 ;
+
+	IPSEC_MEMORY_BARRIER() ;
+	for(reader = 0; reader < IPSEC_DB_READERS; reader++)
+	{
+		entered = db_reader_epoch[reader] ;
+		if((entered != 0) && ((__s32)(entered - epoch) <= 0))
+			return 0 ;
+		entered = db_reader_held[reader] ;
+		if((entered != 0) && ((__s32)(entered - epoch) <= 0))
+			return 0 ;
+	}
+	return 1 ;
+}
+
+/**
+ * Moves a deleted SPD entry to the end of the retired list of its table. The selectors, the SA and 
+ * the classifier links of the entry are not changed, because a reader may still use them.
+ *
+ * @param entry		pointer to the SPD entry (already removed from the linked list)
+ * @param epoch		epoch in which the entry was retired
+ * @param table		pointer to the SPD table
+ * @return void
+ */
+static void ipsec_spd_retire(spd_entry *entry, __u32 epoch, spd_table *table)
+{
+	entry->use_flag = IPSEC_FREE ;
+	entry->retired = epoch ;
+	entry->prev = NULL ;
+	entry->next = NULL ;
+	if(table->retired_list == NULL)
+		table->retired_list = entry ;
+	else
+		table->retired_tail->next = entry ;
+	table->retired_tail = entry ;
+}
+
+/**
+ * Moves the retired SPD entries which are no longer used by any reader to the free list.
+ *
+ * @param table		pointer to the SPD table
+ * @return void
+ */
+static void ipsec_spd_reclaim(spd_table *table)
+{
+	spd_entry	*entry ;
+
+	/* the retired list is ordered by epoch */
+	while((table->retired_list != NULL) && ipsec_db_unused(table->retired_list->retired))
+	{
+		entry = table->retired_list ;
+		table->retired_list = entry->next ;
+		entry->next = table->free_list ;
+		table->free_list = entry ;
+	}
+}
+
+/**
+ * Moves a deleted SA to the end of the retired list of its table. The SA and its link in the SPI 
+ * index are not changed, because a reader may still use them.
+ *
+ * @param entry		pointer to the SA entry (already removed from the linked list and the SPI index)
+ * @param epoch		epoch in which the entry was retired
+ * @param table		pointer to the SAD table
+ * @return void
+ */
+static void ipsec_sad_retire(sad_entry *entry, __u32 epoch, sad_table *table)
+{
+	entry->use_flag = IPSEC_FREE ;
+	entry->retired = epoch ;
+	entry->prev = NULL ;
+	entry->next = NULL ;
+	if(table->retired_list == NULL)
+		table->retired_list = entry ;
+	else
+		table->retired_tail->next = entry ;
+	table->retired_tail = entry ;
+}
+
+/**
+ * Moves the retired SAs which are no longer used by any reader to the free list.
+ *
+ * @param table		pointer to the SAD table
+ * @return void
+ */
+static void ipsec_sad_reclaim(sad_table *table)
+{
+	sad_entry	*entry ;
+
+	/* the retired list is ordered by epoch */
+	while((table->retired_list != NULL) && ipsec_db_unused(table->retired_list->retired))
+	{
+		entry = table->retired_list ;
+		table->retired_list = entry->next ;
+		entry->next = table->free_list ;
+		table->free_list = entry ;
+	}
+}
+
+/**
+ * Removes the deleted SAs from the SPD entries of the interface the SAD table belongs to, so that no 
+ * policy refers to an SA which is reused later. Must be called before the epoch in which the SAs 
+ * are retired is ended: the readers which enter later find no SA, the earlier ones keep it valid.
+ *
+ * @param sa		pointer to the deleted SA, NULL if all SAs of the table are deleted
+ * @param table		pointer to the SAD table
+ * @return void
+ */
+static void ipsec_sad_unlink(sad_entry *sa, sad_table *table)
+{
+	spd_entry	*entry ;
+	spd_table	*spd ;
+	int			netif ;
+	int			direction ;
+
+	for(netif = 0; netif < IPSEC_NR_NETIFS; netif++)
+	{
+		if((db_sets[netif].use_flag != IPSEC_USED) || 
+		   ((&db_sets[netif].inbound_sad != table) && (&db_sets[netif].outbound_sad != table)))
+			continue ;
+
+		for(direction = 0; direction < 2; direction++)
+		{
+			spd = (direction == 0) ? &db_sets[netif].inbound_spd : &db_sets[netif].outbound_spd ;
+			for(entry = spd->first; entry != NULL; entry = entry->next)
+			{
+				if((entry->sa == NULL) || 
+				   ((sa != NULL) && (entry->sa != sa)) ||
+				   (entry->sa < table->table) || (entry->sa >= table->table + table->size))
+					continue ;
+				*(sad_entry * volatile *)&entry->sa = NULL ;
+			}
+		}
+	}
+}
+
+/**
+ * Calculates the bucket of the SPI index for a given SPI.
+ * All bytes of the SPI are folded together, so the result does not depend on the byte order.
+ *
+ * @param spi	Security Parameters Index (network byte order)
+ * @param mask	number of buckets of the index - 1
+ * @return index of the bucket (0..mask)
+ */
+static int ipsec_sad_hash(__u32 spi, int mask)
+{
+	return (int)((spi ^ (spi >> 8) ^ (spi >> 16) ^ (spi >> 24)) & (__u32)mask) ;
+}
+
+/**
+ * Appends an SA to its bucket of the SPI index. It is appended (and not inserted at the front) so 
+ * that ipsec_sad_lookup() still returns the SA which comes first in the table if several SAs match.
+ * The SA must be set up completely, because it can be found by the readers as soon as it is linked.
+ *
+ * @param entry	pointer to the SA entry
+ * @param table	pointer to the SAD table
+ * @return void
+ */
+static void ipsec_sad_hash_insert(sad_entry *entry, sad_table *table)
+{
+	sad_entry	**link ;
+
+	for(link = &table->hash[ipsec_sad_hash(entry->spi, table->hash_mask)]; *link != NULL; link = &(*link)->hash_next)
+	{
+	}
+	entry->hash_next = NULL ;
+	/* the contents of the SA must be visible before the SA is */
+	IPSEC_MEMORY_BARRIER() ;
+	*link = entry ;
+}
+
+/**
+ * Removes an SA from its bucket of the SPI index. The link of the SA itself is kept, so that a 
+ * reader which is looking at the SA can still go on to the next SA of the bucket.
+ *
+ * @param entry	pointer to the SA entry
+ * @param table	pointer to the SAD table
+ * @return void
+ */
+static void ipsec_sad_hash_remove(sad_entry *entry, sad_table *table)
+{
+	sad_entry	**link ;
+
+	for(link = &table->hash[ipsec_sad_hash(entry->spi, table->hash_mask)]; *link != NULL; link = &(*link)->hash_next)
+	{
+		if(*link == entry)
+		{
+			*link = entry->hash_next ;
+			break ;
+		}
+	}
+}
+
+/**
+ * Builds the SPI index of an SAD table from its linked list.
+ *
+ * @param table	pointer to the SAD table
+ * @return void
+ */
+static void ipsec_sad_hash_build(sad_table *table)
+{
+	sad_entry	*tmp_entry ;
+
+	memset(table->hash, 0, (table->hash_mask+1)*sizeof(table->hash[0])) ;
+	for(tmp_entry = table->first; tmp_entry != NULL; tmp_entry = tmp_entry->next)
+	{
+		ipsec_sad_hash_insert(tmp_entry, table) ;
+	}
+}
 
 /**
- * This function initializes the database set, allocated in a per-network manner.
+ * Chains all free entries of an SPD table to its free list (lowest entry first).
+ *
+ * @param table	pointer to the SPD table
+ * @return void
+ */
+static void ipsec_spd_free_build(spd_table *table)
+{
+	int		index ;
+
+	table->free_list = NULL ;
+	for(index = table->size-1; index >= 0; index--)
+	{
+		if(table->table[index].use_flag != IPSEC_USED)
+		{
+			table->table[index].prev = NULL ;
+			table->table[index].next = table->free_list ;
+			table->free_list = &table->table[index] ;
+		}
+	}
+}
+
+/**
+ * Chains all free entries of an SAD table to its free list (lowest entry first).
+ *
+ * @param table	pointer to the SAD table
+ * @return void
+ */
+static void ipsec_sad_free_build(sad_table *table)
+{
+	int		index ;
+
+	table->free_list = NULL ;
+	for(index = table->size-1; index >= 0; index--)
+	{
+		if(table->table[index].use_flag != IPSEC_USED)
+		{
+			table->table[index].prev = NULL ;
+			table->table[index].next = table->free_list ;
+			table->free_list = &table->table[index] ;
+		}
+	}
+}
+
+
+/**
+ * This function initializes the database set, allocated in a per-network manner, for tables of
+ * any size.
  *
  * The data which is passed by the pointers should not be used by other functions except the 
  * ones of the SA-module. The data passed can be viewed as a place where the SA-module can store its
  * data (Security Policies or Security Associations). 
  * The tables which are passed to the function can already be filled up with static configuration
  * data. You can use the SPD_ENTRY and the SAD_ENTRY macro to do this in a nice way.
+ * Usually ipsec_spd_load_dbs() (tables of IPSEC_MAX_SPD_ENTRIES/IPSEC_MAX_SAD_ENTRIES entries) or
+ * ipsec_spd_create_dbs() (tables taken from a memory arena) is used instead of this function.
  *
  * Implementation
  * -# First the function gets a free entry (set of structs) out of the db_sets table.
  * -# Then it sets the pointer of this struct members.
  * -# On all entries in the table which are not already filled are set to IPSEC_FREE.
+ * -# The key schedules of all statically configured SAs are set up (see ipsec_sad_prepare()).
  * -# In the last and most ugly part of this function tables are linked together so that the linked
  * list is setup properly.
+ * -# Then the free entries of every table are chained to its free list.
+ * -# Finally both SPD tables are compiled (which also invalidates the lookup caches) and the SPI 
+ * index of both SAD tables is built.
  *
  * @param inbound_spd_data 	pointer to a table where inbound Security Policies will be stored
  * @param outbound_spd_data pointer to a table where outbound Security Policies will be stored
  * @param inbound_sad_data 	pointer to a table where inbound Security Associations will be stored
  * @param outbound_sad_data pointer to a table where outbound Security Associations will be stored
+ * @param spd_size			number of entries of each of the two SPD tables
+ * @param sad_size			number of entries of each of the two SAD tables
  *
  * @return pointer to the initialized set of DB's if the setup was successful
  * @return NULL if loading failed
  */
-db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outbound_spd_data, sad_entry *inbound_sad_data, sad_entry *outbound_sad_data)
+db_set_netif	*ipsec_spd_init_dbs(spd_entry *inbound_spd_data, spd_entry *outbound_spd_data, sad_entry *inbound_sad_data, sad_entry *outbound_sad_data, int spd_size, int sad_size)
 {
 	int netif ;
 	int index ;
@@ -141,9 +577,9 @@ db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outboun
 	sad_entry 	*sa, *sa_next, *sa_prev ;
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
-	              "ipsec_spd_load_dbs", 
-				  ("inbound_spd_data=%p, outbound_spd_data=%p, inbound_sad_data=%p, outbound_sad_data=%p",
-			      (void *)inbound_spd_data, (void *)outbound_spd_data, (void *)inbound_sad_data, (void *)outbound_sad_data)
+	              "ipsec_spd_init_dbs", 
+				  ("inbound_spd_data=%p, outbound_spd_data=%p, inbound_sad_data=%p, outbound_sad_data=%p, spd_size=%d, sad_size=%d",
+			      (void *)inbound_spd_data, (void *)outbound_spd_data, (void *)inbound_sad_data, (void *)outbound_sad_data, spd_size, sad_size)
 				 );
 	
 	/* get free entry */
@@ -153,7 +589,7 @@ db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outboun
 	}
 	if(netif >= IPSEC_NR_NETIFS)
 	{
-		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_load_dbs", ("%p", (void *)NULL) );
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_init_dbs", ("%p", (void *)NULL) );
 		return NULL;
 	}
 
@@ -162,26 +598,65 @@ db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outboun
 	db_sets[netif].outbound_spd.table = outbound_spd_data ;
 	db_sets[netif].inbound_sad.table = inbound_sad_data ;
 	db_sets[netif].outbound_sad.table = outbound_sad_data ;
+	db_sets[netif].inbound_spd.size = spd_size ;
+	db_sets[netif].outbound_spd.size = spd_size ;
+	db_sets[netif].inbound_sad.size = sad_size ;
+	db_sets[netif].outbound_sad.size = sad_size ;
+	db_sets[netif].inbound_spd.hash = db_sets[netif].inbound_spd.hash_default ;
+	db_sets[netif].inbound_spd.hash_mask = IPSEC_SPD_HASH_SIZE-1 ;
+	db_sets[netif].outbound_spd.hash = db_sets[netif].outbound_spd.hash_default ;
+	db_sets[netif].outbound_spd.hash_mask = IPSEC_SPD_HASH_SIZE-1 ;
+	db_sets[netif].inbound_sad.hash = db_sets[netif].inbound_sad.hash_default ;
+	db_sets[netif].inbound_sad.hash_mask = IPSEC_SAD_HASH_SIZE-1 ;
+	db_sets[netif].outbound_sad.hash = db_sets[netif].outbound_sad.hash_default ;
+	db_sets[netif].outbound_sad.hash_mask = IPSEC_SAD_HASH_SIZE-1 ;
+	db_sets[netif].inbound_spd.version = 0 ;
+	db_sets[netif].inbound_spd.retired = 0 ;
+	db_sets[netif].inbound_spd.retired_list = NULL ;
+	db_sets[netif].inbound_spd.retired_tail = NULL ;
+	db_sets[netif].outbound_spd.version = 0 ;
+	db_sets[netif].outbound_spd.retired = 0 ;
+	db_sets[netif].outbound_spd.retired_list = NULL ;
+	db_sets[netif].outbound_spd.retired_tail = NULL ;
+	db_sets[netif].inbound_sad.retired_list = NULL ;
+	db_sets[netif].inbound_sad.retired_tail = NULL ;
+	db_sets[netif].inbound_sad.tunnel_src = 0 ;
+	db_sets[netif].inbound_sad.tunnel_dst = 0 ;
+	db_sets[netif].inbound_sad.outer_retired = 0 ;
+	db_sets[netif].outbound_sad.retired_list = NULL ;
+	db_sets[netif].outbound_sad.retired_tail = NULL ;
+	db_sets[netif].outbound_sad.tunnel_src = 0 ;
+	db_sets[netif].outbound_sad.tunnel_dst = 0 ;
+	db_sets[netif].outbound_sad.outer_retired = 0 ;
 
 	db_sets[netif].use_flag = IPSEC_USED ;
 
 	/* set none used entries from the tables to FREE */
-	for(index=0; index < IPSEC_MAX_SPD_ENTRIES; index++)
+	for(index=0; index < spd_size; index++)
 		if(db_sets[netif].inbound_spd.table[index].use_flag != IPSEC_USED)
 			db_sets[netif].inbound_spd.table[index].use_flag = IPSEC_FREE ;
 
-	for(index=0; index < IPSEC_MAX_SPD_ENTRIES; index++)
+	for(index=0; index < sad_size; index++)
 		if(db_sets[netif].inbound_sad.table[index].use_flag != IPSEC_USED)
 			db_sets[netif].inbound_sad.table[index].use_flag = IPSEC_FREE ;
 	
-	for(index=0; index < IPSEC_MAX_SAD_ENTRIES; index++)
+	for(index=0; index < spd_size; index++)
 		if(db_sets[netif].outbound_spd.table[index].use_flag != IPSEC_USED)
 			db_sets[netif].outbound_spd.table[index].use_flag = IPSEC_FREE ;
 
-	for(index=0; index < IPSEC_MAX_SAD_ENTRIES; index++)
+	for(index=0; index < sad_size; index++)
 		if(db_sets[netif].outbound_sad.table[index].use_flag != IPSEC_USED)
 			db_sets[netif].outbound_sad.table[index].use_flag = IPSEC_FREE ;
 
+	/* set up the key schedules of the statically configured SAs */
+	for(index=0; index < sad_size; index++)
+		if(db_sets[netif].inbound_sad.table[index].use_flag == IPSEC_USED)
+			ipsec_sad_prepare(&db_sets[netif].inbound_sad.table[index]) ;
+
+	for(index=0; index < sad_size; index++)
+		if(db_sets[netif].outbound_sad.table[index].use_flag == IPSEC_USED)
+			ipsec_sad_prepare(&db_sets[netif].outbound_sad.table[index]) ;
+
 	/* link the database entries together */
 
 	/* inbound spd data */
@@ -191,7 +666,7 @@ db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outboun
 	{
 		db_sets[netif].inbound_spd.first = sp ;	
 	
-		if ((sp+1)->use_flag == IPSEC_USED)
+		if ((spd_size > 1) && ((sp+1)->use_flag == IPSEC_USED))
 		{
 			sp_next = (sp+1) ;
 		}
@@ -201,7 +676,7 @@ db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outboun
 		}
 	
 		for(index=0, sp_prev=NULL;
-	 		(index < IPSEC_MAX_SPD_ENTRIES) && (sp[index+1].use_flag == IPSEC_USED);
+	 		(index+1 < spd_size) && (sp[index+1].use_flag == IPSEC_USED);
 		    sp_prev = &sp[index], sp_next = &sp[index+2], index++)
 			{
 				sp[index].prev = sp_prev ;
@@ -225,7 +700,7 @@ db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outboun
 	{
 		db_sets[netif].outbound_spd.first = sp ;	
 	
-		if ((sp+1)->use_flag == IPSEC_USED)
+		if ((spd_size > 1) && ((sp+1)->use_flag == IPSEC_USED))
 		{
 			sp_next = (sp+1) ;
 		}
@@ -235,7 +710,7 @@ db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outboun
 		}
 	
 		for(index=0, sp_prev=NULL;
-	 		(index < IPSEC_MAX_SPD_ENTRIES) && (sp[index+1].use_flag == IPSEC_USED);
+	 		(index+1 < spd_size) && (sp[index+1].use_flag == IPSEC_USED);
 		    sp_prev = &sp[index], sp_next = &sp[index+2], index++)
 			{
 				sp[index].prev = sp_prev ;
@@ -260,7 +735,7 @@ db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outboun
 	{
 		db_sets[netif].inbound_sad.first = sa ;	
 	
-		if ((sa+1)->use_flag == IPSEC_USED)
+		if ((sad_size > 1) && ((sa+1)->use_flag == IPSEC_USED))
 		{
 			sa_next = (sa+1) ;
 		}
@@ -270,7 +745,7 @@ db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outboun
 		}
 	
 		for(index=0, sa_prev=NULL;
-	 		(index < IPSEC_MAX_SAD_ENTRIES) && (sa[index+1].use_flag == IPSEC_USED);
+	 		(index+1 < sad_size) && (sa[index+1].use_flag == IPSEC_USED);
 		    sa_prev = &sa[index], sa_next = &sa[index+2], index++)
 			{
 				sa[index].prev = sa_prev ;
@@ -294,7 +769,7 @@ db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outboun
 	{
 		db_sets[netif].outbound_sad.first = sa ;	
 	
-		if ((sa+1)->use_flag == IPSEC_USED)
+		if ((sad_size > 1) && ((sa+1)->use_flag == IPSEC_USED))
 		{
 			sa_next = (sa+1) ;
 		}
@@ -304,7 +779,7 @@ db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outboun
 		}
 	
 		for(index=0, sa_prev=NULL;
-	 		(index < IPSEC_MAX_SAD_ENTRIES) && (sa[index+1].use_flag == IPSEC_USED);
+	 		(index+1 < sad_size) && (sa[index+1].use_flag == IPSEC_USED);
 		    sa_prev = &sa[index], sa_next = &sa[index+2], index++)
 			{
 				sa[index].prev = sa_prev ;
@@ -321,10 +796,120 @@ db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outboun
 		db_sets[netif].outbound_sad.last = NULL ;
 	}
 
-	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_load_dbs", ("&db_sets[netif] = %p", &db_sets[netif]) );
+	ipsec_spd_free_build(&db_sets[netif].inbound_spd) ;
+	ipsec_spd_free_build(&db_sets[netif].outbound_spd) ;
+	ipsec_sad_free_build(&db_sets[netif].inbound_sad) ;
+	ipsec_sad_free_build(&db_sets[netif].outbound_sad) ;
+
+	db_sets[netif].inbound_spd.cache_hits = 0 ;
+	db_sets[netif].inbound_spd.cache_misses = 0 ;
+	db_sets[netif].outbound_spd.cache_hits = 0 ;
+	db_sets[netif].outbound_spd.cache_misses = 0 ;
+
+	ipsec_spd_compile(&db_sets[netif].inbound_spd) ;
+	ipsec_spd_compile(&db_sets[netif].outbound_spd) ;
+	ipsec_sad_hash_build(&db_sets[netif].inbound_sad) ;
+	ipsec_sad_hash_build(&db_sets[netif].outbound_sad) ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_init_dbs", ("&db_sets[netif] = %p", &db_sets[netif]) );
 	return &db_sets[netif] ;
 }
 
+/**
+ * This function initializes the database set, allocated in a per-network manner, for tables of
+ * IPSEC_MAX_SPD_ENTRIES SPD entries and IPSEC_MAX_SAD_ENTRIES SAD entries (see ipsec_spd_init_dbs()).
+ *
+ * @param inbound_spd_data 	pointer to a table where inbound Security Policies will be stored
+ * @param outbound_spd_data pointer to a table where outbound Security Policies will be stored
+ * @param inbound_sad_data 	pointer to a table where inbound Security Associations will be stored
+ * @param outbound_sad_data pointer to a table where outbound Security Associations will be stored
+ *
+ * @return pointer to the initialized set of DB's if the setup was successful
+ * @return NULL if loading failed
+ */
+db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outbound_spd_data, sad_entry *inbound_sad_data, sad_entry *outbound_sad_data)
+{
+	return ipsec_spd_init_dbs(inbound_spd_data, outbound_spd_data, inbound_sad_data, outbound_sad_data, IPSEC_MAX_SPD_ENTRIES, IPSEC_MAX_SAD_ENTRIES) ;
+}
+
+/**
+ * This function creates a database set with empty tables of a size chosen at run-time. 
+ * The memory of the tables is taken from a memory arena provided by the caller, which must be 
+ * at least IPSEC_DB_ARENA_SIZE(spd_size, sad_size) bytes large, aligned like a pointer and must 
+ * not be used otherwise until the database set is released by ipsec_spd_release_dbs().
+ * The arena also holds the buckets of the SPD classifiers and of the SPI indexes. Their number is 
+ * chosen in the range of the table size (instead of IPSEC_SPD_HASH_SIZE/IPSEC_SAD_HASH_SIZE), so 
+ * that the buckets stay short no matter how large the tables are.
+ *
+ * @param arena			pointer to the memory arena
+ * @param arena_size	size of the memory arena in bytes
+ * @param spd_size		number of entries of each of the two SPD tables
+ * @param sad_size		number of entries of each of the two SAD tables
+ *
+ * @return pointer to the initialized set of DB's if the setup was successful
+ * @return NULL if the arena is too small or if there is no free set of DB's
+ */
+db_set_netif	*ipsec_spd_create_dbs(void *arena, __u32 arena_size, int spd_size, int sad_size)
+{
+	sad_entry	*sad_data ;
+	spd_entry	*spd_data ;
+	void		**buckets ;
+	int			spd_buckets ;
+	int			sad_buckets ;
+	db_set_netif	*dbs ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsec_spd_create_dbs", 
+				  ("arena=%p, arena_size=%lu, spd_size=%d, sad_size=%d",
+			      arena, arena_size, spd_size, sad_size)
+				 );
+
+	if((spd_size < 1) || (sad_size < 1) || (arena_size < IPSEC_DB_ARENA_SIZE(spd_size, sad_size)))
+	{
+		IPSEC_LOG_ERR("ipsec_spd_create_dbs", IPSEC_STATUS_FAILURE, ("arena of %lu bytes is too small for %d SPD and %d SAD entries", arena_size, spd_size, sad_size)) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_create_dbs", ("%p", (void *)NULL) );
+		return NULL ;
+	}
+
+	memset(arena, 0, IPSEC_DB_ARENA_SIZE(spd_size, sad_size)) ;
+
+	/* the buckets come first, so they are aligned like the arena (2*size pointers are reserved per table 
+	 * and classifier version) */
+	buckets = (void **)arena ;
+	sad_data = (sad_entry *)(buckets + 8*spd_size + 4*sad_size) ;
+	spd_data = (spd_entry *)(sad_data + 2*sad_size) ;
+
+	dbs = ipsec_spd_init_dbs(spd_data, spd_data + spd_size, sad_data, sad_data + sad_size, spd_size, sad_size) ;
+
+	if(dbs != NULL)
+	{
+		/* largest power of 2 which is not larger than twice the table size */
+		for(spd_buckets = 1; spd_buckets <= spd_size; spd_buckets <<= 1) ;
+		for(sad_buckets = 1; sad_buckets <= sad_size; sad_buckets <<= 1) ;
+
+		/* replace the default buckets by the buckets from the arena */
+		dbs->inbound_spd.hash = (spd_entry **)buckets ;
+		dbs->inbound_spd.hash_mask = spd_buckets-1 ;
+		buckets += 4*spd_size ;
+		dbs->outbound_spd.hash = (spd_entry **)buckets ;
+		dbs->outbound_spd.hash_mask = spd_buckets-1 ;
+		buckets += 4*spd_size ;
+		dbs->inbound_sad.hash = (sad_entry **)buckets ;
+		dbs->inbound_sad.hash_mask = sad_buckets-1 ;
+		buckets += 2*sad_size ;
+		dbs->outbound_sad.hash = (sad_entry **)buckets ;
+		dbs->outbound_sad.hash_mask = sad_buckets-1 ;
+
+		ipsec_spd_compile(&dbs->inbound_spd) ;
+		ipsec_spd_compile(&dbs->outbound_spd) ;
+		ipsec_sad_hash_build(&dbs->inbound_sad) ;
+		ipsec_sad_hash_build(&dbs->outbound_sad) ;
+	}
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_create_dbs", ("dbs = %p", (void *)dbs) );
+	return dbs ;
+}
+
 /**
  * This function is used to release the structure allocated in ipsec_spd_load_dbs().
  * The tables which were allocated in ipsec_spd_load_dbs() can now be freely used.
@@ -344,27 +929,59 @@ ipsec_status ipsec_spd_release_dbs(db_set_netif *dbs)
 	dbs->inbound_spd.first = NULL ;
 	dbs->inbound_spd.last = NULL ;
 	dbs->inbound_spd.table = NULL ;
+	dbs->inbound_spd.size = 0 ;
+	dbs->inbound_spd.free_list = NULL ;
+	dbs->inbound_spd.retired_list = NULL ;
+	dbs->inbound_spd.retired_tail = NULL ;
+	dbs->inbound_spd.tuples[0] = NULL ;
+	dbs->inbound_spd.tuples[1] = NULL ;
+	dbs->inbound_spd.hash = NULL ;
+	dbs->inbound_spd.hash_mask = 0 ;
 
 	dbs->outbound_spd.first = NULL ;
 	dbs->outbound_spd.last = NULL ;
 	dbs->outbound_spd.table = NULL ;
+	dbs->outbound_spd.size = 0 ;
+	dbs->outbound_spd.free_list = NULL ;
+	dbs->outbound_spd.retired_list = NULL ;
+	dbs->outbound_spd.retired_tail = NULL ;
+	dbs->outbound_spd.tuples[0] = NULL ;
+	dbs->outbound_spd.tuples[1] = NULL ;
+	dbs->outbound_spd.hash = NULL ;
+	dbs->outbound_spd.hash_mask = 0 ;
 
 	dbs->inbound_sad.first = NULL ;
 	dbs->inbound_sad.last = NULL ;
 	dbs->inbound_sad.table = NULL ;
+	dbs->inbound_sad.size = 0 ;
+	dbs->inbound_sad.free_list = NULL ;
+	dbs->inbound_sad.retired_list = NULL ;
+	dbs->inbound_sad.retired_tail = NULL ;
+	dbs->inbound_sad.hash = NULL ;
+	dbs->inbound_sad.hash_mask = 0 ;
 
 	dbs->outbound_sad.first = NULL ;
 	dbs->outbound_sad.last = NULL ;
 	dbs->outbound_sad.table = NULL ;
+	dbs->outbound_sad.size = 0 ;
+	dbs->outbound_sad.free_list = NULL ;
+	dbs->outbound_sad.retired_list = NULL ;
+	dbs->outbound_sad.retired_tail = NULL ;
+	dbs->outbound_sad.hash = NULL ;
+	dbs->outbound_sad.hash_mask = 0 ;
 
 	dbs->use_flag = IPSEC_FREE ;
 
+	ipsec_db_changed() ;
+
 	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_load_dbs", ("return = %d", IPSEC_STATUS_SUCCESS));
 	return IPSEC_STATUS_SUCCESS ;
 }
 
 /**
- * Gives back a pointer to the next free entry from the given SPD table.
+ * Gives back a pointer to the next free entry from the given SPD table. This is the head of the 
+ * free list, so the entry is not removed from the free list until it is used by ipsec_spd_add().
+ * Deleted entries are only put back to the free list once no reader uses them any more.
  *
  * @todo this function should probably be static
  * 
@@ -374,43 +991,32 @@ ipsec_status ipsec_spd_release_dbs(db_set_netif *dbs)
  */
 spd_entry *ipsec_spd_get_free(spd_table *table)
 {
-	int index ;
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
 	              "ipsec_spd_get_free", 
 				  ("table=%p",
 			      (void *)table)
 				 );
 
-	/* find first free entry */
-	for(index = 0; index < IPSEC_MAX_SPD_ENTRIES; index++)
-	{
-		if (table->table[index].use_flag == IPSEC_FREE)
-			break ;
-	}
-	/* if no free entry */
-	if (index >= IPSEC_MAX_SPD_ENTRIES)
-	{
-		return NULL ;
-	}
+	ipsec_spd_reclaim(table) ;
 
-	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_get_free", ("&table->table[index] = %p", &table->table[index]));
-	return &table->table[index] ;
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_get_free", ("table->free_list = %p", (void *)table->free_list));
+	return table->free_list ;
 }
 
 /**
  * Adds a Security Policy to an SPD table.
  *
  * The SPD entries are added to a statically allocated array of SPD structs. The size
- * is defined by IPSEC_MAX_SPD_ENRIES, so there cannot be added more entries added as this
- * constant. 
+ * is defined by IPSEC_MAX_SPD_ENRIES (or the size passed to ipsec_spd_init_dbs()), so there cannot be 
+ * added more entries added as this constant. 
  * The order of the entries within the table is not the same as the order within the array. 
  * The "table functionality" is implemented in a linked-list, so one must follow the links of 
  * the structure to get to the next entry.
  *
  * Implementation
- * -# This function first gets an empty entry out of the table passed by ipsec_spd_load_dbs().
+ * -# This function first gets an empty entry from the free list of the table.
  * -# If a free place was found, then the function arguments are copied to the appropriate place. 
- * -# Then the linked-list is re-linked.
+ * -# Then the linked-list is re-linked and the table is compiled, which publishes the new entry.
  *
  * @param src		IP source address
  * @param src_net	Netmask for the source address
@@ -422,13 +1028,13 @@ spd_entry *ipsec_spd_get_free(spd_table *table)
  * @param policy	The policy defining how the packet matching the entry must be processed
  * @param table		Pointer to the SPD table
  * @return A pointer to the added entry when adding was successful
- * @return NULL when the entry could not have been added (no free entry or duplicate) 
+ * @return NULL when the entry could not have been added (no free entry, duplicate or the previous 
+ * classifier version is still used by a reader, see ipsec_spd_compile()) 
  * @todo right now there is no special order implemented, maybe this is needed
  */
 spd_entry *ipsec_spd_add(__u32 src, __u32 src_net, __u32 dst, __u32 dst_net, __u8 proto, __u16 src_port, __u16 dst_port, __u8 policy, spd_table *table)
 {
 	spd_entry 	*free_entry ;
-	spd_entry	*tmp_entry ;
 	int			table_size ;
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
@@ -440,7 +1046,7 @@ spd_entry *ipsec_spd_add(__u32 src, __u32 src_net, __u32 dst, __u32 dst_net, __u
 	table_size = table->size ;
 
 	free_entry = ipsec_spd_get_free(table) ;
-	if (free_entry == NULL) 
+	if ((free_entry == NULL) || !ipsec_db_unused(table->retired)) 
 	{
 		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_add", ("%p", (void *)NULL) );
 		return NULL ;
@@ -456,7 +1062,9 @@ spd_entry *ipsec_spd_add(__u32 src, __u32 src_net, __u32 dst, __u32 dst_net, __u
 	free_entry->src_port = src_port ;
 	free_entry->dest_port = dst_port ;
 	free_entry->policy = policy ;
+	free_entry->sa = NULL ;
 
+	table->free_list = free_entry->next ;
 	free_entry->use_flag = IPSEC_USED ;
 
 	/* re-link entry */
@@ -472,17 +1080,15 @@ spd_entry *ipsec_spd_add(__u32 src, __u32 src_net, __u32 dst, __u32 dst_net, __u
 	}
 	else
 	{
-		/* go till end of list */
-		for(tmp_entry = table->first; tmp_entry->next != NULL; tmp_entry = tmp_entry->next)
-		{
-		}
-
-		/* inset at end */
-		free_entry->prev = tmp_entry ;
-		tmp_entry->next = free_entry ;
+		/* insert at the end */
+		free_entry->prev = table->last ;
+		table->last->next = free_entry ;
 		free_entry->next = NULL ;
+		table->last = free_entry ;
 	}
 
+	ipsec_spd_compile(table) ;
+
 	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_add", ("free_entry=%p", (void *)free_entry) );
 	return free_entry ;
 }
@@ -502,22 +1108,145 @@ ipsec_status ipsec_spd_add_sa(spd_entry *entry, sad_entry *sa)
 			 );
 
 	entry->sa = sa ;
+	ipsec_db_changed() ;
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_add_sa", ("return = %d", IPSEC_STATUS_SUCCESS) );
 	return IPSEC_STATUS_SUCCESS ;
 }
 
+/**
+ * Calculates the bucket of the SPD classifier for the (already masked) selectors of a class.
+ *
+ * @param tuple		position of the first entry of the class
+ * @param src		masked source address
+ * @param dest		masked destination address
+ * @param proto		transport layer protocol (0 if the class matches any protocol)
+ * @param mask		number of buckets of the classifier - 1
+ * @return index of the bucket (0..mask)
+ */
+static int ipsec_spd_hash(int tuple, __u32 src, __u32 dest, __u8 proto, int mask)
+{
+	__u32	hash ;
+
+	hash = src ^ dest ^ ((__u32)proto << 8) ^ (__u32)tuple ;
+	hash ^= hash >> 16 ;
+	hash ^= hash >> 8 ;
+
+	return (int)(hash & (__u32)mask) ;
+}
+
+/**
+ * Compiles an SPD table into a classifier (tuple space search) which is used by ipsec_spd_lookup().
+ *
+ * The entries are grouped into classes of entries which use the same network masks and either 
+ * match a specific or any protocol. The first entry of a class represents the class and the classes 
+ * are chained by spd_entry.tuple_next. Within a class the masked addresses and the protocol
+ * of a packet select one bucket of a hash table, so a lookup only needs one hash probe per class
+ * instead of checking every entry.
+ * To keep the first-match semantics of the table, every entry remembers its position in the table.
+ * The classes are ordered by their first entry and the buckets are ordered by position.
+ *
+ * The classifier is kept twice. The version which is not used by ipsec_spd_lookup() is rebuilt 
+ * and then published by switching spd_table.version, so lookups running at the same time always 
+ * see a complete classifier. The version which was replaced is retired: it is not rebuilt before 
+ * every reader which may use it has left (see ipsec_db_enter()).
+ *
+ * This function is called by ipsec_spd_load_dbs(), ipsec_spd_add(), ipsec_spd_del() and 
+ * ipsec_spd_flush(). It must be called again if the selectors of an entry are changed directly.
+ * It also invalidates the lookup caches.
+ *
+ * @param table	pointer to the SPD table
+ * @return IPSEC_STATUS_SUCCESS	if the new classifier was published
+ * @return IPSEC_STATUS_BUSY	if the previous classifier version is still used by a reader (nothing was changed)
+ */
+ipsec_status ipsec_spd_compile(spd_table *table)
+{
+	spd_entry	*tmp_entry ;
+	spd_entry	**hash ;
+	spd_entry	**link ;
+	spd_entry	**tuple_link ;
+	spd_entry	*tuple ;
+	int			version ;
+	int			position ;
+	int			tuple_count ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+              "ipsec_spd_compile", 
+			  ("table=%p",
+		      (void *)table)
+			 );
+
+	if(!ipsec_db_unused(table->retired))
+	{
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_compile", ("return = %d", IPSEC_STATUS_BUSY) );
+		return IPSEC_STATUS_BUSY ;
+	}
+
+	version = 1 - table->version ;
+	hash = table->hash + version*(table->hash_mask+1) ;
+	memset(hash, 0, (table->hash_mask+1)*sizeof(hash[0])) ;
+	table->tuples[version] = NULL ;
+	tuple_link = &table->tuples[version] ;
+	tuple_count = 0 ;
+
+	for(position = 0, tmp_entry = table->first; tmp_entry != NULL; position++, tmp_entry = tmp_entry->next)
+	{
+		tmp_entry->position[version] = position ;
+
+		/* find the class of the entry or open a new one */
+		for(tuple = table->tuples[version]; tuple != NULL; tuple = tuple->tuple_next[version])
+		{
+			if((tuple->src_netaddr == tmp_entry->src_netaddr) &&
+			   (tuple->dest_netaddr == tmp_entry->dest_netaddr) &&
+			   ((tuple->protocol == 0) == (tmp_entry->protocol == 0)))
+				break ;
+		}
+		if(tuple == NULL)
+		{
+			tuple = tmp_entry ;
+			tuple->tuple_next[version] = NULL ;
+			*tuple_link = tuple ;
+			tuple_link = &tuple->tuple_next[version] ;
+			tuple_count++ ;
+		}
+		tmp_entry->tuple[version] = tuple ;
+
+		/* append to the bucket, so that the bucket stays ordered by position */
+		for(link = &hash[ipsec_spd_hash(tuple->position[version], 
+		                                tmp_entry->src & tmp_entry->src_netaddr, 
+		                                tmp_entry->dest & tmp_entry->dest_netaddr, 
+		                                tmp_entry->protocol, table->hash_mask)];
+		    *link != NULL; link = &(*link)->hash_next[version])
+		{
+		}
+		tmp_entry->hash_next[version] = NULL ;
+		*link = tmp_entry ;
+	}
+
+	/* publish the new version, the readers must see it completely */
+	IPSEC_MEMORY_BARRIER() ;
+	table->version = version ;
+	table->retired = ipsec_db_advance() ;
+	ipsec_db_changed() ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_compile", ("tuple_count = %d", tuple_count) );
+	return IPSEC_STATUS_SUCCESS ;
+}
+
 /**
  * Deletes an Security Policy from an SPD table.
  *
  * This function is simple. If the pointer is within the range of the table, then
- * the entry is cleared. If the pointer does not match, nothing happens.
+ * the entry is removed and retired (it is put back to the free list once no reader uses it any more). 
+ * The SPD entries of the interface which refer to the SA lose it in the same epoch. 
+ * If the pointer does not match, nothing happens.
  *
  * @param entry Pointer to the SPD entry which needs to be deleted
  * @param table Pointer to the SPD table
  *
  * @return IPSEC_STATUS_SUCCESS	entry was deleted properly
  * @return IPSEC_STATUS_FAILURE entry could not be deleted because not found, or invalid pointer
+ * @return IPSEC_STATUS_BUSY	the previous classifier version is still used by a reader (see ipsec_spd_compile())
  * @todo right now there is no special order implemented, maybe this is needed
  */
 ipsec_status ipsec_spd_del(spd_entry *entry, spd_table *table)
@@ -532,7 +1261,7 @@ ipsec_status ipsec_spd_del(spd_entry *entry, spd_table *table)
 			 );
 
 	/* check range */		
-	if((entry >= table->table ) && (entry <= (table->table + (IPSEC_MAX_SPD_ENTRIES*sizeof(spd_entry)))))
+	if((entry >= table->table ) && (entry < (table->table + table->size)))
 	{
 		/* first clear associated SA if there is one */
 		/**@todo probably the SA should also be deleted */
@@ -545,6 +1274,12 @@ ipsec_status ipsec_spd_del(spd_entry *entry, spd_table *table)
 			return IPSEC_STATUS_FAILURE ;
 		}
 
+		if(!ipsec_db_unused(table->retired))
+		{
+			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_del", ("return = %d", IPSEC_STATUS_BUSY) );
+			return IPSEC_STATUS_BUSY ;
+		}
+
 		/* relink previous with next */
 		prev_ptr = entry->prev ;
 		next_ptr = entry->next ;
@@ -554,9 +1289,9 @@ ipsec_status ipsec_spd_del(spd_entry *entry, spd_table *table)
 			next_ptr->prev = prev_ptr ;
 
 		/* if removed last entry */
-		if(entry->next == NULL)
+		if(entry == table->last)
 		{
-			table->last == entry->prev ;
+			table->last = entry->prev ;
 		}
 
 		/* if removed first entry */
@@ -565,8 +1300,9 @@ ipsec_status ipsec_spd_del(spd_entry *entry, spd_table *table)
 			table->first = entry->next ;
 		}
 
-		/* clear field */
-		entry->use_flag = IPSEC_FREE ;
+		/* the old classifier version still holds the entry, so it is retired together with it */
+		ipsec_spd_compile(table) ;
+		ipsec_spd_retire(entry, table->retired, table) ;
 
 		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_del", ("return = %d", IPSEC_STATUS_SUCCESS) );
 		return IPSEC_STATUS_SUCCESS ;
@@ -576,6 +1312,47 @@ ipsec_status ipsec_spd_del(spd_entry *entry, spd_table *table)
 	return IPSEC_STATUS_FAILURE ;
 }
 
+/**
+ * Checks all the selector fields of an SPD entry against a packet. The port numbers
+ * are only checked if the protocol is TCP or UDP.
+ * A selector which has a value of 0 is the same as the '*' which means everything.
+ *
+ * @param	entry	Pointer to the SPD entry
+ * @param	header	Pointer to an IP packet which is checked
+ * @return 	1 if the entry matches the packet
+ * @return 	0 if the entry does not match the packet
+ */
+static int ipsec_spd_match(spd_entry *entry, ipsec_ip_header *header)
+{
+	ipsec_in_ip	*ip ;
+
+	ip = (ipsec_in_ip*) header ;
+
+	if(!ipsec_ip_addr_maskcmp(header->src, entry->src, entry->src_netaddr))
+		return 0 ;
+	if(!ipsec_ip_addr_maskcmp(header->dest, entry->dest, entry->dest_netaddr))
+		return 0 ;
+	if((entry->protocol != 0) && (entry->protocol != header->protocol))
+		return 0 ;
+
+	if(header->protocol == IPSEC_PROTO_TCP)
+	{
+		if((entry->src_port != 0) && (entry->src_port != ip->inner_header.tcp.src)) 
+			return 0 ;
+		if((entry->dest_port != 0) && (entry->dest_port != ip->inner_header.tcp.dest)) 
+			return 0 ;
+	}
+	else if(header->protocol == IPSEC_PROTO_UDP)
+	{
+		if((entry->src_port != 0) && (entry->src_port != ip->inner_header.udp.src)) 
+			return 0 ;
+		if((entry->dest_port != 0) && (entry->dest_port != ip->inner_header.udp.dest)) 
+			return 0 ;
+	}
+
+	return 1 ;
+}
+
 /**
  * Returns an pointer to an SPD entry which matches the packet.
  *
@@ -584,20 +1361,40 @@ ipsec_status ipsec_spd_del(spd_entry *entry, spd_table *table)
  *
  * Implementation
  *
- * This function checks all the selector fields of the SPD table. The port numbers
- * are only checked if the protocol is TCP or UDP.
- * An entry which has a value of 0 is the same as the '*' which means everything.
+ * First the lookup cache of the table is checked. It remembers the matching entry for the last 
+ * flows (addresses, protocol and ports) and is only used if no SPD or SAD was changed since the 
+ * result was stored. 
+ * Otherwise the lookup uses the classifier built by ipsec_spd_compile(). For every class, the 
+ * addresses of the packet are masked with the masks of the class and only the entries of the 
+ * matching bucket are checked (see ipsec_spd_match()). Because classes and buckets are ordered by 
+ * position, the search stops as soon as no better (earlier) entry can be found. Like this the result
+ * is the same as the first matching entry of the table. The result is then stored in the cache.
+ * The lookup takes no locks. It uses the classifier version published last and tags the cached 
+ * result with the generation it started in, so a result found while the tables are changed is 
+ * never used afterwards. Several readers may look up the same table: a cache entry is only used if 
+ * its sequence count did not change while it was copied, and a result is only stored by the reader
+ * which claimed the entry (the others skip storing it).
  * 
  * @param	header	Pointer to an IP packet which is checked
  * @param 	table	Pointer to the SPD inbound/outbound table
  * @return 	Pointer to the matching SPD entry
  * @return 	NULL if no entry matched 
- * @todo port checking should be implemnted also
  */
 spd_entry *ipsec_spd_lookup(ipsec_ip_header *header, spd_table *table)
 {
 	spd_entry	*tmp_entry ;
+	spd_entry	*match ;
+	spd_entry	*tuple ;
 	ipsec_in_ip	*ip ;
+	spd_cache_entry	*cache ;
+	spd_cache_entry	cached ;
+	spd_entry	**buckets ;
+	__u16		src_port ;
+	__u16		dest_port ;
+	__u32		hash ;
+	__u32		generation ;
+	__u32		sequence ;
+	int			version ;
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
               "ipsec_spd_lookup", 
@@ -607,44 +1404,88 @@ spd_entry *ipsec_spd_lookup(ipsec_ip_header *header, spd_table *table)
 
 	ip = (ipsec_in_ip*) header ;
 
-	/* compare and return when all fields match */
-	for(tmp_entry = table->first; tmp_entry != NULL; tmp_entry = tmp_entry->next)
+	generation = db_generation ;
+	IPSEC_MEMORY_BARRIER() ;
+
+	/* get the cache entry of this flow */
+	src_port = 0 ;
+	dest_port = 0 ;
+	if(header->protocol == IPSEC_PROTO_TCP)
+	{
+		src_port = ip->inner_header.tcp.src ;
+		dest_port = ip->inner_header.tcp.dest ;
+	}
+	else if(header->protocol == IPSEC_PROTO_UDP)
 	{
-		if(ipsec_ip_addr_maskcmp(header->src, tmp_entry->src, tmp_entry->src_netaddr))
+		src_port = ip->inner_header.udp.src ;
+		dest_port = ip->inner_header.udp.dest ;
+	}
+	hash = header->src ^ header->dest ^ (((__u32)src_port << 16) | dest_port) ^ header->protocol ;
+	hash ^= hash >> 16 ;
+	hash ^= hash >> 8 ;
+	cache = &table->cache[hash & (IPSEC_SPD_CACHE_SIZE-1)] ;
+
+	/* copy the entry, it is only valid if no other reader stored a result meanwhile */
+	sequence = cache->sequence ;
+	IPSEC_MEMORY_BARRIER() ;
+	memcpy(&cached, (void *)cache, sizeof(cached)) ;
+	IPSEC_MEMORY_BARRIER() ;
+	if(((sequence & 1) == 0) && (cache->sequence == sequence) &&
+	   (cached.generation == generation) &&
+	   (cached.src == header->src) && (cached.dest == header->dest) &&
+	   (cached.protocol == header->protocol) &&
+	   (cached.src_port == src_port) && (cached.dest_port == dest_port))
+	{
+		ipsec_db_count(&table->cache_hits) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_lookup", ("cached.spd = %p", (void *) cached.spd) );
+		return cached.spd ;
+	}
+	ipsec_db_count(&table->cache_misses) ;
+
+	match = NULL ;
+	version = table->version ;
+	buckets = table->hash + version*(table->hash_mask+1) ;
+	for(tuple = table->tuples[version]; tuple != NULL; tuple = tuple->tuple_next[version])
+	{
+		/* all entries of this and the following classes come after the match */
+		if((match != NULL) && (tuple->position[version] > match->position[version]))
+			break ;
+
+		for(tmp_entry = buckets[ipsec_spd_hash(tuple->position[version], 
+		                                       header->src & tuple->src_netaddr, 
+		                                       header->dest & tuple->dest_netaddr, 
+		                                       (tuple->protocol == 0) ? 0 : header->protocol, table->hash_mask)];
+		    tmp_entry != NULL; tmp_entry = tmp_entry->hash_next[version])
 		{
-			if(ipsec_ip_addr_maskcmp(header->dest, tmp_entry->dest, tmp_entry->dest_netaddr))
+			if((match != NULL) && (tmp_entry->position[version] > match->position[version]))
+				break ;
+
+			if((tmp_entry->tuple[version] == tuple) && ipsec_spd_match(tmp_entry, header))
 			{
-				if((tmp_entry->protocol == 0) || tmp_entry->protocol == header->protocol)
-				{
-					if(header->protocol == IPSEC_PROTO_TCP)
-					{
-						if((tmp_entry->src_port == 0) || (tmp_entry->src_port == ip->inner_header.tcp.src)) 
-							if( (tmp_entry->dest_port == 0) || (tmp_entry->dest_port == ip->inner_header.tcp.dest)) 
-							{
-								IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_lookup", ("tmp_entry = %p", (void *) tmp_entry) );
-								return tmp_entry ;
-							}
-					}
-					else if(header->protocol == IPSEC_PROTO_UDP)
-					{
-							if((tmp_entry->src_port == 0) || (tmp_entry->src_port == ip->inner_header.udp.src)) 
-								if( (tmp_entry->dest_port == 0) || (tmp_entry->dest_port == ip->inner_header.udp.dest)) 
-								{
-									IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_lookup", ("tmp_entry = %p", (void *) tmp_entry) );
-									return tmp_entry ;
-								}
-					} 
-					else
-					{
-						IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_lookup", ("tmp_entry = %p", (void *) tmp_entry) );
-						return tmp_entry ;
-					}
-				}
+				match = tmp_entry ;
+				break ;
 			}
 		}
 	}
-	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_lookup", ("return = %p", (void *) NULL) );
-	return NULL ;
+
+	/* store the result if no other reader is storing one in this entry */
+	sequence = cache->sequence ;
+	if((match != NULL) && ((sequence & 1) == 0) && IPSEC_ATOMIC_CAS(&cache->sequence, sequence, sequence + 1))
+	{
+		IPSEC_MEMORY_BARRIER() ;
+		cache->src = header->src ;
+		cache->dest = header->dest ;
+		cache->protocol = header->protocol ;
+		cache->src_port = src_port ;
+		cache->dest_port = dest_port ;
+		cache->spd = match ;
+		cache->generation = generation ;
+		IPSEC_MEMORY_BARRIER() ;
+		cache->sequence = sequence + 2 ;
+	}
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_lookup", ("match = %p", (void *) match) );
+	return match ;
 }
 
 /**
@@ -741,11 +1582,15 @@ void ipsec_spd_print(spd_table *table)
 		ipsec_spd_print_single(tmp_ptr) ;
 	}
 
+	printf("      lookup cache: %lu hits, %lu misses\n", table->cache_hits, table->cache_misses) ;
+
 	return ;
 }
 
 /**
- * Gives back a pointer to the next free entry from the given SA table.
+ * Gives back a pointer to the next free entry from the given SA table. This is the head of the 
+ * free list, so the entry is not removed from the free list until it is used by ipsec_sad_add().
+ * Deleted entries are only put back to the free list once no reader uses them any more.
  *
  * @todo this function should probably be static
  * 
@@ -755,48 +1600,347 @@ void ipsec_spd_print(spd_table *table)
  */
 sad_entry *ipsec_sad_get_free(sad_table *table)
 {
-	int index ;
+	ipsec_sad_reclaim(table) ;
+	return table->free_list ;
+}
 
-	/* find first free entry */
-	for(index = 0; index < IPSEC_MAX_SAD_ENTRIES; index++)
+/**
+ * Sets up the state of an SA which is derived from its keys (the expanded 3DES or AES keys, the
+ * GHASH key, the ChaCha20 key and the HMAC state after the inner and outer pad), so that this does not need to be 
+ * done again for every packet.
+ *
+ * The anti-replay state is reset to an empty window of replay_win sequence numbers and the counter
+ * of packets refused for lack of sequence numbers is cleared.
+ *
+ * This function is called by ipsec_sad_add() and ipsec_spd_load_dbs(). It must be called again
+ * whenever the keys of an SA are changed.
+ *
+ * @param entry	pointer to the SA entry
+ * @return IPSEC_STATUS_SUCCESS	if the key schedules were set up properly
+ * @return IPSEC_STATUS_BAD_KEY	if the encryption key was rejected (bad parity or weak key)
+ */
+ipsec_status ipsec_sad_prepare(sad_entry *entry)
+{
+	int ret_val ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsec_sad_prepare", 
+				  ("entry=%p",
+			      (void *)entry)
+				 );
+
+	switch(entry->enc_alg)
 	{
-		if (table->table[index].use_flag == IPSEC_FREE)
+		case IPSEC_3DES:
+			ret_val = cipher_3des_set_key(entry->enckey, entry->enc_ctx.des) ;
+			break ;
+		case IPSEC_AES_128_CBC:
+		case IPSEC_AES_128_CTR:
+			ret_val = cipher_aes_set_key(entry->enckey, IPSEC_AES_128_KEY_LEN, &entry->enc_ctx.aes) ;
+			break ;
+		case IPSEC_AES_256_CBC:
+		case IPSEC_AES_256_CTR:
+			ret_val = cipher_aes_set_key(entry->enckey, IPSEC_AES_256_KEY_LEN, &entry->enc_ctx.aes) ;
+			break ;
+		case IPSEC_AES_128_GCM_8:
+		case IPSEC_AES_128_GCM_12:
+		case IPSEC_AES_128_GCM_16:
+			ret_val = cipher_gcm_set_key(entry->enckey, IPSEC_AES_128_KEY_LEN, &entry->enc_ctx.gcm) ;
+			break ;
+		case IPSEC_AES_256_GCM_8:
+		case IPSEC_AES_256_GCM_12:
+		case IPSEC_AES_256_GCM_16:
+			ret_val = cipher_gcm_set_key(entry->enckey, IPSEC_AES_256_KEY_LEN, &entry->enc_ctx.gcm) ;
+			break ;
+		case IPSEC_CHACHA20_POLY1305:
+			cipher_chacha_set_key(entry->enckey, &entry->enc_ctx.chacha) ;
+			ret_val = 0 ;
+			break ;
+		default:
+			ret_val = 0 ;
 			break ;
 	}
-	/* if no free entry */
-	if (index >= IPSEC_MAX_SAD_ENTRIES)
+	if(ret_val != 0)
 	{
-		return NULL ;
+		entry->key_state = IPSEC_KEYS_BAD ;
+		IPSEC_LOG_ERR("ipsec_sad_prepare", IPSEC_STATUS_BAD_KEY, ("encryption key of SA with spi=%08lx was rejected", ipsec_ntohl(entry->spi))) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_sad_prepare", ("return = %d", IPSEC_STATUS_BAD_KEY) );
+		return IPSEC_STATUS_BAD_KEY ;
+	}
+
+	switch(entry->auth_alg)
+	{
+		case IPSEC_HMAC_MD5:
+			hmac_md5_init(&entry->auth_ctx.md5, entry->authkey, IPSEC_AUTH_MD5_KEY_LEN) ;
+			break ;
+		case IPSEC_HMAC_SHA1:
+			hmac_sha1_init(&entry->auth_ctx.sha1, entry->authkey, IPSEC_AUTH_SHA1_KEY_LEN) ;
+			break ;
+		case IPSEC_HMAC_SHA256:
+			hmac_sha256_init(&entry->auth_ctx.sha256, entry->authkey, IPSEC_AUTH_SHA256_KEY_LEN) ;
+			break ;
+		case IPSEC_HMAC_SHA384:
+			hmac_sha384_init(&entry->auth_ctx.sha512, entry->authkey, IPSEC_AUTH_SHA384_KEY_LEN) ;
+			break ;
+		case IPSEC_HMAC_SHA512:
+			hmac_sha512_init(&entry->auth_ctx.sha512, entry->authkey, IPSEC_AUTH_SHA512_KEY_LEN) ;
+			break ;
+		default:
+			break ;
+	}
+
+	/* a new salt for the CBC IVs, so they do not repeat if the SA is set up again with the same key */
+	if(((entry->enc_alg == IPSEC_3DES) || (entry->enc_alg == IPSEC_AES_128_CBC) || (entry->enc_alg == IPSEC_AES_256_CBC)) && 
+	   (ipsec_ivgen_prepare(entry) != IPSEC_STATUS_SUCCESS))
+		IPSEC_LOG_AUD("ipsec_sad_prepare", IPSEC_AUDIT_FAILURE, ("no random IV salt for SA with spi=%08lx, the IVs are the encrypted sequence numbers", ipsec_ntohl(entry->spi))) ;
+
+	/* the outer headers are built for the tunnel of the table (see ipsec_sad_set_tunnel()), the IP IDs start at a random number */
+	entry->outer[0].valid = 0 ;
+	entry->outer[1].valid = 0 ;
+	entry->outer_version = 0 ;
+	if(ipsec_ivgen_random(IPSEC_IVGEN_SETUP, (unsigned char *)&entry->ip_id_base, 2) != IPSEC_STATUS_SUCCESS)
+		entry->ip_id_base = 0 ;
+
+	ipsec_init_replay_window(&entry->replay, entry->replay_win) ;
+	entry->seq_exhausted = 0 ;
+
+	entry->key_state = IPSEC_KEYS_READY ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_sad_prepare", ("return = %d", IPSEC_STATUS_SUCCESS) );
+	return IPSEC_STATUS_SUCCESS ;
+}
+
+/**
+ * Reserves the sequence numbers of count outbound packets of an SA.
+ *
+ * The sequence number of the SA is advanced with IPSEC_ATOMIC_CAS(), so several threads may 
+ * encapsulate packets of the same SA at the same time and a batch can reserve the numbers of all 
+ * its packets at once. The sequence number must never cycle (RFC 2402, 3.3.2 and RFC 2406, 3.3.3): 
+ * if not enough numbers are left, nothing is reserved, the refused packets are counted in 
+ * seq_exhausted (also with IPSEC_ATOMIC_CAS()) and IPSEC_SA_EXHAUSTED() is called once by the thread 
+ * which counted the first of them, so that the SA can be replaced.
+ *
+ * @param sa		pointer to the SA
+ * @param count		number of sequence numbers to reserve (at least 1)
+ * @param first		returns the first reserved sequence number (host byte order, the first packet of an SA gets 1)
+ * @return IPSEC_STATUS_SUCCESS			if the sequence numbers first..first+count-1 are reserved
+ * @return IPSEC_STATUS_SEQ_EXHAUSTED	if the SA has less than count sequence numbers left
+ */
+ipsec_status ipsec_sad_next_sequence(sad_entry *sa, int count, __u32 *first)
+{
+	__u32	current ;
+	__u32	exhausted ;
+	__u32	counted ;
+
+	do
+	{
+		current = *(volatile __u32 *)&sa->sequence_number ;
+		if(0xFFFFFFFFUL - current < (__u32)count)
+		{
+			/* the thread which counts the first refused packets reports the SA, the others only count (the counter saturates, so it is never 0 again) */
+			do
+			{
+				exhausted = *(volatile __u32 *)&sa->seq_exhausted ;
+				counted = (exhausted + (__u32)count < exhausted) ? 0xFFFFFFFFUL : exhausted + (__u32)count ;
+			}
+			while(!IPSEC_ATOMIC_CAS(&sa->seq_exhausted, exhausted, counted)) ;
+			if(exhausted == 0)
+			{
+				IPSEC_LOG_AUD("ipsec_sad_next_sequence", IPSEC_AUDIT_SEQ_EXHAUSTED, ("sequence numbers of SA with spi=%08lx are used up", ipsec_ntohl(sa->spi)) );
+				IPSEC_SA_EXHAUSTED(sa) ;
+			}
+			return IPSEC_STATUS_SEQ_EXHAUSTED ;
+		}
+	}
+	while(!IPSEC_ATOMIC_CAS(&sa->sequence_number, current, current + (__u32)count)) ;
+
+	*first = current + 1 ;
+	return IPSEC_STATUS_SUCCESS ;
+}
+
+/**
+ * Builds an outer header template of an SA for a pair of tunnel addresses: the IP header with 
+ * the fields which are the same for all packets, the start of the AH or ESP header and the 
+ * checksum of the constant part of the IP header.
+ *
+ * @param sa		pointer to the SA
+ * @param outer		template to build (not used by any packet)
+ * @param src		tunnel source address (network order)
+ * @param dest		tunnel destination address (network order)
+ * @return void
+ */
+static void ipsec_sad_outer_template(sad_entry *sa, ipsec_outer_template *outer, __u32 src, __u32 dest)
+{
+	ipsec_ip_header *ip = &outer->ip ;
+	int icv_len ;
+
+	ip->v_hl 	 = 0x45 ;
+	ip->tos 	 = 0 ;
+	ip->len 	 = 0 ;
+	ip->id 		 = 0 ;
+	ip->offset 	 = 0 ;
+	ip->ttl 	 = IPSEC_OUTER_TTL ;
+	ip->protocol = sa->protocol ;
+	ip->chksum 	 = 0 ;
+	ip->src 	 = src ;
+	ip->dest 	 = dest ;
+
+	/* fragment offset, TTL, protocol and the addresses (the checksum is 0) */
+	outer->sum = ipsec_chksum_add(&ip->offset, IPSEC_MIN_IPHDR_SIZE - 6, 0) ;
+
+	if(sa->protocol == IPSEC_PROTO_AH)
+	{
+		icv_len = IPSEC_AUTH_ICV_LEN(sa->auth_alg) ;
+		outer->ipsec[0] = 0x04 ;		/* IP in IP */
+		outer->ipsec[1] = (IPSEC_AH_HDR_SIZE + icv_len)/4 - 2 ;
+		outer->ipsec[2] = 0 ;
+		outer->ipsec[3] = 0 ;
+		memcpy(&outer->ipsec[4], &sa->spi, 4) ;
+	}
+	else
+		memcpy(outer->ipsec, &sa->spi, 4) ;
+
+	outer->valid = 1 ;
+}
+
+/**
+ * Sets the tunnel addresses of an SAD table and builds the outer header templates of its SAs 
+ * for them. SAs added later get their template from ipsec_sad_add().
+ *
+ * The templates used by the packets are never changed: the other template of every SA is built 
+ * and then published (like the classifier versions of ipsec_spd_compile()). Outbound packets 
+ * must be encapsulated between ipsec_db_enter() and ipsec_db_leave() (or with the epoch held), 
+ * so that the replaced templates are not rebuilt while a packet still copies them.
+ *
+ * @param table		pointer to the SAD table
+ * @param src		tunnel source address (network order)
+ * @param dest		tunnel destination address (network order)
+ * @return IPSEC_STATUS_SUCCESS	if the templates were published
+ * @return IPSEC_STATUS_BUSY	if the previous templates are still used by a reader (nothing was changed, 
+ * the packets get headers without the templates until the function is called again)
+ */
+ipsec_status ipsec_sad_set_tunnel(sad_table *table, __u32 src, __u32 dest)
+{
+	sad_entry	*entry ;
+	int			version ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsec_sad_set_tunnel", 
+				  ("table=%p, src=%lu, dest=%lu",
+			      (void *)table, src, dest)
+				 );
+
+	if(!ipsec_db_unused(table->outer_retired))
+	{
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_sad_set_tunnel", ("return = %d", IPSEC_STATUS_BUSY) );
+		return IPSEC_STATUS_BUSY ;
+	}
+
+	table->tunnel_src = src ;
+	table->tunnel_dst = dest ;
+	for(entry = table->first; entry != NULL; entry = entry->next)
+	{
+		version = 1 - entry->outer_version ;
+		ipsec_sad_outer_template(entry, &entry->outer[version], src, dest) ;
+		/* publish the template, the packets must see it completely */
+		IPSEC_MEMORY_BARRIER() ;
+		entry->outer_version = version ;
 	}
+	table->outer_retired = ipsec_db_advance() ;
 
-	return &table->table[index] ;
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_sad_set_tunnel", ("return = %d", IPSEC_STATUS_SUCCESS) );
+	return IPSEC_STATUS_SUCCESS ;
+}
+
+/**
+ * Sets up the outer IP header and the start of the AH header (up to the SPI) or of the ESP 
+ * header (the SPI) of an outbound packet from the template of the SA (see ipsec_sad_set_tunnel()). 
+ * The SA is not changed: if the template was built for other tunnel addresses, the headers are 
+ * built for this packet only. The IP ID follows the sequence number, so it is unique for 2^16 
+ * packets without a shared counter.
+ *
+ * The TOS is 0, ipsec_sad_outer_chksum() sets the checksum once the TOS is set.
+ *
+ * @param sa		pointer to the SA
+ * @param header	outer IP header of the packet, followed by the AH or ESP header
+ * @param src		tunnel source address (network order)
+ * @param dest		tunnel destination address (network order)
+ * @param len		total length of the packet (host order)
+ * @param sequence	sequence number of the packet
+ * @return void
+ */
+void ipsec_sad_outer_header(sad_entry *sa, ipsec_ip_header *header, __u32 src, __u32 dest, __u16 len, __u32 sequence)
+{
+	ipsec_outer_template	*outer ;
+	ipsec_outer_template	local ;
+
+	outer = &sa->outer[sa->outer_version] ;
+	if(!outer->valid || (outer->ip.src != src) || (outer->ip.dest != dest))
+	{
+		ipsec_sad_outer_template(sa, &local, src, dest) ;
+		outer = &local ;
+	}
+
+	memcpy(header, &outer->ip, IPSEC_MIN_IPHDR_SIZE) ;
+	memcpy(((__u8 *)header) + IPSEC_MIN_IPHDR_SIZE, outer->ipsec, (sa->protocol == IPSEC_PROTO_AH) ? 8 : 4) ;
+	header->len = ipsec_htons(len) ;
+	header->id = ipsec_htons((__u16)(sa->ip_id_base + sequence)) ;
+}
+
+/**
+ * Sets the checksum of an outer IP header built by ipsec_sad_outer_header(): the words which 
+ * change per packet (version and TOS, length and ID) are added to the sum of the template. 
+ * Without a template for the addresses of the header, the constant part is summed up too.
+ *
+ * @param sa		pointer to the SA
+ * @param header	outer IP header (only the TOS, length and ID may differ from the template)
+ * @return void
+ */
+void ipsec_sad_outer_chksum(sad_entry *sa, ipsec_ip_header *header)
+{
+	ipsec_outer_template	*outer ;
+	__u32	sum ;
+	__u16	first ;
+
+	outer = &sa->outer[sa->outer_version] ;
+	if(outer->valid && (outer->ip.src == header->src) && (outer->ip.dest == header->dest))
+		sum = outer->sum ;
+	else
+	{
+		header->chksum = 0 ;
+		sum = ipsec_chksum_add(&header->offset, IPSEC_MIN_IPHDR_SIZE - 6, 0) ;
+	}
+
+	memcpy(&first, header, 2) ;
+	header->chksum = (__u16)~ipsec_chksum_fold(sum + first + header->len + header->id) ;
 }
 
 /**
  * Adds an Security Association to an SA table.
  *
  * The SA entries are added to a statically allocated array of SAD structs. The size
- * is defined by IPSEC_MAX_SAD_ENTRIES, so there cannot be added more entries added as this
- * constant. 
+ * is defined by IPSEC_MAX_SAD_ENTRIES (or the size passed to ipsec_spd_init_dbs()), so there cannot be 
+ * added more entries added as this constant. 
  * The order of the entries within the table is not the same as the order within the array. 
  * The "table functionality" is implemented in a linked-list, so one must follow the links of 
  * the structure to get to the next entry.
  *
  * Implementation
- * -# This function first gets an empty entry out of the table passed by ipsec_spd_load_dbs().
+ * -# This function first gets an empty entry from the free list of the table.
  * -# If a free place was found, then the function arguments are copied to the appropriate place. 
- * -# Then the linked-list is re-linked.
+ * -# The key schedules are set up. If the key is rejected, the entry is not added (and stays on 
+ * the free list).
+ * -# Then the linked-list is re-linked and the entry is added to the SPI index, which publishes it.
  *
  * @param entry		pointer to the SA structure which will be copied into the table
  * @param table		pointer to the table where the SA is added
  * @return A pointer to the added entry when adding was successful
- * @return NULL when the entry could not have been added (no free entry or duplicate) 
+ * @return NULL when the entry could not have been added (no free entry, duplicate or bad key) 
  * @todo right now there is no special order implemented, maybe this is needed
  */
 sad_entry *ipsec_sad_add(sad_entry *entry, sad_table *table) 
 {
 	sad_entry 	*free_entry ;
-	sad_entry	*tmp_entry ;
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
 	              "ipsec_sad_add", 
@@ -825,6 +1969,15 @@ sad_entry *ipsec_sad_add(sad_entry *entry, sad_table *table)
 	free_entry->auth_alg = entry->auth_alg ;
 	memcpy(free_entry->authkey, entry->authkey, IPSEC_MAX_AUTHKEY_LEN) ;
 
+	if(ipsec_sad_prepare(free_entry) != IPSEC_STATUS_SUCCESS)
+	{
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_sad_add", ("return = %p", (void *) NULL) );
+		return NULL ;
+	}
+	if((table->tunnel_src != 0) || (table->tunnel_dst != 0))
+		ipsec_sad_outer_template(free_entry, &free_entry->outer[0], table->tunnel_src, table->tunnel_dst) ;
+
+	table->free_list = free_entry->next ;
 	free_entry->use_flag = IPSEC_USED ;
 
 	/* re-link entry */
@@ -840,16 +1993,16 @@ sad_entry *ipsec_sad_add(sad_entry *entry, sad_table *table)
 	}
 	else
 	{
-		/* go till end of list */
-		for(tmp_entry = table->first; tmp_entry->next != NULL; tmp_entry = tmp_entry->next)
-		{
-		}
-		/* inset at end */
-		free_entry->prev = tmp_entry ;
-		tmp_entry->next = free_entry ;
+		/* insert at the end */
+		free_entry->prev = table->last ;
+		table->last->next = free_entry ;
 		free_entry->next = NULL ;
+		table->last = free_entry ;
 	}
 
+	ipsec_sad_hash_insert(free_entry, table) ;
+	ipsec_db_changed() ;
+
 	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_sad_add", ("free_entry = %p", (void *) free_entry) );
 	return free_entry ;
 }
@@ -858,7 +2011,9 @@ sad_entry *ipsec_sad_add(sad_entry *entry, sad_table *table)
  * Deletes an Security Association from an SA table.
  *
  * This function is simple. If the pointer is within the range of the table, then
- * the entry is cleared. If the pointer does not match, nothing happens.
+ * the entry is removed and retired (it is put back to the free list once no reader uses it any more). 
+ * The SPD entries of the interface which refer to the SA lose it in the same epoch. 
+ * If the pointer does not match, nothing happens.
  *
  * @param entry Pointer to the SA entry which needs to be deleted
  * @param table Pointer to the SA table
@@ -879,7 +2034,7 @@ ipsec_status ipsec_sad_del(sad_entry *entry, sad_table *table)
 				 );
 
 	/* check range */		
-	if((entry >= table->table ) && (entry <= (table->table + (IPSEC_MAX_SAD_ENTRIES*sizeof(sad_entry)))))
+	if((entry >= table->table ) && (entry < (table->table + table->size)))
 	{
 		/* relink table */
 	
@@ -898,9 +2053,9 @@ ipsec_status ipsec_sad_del(sad_entry *entry, sad_table *table)
 			next_ptr->prev = prev_ptr ;
 
 		/* if removed last entry */
-		if(entry->next == NULL)
+		if(entry == table->last)
 		{
-			table->last == entry->prev ;
+			table->last = entry->prev ;
 		}
 
 		/* if removed first entry */
@@ -909,9 +2064,10 @@ ipsec_status ipsec_sad_del(sad_entry *entry, sad_table *table)
 			table->first = entry->next ;
 		}
 
-		/* clear field */
-		entry->use_flag = IPSEC_FREE ;
-
+		ipsec_sad_hash_remove(entry, table) ;
+		ipsec_sad_unlink(entry, table) ;
+		ipsec_db_changed() ;
+		ipsec_sad_retire(entry, ipsec_db_advance(), table) ;
 
 		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_sad_del", ("return = %d", IPSEC_STATUS_SUCCESS) );
 		return IPSEC_STATUS_SUCCESS ;
@@ -928,7 +2084,8 @@ ipsec_status ipsec_sad_del(sad_entry *entry, sad_table *table)
  * for outgoing packets the packet must be checked against the outbound SAD.
  *
  * Implementation
- * It simply loops over all entries and returns the first match.
+ * Only the SAs in the bucket of the SPI index which belongs to spi are compared. The first match 
+ * (in the order of the table) is returned.
  *
  * @param dest	destination IP address
  * @param proto	IPsec protocol
@@ -948,13 +2105,13 @@ sad_entry *ipsec_sad_lookup(__u32 dest, __u8 proto, __u32 spi, sad_table *table)
 				 );
 
 	/* compare and return when all fields match */
-	for(tmp_entry = table->first; tmp_entry != NULL; tmp_entry = tmp_entry->next)
+	for(tmp_entry = table->hash[ipsec_sad_hash(spi, table->hash_mask)]; tmp_entry != NULL; tmp_entry = tmp_entry->hash_next)
 	{
-		if(ipsec_ip_addr_maskcmp(dest, tmp_entry->dest, tmp_entry->dest_netaddr))
+		if(tmp_entry->spi == spi)
 		{
 			if(tmp_entry->protocol == proto)
 			{
-				if(tmp_entry->spi == spi)
+				if(ipsec_ip_addr_maskcmp(dest, tmp_entry->dest, tmp_entry->dest_netaddr))
 				{
 					IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_sad_lookup", ("tmp_entry = %p", (void *)tmp_entry) );
 					return tmp_entry ;
@@ -1070,42 +2227,125 @@ __u32 ipsec_sad_get_spi(ipsec_ip_header *header)
  * Flushes an SPD table and sets a new default entry. The default entry allows to keep 
  * a door open for IKE.
  *
+ * The default entry is published in the same classifier version which drops the flushed entries, 
+ * so a reader finds either the old policies or the default entry. It takes a free entry, or the 
+ * flushed entry with the same selectors and policy if the table is full (its SA is removed). 
+ * The flushed entries are retired like the ones removed by ipsec_spd_del().
+ *
  * @param table			pointer to the SPD table
  * @param def_entry 	pointer to the default entry
  * @return IPSEC_STATUS_SUCCESS if the flush was successful
- * @return IPSEC_STATUS_FAILURE if the flush failed
+ * @return IPSEC_STATUS_FAILURE if the table is full and holds no entry equal to the default entry (the table is unchanged)
+ * @return IPSEC_STATUS_BUSY if the previous classifier version is still used by a reader (the table is unchanged, 
+ * the function must be called again later)
  */
 ipsec_status ipsec_spd_flush(spd_table *table, spd_entry *def_entry)
 {
-	memset(table->table, 0, sizeof(spd_entry)*IPSEC_MAX_SPD_ENTRIES) ;
-	table->first = NULL ;
-	table->first = NULL ;
+	spd_entry	*entry ;
+	spd_entry	*next_entry ;
+	spd_entry	*default_entry ;
 
-	if(ipsec_spd_add(	def_entry->src,
-						def_entry->src_netaddr,
-						def_entry->dest,
-						def_entry->dest_netaddr,
-						def_entry->protocol,
-						def_entry->src_port,
-						def_entry->dest_port,
-						def_entry->policy,
-						table) == NULL)
-		return IPSEC_STATUS_FAILURE ;
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsec_spd_flush", 
+				  ("table=%p, def_entry=%p",
+			      (void *)table, (void *)def_entry)
+				 );
+
+	if(!ipsec_db_unused(table->retired))
+	{
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_flush", ("return = %d", IPSEC_STATUS_BUSY) );
+		return IPSEC_STATUS_BUSY ;
+	}
 
+	default_entry = ipsec_spd_get_free(table) ;
+	if(default_entry != NULL)
+	{
+		table->free_list = default_entry->next ;
+		default_entry->src = def_entry->src ;
+		default_entry->src_netaddr = def_entry->src_netaddr ;
+		default_entry->dest = def_entry->dest ;
+		default_entry->dest_netaddr = def_entry->dest_netaddr ;
+		default_entry->protocol = def_entry->protocol ;
+		default_entry->src_port = def_entry->src_port ;
+		default_entry->dest_port = def_entry->dest_port ;
+		default_entry->policy = def_entry->policy ;
+		default_entry->use_flag = IPSEC_USED ;
+	}
+	else
+	{
+		/* the selectors of a published entry must not change, only an entry equal to the default entry may be kept */
+		for(default_entry = table->first; default_entry != NULL; default_entry = default_entry->next)
+		{
+			if((default_entry->src == def_entry->src) &&
+			   (default_entry->src_netaddr == def_entry->src_netaddr) &&
+			   (default_entry->dest == def_entry->dest) &&
+			   (default_entry->dest_netaddr == def_entry->dest_netaddr) &&
+			   (default_entry->protocol == def_entry->protocol) &&
+			   (default_entry->src_port == def_entry->src_port) &&
+			   (default_entry->dest_port == def_entry->dest_port) &&
+			   (default_entry->policy == def_entry->policy))
+				break ;
+		}
+		if(default_entry == NULL)
+		{
+			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_flush", ("return = %d", IPSEC_STATUS_FAILURE) );
+			return IPSEC_STATUS_FAILURE ;
+		}
+		/* the list links are only used by the writer */
+		if(default_entry->prev != NULL)
+			default_entry->prev->next = default_entry->next ;
+		else
+			table->first = default_entry->next ;
+		if(default_entry->next != NULL)
+			default_entry->next->prev = default_entry->prev ;
+	}
+	*(sad_entry * volatile *)&default_entry->sa = NULL ;
+	default_entry->prev = NULL ;
+	default_entry->next = NULL ;
+
+	entry = table->first ;
+	table->first = default_entry ;
+	table->last = default_entry ;
+	ipsec_spd_compile(table) ;
+	for( ; entry != NULL; entry = next_entry)
+	{
+		next_entry = entry->next ;
+		ipsec_spd_retire(entry, table->retired, table) ;
+	}
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsec_spd_flush", ("return = %d", IPSEC_STATUS_SUCCESS) );
 	return IPSEC_STATUS_SUCCESS ;
 }
 
 /**
- * Flushes an SAD table.
+ * Flushes an SAD table. The flushed entries are retired like the ones removed by ipsec_sad_del() and are 
+ * removed from the SPD entries of the interface.
  *
  * @param table	pointer to the SAD table
  * @return IPSEC_STATUS_SUCCESS if the flush was successful
  */
 ipsec_status ipsec_sad_flush(sad_table *table)
 {
-	memset(table->table, 0, sizeof(spd_entry)*IPSEC_MAX_SAD_ENTRIES) ;
-	table->first = NULL ;
+	sad_entry	*entry ;
+	sad_entry	*next_entry ;
+	__u32		epoch ;
+	int			index ;
+
+	/* every bucket is cleared by a single store, so the readers either see the old chain or nothing */
+	for(index = 0; index <= table->hash_mask; index++)
+		table->hash[index] = NULL ;
+	ipsec_sad_unlink(NULL, table) ;
+	ipsec_db_changed() ;
+	epoch = ipsec_db_advance() ;
+
+	entry = table->first ;
 	table->first = NULL ;
+	table->last = NULL ;
+	for( ; entry != NULL; entry = next_entry)
+	{
+		next_entry = entry->next ;
+		ipsec_sad_retire(entry, epoch, table) ;
+	}
 	
 	return IPSEC_STATUS_SUCCESS ;
 }
@@ -40,6 +40,11 @@
  * "This product includes cryptographic software written by
  * Eric Young (eay@cryptsoft.com)" (taken form www.openssl.org)"
  *
+ *  If IPSEC_SHA1_NI is defined (default with GCC on x86), the engine using the SHA extensions 
+ *  (SHA1RNDS4 for four rounds, SHA1NEXTE/SHA1MSG1/SHA1MSG2 for the message schedule) is 
+ *  selected on the first call of SHA1_Init() when CPUID reports them. sha1_set_engine() can be 
+ *  used to select the portable engine.
+ *
  *  <B>NOTES:</B>
  *
  *
@@ -55,6 +60,11 @@
 #include "ipsec/sha1.h"
 #include "ipsec/debug.h"
 
+#ifdef IPSEC_SHA1_NI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 
 unsigned char *SHA1(const unsigned char *d, unsigned long n, unsigned char *md)
 {
@@ -77,6 +87,9 @@ unsigned char *SHA1(const unsigned char *d, unsigned long n, unsigned char *md)
 void sha1_block_host_order (SHA_CTX *c, const void *p,int num);
 void sha1_block_data_order (SHA_CTX *c, const void *p,int num);
 
+static int sha1_engine = -1 ;		/**< engine used by SHA1, -1 until it was selected */
+static int sha1_select(int engine);
+
 
 
 #define SHA_CBLOCK	(SHA_LBLOCK*4)	/* SHA treats input data as a
@@ -104,6 +117,11 @@ void sha1_block_data_order (SHA_CTX *c, const void *p,int num);
 #define ROTATE(a,n)	_lrol_(a,n)
 #endif
 
+// *** any other compiler ***
+#ifndef ROTATE
+#define ROTATE(a,n)	((((a)<<(n))|(((a)&0xffffffffUL)>>(32-(n))))&0xffffffffUL)
+#endif
+
 
 /* A nice byte order reversal from Wei Dai <weidai@eskimo.com> */
 #ifdef ROTATE
@@ -306,6 +324,10 @@ void SHA1_Final (unsigned char *md, SHA_CTX *c)
 
 void SHA1_Init (SHA_CTX *c)
 {
+	/* select the engine on first use (CPUID) */
+	if (sha1_engine < 0)
+		sha1_engine = sha1_select(HASH_SHA1_NI);
+
 	c->h0=INIT_DATA_h0;
 	c->h1=INIT_DATA_h1;
 	c->h2=INIT_DATA_h2;
@@ -365,7 +387,7 @@ void SHA1_Init (SHA_CTX *c)
 
 #define X(i)	XX##i
 
-void sha1_block_host_order (SHA_CTX *c, const void *d, int num)
+static void sha1_block_host_portable (SHA_CTX *c, const void *d, int num)
 {
 	const SHA_LONG *W=d;
 	unsigned long A,B,C,D,E,T;
@@ -484,7 +506,7 @@ void sha1_block_host_order (SHA_CTX *c, const void *d, int num)
 	}
 }
 
-void sha1_block_data_order (SHA_CTX *c, const void *p, int num)
+static void sha1_block_data_portable (SHA_CTX *c, const void *p, int num)
 {
 	const unsigned char *data=p;
 	unsigned long A,B,C,D,E,T,l;
@@ -605,30 +627,216 @@ void sha1_block_data_order (SHA_CTX *c, const void *p, int num)
 }
 
 
+#ifdef IPSEC_SHA1_NI
 
+/**
+ * Tells whether the CPU supports the SHA extensions (and SSE4.1, which is used along).
+ *
+ * @return 1 if the SHA extensions are available, 0 otherwise
+ */
+static int sha1_ni_available(void)
+{
+	unsigned int a, b, c, d ;
 
-/*
- * Function: RFC 2104 hmac_sha1 
+	if(!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1))
+		return 0 ;
+	if(!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+		return 0 ;
+	return (b & bit_SHA) != 0 ;
+}
+
+/* four rounds with the message words in m0 using ea for E, while the schedule of the following 
+ * words goes on: m1 is completed, m3 gets its first part and m2 its second part */
+#define SHA1_NI_ROUNDS(ea, eb, m0, m1, m2, m3, f) \
+	ea = _mm_sha1nexte_epu32(ea, m0) ; \
+	eb = abcd ; \
+	m1 = _mm_sha1msg2_epu32(m1, m0) ; \
+	abcd = _mm_sha1rnds4_epu32(abcd, ea, f) ; \
+	m3 = _mm_sha1msg1_epu32(m3, m0) ; \
+	m2 = _mm_xor_si128(m2, m0) ;
+
+/**
+ * Hashes num blocks with the SHA extensions.
+ *
+ * @param c		pointer to the context
+ * @param p		blocks to hash
+ * @param num	number of blocks
+ * @param host	0 if the blocks are bytes (big endian words), 1 if they are 32 bit host order words
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha1_block_ni(SHA_CTX *c, const void *p, int num, int host)
+{
+	const unsigned char	*data = p ;
+	/* the instructions expect the first word in the most significant lane */
+	const __m128i		order = host ? _mm_set_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12) 
+	                                 : _mm_set_epi8(0,1,2,3, 4,5,6,7, 8,9,10,11, 12,13,14,15) ;
+	__m128i				abcd, abcd_save, e0, e0_save, e1 ;
+	__m128i				m0, m1, m2, m3 ;
+
+	abcd = _mm_set_epi32((int)c->h0, (int)c->h1, (int)c->h2, (int)c->h3) ;
+	e0   = _mm_set_epi32((int)c->h4, 0, 0, 0) ;
+
+	for(; num > 0; num--, data += SHA_CBLOCK)
+	{
+		abcd_save = abcd ;
+		e0_save   = e0 ;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data +  0)), order) ;
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), order) ;
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), order) ;
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), order) ;
+
+		/* rounds 0 to 11 */
+		e0   = _mm_add_epi32(e0, m0) ;
+		e1   = abcd ;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0) ;
+		e1   = _mm_sha1nexte_epu32(e1, m1) ;
+		e0   = abcd ;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0) ;
+		m0   = _mm_sha1msg1_epu32(m0, m1) ;
+		e0   = _mm_sha1nexte_epu32(e0, m2) ;
+		e1   = abcd ;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0) ;
+		m1   = _mm_sha1msg1_epu32(m1, m2) ;
+		m0   = _mm_xor_si128(m0, m2) ;
+
+		/* rounds 12 to 79 */
+		SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 0)
+		SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 0)
+		SHA1_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 1)
+		SHA1_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 1)
+		SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 1)
+		SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 1)
+		SHA1_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 1)
+		SHA1_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 2)
+		SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 2)
+		SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 2)
+		SHA1_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 2)
+		SHA1_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 2)
+		SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 3)
+		SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 3)
+		SHA1_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 3)
+		SHA1_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 3)
+		SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 3)
+
+		e0   = _mm_sha1nexte_epu32(e0, e0_save) ;
+		abcd = _mm_add_epi32(abcd, abcd_save) ;
+	}
+
+	c->h0 = (unsigned int)_mm_extract_epi32(abcd, 3) ;
+	c->h1 = (unsigned int)_mm_extract_epi32(abcd, 2) ;
+	c->h2 = (unsigned int)_mm_extract_epi32(abcd, 1) ;
+	c->h3 = (unsigned int)_mm_extract_epi32(abcd, 0) ;
+	c->h4 = (unsigned int)_mm_extract_epi32(e0, 3) ;
+}
+
+#endif
+
+
+/**
+ * Hashes num blocks of host order words (the buffer of the context) with the selected engine.
+ */
+void sha1_block_host_order (SHA_CTX *c, const void *p, int num)
+{
+#ifdef IPSEC_SHA1_NI
+	/* the words can only be loaded into vectors if they are 32 bit wide */
+	if (sizeof(SHA_LONG) == 4)
+		{
+		if (sha1_engine == HASH_SHA1_NI)
+			{
+			sha1_block_ni(c, p, num, 1);
+			return;
+			}
+		}
+#endif
+	sha1_block_host_portable(c, p, num);
+}
+
+/**
+ * Hashes num blocks of data with the selected engine.
+ */
+void sha1_block_data_order (SHA_CTX *c, const void *p, int num)
+{
+#ifdef IPSEC_SHA1_NI
+	if (sha1_engine == HASH_SHA1_NI)
+		{
+		sha1_block_ni(c, p, num, 0);
+		return;
+		}
+#endif
+	sha1_block_data_portable(c, p, num);
+}
+
+/**
+ * Returns the engine which is used when an engine is requested.
  *
- *   unsigned char*  text          pointer to data stream
- *   int             text_len      length of data stream
- *   unsigned char*  key           pointer to authentication key
- *   int             key_len       length of authentication key
- *   unsigned char*  digest        caller digest to be filled in
+ * @param engine	HASH_SHA1_PORTABLE or HASH_SHA1_NI
+ * @return HASH_SHA1_NI if requested, compiled in and supported by the CPU, HASH_SHA1_PORTABLE otherwise
+ */
+static int sha1_select(int engine)
+{
+#ifdef IPSEC_SHA1_NI
+	if ((engine == HASH_SHA1_NI) && sha1_ni_available())
+		return HASH_SHA1_NI;
+#endif
+	return HASH_SHA1_PORTABLE;
+}
+
+/**
+ * Selects the SHA1 engine. By default, HASH_SHA1_NI is used if it was compiled in and the CPU 
+ * supports it. Contexts which are in use can be continued with another engine.
  *
+ * @param engine	HASH_SHA1_PORTABLE or HASH_SHA1_NI
+ * @return the engine used so far
  */
-void hmac_sha1(unsigned char* text, int text_len, unsigned char*  key, int key_len, unsigned char*  digest)
+int sha1_set_engine(int engine)
+{
+	int previous;
+
+	if (sha1_engine < 0)
+		sha1_engine = sha1_select(HASH_SHA1_NI);
+	previous = sha1_engine;
+	sha1_engine = sha1_select(engine);
+	return previous;
+}
+
+/**
+ * Tells which SHA1 engine is used.
+ *
+ * @return HASH_SHA1_PORTABLE or HASH_SHA1_NI
+ */
+int sha1_get_engine(void)
+{
+	if (sha1_engine < 0)
+		sha1_engine = sha1_select(HASH_SHA1_NI);
+	return sha1_engine;
+}
+
+
+
+/**
+ * Precomputes the HMAC-SHA1 state of a key (RFC 2104). The key is padded and XORed with ipad 
+ * and opad and both pad blocks are absorbed into a SHA1 context. The resulting state can be stored
+ * (e.g. in the SAD entry) and used by hmac_sha1_precomputed() for every packet, which saves two
+ * SHA1 block operations per packet.
+ *
+ * @param hctx		pointer to the HMAC context which is set up
+ * @param key		pointer to authentication key
+ * @param key_len	length of authentication key
+ * @return void
+ *
+ */
+void hmac_sha1_init(HMAC_SHA1_CTX* hctx, unsigned char*  key, int key_len)
 {
-    SHA_CTX context;
     unsigned char k_ipad[65];    /* inner padding - key XORd with ipad */
     unsigned char k_opad[65];    /* outer padding - key XORd with opad */
-    unsigned char tk[20];		 /* L=20 for SHA1 (RFC 2141, 2. Definition of HMAC) */
+    unsigned char tk[20];	 	 /* L=20 for SHA1 (RFC 2141, 2. Definition of HMAC) */
     int i;
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
-	              "hmac_sha1", 
-				  ("text=%p, text_len=%d, key=%p, key_len=%d, digest=%p",
-			      (void *)text, text_len, (void *)key, key_len, (void *)digest)
+	              "hmac_sha1_init", 
+				  ("hctx=%p, key=%p, key_len=%d",
+			      (void *)hctx, (void *)key, key_len)
 				 );
 
     /* if key is longer than 64 bytes reset it to key=SHA1(key) */
@@ -644,46 +852,155 @@ void hmac_sha1(unsigned char* text, int text_len, unsigned char*  key, int key_l
             key_len = 20;
     }
 
-    /*
-     * the HMAC_SHA1 transform looks like:
-     *
-     * SHA1(K XOR opad, SHA1(K XOR ipad, text))
-     *
-     * where K is an n byte key
-     * ipad is the byte 0x36 repeated 64 times
-     * opad is the byte 0x5c repeated 64 times
-     * and text is the data being protected
-     */
-
     /* start out by storing key in pads */
-    memset(k_ipad, '\0', sizeof(k_ipad));  
-    memset(k_opad, '\0', sizeof(k_opad));  
-    memcpy(k_ipad, key, key_len); 		   
-    memcpy(k_opad, key, key_len); 		   
-
+    memset(k_ipad, '\0', sizeof(k_ipad));
+    memset(k_opad, '\0', sizeof(k_opad));
+    memcpy(k_ipad, key, key_len);
+    memcpy(k_opad, key, key_len);
 
     /* XOR key with ipad and opad values */
     for (i=0; i<64; i++) {
             k_ipad[i] ^= 0x36;
             k_opad[i] ^= 0x5c;
     }
+
+    SHA1_Init(&hctx->inner);              /* inner context starts with inner pad */
+    SHA1_Update(&hctx->inner, k_ipad, 64);
+    SHA1_Init(&hctx->outer);              /* outer context starts with outer pad */
+    SHA1_Update(&hctx->outer, k_opad, 64);
+
+	/* do not leave key material on the stack */
+    memset(k_ipad, '\0', sizeof(k_ipad));
+    memset(k_opad, '\0', sizeof(k_opad));
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_sha1_init", ("void") );
+}
+
+/**
+ * Calculates an HMAC-SHA1 digest using a state precomputed by hmac_sha1_init().
+ * The precomputed state is not modified, so it can be used for any number of digests.
+ *
+ * @param hctx		pointer to the precomputed HMAC context
+ * @param text		pointer to data stream
+ * @param text_len	length of data stream
+ * @param digest	caller digest to be filled in (160-bit)
+ * @return void
+ *
+ */
+void hmac_sha1_precomputed(HMAC_SHA1_CTX* hctx, unsigned char* text, int text_len, unsigned char*  digest)
+{
+    SHA_CTX context;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "hmac_sha1_precomputed", 
+				  ("hctx=%p, text=%p, text_len=%d, digest=%p",
+			      (void *)hctx, (void *)text, text_len, (void *)digest)
+				 );
+
+    /*
+     * perform inner SHA1
+     */
+    memcpy(&context, &hctx->inner, sizeof(SHA_CTX));
+    SHA1_Update(&context, text, text_len);       /* text of datagram */
+    SHA1_Final(digest, &context);                /* finish up 1st pass */
+    /*
+     * perform outer SHA1
+     */
+    memcpy(&context, &hctx->outer, sizeof(SHA_CTX));
+    SHA1_Update(&context, digest, 20);          /* results of 1st hash */
+    SHA1_Final(digest, &context);                /* finish up 2nd pass */
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_sha1_precomputed", ("void") );
+}
+
+/**
+ * Calculates an HMAC-SHA1 digest over a part of a chain of buffers using a state precomputed 
+ * by hmac_sha1_init(). The segments are hashed one after the other, so the data need not be 
+ * contiguous.
+ *
+ * @param hctx		pointer to the precomputed HMAC context
+ * @param chain		first segment of the chain
+ * @param offset	offset of the first byte to hash relative to the start of the chain
+ * @param len		number of bytes to hash
+ * @param digest	caller digest to be filled in (160-bit)
+ * @return void
+ *
+ */
+void hmac_sha1_chain(HMAC_SHA1_CTX* hctx, ipsec_buffer *chain, int offset, int len, unsigned char*  digest)
+{
+    SHA_CTX context;
+	int n;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "hmac_sha1_chain", 
+				  ("hctx=%p, chain=%p, offset=%d, len=%d, digest=%p",
+			      (void *)hctx, (void *)chain, offset, len, (void *)digest)
+				 );
+
     /*
-     * perform inner MD5
+     * perform inner SHA1
      */
-    SHA1_Init(&context);                 /* init context for 1st pass */
-    SHA1_Update(&context, k_ipad, 64);   /* start with inner pad */
-    SHA1_Update(&context, text, text_len);/* then text of datagram */
-    SHA1_Final(digest, &context);         /* finish up 1st pass */
+    memcpy(&context, &hctx->inner, sizeof(SHA_CTX));
+	for(; (chain != NULL) && (len > 0); chain = chain->next)
+	{
+		if(offset >= chain->len)
+		{
+			offset -= chain->len;
+			continue;
+		}
+		n = chain->len - offset;
+		if(n > len) n = len;
+	    SHA1_Update(&context, chain->data + offset, n);	/* text of datagram in this segment */
+		len -= n;
+		offset = 0;
+	}
+    SHA1_Final(digest, &context);                /* finish up 1st pass */
+    /*
+     * perform outer SHA1
+     */
+    memcpy(&context, &hctx->outer, sizeof(SHA_CTX));
+    SHA1_Update(&context, digest, 20);          /* results of 1st hash */
+    SHA1_Final(digest, &context);                /* finish up 2nd pass */
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_sha1_chain", ("void") );
+}
+
+/**
+ * RFC 2104 hmac_sha1 function calculates a digest from a given data buffer and a given key.
+ * If the same key is used more than once, use hmac_sha1_init() and hmac_sha1_precomputed() instead.
+ *
+ * @param text		pointer to data stream
+ * @param text_len	length of data stream
+ * @param key		pointer to authentication key
+ * @param key_len	length of authentication key
+ * @param digest	caller digest to be filled in (160-bit)
+ * @return void
+ *
+ */
+void hmac_sha1(unsigned char* text, int text_len, unsigned char*  key, int key_len, unsigned char*  digest)
+{
+    HMAC_SHA1_CTX hctx;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "hmac_sha1", 
+				  ("text=%p, text_len=%d, key=%p, key_len=%d, digest=%p",
+			      (void *)text, text_len, (void *)key, key_len, (void *)digest)
+				 );
+
     /*
-     * perform outer MD5
+     * the HMAC_SHA1 transform looks like:
+     *
+     * SHA1(K XOR opad, SHA1(K XOR ipad, text))
+     *
+     * where K is an n byte key
+     * ipad is the byte 0x36 repeated 64 times
+     * opad is the byte 0x5c repeated 64 times
+     * and text is the data being protected
      */
-    SHA1_Init(&context);                 /* init context for 2nd
-                                          * pass */
-    SHA1_Update(&context, k_opad, 64);   /* start with outer pad */
-    SHA1_Update(&context, digest, 20);   /* then results of 1st hash */
-    SHA1_Final(digest, &context);        /* finish up 2nd pass */
+    hmac_sha1_init(&hctx, key, key_len);
+    hmac_sha1_precomputed(&hctx, text, text_len, digest);
 
-   	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_sha1", ("void") );
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_sha1", ("void") );
 }
 
 
@@ -0,0 +1,1103 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file sha2.c
+ *  @brief FIPS 180-4 - SHA-256, SHA-384 and SHA-512 and their HMACs (RFC 2104, RFC 4868)
+ *
+ *  <B>OUTLINE:</B>
+ *  The following functions are implemented in this module:
+ *   - SHA256_Init() / SHA256_Update() / SHA256_Final(): SHA-256
+ *   - SHA384_Init() / SHA512_Init() / SHA512_Update() / SHA512_Final(): SHA-384 and SHA-512
+ *   - hmac_sha256_xxx(): HMAC-SHA-256 with a precomputed state, on a buffer or a chain of buffers
+ *   - hmac_sha384_init() / hmac_sha512_xxx(): the same for HMAC-SHA-384 and HMAC-SHA-512
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *  The portable SHA-256 engine keeps the message schedule in a ring of 16 words and computes 
+ *  it while the rounds are done, eight rounds per loop iteration.
+ *
+ *  If IPSEC_SHA256_NI is defined (default with GCC on x86), the engine using the SHA extensions
+ *  (SHA256RNDS2 for two rounds, SHA256MSG1/SHA256MSG2 for the message schedule) is selected on 
+ *  the first call of SHA256_Init() when CPUID reports them. sha256_set_engine() can be used to 
+ *  select the portable engine.
+ *
+ *  SHA-512 uses 64 bit words if IPSEC_SHA512_64 is defined (default with GCC), and pairs of 
+ *  32 bit words otherwise (targets without 64 bit types). The chaining state is always stored 
+ *  as pairs of 32 bit words, so both variants use the same context.
+ *
+ *  <B>NOTES:</B>
+ *
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/sha2.h"
+#include "ipsec/util.h"
+#include "ipsec/debug.h"
+
+#ifdef IPSEC_SHA256_NI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+
+#define SHA2_LOAD32(p)		(((__u32)(p)[0]<<24)|((__u32)(p)[1]<<16)|((__u32)(p)[2]<<8)|((__u32)(p)[3]))
+#define SHA2_STORE32(p,v)	((p)[0]=(unsigned char)((v)>>24), (p)[1]=(unsigned char)((v)>>16), (p)[2]=(unsigned char)((v)>>8), (p)[3]=(unsigned char)(v))
+
+/* Keil C166: rotate intrinsic */
+#ifdef __C166__
+#include <intrins.h>
+#define SHA256_ROTR(x,n)	_lrol_(x,32-(n))
+#else
+#define SHA256_ROTR(x,n)	((((x)>>(n))|((x)<<(32-(n))))&0xffffffffUL)
+#endif
+
+#define SHA256_SIGMA0(x)	(SHA256_ROTR((x),2)^SHA256_ROTR((x),13)^SHA256_ROTR((x),22))
+#define SHA256_SIGMA1(x)	(SHA256_ROTR((x),6)^SHA256_ROTR((x),11)^SHA256_ROTR((x),25))
+#define SHA256_sigma0(x)	(SHA256_ROTR((x),7)^SHA256_ROTR((x),18)^((x)>>3))
+#define SHA256_sigma1(x)	(SHA256_ROTR((x),17)^SHA256_ROTR((x),19)^((x)>>10))
+#define SHA2_CH(x,y,z)		((((y)^(z))&(x))^(z))
+#define SHA2_MAJ(x,y,z)		(((x)&(y))|(((x)|(y))&(z)))
+
+/* word i (16..63) of the message schedule, replaces word i-16 in the ring */
+#define SHA256_W(i)			(W[(i)&15] = (W[(i)&15] + SHA256_sigma1(W[((i)-2)&15]) + W[((i)-7)&15] + SHA256_sigma0(W[((i)-15)&15])) & 0xffffffffUL)
+
+/* one round, the variables are renamed instead of moved */
+#define SHA256_ROUND(a,b,c,d,e,f,g,h,w,k) \
+	t1 = (h) + SHA256_SIGMA1(e) + SHA2_CH((e),(f),(g)) + (k) + (w) ; \
+	(d) = ((d) + t1) & 0xffffffffUL ; \
+	(h) = (t1 + SHA256_SIGMA0(a) + SHA2_MAJ((a),(b),(c))) & 0xffffffffUL ;
+
+
+static const __u32 sha256_k[64] = {
+	0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+	0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+	0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL, 0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+	0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+	0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+	0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+	0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+	0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL, 0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+} ;
+
+static const __u32 sha256_h[8] = { 0x6a09e667UL, 0xbb67ae85UL, 0x3c6ef372UL, 0xa54ff53aUL, 0x510e527fUL, 0x9b05688cUL, 0x1f83d9abUL, 0x5be0cd19UL } ;
+
+static int sha256_engine = -1 ;		/**< engine used by SHA-256, -1 until it was selected */
+
+
+/**
+ * Hashes num blocks with the portable engine.
+ */
+static void sha256_block_portable(SHA256_CTX *c, const unsigned char *p, int num)
+{
+	__u32	a, b, d, e, f, g, h, t1 ;
+	__u32	cc ;
+	__u32	W[16] ;
+	int		i ;
+
+	for(; num > 0; num--, p += SHA256_CBLOCK)
+	{
+		a = c->h[0] ; b = c->h[1] ; cc = c->h[2] ; d = c->h[3] ;
+		e = c->h[4] ; f = c->h[5] ; g = c->h[6] ; h = c->h[7] ;
+
+		for(i = 0; i < 16; i++)
+			W[i] = SHA2_LOAD32(p+4*i) ;
+
+		for(i = 0; i < 16; i += 8)
+		{
+			SHA256_ROUND(a, b, cc, d, e, f, g, h, W[i+0], sha256_k[i+0]) ;
+			SHA256_ROUND(h, a, b, cc, d, e, f, g, W[i+1], sha256_k[i+1]) ;
+			SHA256_ROUND(g, h, a, b, cc, d, e, f, W[i+2], sha256_k[i+2]) ;
+			SHA256_ROUND(f, g, h, a, b, cc, d, e, W[i+3], sha256_k[i+3]) ;
+			SHA256_ROUND(e, f, g, h, a, b, cc, d, W[i+4], sha256_k[i+4]) ;
+			SHA256_ROUND(d, e, f, g, h, a, b, cc, W[i+5], sha256_k[i+5]) ;
+			SHA256_ROUND(cc, d, e, f, g, h, a, b, W[i+6], sha256_k[i+6]) ;
+			SHA256_ROUND(b, cc, d, e, f, g, h, a, W[i+7], sha256_k[i+7]) ;
+		}
+		for(; i < 64; i += 8)
+		{
+			SHA256_ROUND(a, b, cc, d, e, f, g, h, SHA256_W(i+0), sha256_k[i+0]) ;
+			SHA256_ROUND(h, a, b, cc, d, e, f, g, SHA256_W(i+1), sha256_k[i+1]) ;
+			SHA256_ROUND(g, h, a, b, cc, d, e, f, SHA256_W(i+2), sha256_k[i+2]) ;
+			SHA256_ROUND(f, g, h, a, b, cc, d, e, SHA256_W(i+3), sha256_k[i+3]) ;
+			SHA256_ROUND(e, f, g, h, a, b, cc, d, SHA256_W(i+4), sha256_k[i+4]) ;
+			SHA256_ROUND(d, e, f, g, h, a, b, cc, SHA256_W(i+5), sha256_k[i+5]) ;
+			SHA256_ROUND(cc, d, e, f, g, h, a, b, SHA256_W(i+6), sha256_k[i+6]) ;
+			SHA256_ROUND(b, cc, d, e, f, g, h, a, SHA256_W(i+7), sha256_k[i+7]) ;
+		}
+
+		c->h[0] = (c->h[0] + a) & 0xffffffffUL ;
+		c->h[1] = (c->h[1] + b) & 0xffffffffUL ;
+		c->h[2] = (c->h[2] + cc) & 0xffffffffUL ;
+		c->h[3] = (c->h[3] + d) & 0xffffffffUL ;
+		c->h[4] = (c->h[4] + e) & 0xffffffffUL ;
+		c->h[5] = (c->h[5] + f) & 0xffffffffUL ;
+		c->h[6] = (c->h[6] + g) & 0xffffffffUL ;
+		c->h[7] = (c->h[7] + h) & 0xffffffffUL ;
+	}
+}
+
+
+#ifdef IPSEC_SHA256_NI
+
+/**
+ * Tells whether the CPU supports the SHA extensions (and SSE4.1, which is used along).
+ *
+ * @return 1 if the SHA extensions are available, 0 otherwise
+ */
+static int sha256_ni_available(void)
+{
+	unsigned int a, b, c, d ;
+
+	if(!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1))
+		return 0 ;
+	if(!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+		return 0 ;
+	return (b & bit_SHA) != 0 ;
+}
+
+/* four rounds with the message words in m */
+#define SHA256_NI_ROUNDS(m, i) \
+	msg = _mm_add_epi32((m), _mm_set_epi32((int)sha256_k[(i)+3], (int)sha256_k[(i)+2], (int)sha256_k[(i)+1], (int)sha256_k[(i)])) ; \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg) ; \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E)) ;
+
+/* the next four message words replace m0 */
+#define SHA256_NI_SCHEDULE(m0, m1, m2, m3) \
+	m0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32((m0), (m1)), _mm_alignr_epi8((m3), (m2), 4)), (m3)) ;
+
+/* four rounds with the next four message words */
+#define SHA256_NI_NEXT(m0, m1, m2, m3, i) \
+	SHA256_NI_SCHEDULE(m0, m1, m2, m3) \
+	SHA256_NI_ROUNDS(m0, i)
+
+/**
+ * Hashes num blocks with the SHA extensions.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_block_ni(SHA256_CTX *c, const unsigned char *p, int num)
+{
+	const __m128i	swap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL) ;
+	__m128i			state0, state1, abef, cdgh, msg, tmp ;
+	__m128i			m0, m1, m2, m3 ;
+	unsigned int	h[8] ;
+	int				i ;
+
+	for(i = 0; i < 8; i++)
+		h[i] = (unsigned int)c->h[i] ;
+
+	/* the instructions keep the state as ABEF and CDGH */
+	tmp    = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&h[0]), 0xB1) ;
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&h[4]), 0x1B) ;
+	state0 = _mm_alignr_epi8(tmp, state1, 8) ;
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0) ;
+
+	for(; num > 0; num--, p += SHA256_CBLOCK)
+	{
+		abef = state0 ;
+		cdgh = state1 ;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(p+0)), swap) ;
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(p+16)), swap) ;
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(p+32)), swap) ;
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(p+48)), swap) ;
+
+		SHA256_NI_ROUNDS(m0, 0) 
+		SHA256_NI_ROUNDS(m1, 4) 
+		SHA256_NI_ROUNDS(m2, 8) 
+		SHA256_NI_ROUNDS(m3, 12) 
+		SHA256_NI_NEXT(m0, m1, m2, m3, 16)
+		SHA256_NI_NEXT(m1, m2, m3, m0, 20)
+		SHA256_NI_NEXT(m2, m3, m0, m1, 24)
+		SHA256_NI_NEXT(m3, m0, m1, m2, 28)
+		SHA256_NI_NEXT(m0, m1, m2, m3, 32)
+		SHA256_NI_NEXT(m1, m2, m3, m0, 36)
+		SHA256_NI_NEXT(m2, m3, m0, m1, 40)
+		SHA256_NI_NEXT(m3, m0, m1, m2, 44)
+		SHA256_NI_NEXT(m0, m1, m2, m3, 48)
+		SHA256_NI_NEXT(m1, m2, m3, m0, 52)
+		SHA256_NI_NEXT(m2, m3, m0, m1, 56)
+		SHA256_NI_NEXT(m3, m0, m1, m2, 60)
+
+		state0 = _mm_add_epi32(state0, abef) ;
+		state1 = _mm_add_epi32(state1, cdgh) ;
+	}
+
+	tmp    = _mm_shuffle_epi32(state0, 0x1B) ;
+	state1 = _mm_shuffle_epi32(state1, 0xB1) ;
+	_mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(tmp, state1, 0xF0)) ;
+	_mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(state1, tmp, 8)) ;
+
+	for(i = 0; i < 8; i++)
+		c->h[i] = h[i] ;
+}
+
+#endif
+
+
+/**
+ * Hashes num blocks with the selected engine.
+ */
+static void sha256_block(SHA256_CTX *c, const unsigned char *p, int num)
+{
+#ifdef IPSEC_SHA256_NI
+	if(sha256_engine == HASH_SHA256_NI)
+	{
+		sha256_block_ni(c, p, num) ;
+		return ;
+	}
+#endif
+	sha256_block_portable(c, p, num) ;
+}
+
+/**
+ * Returns the engine which is used when an engine is requested.
+ *
+ * @param engine	HASH_SHA256_PORTABLE or HASH_SHA256_NI
+ * @return HASH_SHA256_NI if requested, compiled in and supported by the CPU, HASH_SHA256_PORTABLE otherwise
+ */
+static int sha256_select(int engine)
+{
+#ifdef IPSEC_SHA256_NI
+	if((engine == HASH_SHA256_NI) && sha256_ni_available())
+		return HASH_SHA256_NI ;
+#endif
+	return HASH_SHA256_PORTABLE ;
+}
+
+/**
+ * Selects the SHA-256 engine. By default, HASH_SHA256_NI is used if it was compiled in and 
+ * the CPU supports it. Contexts which are in use can be continued with another engine.
+ *
+ * @param engine	HASH_SHA256_PORTABLE or HASH_SHA256_NI
+ * @return the engine used so far
+ */
+int sha256_set_engine(int engine)
+{
+	int previous ;
+
+	if(sha256_engine < 0)
+		sha256_engine = sha256_select(HASH_SHA256_NI) ;
+	previous = sha256_engine ;
+	sha256_engine = sha256_select(engine) ;
+	return previous ;
+}
+
+/**
+ * Initializes a SHA-256 context.
+ *
+ * @param c		pointer to the context
+ * @return void
+ */
+void SHA256_Init(SHA256_CTX *c)
+{
+	/* select the engine on first use (CPUID) */
+	if(sha256_engine < 0)
+		sha256_engine = sha256_select(HASH_SHA256_NI) ;
+
+	memcpy(c->h, sha256_h, sizeof(c->h)) ;
+	c->Nl = 0 ;
+	c->Nh = 0 ;
+	c->num = 0 ;
+}
+
+/**
+ * Hashes len bytes. Full blocks are hashed directly from the data, the rest is kept in the context.
+ *
+ * @param c		pointer to the context
+ * @param data_	pointer to the data
+ * @param len	number of bytes
+ * @return void
+ */
+void SHA256_Update(SHA256_CTX *c, const void *data_, unsigned long len)
+{
+	const unsigned char *data = data_ ;
+	__u32	l ;
+	int		n ;
+
+	if(len == 0) 
+		return ;
+
+	l = (c->Nl + (len << 3)) & 0xffffffffUL ;
+	if(l < c->Nl)
+		c->Nh++ ;
+	c->Nh = (c->Nh + (len >> 29)) & 0xffffffffUL ;
+	c->Nl = l ;
+
+	if(c->num != 0)
+	{
+		n = SHA256_CBLOCK - c->num ;
+		if(len < (unsigned long)n)
+		{
+			memcpy(c->data + c->num, data, len) ;
+			c->num += (int)len ;
+			return ;
+		}
+		memcpy(c->data + c->num, data, n) ;
+		sha256_block(c, c->data, 1) ;
+		data += n ;
+		len -= n ;
+		c->num = 0 ;
+	}
+
+	n = (int)(len / SHA256_CBLOCK) ;
+	if(n > 0)
+	{
+		sha256_block(c, data, n) ;
+		data += n * SHA256_CBLOCK ;
+		len -= n * SHA256_CBLOCK ;
+	}
+
+	if(len != 0)
+	{
+		memcpy(c->data, data, len) ;
+		c->num = (int)len ;
+	}
+}
+
+/**
+ * Pads the data and writes the digest.
+ *
+ * @param md	pointer to the digest which is filled in (SHA256_DIGEST_LENGTH bytes)
+ * @param c		pointer to the context
+ * @return void
+ */
+void SHA256_Final(unsigned char *md, SHA256_CTX *c)
+{
+	int i ;
+
+	c->data[c->num++] = 0x80 ;
+	if(c->num > SHA256_CBLOCK - 8)
+	{
+		memset(c->data + c->num, 0, SHA256_CBLOCK - c->num) ;
+		sha256_block(c, c->data, 1) ;
+		c->num = 0 ;
+	}
+	memset(c->data + c->num, 0, SHA256_CBLOCK - 8 - c->num) ;
+	SHA2_STORE32(c->data + SHA256_CBLOCK - 8, c->Nh) ;
+	SHA2_STORE32(c->data + SHA256_CBLOCK - 4, c->Nl) ;
+	sha256_block(c, c->data, 1) ;
+
+	for(i = 0; i < 8; i++)
+		SHA2_STORE32(md + 4*i, c->h[i]) ;
+	c->num = 0 ;
+}
+
+
+static const __u32 sha384_h[16] = {
+	0xcbbb9d5dUL, 0xc1059ed8UL,
+	0x629a292aUL, 0x367cd507UL,
+	0x9159015aUL, 0x3070dd17UL,
+	0x152fecd8UL, 0xf70e5939UL,
+	0x67332667UL, 0xffc00b31UL,
+	0x8eb44a87UL, 0x68581511UL,
+	0xdb0c2e0dUL, 0x64f98fa7UL,
+	0x47b5481dUL, 0xbefa4fa4UL
+} ;
+
+static const __u32 sha512_h[16] = {
+	0x6a09e667UL, 0xf3bcc908UL,
+	0xbb67ae85UL, 0x84caa73bUL,
+	0x3c6ef372UL, 0xfe94f82bUL,
+	0xa54ff53aUL, 0x5f1d36f1UL,
+	0x510e527fUL, 0xade682d1UL,
+	0x9b05688cUL, 0x2b3e6c1fUL,
+	0x1f83d9abUL, 0xfb41bd6bUL,
+	0x5be0cd19UL, 0x137e2179UL
+} ;
+
+
+#ifdef IPSEC_SHA512_64
+
+typedef unsigned long long sha512_word ;
+
+#define SHA512_K(hi,lo)		((((sha512_word)(hi))<<32)|(lo))
+
+#define SHA512_ROTR(x,n)	(((x)>>(n))|((x)<<(64-(n))))
+#define SHA512_SIGMA0(x)	(SHA512_ROTR((x),28)^SHA512_ROTR((x),34)^SHA512_ROTR((x),39))
+#define SHA512_SIGMA1(x)	(SHA512_ROTR((x),14)^SHA512_ROTR((x),18)^SHA512_ROTR((x),41))
+#define SHA512_sigma0(x)	(SHA512_ROTR((x),1)^SHA512_ROTR((x),8)^((x)>>7))
+#define SHA512_sigma1(x)	(SHA512_ROTR((x),19)^SHA512_ROTR((x),61)^((x)>>6))
+
+#define SHA512_W(i)			(W[(i)&15] += SHA512_sigma1(W[((i)-2)&15]) + W[((i)-7)&15] + SHA512_sigma0(W[((i)-15)&15]))
+
+#define SHA512_ROUND(a,b,c,d,e,f,g,h,w,k) \
+	t1 = (h) + SHA512_SIGMA1(e) + SHA2_CH((e),(f),(g)) + (k) + (w) ; \
+	(d) += t1 ; \
+	(h) = t1 + SHA512_SIGMA0(a) + SHA2_MAJ((a),(b),(c)) ;
+
+#else
+
+typedef __u32 sha512_word ;
+
+#define SHA512_K(hi,lo)		(hi), (lo)
+
+#endif
+
+static const sha512_word sha512_k[] = {
+	SHA512_K(0x428a2f98,0xd728ae22), SHA512_K(0x71374491,0x23ef65cd), SHA512_K(0xb5c0fbcf,0xec4d3b2f), SHA512_K(0xe9b5dba5,0x8189dbbc),
+	SHA512_K(0x3956c25b,0xf348b538), SHA512_K(0x59f111f1,0xb605d019), SHA512_K(0x923f82a4,0xaf194f9b), SHA512_K(0xab1c5ed5,0xda6d8118),
+	SHA512_K(0xd807aa98,0xa3030242), SHA512_K(0x12835b01,0x45706fbe), SHA512_K(0x243185be,0x4ee4b28c), SHA512_K(0x550c7dc3,0xd5ffb4e2),
+	SHA512_K(0x72be5d74,0xf27b896f), SHA512_K(0x80deb1fe,0x3b1696b1), SHA512_K(0x9bdc06a7,0x25c71235), SHA512_K(0xc19bf174,0xcf692694),
+	SHA512_K(0xe49b69c1,0x9ef14ad2), SHA512_K(0xefbe4786,0x384f25e3), SHA512_K(0x0fc19dc6,0x8b8cd5b5), SHA512_K(0x240ca1cc,0x77ac9c65),
+	SHA512_K(0x2de92c6f,0x592b0275), SHA512_K(0x4a7484aa,0x6ea6e483), SHA512_K(0x5cb0a9dc,0xbd41fbd4), SHA512_K(0x76f988da,0x831153b5),
+	SHA512_K(0x983e5152,0xee66dfab), SHA512_K(0xa831c66d,0x2db43210), SHA512_K(0xb00327c8,0x98fb213f), SHA512_K(0xbf597fc7,0xbeef0ee4),
+	SHA512_K(0xc6e00bf3,0x3da88fc2), SHA512_K(0xd5a79147,0x930aa725), SHA512_K(0x06ca6351,0xe003826f), SHA512_K(0x14292967,0x0a0e6e70),
+	SHA512_K(0x27b70a85,0x46d22ffc), SHA512_K(0x2e1b2138,0x5c26c926), SHA512_K(0x4d2c6dfc,0x5ac42aed), SHA512_K(0x53380d13,0x9d95b3df),
+	SHA512_K(0x650a7354,0x8baf63de), SHA512_K(0x766a0abb,0x3c77b2a8), SHA512_K(0x81c2c92e,0x47edaee6), SHA512_K(0x92722c85,0x1482353b),
+	SHA512_K(0xa2bfe8a1,0x4cf10364), SHA512_K(0xa81a664b,0xbc423001), SHA512_K(0xc24b8b70,0xd0f89791), SHA512_K(0xc76c51a3,0x0654be30),
+	SHA512_K(0xd192e819,0xd6ef5218), SHA512_K(0xd6990624,0x5565a910), SHA512_K(0xf40e3585,0x5771202a), SHA512_K(0x106aa070,0x32bbd1b8),
+	SHA512_K(0x19a4c116,0xb8d2d0c8), SHA512_K(0x1e376c08,0x5141ab53), SHA512_K(0x2748774c,0xdf8eeb99), SHA512_K(0x34b0bcb5,0xe19b48a8),
+	SHA512_K(0x391c0cb3,0xc5c95a63), SHA512_K(0x4ed8aa4a,0xe3418acb), SHA512_K(0x5b9cca4f,0x7763e373), SHA512_K(0x682e6ff3,0xd6b2b8a3),
+	SHA512_K(0x748f82ee,0x5defb2fc), SHA512_K(0x78a5636f,0x43172f60), SHA512_K(0x84c87814,0xa1f0ab72), SHA512_K(0x8cc70208,0x1a6439ec),
+	SHA512_K(0x90befffa,0x23631e28), SHA512_K(0xa4506ceb,0xde82bde9), SHA512_K(0xbef9a3f7,0xb2c67915), SHA512_K(0xc67178f2,0xe372532b),
+	SHA512_K(0xca273ece,0xea26619c), SHA512_K(0xd186b8c7,0x21c0c207), SHA512_K(0xeada7dd6,0xcde0eb1e), SHA512_K(0xf57d4f7f,0xee6ed178),
+	SHA512_K(0x06f067aa,0x72176fba), SHA512_K(0x0a637dc5,0xa2c898a6), SHA512_K(0x113f9804,0xbef90dae), SHA512_K(0x1b710b35,0x131c471b),
+	SHA512_K(0x28db77f5,0x23047d84), SHA512_K(0x32caab7b,0x40c72493), SHA512_K(0x3c9ebe0a,0x15c9bebc), SHA512_K(0x431d67c4,0x9c100d4c),
+	SHA512_K(0x4cc5d4be,0xcb3e42b6), SHA512_K(0x597f299c,0xfc657e2a), SHA512_K(0x5fcb6fab,0x3ad6faec), SHA512_K(0x6c44198c,0x4a475817)
+} ;
+
+
+#ifdef IPSEC_SHA512_64
+
+/**
+ * Hashes num blocks (64 bit words).
+ */
+static void sha512_block(SHA512_CTX *c, const unsigned char *p, int num)
+{
+	sha512_word	s[8] ;
+	sha512_word	a, b, cc, d, e, f, g, h, t1 ;
+	sha512_word	W[16] ;
+	int			i ;
+
+	for(i = 0; i < 8; i++)
+		s[i] = ((sha512_word)(c->h[2*i] & 0xffffffffUL) << 32) | (c->h[2*i+1] & 0xffffffffUL) ;
+
+	for(; num > 0; num--, p += SHA512_CBLOCK)
+	{
+		a = s[0] ; b = s[1] ; cc = s[2] ; d = s[3] ;
+		e = s[4] ; f = s[5] ; g = s[6] ; h = s[7] ;
+
+		for(i = 0; i < 16; i++)
+			W[i] = ((sha512_word)SHA2_LOAD32(p+8*i) << 32) | SHA2_LOAD32(p+8*i+4) ;
+
+		for(i = 0; i < 16; i += 8)
+		{
+			SHA512_ROUND(a, b, cc, d, e, f, g, h, W[i+0], sha512_k[i+0]) ;
+			SHA512_ROUND(h, a, b, cc, d, e, f, g, W[i+1], sha512_k[i+1]) ;
+			SHA512_ROUND(g, h, a, b, cc, d, e, f, W[i+2], sha512_k[i+2]) ;
+			SHA512_ROUND(f, g, h, a, b, cc, d, e, W[i+3], sha512_k[i+3]) ;
+			SHA512_ROUND(e, f, g, h, a, b, cc, d, W[i+4], sha512_k[i+4]) ;
+			SHA512_ROUND(d, e, f, g, h, a, b, cc, W[i+5], sha512_k[i+5]) ;
+			SHA512_ROUND(cc, d, e, f, g, h, a, b, W[i+6], sha512_k[i+6]) ;
+			SHA512_ROUND(b, cc, d, e, f, g, h, a, W[i+7], sha512_k[i+7]) ;
+		}
+		for(; i < 80; i += 8)
+		{
+			SHA512_ROUND(a, b, cc, d, e, f, g, h, SHA512_W(i+0), sha512_k[i+0]) ;
+			SHA512_ROUND(h, a, b, cc, d, e, f, g, SHA512_W(i+1), sha512_k[i+1]) ;
+			SHA512_ROUND(g, h, a, b, cc, d, e, f, SHA512_W(i+2), sha512_k[i+2]) ;
+			SHA512_ROUND(f, g, h, a, b, cc, d, e, SHA512_W(i+3), sha512_k[i+3]) ;
+			SHA512_ROUND(e, f, g, h, a, b, cc, d, SHA512_W(i+4), sha512_k[i+4]) ;
+			SHA512_ROUND(d, e, f, g, h, a, b, cc, SHA512_W(i+5), sha512_k[i+5]) ;
+			SHA512_ROUND(cc, d, e, f, g, h, a, b, SHA512_W(i+6), sha512_k[i+6]) ;
+			SHA512_ROUND(b, cc, d, e, f, g, h, a, SHA512_W(i+7), sha512_k[i+7]) ;
+		}
+
+		s[0] += a ; s[1] += b ; s[2] += cc ; s[3] += d ;
+		s[4] += e ; s[5] += f ; s[6] += g ; s[7] += h ;
+	}
+
+	for(i = 0; i < 8; i++)
+	{
+		c->h[2*i]   = (__u32)(s[i] >> 32) ;
+		c->h[2*i+1] = (__u32)(s[i] & 0xffffffffUL) ;
+	}
+}
+
+#else
+
+/**
+ * Computes r = x ROTR n1 ^ x ROTR n2 ^ x ROTR/SHR n3 on a 64 bit word stored as two 32 bit words 
+ * (most significant first). The shifts must not be 0 or 32.
+ */
+static void sha512_sigma(__u32 *r, __u32 *x, int n1, int n2, int n3, int shift)
+{
+	int		n[3] ;
+	__u32	hi, lo ;
+	int		i, s ;
+
+	n[0] = n1 ; n[1] = n2 ; n[2] = n3 ;
+	r[0] = 0 ;
+	r[1] = 0 ;
+	for(i = 0; i < 3; i++)
+	{
+		hi = x[0] ;
+		lo = x[1] ;
+		s = n[i] ;
+		if((i == 2) && shift)
+		{
+			r[0] ^= hi >> s ;
+			r[1] ^= ((lo >> s) | (hi << (32-s))) & 0xffffffffUL ;
+			continue ;
+		}
+		if(s > 32)
+		{
+			hi = x[1] ;
+			lo = x[0] ;
+			s -= 32 ;
+		}
+		r[0] ^= ((hi >> s) | (lo << (32-s))) & 0xffffffffUL ;
+		r[1] ^= ((lo >> s) | (hi << (32-s))) & 0xffffffffUL ;
+	}
+}
+
+/* r += x on 64 bit words stored as two 32 bit words */
+#define SHA512_ADD(r,x) \
+	{ (r)[1] = ((r)[1] + (x)[1]) & 0xffffffffUL ; \
+	  (r)[0] = ((r)[0] + (x)[0] + ((r)[1] < (x)[1])) & 0xffffffffUL ; }
+
+/**
+ * Hashes num blocks (pairs of 32 bit words).
+ */
+static void sha512_block(SHA512_CTX *c, const unsigned char *p, int num)
+{
+	__u32	s[16] ;
+	__u32	W[32] ;
+	__u32	t1[2], t2[2], x[2] ;
+	int		i, j ;
+
+	for(; num > 0; num--, p += SHA512_CBLOCK)
+	{
+		memcpy(s, c->h, sizeof(s)) ;
+
+		for(i = 0; i < 80; i++)
+		{
+			j = 2*(i&15) ;
+			if(i < 16)
+			{
+				W[j]   = SHA2_LOAD32(p+4*j) ;
+				W[j+1] = SHA2_LOAD32(p+4*j+4) ;
+			}
+			else
+			{
+				sha512_sigma(x, &W[2*((i-2)&15)], 19, 61, 6, 1) ;
+				SHA512_ADD(&W[j], x) ;
+				SHA512_ADD(&W[j], &W[2*((i-7)&15)]) ;
+				sha512_sigma(x, &W[2*((i-15)&15)], 1, 8, 7, 1) ;
+				SHA512_ADD(&W[j], x) ;
+			}
+
+			/* t1 = h + SIGMA1(e) + CH(e,f,g) + k + w */
+			t1[0] = s[14] ;
+			t1[1] = s[15] ;
+			sha512_sigma(x, &s[8], 14, 18, 41, 0) ;
+			SHA512_ADD(t1, x) ;
+			x[0] = SHA2_CH(s[8], s[10], s[12]) ;
+			x[1] = SHA2_CH(s[9], s[11], s[13]) ;
+			SHA512_ADD(t1, x) ;
+			SHA512_ADD(t1, &sha512_k[2*i]) ;
+			SHA512_ADD(t1, &W[j]) ;
+
+			/* t2 = SIGMA0(a) + MAJ(a,b,c) */
+			sha512_sigma(t2, &s[0], 28, 34, 39, 0) ;
+			x[0] = SHA2_MAJ(s[0], s[2], s[4]) ;
+			x[1] = SHA2_MAJ(s[1], s[3], s[5]) ;
+			SHA512_ADD(t2, x) ;
+
+			memmove(&s[2], &s[0], 14*sizeof(__u32)) ;
+			SHA512_ADD(&s[8], t1) ;
+			s[0] = t1[0] ;
+			s[1] = t1[1] ;
+			SHA512_ADD(s, t2) ;
+		}
+
+		for(i = 0; i < 16; i += 2)
+			SHA512_ADD(&c->h[i], &s[i]) ;
+	}
+}
+
+#endif
+
+
+/**
+ * Initializes a SHA-384 context.
+ *
+ * @param c		pointer to the context
+ * @return void
+ */
+void SHA384_Init(SHA512_CTX *c)
+{
+	memcpy(c->h, sha384_h, sizeof(c->h)) ;
+	c->Nl = 0 ;
+	c->Nh = 0 ;
+	c->num = 0 ;
+	c->md_len = SHA384_DIGEST_LENGTH ;
+}
+
+/**
+ * Initializes a SHA-512 context.
+ *
+ * @param c		pointer to the context
+ * @return void
+ */
+void SHA512_Init(SHA512_CTX *c)
+{
+	memcpy(c->h, sha512_h, sizeof(c->h)) ;
+	c->Nl = 0 ;
+	c->Nh = 0 ;
+	c->num = 0 ;
+	c->md_len = SHA512_DIGEST_LENGTH ;
+}
+
+/**
+ * Hashes len bytes (SHA-384 or SHA-512, depending on the initialization of the context). 
+ *
+ * @param c		pointer to the context
+ * @param data_	pointer to the data
+ * @param len	number of bytes
+ * @return void
+ */
+void SHA512_Update(SHA512_CTX *c, const void *data_, unsigned long len)
+{
+	const unsigned char *data = data_ ;
+	__u32	l ;
+	int		n ;
+
+	if(len == 0) 
+		return ;
+
+	l = (c->Nl + (len << 3)) & 0xffffffffUL ;
+	if(l < c->Nl)
+		c->Nh++ ;
+	c->Nh = (c->Nh + (len >> 29)) & 0xffffffffUL ;
+	c->Nl = l ;
+
+	if(c->num != 0)
+	{
+		n = SHA512_CBLOCK - c->num ;
+		if(len < (unsigned long)n)
+		{
+			memcpy(c->data + c->num, data, len) ;
+			c->num += (int)len ;
+			return ;
+		}
+		memcpy(c->data + c->num, data, n) ;
+		sha512_block(c, c->data, 1) ;
+		data += n ;
+		len -= n ;
+		c->num = 0 ;
+	}
+
+	n = (int)(len / SHA512_CBLOCK) ;
+	if(n > 0)
+	{
+		sha512_block(c, data, n) ;
+		data += n * SHA512_CBLOCK ;
+		len -= n * SHA512_CBLOCK ;
+	}
+
+	if(len != 0)
+	{
+		memcpy(c->data, data, len) ;
+		c->num = (int)len ;
+	}
+}
+
+/**
+ * Pads the data and writes the digest.
+ *
+ * @param md	pointer to the digest which is filled in (md_len of the context, 48 or 64 bytes)
+ * @param c		pointer to the context
+ * @return void
+ */
+void SHA512_Final(unsigned char *md, SHA512_CTX *c)
+{
+	int i ;
+
+	c->data[c->num++] = 0x80 ;
+	if(c->num > SHA512_CBLOCK - 16)
+	{
+		memset(c->data + c->num, 0, SHA512_CBLOCK - c->num) ;
+		sha512_block(c, c->data, 1) ;
+		c->num = 0 ;
+	}
+	memset(c->data + c->num, 0, SHA512_CBLOCK - 8 - c->num) ;
+	SHA2_STORE32(c->data + SHA512_CBLOCK - 8, c->Nh) ;
+	SHA2_STORE32(c->data + SHA512_CBLOCK - 4, c->Nl) ;
+	sha512_block(c, c->data, 1) ;
+
+	for(i = 0; i < c->md_len/4; i++)
+		SHA2_STORE32(md + 4*i, c->h[i]) ;
+	c->num = 0 ;
+}
+
+
+/**
+ * Precomputes the HMAC-SHA-256 state of a key (RFC 2104). The key is padded and XORed with ipad 
+ * and opad and both pad blocks are absorbed into a SHA-256 context, like hmac_sha1_init().
+ *
+ * @param hctx		pointer to the HMAC context which is set up
+ * @param key		pointer to authentication key
+ * @param key_len	length of authentication key
+ * @return void
+ *
+ */
+void hmac_sha256_init(HMAC_SHA256_CTX* hctx, unsigned char* key, int key_len)
+{
+	unsigned char	k_ipad[SHA256_CBLOCK] ;		/* inner padding - key XORd with ipad */
+	unsigned char	k_opad[SHA256_CBLOCK] ;		/* outer padding - key XORd with opad */
+	unsigned char	tk[SHA256_DIGEST_LENGTH] ;
+	int i ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "hmac_sha256_init", 
+				  ("hctx=%p, key=%p, key_len=%d",
+			      (void *)hctx, (void *)key, key_len)
+				 );
+
+	/* if key is longer than a block reset it to key=SHA256(key) */
+	if(key_len > SHA256_CBLOCK)
+	{
+		SHA256_Init(&hctx->inner) ;
+		SHA256_Update(&hctx->inner, key, key_len) ;
+		SHA256_Final(tk, &hctx->inner) ;
+		key = tk ;
+		key_len = SHA256_DIGEST_LENGTH ;
+	}
+
+	memset(k_ipad, 0, sizeof(k_ipad)) ;
+	memcpy(k_ipad, key, key_len) ;
+	for(i = 0; i < SHA256_CBLOCK; i++)
+	{
+		k_opad[i] = k_ipad[i] ^ 0x5c ;
+		k_ipad[i] ^= 0x36 ;
+	}
+
+	SHA256_Init(&hctx->inner) ;
+	SHA256_Update(&hctx->inner, k_ipad, SHA256_CBLOCK) ;
+	SHA256_Init(&hctx->outer) ;
+	SHA256_Update(&hctx->outer, k_opad, SHA256_CBLOCK) ;
+
+	/* do not leave key material on the stack */
+	memset(k_ipad, 0, sizeof(k_ipad)) ;
+	memset(k_opad, 0, sizeof(k_opad)) ;
+	memset(tk, 0, sizeof(tk)) ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_sha256_init", ("void") );
+}
+
+/**
+ * Calculates an HMAC-SHA-256 digest using a state precomputed by hmac_sha256_init().
+ *
+ * @param hctx		pointer to the precomputed HMAC context
+ * @param text		pointer to data stream
+ * @param text_len	length of data stream
+ * @param digest	caller digest to be filled in (256-bit)
+ * @return void
+ *
+ */
+void hmac_sha256_precomputed(HMAC_SHA256_CTX* hctx, unsigned char* text, int text_len, unsigned char* digest)
+{
+	ipsec_buffer segment ;
+
+	segment.next = NULL ;
+	segment.data = text ;
+	segment.len  = text_len ;
+	hmac_sha256_chain(hctx, &segment, 0, text_len, digest) ;
+}
+
+/**
+ * Calculates an HMAC-SHA-256 digest over a part of a chain of buffers using a state precomputed 
+ * by hmac_sha256_init().
+ *
+ * @param hctx		pointer to the precomputed HMAC context
+ * @param chain		first segment of the chain
+ * @param offset	offset of the first byte to hash relative to the start of the chain
+ * @param len		number of bytes to hash
+ * @param digest	caller digest to be filled in (256-bit)
+ * @return void
+ *
+ */
+void hmac_sha256_chain(HMAC_SHA256_CTX* hctx, ipsec_buffer *chain, int offset, int len, unsigned char* digest)
+{
+	SHA256_CTX	context ;
+	int 		n ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "hmac_sha256_chain", 
+				  ("hctx=%p, chain=%p, offset=%d, len=%d, digest=%p",
+			      (void *)hctx, (void *)chain, offset, len, (void *)digest)
+				 );
+
+	memcpy(&context, &hctx->inner, sizeof(SHA256_CTX)) ;
+	for(; (chain != NULL) && (len > 0); chain = chain->next)
+	{
+		if(offset >= chain->len)
+		{
+			offset -= chain->len ;
+			continue ;
+		}
+		n = chain->len - offset ;
+		if(n > len) n = len ;
+		SHA256_Update(&context, chain->data + offset, n) ;
+		len -= n ;
+		offset = 0 ;
+	}
+	SHA256_Final(digest, &context) ;
+
+	memcpy(&context, &hctx->outer, sizeof(SHA256_CTX)) ;
+	SHA256_Update(&context, digest, SHA256_DIGEST_LENGTH) ;
+	SHA256_Final(digest, &context) ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_sha256_chain", ("void") );
+}
+
+/**
+ * RFC 4868 HMAC-SHA-256 of a buffer with a key. If the same key is used more than once, use 
+ * hmac_sha256_init() and hmac_sha256_precomputed() instead.
+ *
+ * @param text		pointer to data stream
+ * @param text_len	length of data stream
+ * @param key		pointer to authentication key
+ * @param key_len	length of authentication key
+ * @param digest	caller digest to be filled in (256-bit)
+ * @return void
+ *
+ */
+void hmac_sha256(unsigned char* text, int text_len, unsigned char* key, int key_len, unsigned char* digest)
+{
+	HMAC_SHA256_CTX hctx ;
+
+	hmac_sha256_init(&hctx, key, key_len) ;
+	hmac_sha256_precomputed(&hctx, text, text_len, digest) ;
+}
+
+
+/**
+ * Precomputes the HMAC state of a key for SHA-384 or SHA-512.
+ */
+static void hmac_sha512_setup(HMAC_SHA512_CTX* hctx, unsigned char* key, int key_len, int md_len)
+{
+	unsigned char	k_ipad[SHA512_CBLOCK] ;		/* inner padding - key XORd with ipad */
+	unsigned char	k_opad[SHA512_CBLOCK] ;		/* outer padding - key XORd with opad */
+	unsigned char	tk[SHA512_DIGEST_LENGTH] ;
+	int i ;
+
+	/* if key is longer than a block reset it to key=SHA384/512(key) */
+	if(key_len > SHA512_CBLOCK)
+	{
+		if(md_len == SHA384_DIGEST_LENGTH)
+			SHA384_Init(&hctx->inner) ;
+		else
+			SHA512_Init(&hctx->inner) ;
+		SHA512_Update(&hctx->inner, key, key_len) ;
+		SHA512_Final(tk, &hctx->inner) ;
+		key = tk ;
+		key_len = md_len ;
+	}
+
+	memset(k_ipad, 0, sizeof(k_ipad)) ;
+	memcpy(k_ipad, key, key_len) ;
+	for(i = 0; i < SHA512_CBLOCK; i++)
+	{
+		k_opad[i] = k_ipad[i] ^ 0x5c ;
+		k_ipad[i] ^= 0x36 ;
+	}
+
+	if(md_len == SHA384_DIGEST_LENGTH)
+	{
+		SHA384_Init(&hctx->inner) ;
+		SHA384_Init(&hctx->outer) ;
+	}
+	else
+	{
+		SHA512_Init(&hctx->inner) ;
+		SHA512_Init(&hctx->outer) ;
+	}
+	SHA512_Update(&hctx->inner, k_ipad, SHA512_CBLOCK) ;
+	SHA512_Update(&hctx->outer, k_opad, SHA512_CBLOCK) ;
+
+	/* do not leave key material on the stack */
+	memset(k_ipad, 0, sizeof(k_ipad)) ;
+	memset(k_opad, 0, sizeof(k_opad)) ;
+	memset(tk, 0, sizeof(tk)) ;
+}
+
+/**
+ * Precomputes the HMAC-SHA-384 state of a key (RFC 2104), see hmac_sha256_init().
+ *
+ * @param hctx		pointer to the HMAC context which is set up
+ * @param key		pointer to authentication key
+ * @param key_len	length of authentication key
+ * @return void
+ *
+ */
+void hmac_sha384_init(HMAC_SHA512_CTX* hctx, unsigned char* key, int key_len)
+{
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "hmac_sha384_init", 
+				  ("hctx=%p, key=%p, key_len=%d",
+			      (void *)hctx, (void *)key, key_len)
+				 );
+
+	hmac_sha512_setup(hctx, key, key_len, SHA384_DIGEST_LENGTH) ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_sha384_init", ("void") );
+}
+
+/**
+ * Precomputes the HMAC-SHA-512 state of a key (RFC 2104), see hmac_sha256_init().
+ *
+ * @param hctx		pointer to the HMAC context which is set up
+ * @param key		pointer to authentication key
+ * @param key_len	length of authentication key
+ * @return void
+ *
+ */
+void hmac_sha512_init(HMAC_SHA512_CTX* hctx, unsigned char* key, int key_len)
+{
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "hmac_sha512_init", 
+				  ("hctx=%p, key=%p, key_len=%d",
+			      (void *)hctx, (void *)key, key_len)
+				 );
+
+	hmac_sha512_setup(hctx, key, key_len, SHA512_DIGEST_LENGTH) ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_sha512_init", ("void") );
+}
+
+/**
+ * Calculates an HMAC-SHA-384 or HMAC-SHA-512 digest using a state precomputed by 
+ * hmac_sha384_init() or hmac_sha512_init().
+ *
+ * @param hctx		pointer to the precomputed HMAC context
+ * @param text		pointer to data stream
+ * @param text_len	length of data stream
+ * @param digest	caller digest to be filled in (384- or 512-bit)
+ * @return void
+ *
+ */
+void hmac_sha512_precomputed(HMAC_SHA512_CTX* hctx, unsigned char* text, int text_len, unsigned char* digest)
+{
+	ipsec_buffer segment ;
+
+	segment.next = NULL ;
+	segment.data = text ;
+	segment.len  = text_len ;
+	hmac_sha512_chain(hctx, &segment, 0, text_len, digest) ;
+}
+
+/**
+ * Calculates an HMAC-SHA-384 or HMAC-SHA-512 digest over a part of a chain of buffers using a 
+ * state precomputed by hmac_sha384_init() or hmac_sha512_init().
+ *
+ * @param hctx		pointer to the precomputed HMAC context
+ * @param chain		first segment of the chain
+ * @param offset	offset of the first byte to hash relative to the start of the chain
+ * @param len		number of bytes to hash
+ * @param digest	caller digest to be filled in (384- or 512-bit)
+ * @return void
+ *
+ */
+void hmac_sha512_chain(HMAC_SHA512_CTX* hctx, ipsec_buffer *chain, int offset, int len, unsigned char* digest)
+{
+	SHA512_CTX	context ;
+	int 		n ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "hmac_sha512_chain", 
+				  ("hctx=%p, chain=%p, offset=%d, len=%d, digest=%p",
+			      (void *)hctx, (void *)chain, offset, len, (void *)digest)
+				 );
+
+	memcpy(&context, &hctx->inner, sizeof(SHA512_CTX)) ;
+	for(; (chain != NULL) && (len > 0); chain = chain->next)
+	{
+		if(offset >= chain->len)
+		{
+			offset -= chain->len ;
+			continue ;
+		}
+		n = chain->len - offset ;
+		if(n > len) n = len ;
+		SHA512_Update(&context, chain->data + offset, n) ;
+		len -= n ;
+		offset = 0 ;
+	}
+	SHA512_Final(digest, &context) ;
+
+	memcpy(&context, &hctx->outer, sizeof(SHA512_CTX)) ;
+	SHA512_Update(&context, digest, context.md_len) ;
+	SHA512_Final(digest, &context) ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "hmac_sha512_chain", ("void") );
+}
+
+/**
+ * RFC 4868 HMAC-SHA-384 of a buffer with a key.
+ *
+ * @param text		pointer to data stream
+ * @param text_len	length of data stream
+ * @param key		pointer to authentication key
+ * @param key_len	length of authentication key
+ * @param digest	caller digest to be filled in (384-bit)
+ * @return void
+ *
+ */
+void hmac_sha384(unsigned char* text, int text_len, unsigned char* key, int key_len, unsigned char* digest)
+{
+	HMAC_SHA512_CTX hctx ;
+
+	hmac_sha384_init(&hctx, key, key_len) ;
+	hmac_sha512_precomputed(&hctx, text, text_len, digest) ;
+}
+
+/**
+ * RFC 4868 HMAC-SHA-512 of a buffer with a key.
+ *
+ * @param text		pointer to data stream
+ * @param text_len	length of data stream
+ * @param key		pointer to authentication key
+ * @param key_len	length of authentication key
+ * @param digest	caller digest to be filled in (512-bit)
+ * @return void
+ *
+ */
+void hmac_sha512(unsigned char* text, int text_len, unsigned char* key, int key_len, unsigned char* digest)
+{
+	HMAC_SHA512_CTX hctx ;
+
+	hmac_sha512_init(&hctx, key, key_len) ;
+	hmac_sha512_precomputed(&hctx, text, text_len, digest) ;
+}
@@ -58,6 +58,7 @@
 
 #include "ipsec/ipsec.h"
 #include "ipsec/util.h"
+#include "ipsec/chksum.h"
 #include "ipsec/debug.h"
 
 /**
@@ -313,53 +314,94 @@ __u32 ipsec_ntohl(__u32 n)
 }
 
 /**
- * helper function to calculate the IP header checksum
- *
- * @param len 		length of the buffer
- * @param dataptr	pointer the buffer
+ * calculates the checksum of the IP header (see ipsec_chksum_add(), ipsec_ip_set_word() 
+ * changes single fields without summing the header again)
+ * 
+ * @param dataptr	pointer to the buffer
+ * @param len		length of the buffer
  * @return 16-bit value of the checksum
  */
-static __u16 chksum(void *dataptr, int len)
+__u16 ipsec_ip_chksum(void *dataptr, __u16 len)
 {
-  __u32 acc;
-
-  for(acc = 0; len > 1; len -= 2) {
-      /*    acc = acc + *((u16_t *)dataptr)++;*/
-    acc += *(__u16 *)dataptr;
-    dataptr = (void *)((__u16 *)dataptr + 1);
-  }
+  return (__u16)~ipsec_chksum_fold(ipsec_chksum_add(dataptr, len, 0));
+}
 
-  /* add up any odd byte */
-  if (len == 1) {
-    acc += ipsec_htons((__u16)((*(__u8 *)dataptr) & 0xff) << 8);
-  } else {
+/**
+ * Returns the total number of bytes in a chain of buffers
+ *
+ * @param chain		first segment of the chain
+ * @return number of bytes in all segments
+ */
+int ipsec_buffer_len(ipsec_buffer *chain)
+{
+	int len = 0 ;
 
-  }
-  acc = (acc >> 16) + (acc & 0xffffUL);
+	for(; chain != NULL; chain = chain->next)
+		len += chain->len ;
+	return len ;
+}
 
-  if ((acc & 0xffff0000) != 0) {
-    acc = (acc >> 16) + (acc & 0xffffUL);
-  }
+/**
+ * Copies bytes out of a chain of buffers into a flat buffer.
+ * Used to access fields which may span two segments.
+ *
+ * @param chain		first segment of the chain
+ * @param offset	offset of the first byte relative to the start of the chain
+ * @param len		number of bytes to copy
+ * @param dst		destination buffer
+ * @return number of bytes copied (less than len if the chain is too short)
+ */
+int ipsec_buffer_copy_out(ipsec_buffer *chain, int offset, int len, void *dst)
+{
+	int copied = 0 ;
+	int n ;
 
-  return (__u16)acc;
+	for(; (chain != NULL) && (len > 0); chain = chain->next)
+	{
+		if(offset >= chain->len)
+		{
+			offset -= chain->len ;
+			continue ;
+		}
+		n = chain->len - offset ;
+		if(n > len) n = len ;
+		memcpy((unsigned char *)dst + copied, chain->data + offset, n) ;
+		copied += n ;
+		len -= n ;
+		offset = 0 ;
+	}
+	return copied ;
 }
 
 /**
- * calculates the checksum of the IP header
- * 
- * @param dataptr	pointer to the buffer
- * @param len		length of the buffer
- * @return 16-bit value of the checksum
+ * Copies bytes from a flat buffer into a chain of buffers.
+ *
+ * @param chain		first segment of the chain
+ * @param offset	offset of the first byte relative to the start of the chain
+ * @param len		number of bytes to copy
+ * @param src		source buffer
+ * @return number of bytes copied (less than len if the chain is too short)
  */
-__u16 ipsec_ip_chksum(void *dataptr, __u16 len)
+int ipsec_buffer_copy_in(ipsec_buffer *chain, int offset, int len, void *src)
 {
-  __u32 acc;
+	int copied = 0 ;
+	int n ;
 
-  acc = chksum(dataptr, len);
-  while (acc >> 16) {
-    acc = (acc & 0xffff) + (acc >> 16);
-  }
-  return ~(acc & 0xffff);
+	for(; (chain != NULL) && (len > 0); chain = chain->next)
+	{
+		if(offset >= chain->len)
+		{
+			offset -= chain->len ;
+			continue ;
+		}
+		n = chain->len - offset ;
+		if(n > len) n = len ;
+		memcpy(chain->data + offset, (unsigned char *)src + copied, n) ;
+		copied += n ;
+		len -= n ;
+		offset = 0 ;
+	}
+	return copied ;
 }
 
 
@@ -418,37 +460,66 @@ void ipsec_dump_buffer(char *prefix, unsigned char *data, int offs, int length)
 
 
 /**
- * Verify the sequence number of the AH packet is inside the window (defined as IPSEC_SEQ_MAX_WINDOW)
- * Note: this function does NOT update the lastSeq variable and may
+ * Resets the anti-replay state of an SA and sets its window size.
+ *
+ * The window is rounded up to a multiple of 32 and limited to IPSEC_SEQ_MIN_WINDOW..IPSEC_SEQ_MAX_WINDOW.
+ * A window of 0 selects IPSEC_SEQ_DEFAULT_WINDOW.
+ *
+ * @param  state     pointer to the anti-replay state
+ * @param  window    requested window size (number of sequence numbers)
+ * @return void
+ */
+void ipsec_init_replay_window(ipsec_replay_state *state, __u16 window)
+{
+	if(window == 0) window = IPSEC_SEQ_DEFAULT_WINDOW;
+	if(window < IPSEC_SEQ_MIN_WINDOW) window = IPSEC_SEQ_MIN_WINDOW;
+	if(window > IPSEC_SEQ_MAX_WINDOW) window = IPSEC_SEQ_MAX_WINDOW;
+
+	state->window 	= (window + 31) & ~31;
+	state->words 	= (state->window >> 5) + 1;		/* one spare word, so a full window fits at any bit position */
+	state->top 		= 0;
+	state->last_seq	= 0;
+	memset(state->bitmap, 0, sizeof(state->bitmap));
+}
+
+/**
+ * Verify the sequence number of the packet is inside the window of the SA.
+ * Note: this function does NOT update the state and may
  *       safely be called prior to IVC check.
  *
+ * The bitmap is a ring of 32-bit words: bit (seq & 31) of a word marks seq as seen, and the word
+ * of a sequence number is found relative to the word holding last_seq. So the check does
+ * not depend on the window size.
+ *
  * @param  seq       sequence number of the current packet
- * @param  lastSeq   sequence number of the last known packet
- * @param  bitField  field used to verify resent data within the window
+ * @param  state     pointer to the anti-replay state of the SA
  * @return IPSEC_AUDIT_SUCCESS if check passed (packet allowed)
  * @return IPSEC_AUDIT_SEQ_MISMATCH if check failed (packet disallowed)
  */
-ipsec_audit ipsec_check_replay_window(__u32 seq, __u32 lastSeq, __u32 bitField) 
+ipsec_audit ipsec_check_replay_window(__u32 seq, ipsec_replay_state *state) 
 {
     __u32 diff;
+    int   index;
 
     if(seq == 0) return IPSEC_AUDIT_SEQ_MISMATCH;    /* first == 0 or wrapped */
     
-    if(seq > lastSeq) 					/* new larger sequence number  */
+    if(seq > state->last_seq) 			/* new larger sequence number  */
     {  
-        diff = seq - lastSeq;
+        diff = seq - state->last_seq;
 
-	    /* only accept new number if delta is not > IPSEC_SEQ_MAX_WINDOW */
-	    if(diff >= IPSEC_SEQ_MAX_WINDOW) return IPSEC_AUDIT_SEQ_MISMATCH;
+	    /* only accept new number if delta is not > window */
+	    if(diff >= state->window) return IPSEC_AUDIT_SEQ_MISMATCH;
     }
     else {								/* new smaller sequence number */
-    	diff = lastSeq - seq;
+    	diff = state->last_seq - seq;
 
-	    /* only accept new number if delta is not > IPSEC_SEQ_MAX_WINDOW */
-	    if(diff >= IPSEC_SEQ_MAX_WINDOW) return IPSEC_AUDIT_SEQ_MISMATCH;
+	    /* only accept new number if delta is not > window */
+	    if(diff >= state->window) return IPSEC_AUDIT_SEQ_MISMATCH;
 
 	    /* already seen */
-	    if(bitField & ((__u32)1 << diff)) return IPSEC_AUDIT_SEQ_MISMATCH; 
+	    index = state->top - (int)((state->last_seq >> 5) - (seq >> 5));
+	    if(index < 0) index += state->words;
+	    if(state->bitmap[index] & ((__u32)1 << (seq & 31))) return IPSEC_AUDIT_SEQ_MISMATCH; 
     }
     
     return IPSEC_AUDIT_SUCCESS;
@@ -457,35 +528,46 @@ ipsec_audit ipsec_check_replay_window(__u32 seq, __u32 lastSeq, __u32 bitField)
 
 /**
  * Verify and update the sequence number.
- * Note: this function is UPDATING the lastSeq variable and must be called
+ * Note: this function is UPDATING the state and must be called
  *       only AFTER checking the IVC.
  *
- * This  code  is  based  on  RFC2401,  Appendix  C  --  Sequence  Space  Window  Code  Example 
+ * This  code  is  based  on  RFC2401,  Appendix  C  --  Sequence  Space  Window  Code  Example.
+ * Instead of shifting the whole bitmap, the window slides forward by whole words: the ring position of
+ * last_seq advances and the words which enter the window are cleared. Each word is cleared at most once
+ * per 32 sequence numbers, so a packet costs O(1) whatever the window size.
  *
  * @param  seq       sequence number of the current packet
- * @param  lastSeq   pointer to sequence number of the last known packet
- * @param  bitField  pointer to field used to verify resent data within the window
+ * @param  state     pointer to the anti-replay state of the SA
  * @return IPSEC_AUDIT_SUCCESS if check passed (packet allowed)
  * @return IPSEC_AUDIT_SEQ_MISMATCH if check failed (packet disallowed)
  */
-ipsec_audit ipsec_update_replay_window(__u32 seq, __u32 *lastSeq, __u32 *bitField) 
+ipsec_audit ipsec_update_replay_window(__u32 seq, ipsec_replay_state *state) 
 {
     __u32 diff;
+    __u32 words;
+    int   index;
 
     if (seq == 0) return IPSEC_AUDIT_SEQ_MISMATCH;     	/* first == 0 or wrapped 	*/
-    if (seq > *lastSeq) {               		/* new larger sequence number 		*/
-        diff = seq - *lastSeq;
-        if (diff < IPSEC_SEQ_MAX_WINDOW) {  	/* In window */
-            *bitField <<= diff;
-            *bitField |= 1;	         			/* set bit for this packet 			*/
-        } else *bitField = 1;					/* This packet has a "way larger" 	*/
-        *lastSeq = seq;
+    if (seq > state->last_seq) {           		/* new larger sequence number 		*/
+        words = (seq >> 5) - (state->last_seq >> 5);
+        if (words < state->words) {  			/* In window: clear the words entering the window */
+            while(words--) {
+                if(++state->top >= state->words) state->top = 0;
+                state->bitmap[state->top] = 0;
+            }
+        } else {								/* This packet has a "way larger" 	*/
+            memset(state->bitmap, 0, state->words * sizeof(__u32));
+        }
+        state->bitmap[state->top] |= ((__u32)1 << (seq & 31));	/* set bit for this packet */
+        state->last_seq = seq;
         return IPSEC_AUDIT_SUCCESS;  			/* larger is good */
     }
-    diff = *lastSeq - seq;
-    if (diff >= IPSEC_SEQ_MAX_WINDOW) return IPSEC_AUDIT_SEQ_MISMATCH; /* too old or wrapped */
-    if (*bitField & ((__u32)1 << diff)) return IPSEC_AUDIT_SEQ_MISMATCH; /* already seen 	*/
-    *bitField |= ((__u32)1 << diff);      		/* mark as seen 			*/
+    diff = state->last_seq - seq;
+    if (diff >= state->window) return IPSEC_AUDIT_SEQ_MISMATCH; /* too old or wrapped */
+    index = state->top - (int)((state->last_seq >> 5) - (seq >> 5));
+    if (index < 0) index += state->words;
+    if (state->bitmap[index] & ((__u32)1 << (seq & 31))) return IPSEC_AUDIT_SEQ_MISMATCH; /* already seen 	*/
+    state->bitmap[index] |= ((__u32)1 << (seq & 31));      		/* mark as seen 			*/
     return IPSEC_AUDIT_SUCCESS;           		/* out of order but good 	*/
 }
 
@@ -0,0 +1,76 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file aes.h
+ *  @brief Header of the AES cipher (CBC and CTR mode)
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#ifndef __AES_H__
+#define __AES_H__
+
+#include "ipsec/types.h"
+
+
+#define AES_BLOCK_SIZE		(16)		/**< AES block size in bytes */
+#define AES_MAX_ROUNDS		(14)		/**< number of rounds of AES-256 */
+
+#define AES_ENCRYPT			1			/**< defines encryption for the AES functions */
+#define AES_DECRYPT			0			/**< defines decryption for the AES functions */
+
+#define CIPHER_AES_PORTABLE	(0)			/**< AES engine: portable C code with one 1 KB lookup table per direction */
+#define CIPHER_AES_NI		(1)			/**< AES engine: AES-NI instructions (x86 only, used if the CPU has them) */
+
+#if !defined(IPSEC_AES_NO_NI) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IPSEC_AES_NI					/**< compile the AES-NI engine (define IPSEC_AES_NO_NI to leave it out) */
+#endif
+
+/** Expanded AES key */
+typedef struct aes_key_struct
+{
+	__u32	ek[4*(AES_MAX_ROUNDS+1)] ;	/**< round keys used for encryption */
+	__u32	dk[4*(AES_MAX_ROUNDS+1)] ;	/**< round keys used for decryption (equivalent inverse cipher) */
+	int		rounds ;					/**< number of rounds (10, 12 or 14) */
+	int		engine ;					/**< engine the round keys were expanded for (CIPHER_AES_xxx) */
+} aes_key ;
+
+
+int cipher_aes_set_engine(int) ;
+int cipher_aes_set_key(unsigned char *, int, aes_key *) ;
+void cipher_aes_encrypt(aes_key *, unsigned char *, unsigned char *) ;
+void cipher_aes_decrypt(aes_key *, unsigned char *, unsigned char *) ;
+void cipher_aes_cbc(unsigned char *, int, aes_key *, unsigned char *, int, unsigned char *) ;
+void cipher_aes_ctr(unsigned char *, int, aes_key *, unsigned char *, unsigned char *) ;
+void cipher_aes_cbc_chain(ipsec_buffer *, int, int, aes_key *, unsigned char *, int) ;
+void cipher_aes_ctr_chain(ipsec_buffer *, int, int, aes_key *, unsigned char *) ;
+
+#endif
@@ -50,6 +50,8 @@
 #define IPSEC_AH_HDR_SIZE (12)			/**< AH header size without ICV */
 
 
+#pragma pack(1)
+
 typedef struct ah_hdr_struct 
 {
   __u8	nexthdr;	/**< type of next payload (protocol nr) */
@@ -57,15 +59,18 @@ typedef struct ah_hdr_struct
   __u16 reserved;	/**< MUST be 0x0000 (reserved for future use) */
   __u32 spi;		/**< Security Parameter Index (0, 1..255 are special cases RFC2402, p.4) */
   __u32 sequence;	/**< sequence number (increasing strictly), used by anti-replay feature */
-  __u8  ah_data[IPSEC_AUTH_ICV]; /**< ICV (Integrity Check Value), variable-length data. 12 bytes (96 bits) for HMAC-SHA1-96 and HMAC-MD5-96 */
+  __u8  ah_data[IPSEC_MAX_AUTH_ICV]; /**< ICV (Integrity Check Value), variable-length data. IPSEC_AUTH_ICV_LEN() bytes, e.g. 12 bytes (96 bits) for HMAC-SHA1-96 and HMAC-MD5-96 */
 } ipsec_ah_header;
 
+#pragma pack()
 
-extern __u32 ipsec_ah_bitmap; 			/**< bitmap used for anti-replay service */
-extern __u32 ipsec_ah_lastSeq;			/**< last seen sequence number, used for anit-replay service */
 
 int ipsec_ah_check(ipsec_ip_header *, int *, int *, void *);
 int ipsec_ah_encapsulate(ipsec_ip_header *, int *, int *, void *, __u32, __u32);
+int ipsec_ah_check_chain(ipsec_buffer *, int *, int *, sad_entry *);
+void ipsec_ah_check_batch(ipsec_packet **, int, sad_entry *);
+int ipsec_ah_encapsulate_chain(ipsec_buffer *, int *, int *, sad_entry *, __u32, __u32, __u32);
+void ipsec_ah_get_overhead(sad_entry *, int *, int *);
 
 #endif
 
@@ -0,0 +1,78 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file chacha.h
+ *  @brief Header of ChaCha20 and the ChaCha20-Poly1305 combined mode (encryption and authentication)
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#ifndef __CHACHA_H__
+#define __CHACHA_H__
+
+#include "ipsec/types.h"
+
+
+#define CHACHA_KEY_SIZE			(32)		/**< size of a ChaCha20 key in bytes */
+#define CHACHA_NONCE_SIZE		(12)		/**< size of the nonce in bytes */
+#define CHACHA_BLOCK_SIZE		(64)		/**< size of a key stream block in bytes */
+#define POLY1305_TAG_SIZE		(16)		/**< size of the Poly1305 authentication tag in bytes */
+
+#define CHACHA_ENCRYPT			1			/**< defines encryption for cipher_chacha_poly() */
+#define CHACHA_DECRYPT			0			/**< defines decryption for cipher_chacha_poly() */
+
+#define CIPHER_CHACHA_PORTABLE	(0)			/**< ChaCha20 engine: portable C code, one block at a time */
+#define CIPHER_CHACHA_SSE2		(1)			/**< ChaCha20 engine: SSE2, four blocks at a time (x86 only) */
+#define CIPHER_CHACHA_AVX2		(2)			/**< ChaCha20 engine: AVX2, eight blocks at a time (x86 only, used if the CPU has it) */
+
+#if !defined(IPSEC_CHACHA_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IPSEC_CHACHA_SIMD					/**< compile the SSE2 and AVX2 engines (define IPSEC_CHACHA_NO_SIMD to leave them out) */
+#endif
+
+#if !defined(IPSEC_POLY1305_NO_64) && defined(__GNUC__)
+#define IPSEC_POLY1305_64					/**< Poly1305 with 26 bit limbs and 64 bit products (13 bit limbs and 32 bit products otherwise) */
+#endif
+
+/** ChaCha20 key */
+typedef struct chacha_key_struct
+{
+	__u32	key[8] ;					/**< key as little endian words */
+	int		engine ;					/**< engine selected for this key (CIPHER_CHACHA_xxx) */
+} chacha_key ;
+
+
+int cipher_chacha_set_engine(int) ;
+void cipher_chacha_set_key(unsigned char *, chacha_key *) ;
+void cipher_chacha20(unsigned char *, int, chacha_key *, unsigned char *, __u32, unsigned char *) ;
+void cipher_chacha_poly(unsigned char *, int, chacha_key *, unsigned char *, unsigned char *, int, int, unsigned char *, unsigned char *) ;
+void cipher_chacha_poly_chain(ipsec_buffer *, int, int, chacha_key *, unsigned char *, unsigned char *, int, int, unsigned char *) ;
+
+#endif
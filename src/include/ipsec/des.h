@@ -68,9 +68,31 @@ typedef struct DES_ks
 #define DES_ENCRYPT	1							/**< defines encryption for the des function */
 #define DES_DECRYPT	0							/**< defines decryption for the des function */
 
+#define CIPHER_3DES_SERIAL		(0)				/**< 3DES engine: one block after the other (smallest code, for 16-bit targets) */
+#define CIPHER_3DES_INTERLEAVED	(1)				/**< 3DES engine: two independent blocks per round (CBC decryption, several buffers) */
+
+#ifndef CIPHER_3DES_DEFAULT_ENGINE
+#define CIPHER_3DES_DEFAULT_ENGINE	CIPHER_3DES_INTERLEAVED	/**< 3DES engine used until cipher_3des_set_engine() is called */
+#endif
+
+/** One buffer processed by cipher_3des_cbc_multi() */
+typedef struct cipher_3des_stream_struct
+{
+	unsigned char		*text ;		/**< input data */
+	unsigned char		*output ;	/**< en- or decrypted data (may be the same as text) */
+	int					len ;		/**< length of input data */
+	DES_key_schedule	*ks ;		/**< array of 3 key schedules (see cipher_3des_set_key()) */
+	unsigned char		*iv ;		/**< initialization vector, holds the last cipher block when the function returns */
+} cipher_3des_stream ;
+
 int DES_set_key_checked(const_DES_cblock *key,DES_key_schedule *schedule);
 void DES_set_key_unchecked(const_DES_cblock *key,DES_key_schedule *schedule);
 void cipher_3des_cbc(unsigned char*, int, unsigned char*, unsigned char*, int, unsigned char*);
+int cipher_3des_set_key(unsigned char*, DES_key_schedule*);
+void cipher_3des_cbc_ks(unsigned char*, int, DES_key_schedule*, unsigned char*, int, unsigned char*);
+void cipher_3des_cbc_chain(ipsec_buffer*, int, int, DES_key_schedule*, unsigned char*, int);
+void cipher_3des_cbc_multi(cipher_3des_stream*, int, int);
+int cipher_3des_set_engine(int);
 
 #endif
 
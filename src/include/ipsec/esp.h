@@ -45,12 +45,19 @@
 
 #include "ipsec/sa.h"
 
-#define IPSEC_ESP_IV_SIZE		(8)			/**< Defines the size (in bytes) of the Initialization Vector used by DES and 3DES */
+#define IPSEC_ESP_IV_SIZE		(8)			/**< Defines the size (in bytes) of the Initialization Vector used by DES, 3DES and AES-CTR */
+#define IPSEC_ESP_MAX_IV_SIZE	(16)		/**< Defines the size (in bytes) of the largest Initialization Vector (AES-CBC) */
 #define IPSEC_ESP_SPI_SIZE		(4)			/**< Defines the size (in bytes) of the SPI of an ESP packet */
 #define IPSEC_ESP_SEQ_SIZE		(4)			/**< Defines the size (in bytes) of the Sequence Number of an ESP packet */
 #define IPSEC_ESP_HDR_SIZE		(IPSEC_ESP_SPI_SIZE+IPSEC_ESP_SEQ_SIZE)	/**< Defines the size (in bytes) of the ESP header. Actually it defines just the size of the header which is located in */
+#define IPSEC_ESP_MAX_PADDING	(15)		/**< Defines the maximum padding (in bytes) added to align the payload to the cipher block size (16 bytes for AES-CBC) */
+#define IPSEC_ESP_MAX_ICV_SIZE	(IPSEC_MAX_AUTH_ICV)	/**< Defines the size (in bytes) of the largest ICV (HMAC-SHA-512-256, combined modes have at most 16 bytes) */
+#define IPSEC_ESP_TRAILER_SIZE	(2)			/**< Defines the size (in bytes) of the padding length and next header fields */
+#define IPSEC_ESP_BATCH_SIZE	(8)			/**< Defines the number of packets ipsec_esp_encapsulate_batch() sets up before it encrypts them together */
 
 
+#pragma pack(1)
+
 typedef struct ipsec_esp_header_struct
 {
 	__u32 	spi;			/**< Security Parameters Index      */
@@ -65,11 +72,15 @@ typedef struct esp_packet_struct
 	__u8	data[1] ;				/**< start of data, usually start of the IV */
 } esp_packet ;
 
+#pragma pack()
 
-extern __u32 ipsec_esp_bitmap; 	
-extern __u32 ipsec_esp_lastSeq;
 
 ipsec_status ipsec_esp_decapsulate(ipsec_ip_header *packet, int *offset, int *len, sad_entry *sa) ;
 ipsec_status ipsec_esp_encapsulate(ipsec_ip_header *packet, int *offset, int *len, sad_entry *sa, __u32 src_addr, __u32 dest_addr) ;
+ipsec_status ipsec_esp_decapsulate_chain(ipsec_buffer *chain, int *offset, int *len, sad_entry *sa) ;
+void ipsec_esp_decapsulate_batch(ipsec_packet **packets, int count, sad_entry *sa) ;
+ipsec_status ipsec_esp_encapsulate_chain(ipsec_buffer *chain, int *offset, int *len, sad_entry *sa, __u32 src_addr, __u32 dest_addr, __u32 sequence) ;
+void ipsec_esp_encapsulate_batch(ipsec_packet **packets, int count, sad_entry *sa, __u32 src_addr, __u32 dest_addr, __u32 sequence) ;
+void ipsec_esp_get_overhead(sad_entry *sa, int *headroom, int *tailroom) ;
 
 #endif
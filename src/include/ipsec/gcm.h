@@ -0,0 +1,70 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file gcm.h
+ *  @brief Header of the AES-GCM combined mode (encryption and authentication)
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#ifndef __GCM_H__
+#define __GCM_H__
+
+#include "ipsec/types.h"
+#include "ipsec/aes.h"
+
+
+#define GCM_IV_SIZE				(12)		/**< size of the IV (nonce) in bytes, counter blocks are IV || 32 bit counter */
+#define GCM_TAG_SIZE			(16)		/**< size of the full authentication tag in bytes */
+
+#define CIPHER_GHASH_PORTABLE	(0)			/**< GHASH engine: portable C code with a 4 bit table (256 bytes per key) */
+#define CIPHER_GHASH_CLMUL		(1)			/**< GHASH engine: PCLMULQDQ instruction (x86 only, used if the CPU has it) */
+
+#if !defined(IPSEC_GCM_NO_CLMUL) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IPSEC_GCM_CLMUL						/**< compile the PCLMULQDQ engine (define IPSEC_GCM_NO_CLMUL to leave it out) */
+#endif
+
+/** Expanded AES-GCM key */
+typedef struct gcm_key_struct
+{
+	aes_key	aes ;						/**< expanded AES key */
+	__u32	htable[16][4] ;				/**< hash key H multiplied by all 4 bit values (portable engine) */
+	__u8	h[16] ;						/**< hash key H with reversed byte order (PCLMULQDQ engine) */
+	int		engine ;					/**< GHASH engine selected for this key (CIPHER_GHASH_xxx) */
+} gcm_key ;
+
+
+int cipher_gcm_set_engine(int) ;
+int cipher_gcm_set_key(unsigned char *, int, gcm_key *) ;
+void cipher_gcm(unsigned char *, int, gcm_key *, unsigned char *, unsigned char *, int, int, unsigned char *, unsigned char *) ;
+void cipher_gcm_chain(ipsec_buffer *, int, int, gcm_key *, unsigned char *, unsigned char *, int, int, unsigned char *) ;
+
+#endif
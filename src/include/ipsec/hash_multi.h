@@ -0,0 +1,73 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file hash_multi.h
+ *  @brief Header of the multi-buffer HMAC-MD5 and HMAC-SHA1 (several packets at a time)
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#ifndef __HASH_MULTI_H__
+#define __HASH_MULTI_H__
+
+#include "ipsec/types.h"
+#include "ipsec/md5.h"
+#include "ipsec/sha1.h"
+
+
+#define HASH_MULTI_PORTABLE		(0)		/**< multi-buffer engine: one packet after the other with hmac_md5_chain() or hmac_sha1_chain() */
+#define HASH_MULTI_SSE2			(1)		/**< multi-buffer engine: SSE2, four packets at a time (x86 only) */
+#define HASH_MULTI_AVX2			(2)		/**< multi-buffer engine: AVX2, eight packets at a time (x86 only, used if the CPU has it) */
+#define HASH_MULTI_AVX512		(3)		/**< multi-buffer engine: AVX-512, sixteen packets at a time (x86 only, used if the CPU has it) */
+
+#define HASH_MULTI_MAX_LANES	(16)	/**< largest number of packets hashed at a time */
+
+#if !defined(IPSEC_HASH_NO_MULTI) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IPSEC_HASH_MULTI				/**< compile the SIMD engines (define IPSEC_HASH_NO_MULTI to leave them out) */
+#endif
+
+/** One packet authenticated by hmac_md5_multi() or hmac_sha1_multi() */
+typedef struct hmac_multi_stream_struct
+{
+	void			*hctx ;		/**< precomputed HMAC state (HMAC_MD5_CTX or HMAC_SHA1_CTX, see hmac_md5_init() and hmac_sha1_init()) */
+	ipsec_buffer	*chain ;	/**< first segment of the data */
+	int				offset ;	/**< offset of the first byte to hash relative to the start of the chain */
+	int				len ;		/**< number of bytes to hash */
+	unsigned char	*digest ;	/**< returns the digest (MD5_DIGEST_LENGTH or SHA_DIGEST_LENGTH bytes) */
+} hmac_multi_stream ;
+
+
+int hash_multi_set_engine(int) ;
+int hash_multi_lanes(void) ;
+void hmac_md5_multi(hmac_multi_stream *, int) ;
+void hmac_sha1_multi(hmac_multi_stream *, int) ;
+
+#endif
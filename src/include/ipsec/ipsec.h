@@ -48,18 +48,45 @@
 
 #define IPSEC_DES_KEY_LEN		(8)							/**< Defines the size of a DES key in bytes */
 #define IPSEC_3DES_KEY_LEN		(IPSEC_DES_KEY_LEN*3)		/**< Defines the length of a 3DES key in bytes */
-#define IPSEC_MAX_ENCKEY_LEN	(IPSEC_3DES_KEY_LEN)		/**< Defines the maximum encryption key length of our IPsec system */
+#define IPSEC_AES_128_KEY_LEN	(16)						/**< Defines the length of an AES-128 key in bytes */
+#define IPSEC_AES_256_KEY_LEN	(32)						/**< Defines the length of an AES-256 key in bytes */
+#define IPSEC_AES_CTR_NONCE_LEN	(4)							/**< Defines the length of the nonce which follows the key of an AES-CTR SA (RFC 3686, 5.1) */
+#define IPSEC_AES_GCM_SALT_LEN	(4)							/**< Defines the length of the salt which follows the key of an AES-GCM SA (RFC 4106, 8.1) */
+#define IPSEC_CHACHA20_KEY_LEN	(32)						/**< Defines the length of a ChaCha20 key in bytes */
+#define IPSEC_CHACHA20_SALT_LEN	(4)							/**< Defines the length of the salt which follows the key of a ChaCha20-Poly1305 SA (RFC 7634, 4) */
+#define IPSEC_MAX_ENCKEY_LEN	(IPSEC_AES_256_KEY_LEN+IPSEC_AES_CTR_NONCE_LEN)	/**< Defines the maximum encryption key length of our IPsec system */
 
-#define IPSEC_AUTH_ICV			(12)						/**< Defines the authentication key length in bytes (12 bytes for 96bit keys) */
+#define IPSEC_AUTH_ICV			(12)						/**< Defines the ICV length in bytes of HMAC-MD5-96 and HMAC-SHA1-96 (see IPSEC_AUTH_ICV_LEN() for the other algorithms) */
+#define IPSEC_MAX_AUTH_ICV		(32)						/**< Defines the longest ICV of an authentication algorithm in bytes (HMAC-SHA-512-256) */
 #define IPSEC_AUTH_MD5_KEY_LEN	(16)						/**< Length of MD5 secret key  */
 #define IPSEC_AUTH_SHA1_KEY_LEN	(20)						/**< Length of SHA1 secret key */
-#define IPSEC_MAX_AUTHKEY_LEN   (IPSEC_AUTH_SHA1_KEY_LEN) 	/**< Maximum length of authentication keys */
+#define IPSEC_AUTH_SHA256_KEY_LEN	(32)					/**< Length of HMAC-SHA-256 secret key (RFC 4868, 2.1.1) */
+#define IPSEC_AUTH_SHA384_KEY_LEN	(48)					/**< Length of HMAC-SHA-384 secret key */
+#define IPSEC_AUTH_SHA512_KEY_LEN	(64)					/**< Length of HMAC-SHA-512 secret key */
+#define IPSEC_MAX_AUTHKEY_LEN   (IPSEC_AUTH_SHA512_KEY_LEN) /**< Maximum length of authentication keys (and of the digests, which have the same length) */
 
 #define IPSEC_MIN_IPHDR_SIZE	(20) 	/**< Defines the minimum IP header size (in bytes).*/
-#define IPSEC_SEQ_MAX_WINDOW	(32)	/**< Defines the maximum window for Sequence Number checks (used as anti-replay protection) */
+#ifndef IPSEC_SEQ_MAX_WINDOW
+#define IPSEC_SEQ_MAX_WINDOW	(1024)	/**< Defines the maximum window for Sequence Number checks (used as anti-replay protection), larger replay_win are limited to it. The bitmap of every SA (outbound ones included) takes (IPSEC_SEQ_MAX_WINDOW/32+1)*4 bytes: 132 bytes for 1024, 516 bytes for 4096. So build with the largest window the SAs need (e.g. -DIPSEC_SEQ_MAX_WINDOW=4096) */
+#endif
+#define IPSEC_SEQ_MIN_WINDOW	(64)	/**< Defines the minimum window for Sequence Number checks */
+#define IPSEC_SEQ_DEFAULT_WINDOW	(64)	/**< Defines the window used by SAs which do not configure one (replay_win = 0) */
+#if (IPSEC_SEQ_MAX_WINDOW < IPSEC_SEQ_MIN_WINDOW) || (IPSEC_SEQ_MAX_WINDOW > 32768)
+#error "IPSEC_SEQ_MAX_WINDOW must be in the range of IPSEC_SEQ_MIN_WINDOW..32768"
+#endif
+#define IPSEC_OUTER_TTL			(64)	/**< Defines the TTL of the outer IP header of tunnel mode packets */
+#define IPSEC_TUNNEL_DEC_TTL	(0)		/**< 1: tunnel mode decrements the TTL of the inner header (RFC 4301, 5.1.2.1: only if the packet is forwarded and the stack did not do it already, lwIP's ip_forward() does) */
 
 
 int ipsec_input(unsigned char *, int, int *, int *, void *);
 int ipsec_output(unsigned char *, int , int *, int *, __u32, __u32, void *);
+int ipsec_input_chain(ipsec_buffer *, int *, int *, void *);
+int ipsec_output_chain(ipsec_buffer *, int *, int *, __u32, __u32, void *);
+int ipsec_input_sa(ipsec_buffer *, int *, int *, void *);
+int ipsec_output_sa(ipsec_buffer *, int *, int *, __u32, __u32, void *, __u32);
+int ipsec_input_check_policy(ipsec_buffer *, int, void *, void *);
+int ipsec_input_batch(ipsec_packet *, int, void *);
+int ipsec_output_batch(ipsec_packet *, int, __u32, __u32);
+int ipsec_output_overhead(void *, int *, int *);
 
 #endif 
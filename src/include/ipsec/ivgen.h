@@ -0,0 +1,80 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file ivgen.h
+ *  @brief Header of the random number generator (CTR-DRBG) and the per-packet IV generator
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#ifndef __IVGEN_H__
+#define __IVGEN_H__
+
+#include "ipsec/types.h"
+#include "ipsec/aes.h"
+#include "ipsec/sa.h"
+
+
+#define IPSEC_DRBG_SEED_LEN			(32)		/**< length of the seed of the CTR-DRBG (AES-128 key and V, NIST SP 800-90A, 10.2.1) */
+#define IPSEC_DRBG_BUFFER_SIZE		(128)		/**< random bytes produced by one refill of the buffer (multiple of AES_BLOCK_SIZE) */
+#define IPSEC_DRBG_RESEED_INTERVAL	(65536UL)	/**< refills after which new entropy is fetched (SP 800-90A allows 2^48) */
+
+#define IPSEC_IVGEN_CONTEXTS		(IPSEC_DB_READERS+1)	/**< number of generators, one per thread (reader number of ipsec_db_enter()) and one for ipsec_sad_prepare() */
+#define IPSEC_IVGEN_SETUP			(IPSEC_DB_READERS)		/**< generator used by ipsec_sad_prepare() */
+
+#if !defined(IPSEC_DRBG_NO_GETRANDOM) && defined(__linux__)
+#define IPSEC_DRBG_GETRANDOM					/**< seed from getrandom() by default (define IPSEC_DRBG_NO_GETRANDOM to leave it out) */
+#endif
+
+/** Entropy source: fills the buffer with len bytes of full entropy and returns 0, anything else if it failed */
+typedef int (*ipsec_entropy_hook)(unsigned char *buffer, int len) ;
+
+/** CTR-DRBG with AES-128 and without derivation function (NIST SP 800-90A, 10.2.1) whose output is buffered */
+typedef struct ipsec_drbg_struct
+{
+	aes_key			key ;							/**< expanded key of the DRBG state */
+	unsigned char	v[AES_BLOCK_SIZE] ;				/**< counter V of the DRBG state */
+	unsigned char	buffer[IPSEC_DRBG_BUFFER_SIZE] ;/**< output of the last refill */
+	int				pos ;							/**< next unused byte of the buffer (IPSEC_DRBG_BUFFER_SIZE if it is empty) */
+	__u32			refills ;						/**< refills since the last (re)seed */
+	int				seeded ;						/**< 1 if the DRBG was seeded */
+} ipsec_drbg ;
+
+
+ipsec_entropy_hook ipsec_drbg_set_entropy(ipsec_entropy_hook) ;
+ipsec_status ipsec_drbg_seed(ipsec_drbg *, unsigned char *, int) ;
+ipsec_status ipsec_drbg_generate(ipsec_drbg *, unsigned char *, int) ;
+
+ipsec_status ipsec_ivgen_random(int, unsigned char *, int) ;
+ipsec_status ipsec_ivgen_prepare(sad_entry *) ;
+void ipsec_ivgen_packet(sad_entry *, __u32, unsigned char *) ;
+
+#endif
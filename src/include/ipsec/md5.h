@@ -74,6 +74,16 @@ extern void MD5_Final(unsigned char *md, MD5_CTX *c);
 extern unsigned char *MD5(const unsigned char *d, unsigned long n, unsigned char *md);
 extern void MD5_Transform(MD5_CTX *c, const unsigned char *b);
 
+/* @type HMAC_MD5_CTX precomputed HMAC-MD5 state, holds the MD5 contexts after the inner and outer pad */
+typedef struct HMAC_MD5state_st
+	{
+		MD5_CTX inner;
+		MD5_CTX outer;
+	} HMAC_MD5_CTX;
+
 void hmac_md5(unsigned char*, int, unsigned char*, int, unsigned char*);
+void hmac_md5_init(HMAC_MD5_CTX*, unsigned char*, int);
+void hmac_md5_precomputed(HMAC_MD5_CTX*, unsigned char*, int, unsigned char*);
+void hmac_md5_chain(HMAC_MD5_CTX*, ipsec_buffer*, int, int, unsigned char*);
 
 #endif
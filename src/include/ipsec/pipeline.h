@@ -0,0 +1,97 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file pipeline.h
+ *  @brief Header of the pipelined IPsec engine (worker pool)
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include "ipsec/types.h"
+
+
+#define IPSEC_PIPELINE_WORKERS	(2)		/**< number of crypto workers (threads or cores calling ipsec_pipeline_work()) */
+#define IPSEC_PIPELINE_WINDOW	(16)	/**< maximum number of packets in the pipeline (size of the rings), must be a power of 2 */
+
+#define IPSEC_PIPELINE_INBOUND	(0)		/**< job is an inbound packet (AH check or ESP decapsulation) */
+#define IPSEC_PIPELINE_OUTBOUND	(1)		/**< job is an outbound packet (AH or ESP encapsulation) */
+
+
+/** Lock-free ring with exactly one producer and one consumer */
+typedef struct ipsec_ring_struct
+{
+	volatile unsigned int	head ;							/**< next slot to write, only changed by the producer */
+	volatile unsigned int	tail ;							/**< next slot to read, only changed by the consumer */
+	void					*slot[IPSEC_PIPELINE_WINDOW] ;	/**< queued items */
+} ipsec_ring ;
+
+/** One packet passed through the pipeline */
+typedef struct ipsec_job_struct
+{
+	ipsec_packet	packet ;	/**< packet (chain and, outbound, spd), returns payload_offset, payload_size and status */
+	int				direction ;	/**< IPSEC_PIPELINE_INBOUND or IPSEC_PIPELINE_OUTBOUND */
+	void			*sa ;		/**< SA (sad_entry) found by ipsec_pipeline_dispatch() */
+	__u32			epoch ;		/**< database epoch in which the SA (and the SPD entry) was found (see ipsec_db_hold()) */
+	void			*user ;		/**< data of the owner of the job (e.g. the pbuf), not used by the pipeline */
+} ipsec_job ;
+
+/** Pipeline of one IPsec device: dispatcher -> workers -> collector.
+ *  All packets of an SA are processed by the same worker, so they leave the pipeline in the order
+ *  they were dispatched and the sequence numbers of an SA are assigned strictly in order. */
+typedef struct ipsec_pipeline_struct
+{
+	void			*databases ;								/**< SPD and SA configuration (db_set_netif) */
+	__u32			tunnel_src ;								/**< tunnel source address used for outbound packets */
+	__u32			tunnel_dst ;								/**< tunnel destination address used for outbound packets */
+	ipsec_ring		work[IPSEC_PIPELINE_WORKERS] ;				/**< jobs from the dispatcher to every worker */
+	ipsec_ring		done[IPSEC_PIPELINE_WORKERS] ;				/**< processed jobs from every worker to the collector */
+	int				in_flight ;									/**< number of dispatched jobs which were not collected yet */
+	int				next_done ;									/**< done ring ipsec_pipeline_collect() looks at first */
+	__u32			epoch[IPSEC_PIPELINE_WINDOW] ;				/**< database epochs of the jobs in flight, oldest first (circular, one entry per epoch) */
+	int				epoch_jobs[IPSEC_PIPELINE_WINDOW] ;			/**< number of jobs in flight of every epoch */
+	int				epoch_first ;								/**< entry of the oldest epoch */
+	int				epochs ;									/**< number of epochs of jobs in flight */
+	int				reader ;									/**< reader number of the dispatcher and collector thread (see ipsec_db_enter()) */
+} ipsec_pipeline ;
+
+
+int ipsec_ring_put(ipsec_ring *, void *) ;
+void *ipsec_ring_get(ipsec_ring *) ;
+
+ipsec_status ipsec_pipeline_init(ipsec_pipeline *, void *, __u32, __u32, int) ;
+ipsec_status ipsec_pipeline_dispatch(ipsec_pipeline *, ipsec_job *) ;
+int ipsec_pipeline_work(ipsec_pipeline *, int) ;
+ipsec_job *ipsec_pipeline_collect(ipsec_pipeline *) ;
+
+#endif
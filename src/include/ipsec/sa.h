@@ -44,10 +44,25 @@
 #include "ipsec/types.h"
 #include "ipsec/util.h"
 #include "ipsec/ipsec.h"
+#include "ipsec/des.h"
+#include "ipsec/aes.h"
+#include "ipsec/gcm.h"
+#include "ipsec/chacha.h"
+#include "ipsec/md5.h"
+#include "ipsec/sha1.h"
+#include "ipsec/sha2.h"
 
 
 #define IPSEC_MAX_SAD_ENTRIES	(10)	/**< Defines the size of SPD entries in the SPD table. */
 #define IPSEC_MAX_SPD_ENTRIES	(10)	/**< Defines the size of SAD entries in the SAD table. */
+#define IPSEC_SPD_HASH_SIZE		(16)	/**< Number of buckets of the classifier of an SPD table (must be a power of 2, should be in the range of IPSEC_MAX_SPD_ENTRIES) */
+#define IPSEC_SPD_CACHE_SIZE	(8)		/**< Number of flows remembered by the lookup cache of an SPD table (must be a power of 2) */
+#define IPSEC_SAD_HASH_SIZE		(16)	/**< Number of buckets of the SPI index of an SAD table (must be a power of 2, should be in the range of IPSEC_MAX_SAD_ENTRIES) */
+#define IPSEC_DB_READERS		(2)		/**< Number of threads which may look up the databases at the same time (see ipsec_db_enter()) */
+
+#ifndef IPSEC_SA_EXHAUSTED
+#define IPSEC_SA_EXHAUSTED(sa)			/**< called with the SA when its sequence numbers run out (see ipsec_sad_next_sequence()), a port with key management starts rekeying the SA here */
+#endif
 
 #define IPSEC_FREE				(0)		/**< Tells you that an SPD entry is free */				
 #define IPSEC_USED				(1)		/**< Tells you that an SPD entry is used */
@@ -62,11 +77,46 @@
 #define IPSEC_DES				(1)		/**< Defines DES as the encryption algorithm for an ESP packet */
 #define IPSEC_3DES				(2)		/**< Defines 3DES as the encryption algorithm for an ESP packet */
 #define IPSEC_IDEA				(3)		/**< Defines IDEA as the encryption algorithm for an ESP packet */
+#define IPSEC_AES_128_CBC		(4)		/**< Defines AES-128 in CBC mode (RFC 3602) as the encryption algorithm for an ESP packet */
+#define IPSEC_AES_256_CBC		(5)		/**< Defines AES-256 in CBC mode (RFC 3602) as the encryption algorithm for an ESP packet */
+#define IPSEC_AES_128_CTR		(6)		/**< Defines AES-128 in CTR mode (RFC 3686, the key is followed by the nonce) as the encryption algorithm for an ESP packet */
+#define IPSEC_AES_256_CTR		(7)		/**< Defines AES-256 in CTR mode (RFC 3686, the key is followed by the nonce) as the encryption algorithm for an ESP packet */
+#define IPSEC_AES_128_GCM_8		(8)		/**< Defines AES-128-GCM with an 8 byte ICV (RFC 4106, the key is followed by the salt) as the combined mode algorithm for an ESP packet */
+#define IPSEC_AES_128_GCM_12	(9)		/**< Defines AES-128-GCM with a 12 byte ICV as the combined mode algorithm for an ESP packet */
+#define IPSEC_AES_128_GCM_16	(10)	/**< Defines AES-128-GCM with a 16 byte ICV as the combined mode algorithm for an ESP packet */
+#define IPSEC_AES_256_GCM_8		(11)	/**< Defines AES-256-GCM with an 8 byte ICV as the combined mode algorithm for an ESP packet */
+#define IPSEC_AES_256_GCM_12	(12)	/**< Defines AES-256-GCM with a 12 byte ICV as the combined mode algorithm for an ESP packet */
+#define IPSEC_AES_256_GCM_16	(13)	/**< Defines AES-256-GCM with a 16 byte ICV as the combined mode algorithm for an ESP packet */
+#define IPSEC_CHACHA20_POLY1305	(14)	/**< Defines ChaCha20-Poly1305 (RFC 7634, the key is followed by the salt) as the combined mode algorithm for an ESP packet */
+#define IPSEC_IS_AES_GCM(alg)	(((alg) >= IPSEC_AES_128_GCM_8) && ((alg) <= IPSEC_AES_256_GCM_16))	/**< Checks if an encryption algorithm is AES-GCM */
+#define IPSEC_IS_COMBINED(alg)	(IPSEC_IS_AES_GCM(alg) || ((alg) == IPSEC_CHACHA20_POLY1305))		/**< Checks if an encryption algorithm also authenticates (the SA's auth_alg is not used then) */
 
 #define IPSEC_HMAC_MD5			(1)		/**< Defines HMAC-MD5 as the authentication algorithm for an AH or an ESP packet */
 #define IPSEC_HMAC_SHA1			(2)		/**< Defines HMAC-SHA1 as the authentication algorithm for an AH or an ESP packet */
-
-#define IPSEC_NR_NETIFS			(1)		/**< Defines the number of network interfaces. This is used to reserve space for db_netif_struct's */
+#define IPSEC_HMAC_SHA256		(3)		/**< Defines HMAC-SHA-256-128 (RFC 4868) as the authentication algorithm for an AH or an ESP packet */
+#define IPSEC_HMAC_SHA384		(4)		/**< Defines HMAC-SHA-384-192 (RFC 4868) as the authentication algorithm for an AH or an ESP packet */
+#define IPSEC_HMAC_SHA512		(5)		/**< Defines HMAC-SHA-512-256 (RFC 4868) as the authentication algorithm for an AH or an ESP packet */
+#define IPSEC_IS_HMAC(alg)		(((alg) >= IPSEC_HMAC_MD5) && ((alg) <= IPSEC_HMAC_SHA512))	/**< Checks if an authentication algorithm is supported */
+#define IPSEC_AUTH_ICV_LEN(alg)	((alg) == IPSEC_HMAC_SHA256 ? 16 : (alg) == IPSEC_HMAC_SHA384 ? 24 : \
+								 (alg) == IPSEC_HMAC_SHA512 ? 32 : IPSEC_AUTH_ICV)	/**< ICV length in bytes of an authentication algorithm (the truncated HMAC) */
+
+#define IPSEC_KEYS_UNSET		(0)		/**< The key schedules and HMAC states of an SA were not yet set up (e.g. statically configured SA before ipsec_spd_load_dbs()), the packets of the SA are refused */
+#define IPSEC_KEYS_READY		(1)		/**< The key schedules and HMAC states of an SA are set up and can be used */
+#define IPSEC_KEYS_BAD			(2)		/**< The keys of an SA were rejected (bad parity or weak key) */
+
+#define IPSEC_NR_NETIFS			(2)		/**< Defines the number of network interfaces (ipsecdev instances). This is used to reserve space for db_netif_struct's */
+
+/** \struct ipsec_outer_template_struct
+ * Outer headers of the packets of an SA for one pair of tunnel addresses, built on the control path and copied 
+ * in front of every packet (see ipsec_sad_set_tunnel() and ipsec_sad_outer_header())
+ */
+typedef struct ipsec_outer_template_struct
+{
+	ipsec_ip_header	ip ;			/**< outer IP header, TOS, length, ID and checksum are set per packet */
+	__u8			ipsec[8] ;		/**< start of the AH header (next header, length, reserved and SPI) or of the ESP header (SPI) */
+	__u32			sum ;			/**< one's complement sum of the IP header without the first word, length and ID (see ipsec_chksum_add()) */
+	__u8			valid ;			/**< 1 if ip, ipsec and sum are set up */
+} ipsec_outer_template ;
 
 typedef struct sa_entry_struct sad_entry ;					/**< Security Association Database entry */
 
@@ -83,7 +133,7 @@ struct sa_entry_struct
 	__u8		mode ;				/**< tunnel or transport mode */
 	/* this fields are used to maintain the current connection */
 	__u32		sequence_number ;	/**< the sequence number used to implement the anti-reply mechanism (RFC 2402, 3.3.2: initialize with 0) */
-	__u8		replay_win ;		/**< reply windows size */
+	__u16		replay_win ;		/**< reply windows size (0 = IPSEC_SEQ_DEFAULT_WINDOW, max. IPSEC_SEQ_MAX_WINDOW) */
 	__u32		lifetime ;			/**< lifetime of the SA (must be dropped if lifetime runs out) */
 	__u16		path_mtu ;			/**< mean transmission unit */
 	/* this fields are used for the cryptography */
@@ -94,7 +144,30 @@ struct sa_entry_struct
 	sad_entry	*next ;							/**< pointer to the next SAD entry */
 	sad_entry	*prev ;							/**< pointer to the previous SAD entry */
 	__u8		use_flag ;						/**< this flag defines if the SAD entry is still used or not */
-	/**@todo IV for cbc-mode should be added to this structure */
+	/* this fields are set up by ipsec_sad_prepare() and must not be set by the user */
+	__u8		key_state ;						/**< tells whether the key schedules and HMAC states below are valid (IPSEC_KEYS_...) */
+	union
+	{
+		DES_key_schedule	des[3] ;			/**< expanded 3DES key schedules of enckey */
+		aes_key				aes ;				/**< expanded AES key of enckey */
+		gcm_key				gcm ;				/**< expanded AES key and GHASH key of enckey (AES-GCM) */
+		chacha_key			chacha ;			/**< key of ChaCha20-Poly1305 */
+	} enc_ctx ;									/**< expanded encryption key (depends on enc_alg) */
+	union
+	{
+		HMAC_MD5_CTX	md5 ;					/**< HMAC-MD5 state after absorbing the pads of authkey */
+		HMAC_SHA1_CTX	sha1 ;					/**< HMAC-SHA1 state after absorbing the pads of authkey */
+		HMAC_SHA256_CTX	sha256 ;				/**< HMAC-SHA-256 state after absorbing the pads of authkey */
+		HMAC_SHA512_CTX	sha512 ;				/**< HMAC-SHA-384 or HMAC-SHA-512 state after absorbing the pads of authkey */
+	} auth_ctx ;								/**< precomputed HMAC state (depends on auth_alg) */
+	ipsec_replay_state replay ;					/**< anti-replay state of this SA (inbound only, its bitmap is sized by IPSEC_SEQ_MAX_WINDOW) */
+	sad_entry	*hash_next ;					/**< pointer to the next SAD entry in the same bucket of the SPI index */
+	__u32		retired ;						/**< epoch in which the entry was deleted (see ipsec_db_enter()) */
+	__u32		seq_exhausted ;					/**< number of packets which were not sent because the sequence numbers ran out (see ipsec_sad_next_sequence()) */
+	__u8		iv_salt[AES_BLOCK_SIZE] ;		/**< secret random salt of the CBC IVs (see ipsec_ivgen_packet()) */
+	ipsec_outer_template outer[2] ;				/**< outer headers of outbound packets, the one of outer_version is used (see ipsec_sad_outer_header()) */
+	volatile int	outer_version ;				/**< template used by the outbound packets (0 or 1), the other one is rebuilt by ipsec_sad_set_tunnel() */
+	__u16		ip_id_base ;					/**< random start of the outer IP IDs, a packet gets ip_id_base plus its sequence number */
 	/**@todo enc_alg and auth_alg should be replced by function pointers */
 };
 
@@ -117,8 +190,30 @@ struct spd_entry_struct
 	spd_entry	*next ;			/**< pointer to the next table entry*/
 	spd_entry	*prev ;			/**< pointer to the previous table entry */
 	__u8		use_flag ; 		/**< tells whether the entry is free or not */
+	/* this fields are set up by ipsec_spd_compile() and must not be set by the user (one per classifier version) */
+	spd_entry	*hash_next[2] ;	/**< pointer to the next entry in the same bucket of the classifier */
+	int			position[2] ;	/**< position of the entry in the table (0 = first entry) */
+	spd_entry	*tuple[2] ;		/**< first entry of the class of this entry (it defines the masks and whether a protocol is given) */
+	spd_entry	*tuple_next[2] ;/**< first entry of the next class (only used by the first entry of a class) */
+	__u32		retired ;		/**< epoch in which the entry was deleted (see ipsec_db_enter()) */
 };
 
+/** \struct spd_cache_entry_struct
+ * Remembers the result of an SPD lookup for one flow (addresses, protocol and ports).
+ * The entry is written and read under its sequence count, so several readers may share it.
+ */
+typedef struct spd_cache_entry_struct
+{
+	volatile __u32	sequence ;	/**< odd while a lookup stores a result, advanced by 2 for every stored result */
+	__u32		src ;			/**< IP source address of the flow */
+	__u32		dest ;			/**< IP destination address of the flow */
+	__u16		src_port ;		/**< source port of the flow (0 if neither TCP nor UDP) */
+	__u16		dest_port ;		/**< destination port of the flow (0 if neither TCP nor UDP) */
+	__u8		protocol ;		/**< transport layer protocol of the flow */
+	__u32		generation ;	/**< database generation this result belongs to (see ipsec_spd_lookup()) */
+	spd_entry	*spd ;			/**< matching SPD entry */
+} spd_cache_entry ;
+
 /** \struct spd_table_struct
  * This structure holds pointers which together define the Security Policy Database
  */
@@ -128,6 +223,18 @@ typedef struct spd_table_struct
 	spd_entry	*first ;		/**< Pointer to the first entry in the table */
 	spd_entry	*last ;			/**< Pointer to the last entry in the table */
 	int			size ;			/**< Number of usable elements in the table data */
+	spd_entry	*free_list ;	/**< Pointer to the first free entry (the free entries are chained by their next pointer) */
+	spd_entry	*retired_list ;	/**< Pointer to the oldest deleted entry which may still be used by a reader (chained by the next pointer) */
+	spd_entry	*retired_tail ;	/**< Pointer to the newest deleted entry (only valid if retired_list is not NULL) */
+	spd_entry	*tuples[2] ;	/**< classifier: first entry of the first class (ordered by position, chained by spd_entry.tuple_next) */
+	spd_entry	**hash ;		/**< classifier: first entry of every bucket (chained by spd_entry.hash_next), the buckets of version 1 follow the ones of version 0 */
+	int			hash_mask ;		/**< Number of buckets of one classifier version - 1 (the number of buckets is a power of 2) */
+	volatile int	version ;	/**< classifier version (0 or 1) used by ipsec_spd_lookup(), the other one is rebuilt by ipsec_spd_compile() */
+	__u32		retired ;		/**< epoch in which the other classifier version was replaced */
+	spd_entry	*hash_default[2*IPSEC_SPD_HASH_SIZE] ;	/**< buckets used unless they are taken from a memory arena */
+	spd_cache_entry	cache[IPSEC_SPD_CACHE_SIZE] ;	/**< results of recent lookups, one per flow */
+	volatile __u32	cache_hits ;	/**< Number of lookups answered by the cache (counted with IPSEC_ATOMIC_CAS()) */
+	volatile __u32	cache_misses ;	/**< Number of lookups which had to use the classifier (counted with IPSEC_ATOMIC_CAS()) */
 } spd_table;
 
 typedef struct sad_table_struct
@@ -135,6 +242,16 @@ typedef struct sad_table_struct
 	sad_entry	*table ;		/**< Pointer to the table data. This is pointer to an array of sad_entries */
 	sad_entry	*first ;		/**< Pointer to the first entry in the table */
 	sad_entry	*last ;			/**< Pointer to the last entry in the table */
+	int			size ;			/**< Number of usable elements in the table data */
+	sad_entry	*free_list ;	/**< Pointer to the first free entry (the free entries are chained by their next pointer) */
+	sad_entry	*retired_list ;	/**< Pointer to the oldest deleted entry which may still be used by a reader (chained by the next pointer) */
+	sad_entry	*retired_tail ;	/**< Pointer to the newest deleted entry (only valid if retired_list is not NULL) */
+	sad_entry	**hash ;		/**< SPI index: first entry of every bucket (chained by sad_entry.hash_next) */
+	__u32		tunnel_src ;	/**< tunnel source address the outer header templates are built for (network order, see ipsec_sad_set_tunnel()) */
+	__u32		tunnel_dst ;	/**< tunnel destination address the outer header templates are built for (network order) */
+	__u32		outer_retired ;	/**< epoch in which the other outer header templates of the SAs were replaced */
+	int			hash_mask ;		/**< Number of buckets - 1 (the number of buckets is a power of 2) */
+	sad_entry	*hash_default[IPSEC_SAD_HASH_SIZE] ;	/**< buckets used unless they are taken from a memory arena */
 } sad_table ;
 
 typedef struct db_set_netif_struct
@@ -155,7 +272,7 @@ typedef struct db_set_netif_struct
 			proto, IPSEC_HTONS(src_port), IPSEC_HTONS(dest_port), policy, sa_ptr, 0, 0, \
 			IPSEC_USED 			/**< helps to statically configure the SPD entries */
 
-#define SAD_ENTRY(d1, d2, d3, d4, dn1, dn2, dn3, dn4, spi, proto, mode, enc_alg, ek1, ek2, ek3, ek4, ek5, ek6, ek7, ek8, ek9, ek10, ek11, ek12, ek13, ek14, ek15, ek16, ek17, ek18, ek19, ek20, ek21, ek22, ek23, ek24, auth_alg, ak1, ak2, ak3, ak4, ak5, ak6, ak7, ak8, ak9, ak10, ak11, ak12, ak13, ak14, ak15, ak16, ak17, ak18, ak19, ak20) \
+#define SAD_ENTRY(d1, d2, d3, d4, dn1, dn2, dn3, dn4, spi, proto, mode, enc_alg, ek1, ek2, ek3, ek4, ek5, ek6, ek7, ek8, ek9, ek10, ek11, ek12, ek13, ek14, ek15, ek16, ek17, ek18, ek19, ek20, ek21, ek22, ek23, ek24, ek25, ek26, ek27, ek28, ek29, ek30, ek31, ek32, ek33, ek34, ek35, ek36, auth_alg, ak1, ak2, ak3, ak4, ak5, ak6, ak7, ak8, ak9, ak10, ak11, ak12, ak13, ak14, ak15, ak16, ak17, ak18, ak19, ak20, ak21, ak22, ak23, ak24, ak25, ak26, ak27, ak28, ak29, ak30, ak31, ak32, ak33, ak34, ak35, ak36, ak37, ak38, ak39, ak40, ak41, ak42, ak43, ak44, ak45, ak46, ak47, ak48, ak49, ak50, ak51, ak52, ak53, ak54, ak55, ak56, ak57, ak58, ak59, ak60, ak61, ak62, ak63, ak64) \
 			IPSEC_IP4_ADDR_2(d1, d2, d3, d4), \
 			IPSEC_IP4_ADDR_2(dn1, dn2, dn3, dn4), \
 			IPSEC_HTONL(spi), \
@@ -163,11 +280,15 @@ typedef struct db_set_netif_struct
 			mode, \
 			0, 0, 0, 1450, \
 			enc_alg, \
-			{ek1, ek2, ek3, ek4, ek5, ek6, ek7, ek8, ek9, ek10, ek11, ek12, ek13, ek14, ek15, ek16, ek17, ek18, ek19, ek20, ek21, ek22, ek23, ek24}, \
+			{ek1, ek2, ek3, ek4, ek5, ek6, ek7, ek8, ek9, ek10, ek11, ek12, ek13, ek14, ek15, ek16, ek17, ek18, ek19, ek20, ek21, ek22, ek23, ek24, ek25, ek26, ek27, ek28, ek29, ek30, ek31, ek32, ek33, ek34, ek35, ek36}, \
 			auth_alg, \
-			{ak1, ak2, ak3, ak4, ak5, ak6, ak7, ak8, ak9, ak10, ak11, ak12, ak13, ak14, ak15, ak16, ak17, ak18, ak19, ak20}, \
+			{ak1, ak2, ak3, ak4, ak5, ak6, ak7, ak8, ak9, ak10, ak11, ak12, ak13, ak14, ak15, ak16, ak17, ak18, ak19, ak20, ak21, ak22, ak23, ak24, ak25, ak26, ak27, ak28, ak29, ak30, ak31, ak32, ak33, ak34, ak35, ak36, ak37, ak38, ak39, ak40, ak41, ak42, ak43, ak44, ak45, ak46, ak47, ak48, ak49, ak50, ak51, ak52, ak53, ak54, ak55, ak56, ak57, ak58, ak59, ak60, ak61, ak62, ak63, ak64}, \
 			0,0, IPSEC_USED 	/**< helps to statically configure the SAD entries */
 
+#define IPSEC_DB_ARENA_SIZE(spd_size, sad_size) \
+			(2*(__u32)(spd_size)*sizeof(spd_entry) + 2*(__u32)(sad_size)*sizeof(sad_entry) + \
+			 (8*(__u32)(spd_size)+4*(__u32)(sad_size))*sizeof(void *)) /**< memory needed by ipsec_spd_create_dbs() (tables and buckets) */
+
 #define EMPTY_SAD_ENTRY { 0, 0, 0, 0, 0, 0, \
 						  0, 0, 0, 0, 0, 0, \ 
 						  0, 0, 0, 0, 0, 0, \
@@ -177,15 +298,30 @@ typedef struct db_set_netif_struct
 						  0, 0, 0, 0, 0, 0, \
 						  0, 0, 0, 0, 0, 0, \
 						  0, 0, 0, 0, 0, 0, \
+						  0, 0, 0, 0, 0, 0, \
+						  0, 0, 0, 0, 0, 0, \
 						  IPSEC_FREE } /**< empty, unconfigured SAD entry    */
 
 #define EMPTY_SPD_ENTRY { 0, 0, 0, 0, 0, 0, \
 					  	  0, IPSEC_FREE } /**< empty, unconfigured SPD entry */
 
 
+/* reader functions */
+void ipsec_db_enter(int reader) ;
+
+void ipsec_db_leave(int reader) ;
+
+__u32 ipsec_db_entered(int reader) ;
+
+void ipsec_db_hold(int reader, __u32 epoch) ;
+
 /* SPD functions */
 db_set_netif	*ipsec_spd_load_dbs(spd_entry *inbound_spd_data, spd_entry *outbound_spd_data, sad_entry *inbound_sad_data, sad_entry *outbound_sad_data) ;
 
+db_set_netif	*ipsec_spd_init_dbs(spd_entry *inbound_spd_data, spd_entry *outbound_spd_data, sad_entry *inbound_sad_data, sad_entry *outbound_sad_data, int spd_size, int sad_size) ;
+
+db_set_netif	*ipsec_spd_create_dbs(void *arena, __u32 arena_size, int spd_size, int sad_size) ;
+
 ipsec_status	ipsec_spd_release_dbs(db_set_netif *dbs) ;
 
 spd_entry *ipsec_spd_get_free(spd_table *table) ;
@@ -198,6 +334,8 @@ ipsec_status ipsec_spd_del(spd_entry *entry, spd_table *table) ;
 
 ipsec_status ipsec_spd_add_sa(spd_entry *entry, sad_entry *sa) ;
 
+ipsec_status ipsec_spd_compile(spd_table *table) ;
+
 spd_entry *ipsec_spd_lookup(ipsec_ip_header *header, spd_table *table) ;
 
 void ipsec_spd_print_single(spd_entry *entry) ;
@@ -211,6 +349,16 @@ sad_entry *ipsec_sad_add(sad_entry *entry, sad_table *table) ;
 
 ipsec_status ipsec_sad_del(sad_entry *entry, sad_table *table) ;
 
+ipsec_status ipsec_sad_prepare(sad_entry *entry) ;
+
+ipsec_status ipsec_sad_next_sequence(sad_entry *sa, int count, __u32 *first) ;
+
+ipsec_status ipsec_sad_set_tunnel(sad_table *table, __u32 src, __u32 dest) ;
+
+void ipsec_sad_outer_header(sad_entry *sa, ipsec_ip_header *header, __u32 src, __u32 dest, __u16 len, __u32 sequence) ;
+
+void ipsec_sad_outer_chksum(sad_entry *sa, ipsec_ip_header *header) ;
+
 sad_entry *ipsec_sad_lookup(__u32 dest, __u8 proto, __u32 spi, sad_table *table) ;
 
 void ipsec_sad_print_single(sad_entry *entry) ;
@@ -56,6 +56,13 @@
 #define SHA_LBLOCK	16
 #define SHA_DIGEST_LENGTH 20
 
+#define HASH_SHA1_PORTABLE	(0)		/**< SHA1 engine: portable C code */
+#define HASH_SHA1_NI		(1)		/**< SHA1 engine: SHA extensions (x86 only, used if the CPU has them) */
+
+#if !defined(IPSEC_SHA1_NO_NI) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IPSEC_SHA1_NI				/**< compile the SHA extensions engine (define IPSEC_SHA1_NO_NI to leave it out) */
+#endif
+
 typedef struct SHAstate_st
 	{
 	SHA_LONG h0,h1,h2,h3,h4;
@@ -64,13 +71,25 @@ typedef struct SHAstate_st
 	int num;
 	} SHA_CTX;
 
+int sha1_set_engine(int engine);
+int sha1_get_engine(void);
 void SHA1_Init(SHA_CTX *c);
 void SHA1_Update(SHA_CTX *c, const void *data, unsigned long len);
 void SHA1_Final(unsigned char *md, SHA_CTX *c);
 unsigned char *SHA1(const unsigned char *d, unsigned long n,unsigned char *md);
 void SHA1_Transform(SHA_CTX *c, const unsigned char *data);
 
+/* @type HMAC_SHA1_CTX precomputed HMAC-SHA1 state, holds the SHA1 contexts after the inner and outer pad */
+typedef struct HMAC_SHA1state_st
+	{
+	SHA_CTX inner;
+	SHA_CTX outer;
+	} HMAC_SHA1_CTX;
+
 void hmac_sha1(unsigned char*, int, unsigned char*, int, unsigned char*);
+void hmac_sha1_init(HMAC_SHA1_CTX*, unsigned char*, int);
+void hmac_sha1_precomputed(HMAC_SHA1_CTX*, unsigned char*, int, unsigned char*);
+void hmac_sha1_chain(HMAC_SHA1_CTX*, ipsec_buffer*, int, int, unsigned char*);
 
 
 #endif
\ No newline at end of file
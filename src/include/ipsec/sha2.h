@@ -0,0 +1,115 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file sha2.h
+ *  @brief Header of the SHA-256, SHA-384 and SHA-512 hash functions (FIPS 180-4) and their HMACs
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#ifndef __SHA2_H__
+#define __SHA2_H__
+
+#include "ipsec/types.h"
+
+
+#define SHA256_DIGEST_LENGTH	(32)		/**< size of a SHA-256 digest in bytes */
+#define SHA384_DIGEST_LENGTH	(48)		/**< size of a SHA-384 digest in bytes */
+#define SHA512_DIGEST_LENGTH	(64)		/**< size of a SHA-512 digest in bytes */
+#define SHA256_CBLOCK			(64)		/**< size of a SHA-256 block in bytes */
+#define SHA512_CBLOCK			(128)		/**< size of a SHA-384 and SHA-512 block in bytes */
+
+#define HASH_SHA256_PORTABLE	(0)			/**< SHA-256 engine: portable C code */
+#define HASH_SHA256_NI			(1)			/**< SHA-256 engine: SHA extensions (x86 only, used if the CPU has them) */
+
+#if !defined(IPSEC_SHA256_NO_NI) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IPSEC_SHA256_NI						/**< compile the SHA extensions engine (define IPSEC_SHA256_NO_NI to leave it out) */
+#endif
+
+#if !defined(IPSEC_SHA512_NO_64) && defined(__GNUC__)
+#define IPSEC_SHA512_64						/**< SHA-512 on 64 bit words (define IPSEC_SHA512_NO_64 to use pairs of 32 bit words) */
+#endif
+
+/** SHA-256 context */
+typedef struct SHA256state_st
+{
+	__u32			h[8] ;					/**< chaining state */
+	__u32			Nl, Nh ;				/**< number of bits hashed so far */
+	unsigned char	data[SHA256_CBLOCK] ;	/**< bytes which do not fill a block yet */
+	int				num ;					/**< number of bytes in data */
+} SHA256_CTX ;
+
+/** SHA-384 and SHA-512 context */
+typedef struct SHA512state_st
+{
+	__u32			h[16] ;					/**< chaining state, 64 bit words as pairs of 32 bit words (most significant first) */
+	__u32			Nl, Nh ;				/**< number of bits hashed so far */
+	unsigned char	data[SHA512_CBLOCK] ;	/**< bytes which do not fill a block yet */
+	int				num ;					/**< number of bytes in data */
+	int				md_len ;				/**< digest length (SHA384_DIGEST_LENGTH or SHA512_DIGEST_LENGTH) */
+} SHA512_CTX ;
+
+/** precomputed HMAC-SHA-256 state, holds the SHA-256 contexts after the inner and outer pad */
+typedef struct HMAC_SHA256state_st
+{
+	SHA256_CTX	inner ;
+	SHA256_CTX	outer ;
+} HMAC_SHA256_CTX ;
+
+/** precomputed HMAC-SHA-384 or HMAC-SHA-512 state, holds the contexts after the inner and outer pad */
+typedef struct HMAC_SHA512state_st
+{
+	SHA512_CTX	inner ;
+	SHA512_CTX	outer ;
+} HMAC_SHA512_CTX ;
+
+
+int sha256_set_engine(int) ;
+void SHA256_Init(SHA256_CTX *) ;
+void SHA256_Update(SHA256_CTX *, const void *, unsigned long) ;
+void SHA256_Final(unsigned char *, SHA256_CTX *) ;
+void SHA384_Init(SHA512_CTX *) ;
+void SHA512_Init(SHA512_CTX *) ;
+void SHA512_Update(SHA512_CTX *, const void *, unsigned long) ;
+void SHA512_Final(unsigned char *, SHA512_CTX *) ;
+
+void hmac_sha256(unsigned char*, int, unsigned char*, int, unsigned char*) ;
+void hmac_sha256_init(HMAC_SHA256_CTX*, unsigned char*, int) ;
+void hmac_sha256_precomputed(HMAC_SHA256_CTX*, unsigned char*, int, unsigned char*) ;
+void hmac_sha256_chain(HMAC_SHA256_CTX*, ipsec_buffer*, int, int, unsigned char*) ;
+void hmac_sha384(unsigned char*, int, unsigned char*, int, unsigned char*) ;
+void hmac_sha512(unsigned char*, int, unsigned char*, int, unsigned char*) ;
+void hmac_sha384_init(HMAC_SHA512_CTX*, unsigned char*, int) ;
+void hmac_sha512_init(HMAC_SHA512_CTX*, unsigned char*, int) ;
+void hmac_sha512_precomputed(HMAC_SHA512_CTX*, unsigned char*, int, unsigned char*) ;
+void hmac_sha512_chain(HMAC_SHA512_CTX*, ipsec_buffer*, int, int, unsigned char*) ;
+
+#endif
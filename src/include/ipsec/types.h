@@ -50,6 +50,30 @@ typedef signed     short   __s16;
 typedef unsigned   long    __u32;
 typedef signed     long    __s32;
 
+#if defined(__C166__) && !defined(__GNUC__) && !defined(IPSEC_SINGLE_THREAD)
+#define IPSEC_SINGLE_THREAD				/**< lwIP and IPsec run in a single thread (the C166 port has no operating system) */
+#endif
+
+#ifndef IPSEC_MEMORY_BARRIER
+#if defined(__GNUC__)
+#define IPSEC_MEMORY_BARRIER()			__sync_synchronize()	/**< full memory barrier, used if the databases or the pipeline are used by several cores */
+#elif defined(IPSEC_SINGLE_THREAD)
+#define IPSEC_MEMORY_BARRIER()			/**< no barrier needed in a single thread */
+#else
+#error "IPSEC_MEMORY_BARRIER() must be defined by the port (or IPSEC_SINGLE_THREAD if IPsec only runs in one thread)"
+#endif
+#endif
+
+#ifndef IPSEC_ATOMIC_CAS
+#if defined(__GNUC__)
+#define IPSEC_ATOMIC_CAS(ptr, old, new)	__sync_bool_compare_and_swap((ptr), (old), (new))	/**< atomic compare and swap of an aligned __u32 (1 if *ptr was old and is now new), used if an SA is used by several threads */
+#elif defined(IPSEC_SINGLE_THREAD)
+#define IPSEC_ATOMIC_CAS(ptr, old, new)	((*(ptr) == (old)) ? ((*(ptr) = (new)), 1) : 0)	/**< compare and swap, need not be atomic in a single thread */
+#else
+#error "IPSEC_ATOMIC_CAS() must be defined by the port (or IPSEC_SINGLE_THREAD if IPsec only runs in one thread)"
+#endif
+#endif
+
 
 /** return code convention:
  *
@@ -70,6 +94,8 @@ typedef enum ipsec_status_list {				/** This value is returned if ... */
 	IPSEC_STATUS_BAD_PROTOCOL		= -8,		/**<  SA has an unsupported protocol */
 	IPSEC_STATUS_BAD_KEY			= -9,		/**<  key is invalid or weak and was rejected */
 	IPSEC_STATUS_TTL_EXPIRED		= -10,		/**<  TTL value of a packet reached 0 */
+	IPSEC_STATUS_BUSY				= -11,		/**<  no room left in a queue or a resource is still in use, try again later */
+	IPSEC_STATUS_SEQ_EXHAUSTED		= -12,		/**<  the sequence numbers of an SA are used up, the SA must be rekeyed */
 	IPSEC_STATUS_NOT_INITIALIZED   	= -100		/**<  variables has never been initialized */
 } ipsec_status;
 
@@ -83,7 +109,8 @@ typedef enum ipsec_audit_list {					/** This value is returned if ... */
 	IPSEC_AUDIT_DISCARD				=  5,		/**<  packet must be dropped */
 	IPSEC_AUDIT_SPI_MISMATCH		=  6,		/**<  SPI does not match the SPD lookup */
 	IPSEC_AUDIT_SEQ_MISMATCH		=  7,		/**<  Sequence Number differs more than IPSEC_SEQ_MAX_WINDOW from the previous packets */
-	IPSEC_AUDIT_POLICY_MISMATCH		=  8		/**<  If a policy for an incoming IPsec packet does not specify APPLY */
+	IPSEC_AUDIT_POLICY_MISMATCH		=  8,		/**<  If a policy for an incoming IPsec packet does not specify APPLY */
+	IPSEC_AUDIT_SEQ_EXHAUSTED		=  9		/**<  Sequence Number of an outbound SA would cycle, the SA must be rekeyed */
 } ipsec_audit;
 
 
@@ -96,6 +123,29 @@ typedef enum ipsec_ip_protocol_list {			/** IP protocol number for ... */
 } ipsec_ip_protocol;
 
 
+/** One segment of a packet stored in a chain of buffers (e.g. a chain of lwIP pbufs).
+ *  A packet which is stored in one buffer is a chain with a single segment.
+ */
+typedef struct ipsec_buffer_struct
+{
+	struct ipsec_buffer_struct	*next ;	/**< next segment of the packet, NULL for the last segment */
+	unsigned char				*data ;	/**< start of the data in this segment */
+	int							len ;	/**< number of bytes in this segment */
+} ipsec_buffer ;
+
+
+/** One packet of a batch (see ipsec_input_batch() and ipsec_output_batch()). */
+typedef struct ipsec_packet_struct
+{
+	ipsec_buffer	*chain ;			/**< packet stored in a chain of buffers */
+	void			*spd ;				/**< outbound only: SPD entry (spd_entry) which applies to the packet */
+	void			*sa ;				/**< outbound only: returns the SA (sad_entry) of the SPD entry the packet was encapsulated with */
+	int				payload_offset ;	/**< returns the offset of the processed packet (see ipsec_input_chain()) */
+	int				payload_size ;		/**< returns the size of the processed packet */
+	int				status ;			/**< returns the status code of this packet */
+} ipsec_packet ;
+
+
 #pragma pack(1)
 #pragma bytealign
 
@@ -133,6 +183,9 @@ typedef struct ipsec_udp_hdr_struct
 	__u16	chksum ;		/**< checksum                       */
 } ipsec_udp_header ;
 
+/* only the wire formats are packed, the other structures keep their natural alignment (e.g. for atomic counters) */
+#pragma pack()
+
 
 
 #endif
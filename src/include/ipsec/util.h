@@ -44,6 +44,7 @@
 #define __UTIL_H__
 
 #include "ipsec\types.h"
+#include "ipsec/ipsec.h"
 
 /** 
  * IP related stuff
@@ -82,8 +83,22 @@ __u8 *ipsec_inet_ntoa(__u32 addr) ;
 void ipsec_print_ip(ipsec_ip_header *header);
 void ipsec_dump_buffer(char *, unsigned char *, int, int);
 
-ipsec_audit ipsec_check_replay_window(__u32 seq, __u32 lastSeq, __u32 bitField);
-ipsec_audit ipsec_update_replay_window(__u32 seq, __u32 *lastSeq, __u32 *bitField);
+/** 
+ * Anti-replay state of an SA (see ipsec_check_replay_window())
+ *
+ */
+typedef struct ipsec_replay_state_struct
+{
+	__u32	last_seq ;		/**< highest sequence number accepted so far */
+	__u16	window ;		/**< window size (number of sequence numbers, multiple of 32) */
+	__u16	words ;			/**< number of bitmap words in use (window/32 + 1) */
+	__u16	top ;			/**< index of the bitmap word which holds last_seq */
+	__u32	bitmap[(IPSEC_SEQ_MAX_WINDOW/32)+1] ;	/**< ring of words, bit (seq & 31) marks seq as seen */
+} ipsec_replay_state ;
+
+void ipsec_init_replay_window(ipsec_replay_state *state, __u16 window);
+ipsec_audit ipsec_check_replay_window(__u32 seq, ipsec_replay_state *state);
+ipsec_audit ipsec_update_replay_window(__u32 seq, ipsec_replay_state *state);
 
 
 __u16 ipsec_htons(__u16 n);
@@ -93,6 +108,10 @@ __u32 ipsec_ntohl(__u32 n);
 
 __u16 ipsec_ip_chksum(void *dataptr, __u16 len);
 
+int ipsec_buffer_len(ipsec_buffer *chain);
+int ipsec_buffer_copy_out(ipsec_buffer *chain, int offset, int len, void *dst);
+int ipsec_buffer_copy_in(ipsec_buffer *chain, int offset, int len, void *src);
+
 #endif
 
 
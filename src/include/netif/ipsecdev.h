@@ -52,22 +52,48 @@
 #else
 
 #include "lwip/netif.h"
+#include "ipsec/types.h"
 
 #define IPSEC_HLEN	(PBUF_IP_HLEN + 24 + PBUF_TRANSPORT_HLEN)			/**< Add room for an other IP header and AH(24 bytes with HMAC-xxx-96)/ESP(8 bytes) data */
 #define IPSEC_MTU 	(PBUF_POOL_BUFSIZE - PBUF_LINK_HLEN - IPSEC_HLEN) 	/**< maximum packet size which can be handled by ipsecdev */
 
+#define IPSECDEV_MAX_SEGMENTS (8)	/**< maximum number of pbufs in a chain which is processed without copying it */
+#define IPSECDEV_BATCH_SIZE (8)		/**< maximum number of IPsec packets ipsecdev_input_queue() passes to ipsec_input_batch() at once (fills the lanes of the SSE2 and AVX2 multi-buffer HMAC) */
+
 /** Used to gather statistics, etc */
 struct ipsecdev_stats
 {
 	u32_t sentbytes; 				/**< #number of sent bytes */
+	u32_t copiedpackets;			/**< #number of outbound packets copied for lack of head- or tailroom */
+};
+
+/** State of one ipsecdev instance, referenced by netif->state */
+struct ipsecdev_state
+{
+	struct ipsecdev_stats	stats;				/**< statistics (first member, netif->state may still be used as ipsecdev_stats) */
+	struct db_set_netif_struct *databases;		/**< SPD and SA configuration of this interface */
+	struct netif			*phys_netif;		/**< physical network device this interface is mapped to (no other instance maps it), NULL if none */
+	struct netif			mapped_netif;		/**< copy of the physical device holding its original output functions */
+	u32_t					tunnel_src_addr;	/**< tunnel source address (external address of this IPsec device) */
+	u32_t					tunnel_dst_addr;	/**< tunnel destination address (external address of the other IPsec tunnel endpoint) */
+	struct ipsec_pipeline_struct *pipeline;		/**< pipeline of crypto workers, NULL to process IPsec packets on the lwIP thread */
+	int						reader;				/**< reader number of this instance for looking up the databases (see ipsec_db_enter()) */
+	ipsec_buffer			segments[IPSECDEV_BATCH_SIZE][IPSECDEV_MAX_SEGMENTS];	/**< segments of the inbound packets of a batch (kept off the stack) */
+	struct ipsecdev_job_struct *jobs;			/**< jobs for the packets in the pipeline, allocated by ipsecdev_set_pipeline() */
+	struct ipsecdev_job_struct *free_jobs;		/**< first free job */
 };
 
 void ipsecdev_service(struct netif *);
 err_t ipsecdev_input(struct pbuf *, struct netif *);
+void ipsecdev_input_queue(struct pbuf **, int, struct netif *);
 err_t ipsecdev_output(struct netif *, struct pbuf *, struct ip_addr *);
 err_t ipsecdev_netlink_output(struct netif *netif, struct pbuf *p) ;
 err_t ipsecdev_init(struct netif *);
 void ipsec_set_tunnel(char *src, char *dst) ;
+void ipsecdev_set_tunnel(struct netif *netif, char *src, char *dst) ;
+err_t ipsecdev_set_phys(struct netif *netif, struct netif *phys) ;
+err_t ipsecdev_set_dbs(struct netif *netif, struct db_set_netif_struct *databases) ;
+err_t ipsecdev_set_pipeline(struct netif *netif, struct ipsec_pipeline_struct *pipeline) ;
 
 #endif
 
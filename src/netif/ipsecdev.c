@@ -74,154 +74,503 @@
 #include "ipsec/ipsec.h"
 #include "ipsec/util.h"
 #include "ipsec/sa.h"
+#include "ipsec/pipeline.h"
 
 
 #define IPSECDEV_NAME0 'i'		/**< 1st letter of device name "is" */
 #define IPSECDEV_NAME1 's' 		/**< 2nd letter of device name "is" */
 
+
+#if IPSEC_DB_READERS < IPSEC_NR_NETIFS
+#error "every ipsecdev instance needs its own database reader (IPSEC_DB_READERS >= IPSEC_NR_NETIFS)"
+#endif
+
 extern sad_entry inbound_sad_config[]; /**< inbound SAD configuration data  */
 extern spd_entry inbound_spd_config[]; /**< inbound SPD configuration data  */
 extern sad_entry outbound_sad_config[];/**< outbound SAD configuration data */
 extern spd_entry outbound_spd_config[];/**< outbound SPD configuration data */
 
-extern db_set_netif	db_sets[];
-db_set_netif 	*databases; 	/**< reference to the SPD and SA configuration*/
-struct netif	mapped_netif;	/**< handler of physical output device  	*/
-__u32			tunnel_src_addr;/**< tunnel source address (external address this IPsec device) */
-__u32			tunnel_dst_addr;/**< tunnel destination address (external address the other IPsec tunnel endpoint) */
+static struct netif	*ipsecdev_netifs[IPSEC_NR_NETIFS];	/**< registered ipsecdev instances */
+static __u32		tunnel_src_default;	/**< tunnel source address given to new instances (see ipsec_set_tunnel()) */
+static __u32		tunnel_dst_default;	/**< tunnel destination address given to new instances (see ipsec_set_tunnel()) */
+
+/** A packet of an ipsecdev instance in an IPsec pipeline (see ipsecdev_set_pipeline()) */
+typedef struct ipsecdev_job_struct
+{
+	ipsec_job					job ;								/**< pipeline job, job.user points back to this structure */
+	ipsec_buffer				segments[IPSECDEV_MAX_SEGMENTS] ;	/**< segments of the packet */
+	struct pbuf					*p ;								/**< packet (owned by the job) */
+	struct netif				*netif ;							/**< interface the packet was received on */
+	struct ipsecdev_job_struct	*next ;								/**< next free job */
+} ipsecdev_job ;
+
+
+/**
+ * Returns the state of the ipsecdev instance a network interface belongs to.
+ *
+ * The interface may either be an ipsecdev instance itself or the physical device 
+ * it is mapped to (its output function is redirected to ipsecdev_output()). A physical 
+ * device is mapped to one instance at most (see ipsecdev_map()).
+ *
+ * @param  netif  lwIP network interface data structure
+ * @return pointer to the state of the ipsecdev instance
+ * @return NULL if the interface does not belong to any ipsecdev instance
+ */
+static struct ipsecdev_state *ipsecdev_get_state(struct netif *netif)
+{
+	int i ;
+	struct ipsecdev_state *state ;
+
+	for(i = 0; i < IPSEC_NR_NETIFS; i++)
+	{
+		if(ipsecdev_netifs[i] == NULL) continue ;
+		state = (struct ipsecdev_state *)ipsecdev_netifs[i]->state ;
+		if((ipsecdev_netifs[i] == netif) || (state->phys_netif == netif))
+			return state ;
+	}
+	return NULL ;
+}
+
+
+/**
+ * Checks if a packet can be extended in place by the given number of bytes.
+ *
+ * The room in front of the payload is checked with pbuf_header(). The room after 
+ * the payload is only known for pbufs allocated from the pbuf pool.
+ *
+ * @param  p         pbuf containing the packet
+ * @param  headroom  number of bytes needed in front of the payload
+ * @param  tailroom  number of bytes needed after the payload
+ * @return 1 if there is enough room, 0 otherwise
+ */
+static int ipsecdev_has_room(struct pbuf *p, int headroom, int tailroom)
+{
+	struct pbuf *q ;
+
+	/* the packet is modified in place, so every pbuf of the chain must be writable */
+	for(q = p; q->next != NULL; q = q->next)
+	{
+		if((q->flags != PBUF_FLAG_POOL) && (q->flags != PBUF_FLAG_RAM))
+			return 0 ;
+	}
+	if((q->flags != PBUF_FLAG_POOL) && (q->flags != PBUF_FLAG_RAM))
+		return 0 ;
+
+	if(pbuf_header(p, headroom) != 0)
+		return 0 ;
+	pbuf_header(p, -headroom) ;
+
+	/* trailing data is appended to the last pbuf */
+	if(tailroom == 0)
+		return 1 ;
+	if(q->flags != PBUF_FLAG_POOL)
+		return 0 ;
+	return (((u8_t *)q + sizeof(struct pbuf) + PBUF_POOL_BUFSIZE) - ((u8_t *)q->payload + q->len)) >= tailroom ;
+}
+
+
+/**
+ * Describes a pbuf chain as a chain of IPsec buffers (see ipsec_input_chain()).
+ *
+ * @param  p         first pbuf of the chain
+ * @param  segments  array of IPSECDEV_MAX_SEGMENTS buffers which is filled in
+ * @return number of segments used, 0 if the chain has more than IPSECDEV_MAX_SEGMENTS pbufs
+ */
+static int ipsecdev_pbuf_to_chain(struct pbuf *p, ipsec_buffer *segments)
+{
+	int n ;
+
+	for(n = 0; p != NULL; p = p->next, n++)
+	{
+		if(n == IPSECDEV_MAX_SEGMENTS)
+			return 0 ;
+		if(n > 0)
+			segments[n-1].next = &segments[n] ;
+		segments[n].next = NULL ;
+		segments[n].data = p->payload ;
+		segments[n].len = p->len ;
+	}
+	return n ;
+}
 
 
 /**
- * This is just used to provide an consisstend interface. This function has no functionality.
+ * Updates the lengths of a pbuf chain after its segments have been modified by ipsec_output_chain().
+ *
+ * @param  p         first pbuf of the chain
+ * @param  segments  buffers describing the chain (see ipsecdev_pbuf_to_chain())
+ * @return void
+ */
+static void ipsecdev_chain_to_pbuf(struct pbuf *p, ipsec_buffer *segments)
+{
+	struct pbuf *q ;
+	int n ;
+	int tot_len = 0 ;
+
+	for(q = p, n = 0; q != NULL; q = q->next, n++)
+	{
+		q->len = segments[n].len ;
+		tot_len += q->len ;
+	}
+	for(q = p; q != NULL; q = q->next)
+	{
+		q->tot_len = tot_len ;
+		tot_len -= q->len ;
+	}
+}
+
+
+/**
+ * Passes a packet to the pipeline of an ipsecdev instance.
+ *
+ * The job takes over the pbuf: it is freed if the packet can not be dispatched, otherwise 
+ * it is passed on by ipsecdev_service() once the packet is processed.
+ *
+ * @param  p          packet to process
+ * @param  netif      interface the packet was received on (inbound only)
+ * @param  spd        SPD entry of the packet (outbound only)
+ * @param  direction  IPSEC_PIPELINE_INBOUND or IPSEC_PIPELINE_OUTBOUND
+ * @param  state      state of the ipsecdev instance
+ * @return IPSEC_STATUS_SUCCESS if the packet was dispatched, the reason why it was dropped otherwise
+ */
+static int ipsecdev_dispatch(struct pbuf *p, struct netif *netif, spd_entry *spd, int direction, struct ipsecdev_state *state)
+{
+	ipsecdev_job	*job ;
+	int				status ;
+
+	job = state->free_jobs ;
+	if(job == NULL)
+	{
+		pbuf_free(p) ;
+		return IPSEC_STATUS_BUSY ;
+	}
+
+	ipsecdev_pbuf_to_chain(p, job->segments) ;
+	job->p = p ;
+	job->netif = netif ;
+	job->job.packet.chain = job->segments ;
+	job->job.packet.spd = spd ;
+	job->job.direction = direction ;
+	job->job.user = job ;
+
+	status = ipsec_pipeline_dispatch(state->pipeline, &job->job) ;
+	if(status != IPSEC_STATUS_SUCCESS)
+	{
+		pbuf_free(p) ;
+		return status ;
+	}
+
+	state->free_jobs = job->next ;
+	return IPSEC_STATUS_SUCCESS ;
+}
+
+
+/**
+ * Passes the packets processed by the pipeline of an ipsecdev instance on.
+ *
+ * Without a pipeline (see ipsecdev_set_pipeline()) this function has no functionality. Otherwise
+ * it must be called regularly from the lwIP thread: decapsulated packets are passed to ip_input() 
+ * and encapsulated packets are sent through the mapped physical device.
  *
  * @param  netif  initialized lwIP network interface data structure of this device
  * @return void
  */
 void ipsecdev_service(struct netif *netif)
 {
-	struct netif *i ;
+	struct ipsecdev_state	*state ;
+	ipsec_job				*job ;
+	ipsecdev_job			*dev_job ;
+	struct pbuf				*p ;
+
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, "ipsecdev_service", ("netif=%p", (void *)netif) );
-	i = netif ;
+
+	state = ipsecdev_get_state(netif) ;
+	if((state == NULL) || (state->pipeline == NULL))
+	{
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_service", ("void") );
+		return ;
+	}
+
+	while((job = ipsec_pipeline_collect(state->pipeline)) != NULL)
+	{
+		dev_job = (ipsecdev_job *)job->user ;
+		p = dev_job->p ;
+
+		if(job->packet.status != IPSEC_STATUS_SUCCESS)
+		{
+			IPSEC_LOG_ERR("ipsecdev_service", job->packet.status, ("error on IPsec processing (retcode = %d)", job->packet.status));
+			pbuf_free(p) ;
+		}
+		else if(job->direction == IPSEC_PIPELINE_INBOUND)
+		{
+			/* remove obsolete IPsec headers and trailers */
+			pbuf_header(p, (s16_t)-job->packet.payload_offset) ;
+			pbuf_realloc(p, (u16_t)job->packet.payload_size) ;
+
+			IPSEC_LOG_MSG("ipsecdev_service", ("fwd decapsulated IPsec packet to ip_input()") );
+			ip_input(p, dev_job->netif);
+		}
+		else
+		{
+			ipsecdev_chain_to_pbuf(p, dev_job->segments) ;
+			pbuf_header(p, (s16_t)-job->packet.payload_offset) ;
+
+		  	IPSEC_LOG_MSG("ipsecdev_service", ("fwd IPsec packet to HW mapped device") );
+			state->mapped_netif.output(&state->mapped_netif, p, (void *)&state->tunnel_dst_addr);
+			pbuf_free(p) ;
+		}
+
+		dev_job->next = state->free_jobs ;
+		state->free_jobs = dev_job ;
+	}
+
 	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_service", ("void") );
 	return ;
 }
 
 
 /**
- * This function is used to process incomming IP packets.
+ * Checks if an inbound packet can be processed and describes it as a chain of buffers.
  *
- * This function is called by the physical network driver when a new packet has been
- * received. To decide how to handle the packet, the Security Policy Database 
- * is called. ESP and AH packets are directly forwarded to ipsec_input() while other 
- * packets must pass the SPD lookup.
+ * Packets which can not be processed are freed.
  *
- * @param p      pbuf containing the received packet
- * @param inp    lwIP network interface data structure for this device. The structure must be
- *               initialized with IP, netmask and gateway address.
- * @return err_t return code
+ * @param  p         pbuf containing the received packet
+ * @param  inp       lwIP network interface data structure for this device
+ * @param  state     state of the ipsecdev instance the interface belongs to (may be NULL)
+ * @param  segments  array of IPSECDEV_MAX_SEGMENTS buffers which is filled in (NULL if state is NULL)
+ * @return 1 if the packet can be processed, 0 if it was dropped
  */
-err_t ipsecdev_input(struct pbuf *p, struct netif *inp)
+static int ipsecdev_input_accept(struct pbuf *p, struct netif *inp, struct ipsecdev_state *state, ipsec_buffer *segments)
 {
-	int retcode;
-	int payload_offset	= 0;
-	int payload_size	= 0;
-	spd_entry		*spd ;
-
-	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
-	              "ipsecdev_input", 
-				  ("p=%p, inp=%p",
-			      (void *)p, (void *)inp)
-				 );
+	if(p == NULL || p->payload == NULL)
+ 	{
+  		IPSEC_LOG_DBG("ipsecdev_input", IPSEC_STATUS_DATA_SIZE_ERROR, ("Packet has no payload. Can't pass it to higher level protocol stacks."));
+		if(p != NULL) pbuf_free(p) ;
+		return 0 ;
+	}
 
 	IPSEC_DUMP_BUFFER("ipsecdev_input", p->payload, 0, p->len) ;
 
-	if(p == NULL || p->payload == NULL)
+	/* minimal sanity check of inbound data (packet buffer & IP header fields must be <= MTU) */
+	if((p->tot_len > IPSEC_MTU) || (ipsec_ntohs(((ipsec_ip_header *)((unsigned char *)p->payload))->len) > IPSEC_MTU))
  	{
-  		IPSEC_LOG_DBG("ipsecdev_input", IPSEC_STATUS_DATA_SIZE_ERROR, ("Packet has no payload. Can't pass it to higher level protocol stacks."));
+  		IPSEC_LOG_DBG("ipsecdev_input", IPSEC_STATUS_DATA_SIZE_ERROR, ("Packet to long (%d > %d (IPSEC_MTU))", p->tot_len, IPSEC_MTU) );
+		pbuf_free(p) ;
+		return 0 ;
+	}
+
+	if((state == NULL) || (state->databases == NULL))
+ 	{
+  		IPSEC_LOG_ERR("ipsecdev_input", IPSEC_STATUS_FAILURE, ("no SPD and SA configuration for interface '%c%c'", inp->name[0], inp->name[1]) );
+		pbuf_free(p) ;
+		return 0 ;
+	}
+
+	/* the IP header must be in the first pbuf, the rest of the packet may be chained */
+	if((p->len < IPSEC_MIN_IPHDR_SIZE) || (ipsecdev_pbuf_to_chain(p, segments) == 0))
+ 	{
+  		IPSEC_LOG_DBG("ipsecdev_input", IPSEC_STATUS_DATA_SIZE_ERROR, ("can not handle pbuf chain (first pbuf %d bytes, max. %d pbufs)", p->len, IPSECDEV_MAX_SEGMENTS) );
 		pbuf_free(p) ;
+		return 0 ;
 	}
-	else 
+
+	return 1 ;
+}
+
+
+/**
+ * Passes a non-IPsec packet to ip_input() if the inbound SPD permits it, drops it otherwise.
+ *
+ * @param  p      pbuf containing the received packet
+ * @param  inp    lwIP network interface data structure for this device
+ * @param  state  state of the ipsecdev instance the interface belongs to
+ * @return void
+ */
+static void ipsecdev_input_policy(struct pbuf *p, struct netif *inp, struct ipsecdev_state *state)
+{
+	spd_entry		*spd ;
+
+	/* check what the policy says about non-IPsec traffic */
+	spd = ipsec_spd_lookup(p->payload, &state->databases->inbound_spd) ;
+	if(spd == NULL)
 	{
+		IPSEC_LOG_ERR("ipsecdev_input", IPSEC_STATUS_NO_POLICY_FOUND, ("no matching SPD policy found")) ;
+		pbuf_free(p) ;
+		return ;
+	}
 
-		/* minimal sanity check of inbound data (packet buffer & IP header fields must be <= MTU) */
-		if((p->tot_len > IPSEC_MTU) || (ipsec_ntohs(((ipsec_ip_header *)((unsigned char *)p->payload))->len) > IPSEC_MTU))
-	 	{
-	  		IPSEC_LOG_DBG("ipsecdev_input", IPSEC_STATUS_DATA_SIZE_ERROR, ("Packet to long (%d > %d (IPSEC_MTU))", p->tot_len, IPSEC_MTU) );
-			/* in case of error, free pbuf and return ERR_OK as lwIP does */
+	switch(spd->policy)
+ 	{
+		case POLICY_APPLY:
+			IPSEC_LOG_AUD("ipsecdev_input", IPSEC_AUDIT_APPLY, ("POLICY_APPLY: got non-IPsec packet which should be one")) ;
 			pbuf_free(p) ;
-			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_input", ("return = %d", ERR_OK) );
-			return ERR_OK;
-		}
-
-		if(p->next != NULL)
-	 	{
-	  		IPSEC_LOG_DBG("ipsecdev_input", IPSEC_STATUS_DATA_SIZE_ERROR, ("can not handle chained pbuf - (packet must be < %d bytes )", PBUF_POOL_BUFSIZE - PBUF_LINK_HLEN - IPSEC_HLEN) );
-			/* in case of error, free pbuf and return ERR_OK as lwIP does */
+			break;
+		case POLICY_DISCARD:
+			IPSEC_LOG_AUD("ipsecdev_input", IPSEC_AUDIT_DISCARD, ("POLICY_DISCARD: dropping packet")) ;
 			pbuf_free(p) ;
-			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_input", ("return = %d", ERR_OK) );
-			return ERR_OK;
+			break;
+		case POLICY_BYPASS:
+			IPSEC_LOG_AUD("ipsecdev_input", IPSEC_AUDIT_BYPASS, ("POLICY_BYPASS: forwarding packet to ip_input")) ;
+			ip_input(p, inp);
+			break;
+		default:
+			pbuf_free(p) ;
+			IPSEC_LOG_ERR("ipsecdev_input", IPSEC_STATUS_FAILURE, ("IPSEC_STATUS_FAILURE: dropping packet")) ;
+			IPSEC_LOG_AUD("ipsecdev_input", IPSEC_AUDIT_FAILURE, ("unknown Security Policy: dropping packet")) ;
+	} 
+}
+
+
+/**
+ * Passes a batch of IPsec packets to ipsec_input_batch() and forwards the decapsulated 
+ * packets to ip_input().
+ *
+ * @param  batch    pbufs of the packets
+ * @param  packets  packets as passed to ipsec_input_batch() (chain set up)
+ * @param  count    number of packets in the batch
+ * @param  inp      lwIP network interface data structure for this device
+ * @param  state    state of the ipsecdev instance the interface belongs to
+ * @return void
+ */
+static void ipsecdev_input_flush(struct pbuf **batch, ipsec_packet *packets, int count, struct netif *inp, struct ipsecdev_state *state)
+{
+	int i ;
+
+	ipsec_input_batch(packets, count, state->databases) ;
+
+	for(i = 0; i < count; i++)
+	{
+		if(packets[i].status == IPSEC_STATUS_SUCCESS)
+		{
+			/* remove obsolete IPsec headers and trailers */
+			pbuf_header(batch[i], (s16_t)-packets[i].payload_offset) ;
+			pbuf_realloc(batch[i], (u16_t)packets[i].payload_size) ;
+
+			IPSEC_LOG_MSG("ipsecdev_input", ("fwd decapsulated IPsec packet to ip_input()") );
+			ip_input(batch[i], inp);
+		}
+		else
+		{
+			IPSEC_LOG_ERR("ipsecdev_input", packets[i].status, ("error on ipsec_input() processing (retcode = %d)", packets[i].status));
+			pbuf_free(batch[i]) ;
 		}
+	}
+}
 
 
-		if( ((ipsec_ip_header*)(p->payload))->protocol == IPSEC_PROTO_ESP || ((ipsec_ip_header*)(p->payload))->protocol == IPSEC_PROTO_AH)
+/**
+ * This function is used to process a queue of incomming IP packets.
+ *
+ * IPsec packets are collected in batches of up to IPSECDEV_BATCH_SIZE packets which are processed 
+ * by ipsec_input_batch() (one SA lookup per SA of the batch, the HMACs of the packets of the same SA
+ * are calculated side by side). Other packets must pass the SPD lookup. The packets are passed to ip_input() in the 
+ * order of the queue. Packets which are dropped are freed, as ipsecdev_input() does.
+ *
+ * @param queue  array of pbufs containing the received packets
+ * @param count  number of packets in the queue
+ * @param inp    lwIP network interface data structure for this device. The structure must be
+ *               initialized with IP, netmask and gateway address.
+ * @return void
+ */
+void ipsecdev_input_queue(struct pbuf **queue, int count, struct netif *inp)
+{
+	int 			i ;
+	int				n = 0 ;
+	int				retcode ;
+	struct pbuf		*p ;
+	struct pbuf		*batch[IPSECDEV_BATCH_SIZE] ;
+	ipsec_packet	packets[IPSECDEV_BATCH_SIZE] ;
+	struct ipsecdev_state *state ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsecdev_input_queue", 
+				  ("queue=%p, count=%d, inp=%p",
+			      (void *)queue, count, (void *)inp)
+				 );
+
+	state = ipsecdev_get_state(inp) ;
+	if(state == NULL)
+	{
+		/* not an ipsecdev instance, the packets are dropped */
+		for(i = 0; i < count; i++)
+			ipsecdev_input_accept(queue[i], inp, NULL, NULL) ;
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_input_queue", ("void") );
+		return ;
+	}
+
+	/* the SPD entries and SAs found must stay valid until the packets are passed on */
+	ipsec_db_enter(state->reader) ;
+
+	for(i = 0; i < count; i++)
+	{
+		p = queue[i] ;
+		if(!ipsecdev_input_accept(p, inp, state, state->segments[n]))
+			continue ;
+
+		if((state->pipeline != NULL) && 
+		   (((ipsec_ip_header*)(p->payload))->protocol == IPSEC_PROTO_ESP || ((ipsec_ip_header*)(p->payload))->protocol == IPSEC_PROTO_AH))
+		{
+			/* the packet is passed to ip_input() by ipsecdev_service() */
+			retcode = ipsecdev_dispatch(p, inp, NULL, IPSEC_PIPELINE_INBOUND, state) ;
+			if(retcode != IPSEC_STATUS_SUCCESS)
+				IPSEC_LOG_ERR("ipsecdev_input", retcode, ("packet could not be passed to the IPsec pipeline (retcode = %d)", retcode));
+		}
+		else if( ((ipsec_ip_header*)(p->payload))->protocol == IPSEC_PROTO_ESP || ((ipsec_ip_header*)(p->payload))->protocol == IPSEC_PROTO_AH)
 		{
 			/* we got an IPsec packet which must be handled by the IPsec engine */
-			retcode = ipsec_input(p->payload, p->len, (int *)&payload_offset, (int *)&payload_size, databases);
-
-			if(retcode == IPSEC_STATUS_SUCCESS)
+			batch[n] = p ;
+			packets[n].chain = state->segments[n] ;
+			n++ ;
+			if(n == IPSECDEV_BATCH_SIZE)
 			{
-				/** @todo Attention: the pbuf structure should be updated using pbuf_header() */
-				/* remove obsolete ESP headers */
-				p->payload = (unsigned char *)(p->payload) + payload_offset;
-				p->len = payload_size;
-				p->tot_len = payload_size;
-
-				IPSEC_LOG_MSG("ipsecdev_input", ("fwd decapsulated IPsec packet to ip_input()") );
-				retcode = ip_input(p, inp);		
-				IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_input", ("retcode = %d", retcode) );
-				return retcode;
-
+				ipsecdev_input_flush(batch, packets, n, inp, state) ;
+				n = 0 ;
 			}
-			else
-			{
-				IPSEC_LOG_ERR("ipsecdev_input", retcode, ("error on ipsec_input() processing (retcode = %d)", retcode));
-				pbuf_free(p) ;
-			}			
 		}
 		else
 		{
-			/* check what the policy says about non-IPsec traffic */
-			spd = ipsec_spd_lookup(p->payload, &databases->inbound_spd) ;
-			if(spd == NULL)
-			{
-				IPSEC_LOG_ERR("ipsecdev_input", IPSEC_STATUS_NO_POLICY_FOUND, ("no matching SPD policy found")) ;
-				pbuf_free(p) ;
-			}
-			else
+			/* keep the order of the packets */
+			if(n != 0)
 			{
-				switch(spd->policy)
-			 	{
-					case POLICY_APPLY:
-						IPSEC_LOG_AUD("ipsecdev_input", IPSEC_AUDIT_APPLY, ("POLICY_APPLY: got non-IPsec packet which should be one")) ;
-						pbuf_free(p) ;
-						break;
-					case POLICY_DISCARD:
-						IPSEC_LOG_AUD("ipsecdev_input", IPSEC_AUDIT_DISCARD, ("POLICY_DISCARD: dropping packet")) ;
-						pbuf_free(p) ;
-						break;
-					case POLICY_BYPASS:
-						IPSEC_LOG_AUD("ipsecdev_input", IPSEC_AUDIT_BYPASS, ("POLICY_BYPASS: forwarding packet to ip_input")) ;
-						ip_input(p, inp);
-						break;
-					default:
-						pbuf_free(p) ;
-						IPSEC_LOG_ERR("ipsecdev_input", IPSEC_STATUS_FAILURE, ("IPSEC_STATUS_FAILURE: dropping packet")) ;
-						IPSEC_LOG_AUD("ipsecdev_input", IPSEC_AUDIT_FAILURE, ("unknown Security Policy: dropping packet")) ;
-				} 
+				ipsecdev_input_flush(batch, packets, n, inp, state) ;
+				n = 0 ;
 			}
+			ipsecdev_input_policy(p, inp, state) ;
 		}
 	}
 
+	if(n != 0)
+		ipsecdev_input_flush(batch, packets, n, inp, state) ;
+
+	ipsec_db_leave(state->reader) ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_input_queue", ("void") );
+}
+
+
+/**
+ * This function is used to process incomming IP packets.
+ *
+ * This function is called by the physical network driver when a new packet has been
+ * received. To decide how to handle the packet, the Security Policy Database 
+ * is called. ESP and AH packets are directly forwarded to ipsec_input() while other 
+ * packets must pass the SPD lookup (see ipsecdev_input_queue()).
+ *
+ * @param p      pbuf containing the received packet
+ * @param inp    lwIP network interface data structure for this device. The structure must be
+ *               initialized with IP, netmask and gateway address.
+ * @return err_t return code
+ */
+err_t ipsecdev_input(struct pbuf *p, struct netif *inp)
+{
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsecdev_input", 
+				  ("p=%p, inp=%p",
+			      (void *)p, (void *)inp)
+				 );
+
+	ipsecdev_input_queue(&p, 1, inp) ;
+
 	/* usually return ERR_OK as lwIP does */
 	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_input", ("retcode = %d", ERR_OK) );
 	return ERR_OK;
@@ -249,6 +598,12 @@ err_t ipsecdev_output(struct netif *netif, struct pbuf *p, struct ip_addr *ipadd
 	ipsec_status status ;
 	struct ip_addr dest_addr;
 	int retcode;
+	int headroom ;
+	int tailroom ;
+	struct ipsecdev_state *state ;
+	struct pbuf *q ;
+	int offset ;
+	ipsec_buffer segments[IPSECDEV_MAX_SEGMENTS] ;
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
 	              "ipsecdev_output", 
@@ -264,9 +619,9 @@ err_t ipsecdev_output(struct netif *netif, struct pbuf *p, struct ip_addr *ipadd
 		return ERR_CONN;
 	}
 
-	if(p->next != NULL)
+	if(p->len < IPSEC_MIN_IPHDR_SIZE)
  	{
-  		IPSEC_LOG_DBG("ipsecdev_output", IPSEC_STATUS_DATA_SIZE_ERROR, ("can not handle chained pbuf - use pbuf size of %d bytes", IPSEC_MTU));
+  		IPSEC_LOG_DBG("ipsecdev_output", IPSEC_STATUS_DATA_SIZE_ERROR, ("IP header must be in the first pbuf (%d bytes)", p->len));
 		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_output", ("return = %d", ERR_CONN) );
 		return ERR_CONN;
 	}
@@ -278,17 +633,31 @@ err_t ipsecdev_output(struct netif *netif, struct pbuf *p, struct ip_addr *ipadd
 		return ERR_CONN;
 	}
 
+	state = ipsecdev_get_state(netif) ;
+	if((state == NULL) || (state->databases == NULL))
+ 	{
+  		IPSEC_LOG_ERR("ipsecdev_output", IPSEC_STATUS_FAILURE, ("no SPD and SA configuration for interface '%c%c'", netif->name[0], netif->name[1]) );
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_output", ("return = %d", ERR_CONN) );
+		return ERR_CONN;
+	}
+	if(state->phys_netif == NULL)
+ 	{
+  		IPSEC_LOG_ERR("ipsecdev_output", IPSEC_STATUS_FAILURE, ("interface '%c%c' is not mapped to a physical device", netif->name[0], netif->name[1]) );
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_output", ("return = %d", ERR_CONN) );
+		return ERR_CONN;
+	}
+
 
 	/** backup of physical destination IP address (inner IP header may become encrypted) */
 	memcpy(&dest_addr, ipaddr, sizeof(struct ip_addr));
 
-	/**@todo this static access to the HW device must be replaced by a more flexible method */
-
-	/* RFC conform IPsec processing */
-	spd = ipsec_spd_lookup((ipsec_ip_header*)p->payload, &databases->outbound_spd) ;
+	/* RFC conform IPsec processing, the SPD entry and its SA must stay valid until the packet is sent */
+	ipsec_db_enter(state->reader) ;
+	spd = ipsec_spd_lookup((ipsec_ip_header*)p->payload, &state->databases->outbound_spd) ;
 	if(spd == NULL)
 	{
 		IPSEC_LOG_ERR("ipsecdev_output", IPSEC_STATUS_NO_POLICY_FOUND, ("no matching SPD policy found")) ;
+		ipsec_db_leave(state->reader) ;
 		/* free local pbuf here */
 		pbuf_free(p);
 		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_output", ("retcode = %d", ERR_CONN) );
@@ -300,48 +669,69 @@ err_t ipsecdev_output(struct netif *netif, struct pbuf *p, struct ip_addr *ipadd
 		case POLICY_APPLY:																		
 				IPSEC_LOG_AUD("ipsecdev_output", IPSEC_AUDIT_APPLY, ("POLICY_APPLY: processing IPsec packet")) ;
 
-				/** @todo lwIP TCP ESP outbound processing needs to add data after the original packet.
-				 *        Since the lwIP TCP does leave any room after the original packet, we 
-				 *        copy the packet into a larger buffer. This step can be avoided if enough
-				 *        room is left after the packet when TCP allocates memory.
+				/* AH and ESP add headers in front of the original packet, ESP also adds data after it.
+				 * The packet (which may be a pbuf chain) is encapsulated in place if its pbufs are 
+				 * writable and have enough room. Otherwise (e.g. lwIP TCP does not leave any room after 
+				 * the original packet and references its data in ROM pbufs) it is gathered into a new pbuf.
 				 */
+				ipsec_output_overhead(spd, &headroom, &tailroom) ;
 				p_cpy = p;
-				if(spd->sa->protocol == IPSEC_PROTO_ESP)
+				if((ipsecdev_pbuf_to_chain(p, segments) == 0) || !ipsecdev_has_room(p, PBUF_LINK_HLEN + headroom, tailroom))
 				{
-					// alloc 50 more bytes for ESP trailer and the optional ESP authentication data
-				    p_cpy = pbuf_alloc(PBUF_RAW, p->len + 50, PBUF_POOL);
-
-					if(p_cpy != NULL) {
-						memcpy(p_cpy->payload, p->payload, p->len);
-						p_cpy->next = NULL;
-						p_cpy->len = p->len + 50;
-						p_cpy->tot_len = p->tot_len + 50;
-						p_cpy->ref = p->ref;
-						IPSEC_LOG_MSG("ipsecdev_output", ("lwIP ESP TCP workaround: successfully allocated new pbuf (tot_len = %d)", p_cpy->tot_len) );
+				    p_cpy = pbuf_alloc(PBUF_RAW, PBUF_LINK_HLEN + headroom + p->tot_len + tailroom, PBUF_POOL);
+					if((p_cpy == NULL) || (p_cpy->next != NULL))
+					{
+						if(p_cpy != NULL) pbuf_free(p_cpy);
+						ipsec_db_leave(state->reader) ;
+						IPSEC_LOG_ERR("ipsecdev_output", IPSEC_AUDIT_FAILURE, ("can't alloc new pbuf for IPsec processing!") ) ;
+						IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_output", ("retcode = %d", ERR_MEM) );
+						return ERR_MEM;
 					}
-					else {
-						IPSEC_LOG_ERR("ipsecdev_output", IPSEC_AUDIT_FAILURE, ("can't alloc new pbuf for lwIP ESP TCP workaround!") ) ;
+					/* leave the headroom in front of the copied packet */
+					pbuf_header(p_cpy, -(PBUF_LINK_HLEN + headroom)) ;
+					for(q = p, offset = 0; q != NULL; offset += q->len, q = q->next)
+						memcpy((u8_t *)p_cpy->payload + offset, q->payload, q->len);
+					pbuf_realloc(p_cpy, p->tot_len) ;
+					ipsecdev_pbuf_to_chain(p_cpy, segments) ;
+					state->stats.copiedpackets++ ;
+					IPSEC_LOG_MSG("ipsecdev_output", ("not enough room for IPsec processing, copied packet into new pbuf (tot_len = %d)", p_cpy->tot_len) );
+				}
+
+				if(state->pipeline != NULL)
+				{
+					/* the job keeps the packet until ipsecdev_service() has sent it */
+					if(p_cpy == p) pbuf_ref(p) ;
+					status = ipsecdev_dispatch(p_cpy, NULL, spd, IPSEC_PIPELINE_OUTBOUND, state) ;
+					ipsec_db_leave(state->reader) ;
+					if(status != IPSEC_STATUS_SUCCESS)
+					{
+						IPSEC_LOG_ERR("ipsecdev_output", status, ("packet could not be passed to the IPsec pipeline (retcode = %d)", status));
+						IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_output", ("retcode = %d", ERR_MEM) );
+						return ERR_MEM;
 					}
+					IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_output", ("retcode = %d", ERR_OK) );
+					return ERR_OK;
 				}
 
-				status = ipsec_output(p_cpy->payload, p_cpy->len, &payload_offset, &payload_size, tunnel_src_addr, tunnel_dst_addr, spd) ;
+				status = ipsec_output_chain(segments, &payload_offset, &payload_size, state->tunnel_src_addr, state->tunnel_dst_addr, spd) ;
 
 				if(status == IPSEC_STATUS_SUCCESS)
 				{
-					/* adjust pbuf structure according to the real packet size */
-					p_cpy->payload = (unsigned char *)(p_cpy->payload) + payload_offset;
-					p_cpy->len = payload_size;
-					p_cpy->tot_len = payload_size;
+					/* adjust pbuf structure according to the real packet size (new headers in front
+					 * of the first pbuf, ESP trailer appended to the last one) */
+					ipsecdev_chain_to_pbuf(p_cpy, segments) ;
+					pbuf_header(p_cpy, (s16_t)-payload_offset) ;
 
 				  	IPSEC_LOG_MSG("ipsec_output", ("fwd IPsec packet to HW mapped device") );
-					retcode = mapped_netif.output(&mapped_netif, p_cpy, (void *)&tunnel_dst_addr);
-					if(spd->sa->protocol == IPSEC_PROTO_ESP) pbuf_free(p_cpy);
+					retcode = state->mapped_netif.output(&state->mapped_netif, p_cpy, (void *)&state->tunnel_dst_addr);
+					if(p_cpy != p) pbuf_free(p_cpy);
 				}
 				else {
 					IPSEC_LOG_ERR("ipsec_output", status, ("error on ipsec_output() processing"));
-					if(spd->sa->protocol == IPSEC_PROTO_ESP) pbuf_free(p_cpy);
+					if(p_cpy != p) pbuf_free(p_cpy);
 					IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_output", ("retcode = %d", ERR_CONN) );
 				}
+				ipsec_db_leave(state->reader) ;
 
 				IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_output", ("retcode = %d", ERR_OK) );
 			return ERR_OK;
@@ -351,7 +741,8 @@ err_t ipsecdev_output(struct netif *netif, struct pbuf *p, struct ip_addr *ipadd
 			break;
 		case POLICY_BYPASS:
 				IPSEC_LOG_AUD("ipsecdev_output", IPSEC_AUDIT_BYPASS, ("POLICY_BYPASS: forwarding packet to ip_output")) ;
-				retcode = mapped_netif.output(&mapped_netif, p, &dest_addr);
+				ipsec_db_leave(state->reader) ;
+				retcode = state->mapped_netif.output(&state->mapped_netif, p, &dest_addr);
 				IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_output", ("retcode = %d", retcode) );
 				return retcode;
 			break;
@@ -359,6 +750,7 @@ err_t ipsecdev_output(struct netif *netif, struct pbuf *p, struct ip_addr *ipadd
 			IPSEC_LOG_ERR("ipsecdev_input", IPSEC_STATUS_FAILURE, ("POLICY_DIRCARD: dropping packet")) ;
 			IPSEC_LOG_AUD("ipsecdev_input", IPSEC_AUDIT_FAILURE, ("unknown Security Policy: dropping packet")) ;
 	}
+	ipsec_db_leave(state->reader) ;
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_output", ("return = %d", ERR_CONN) );
 	return ERR_CONN;
@@ -378,22 +770,89 @@ err_t ipsecdev_output(struct netif *netif, struct pbuf *p, struct ip_addr *ipadd
 err_t ipsecdev_netlink_output(struct netif *netif, struct pbuf *p)
 {
 	int retcode;
+	struct ipsecdev_state *state ;
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
 	              "ipsecdev_netlink_output", 
 				  ("netif=%p, p=%d", (void *)netif, (void *)p ) 
 				 );
 	IPSEC_LOG_MSG("ipsecdev_netlink_output", ("fwd from interface '%c%c' to real HW linkoutput",  netif->name[0], netif->name[1]) );
 
-	retcode = mapped_netif.linkoutput(&mapped_netif, p);
+	state = ipsecdev_get_state(netif) ;
+	if(state == NULL)
+	{
+		IPSEC_LOG_ERR("ipsecdev_netlink_output", IPSEC_STATUS_FAILURE, ("interface '%c%c' is not an ipsecdev instance", netif->name[0], netif->name[1]) );
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_netlink_output", ("retcode = %d", ERR_CONN) );
+		return ERR_CONN;
+	}
+	if(state->phys_netif == NULL)
+	{
+		IPSEC_LOG_ERR("ipsecdev_netlink_output", IPSEC_STATUS_FAILURE, ("interface '%c%c' is not mapped to a physical device", netif->name[0], netif->name[1]) );
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_netlink_output", ("retcode = %d", ERR_CONN) );
+		return ERR_CONN;
+	}
+
+	retcode = state->mapped_netif.linkoutput(&state->mapped_netif, p);
 	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_netlink_output", ("retcode = %d", retcode) );
 	return retcode; 
 }
 
 
+/**
+ * Builds the outer header templates of the outbound SAs of an ipsecdev instance for its tunnel 
+ * (see ipsec_sad_set_tunnel()). Runs on the lwIP thread, not while packets are encapsulated.
+ *
+ * @param  state  state of the ipsecdev instance
+ * @return void
+ */
+static void ipsecdev_update_templates(struct ipsecdev_state *state)
+{
+	if(state->databases == NULL)
+		return ;
+	if(ipsec_sad_set_tunnel(&state->databases->outbound_sad, state->tunnel_src_addr, state->tunnel_dst_addr) != IPSEC_STATUS_SUCCESS)
+		IPSEC_LOG_MSG("ipsecdev_update_templates", ("previous outer header templates still in use, the headers are built per packet") );
+}
+
+/**
+ * Maps an ipsecdev instance to a physical network device: the output function of the device 
+ * is redirected to ipsecdev_output() and its original functions are kept in mapped_netif. 
+ * A device previously mapped to the instance gets its output function back.
+ *
+ * @param  state  state of the ipsecdev instance
+ * @param  phys   physical network device
+ * @return ERR_OK   if the device is mapped to the instance
+ * @return ERR_ARG  if the device is an ipsecdev instance or already mapped to another instance
+ */
+static err_t ipsecdev_map(struct ipsecdev_state *state, struct netif *phys)
+{
+	int i ;
+	struct ipsecdev_state *other ;
+
+	for(i = 0; i < IPSEC_NR_NETIFS; i++)
+	{
+		if(ipsecdev_netifs[i] == NULL) continue ;
+		other = (struct ipsecdev_state *)ipsecdev_netifs[i]->state ;
+		if((ipsecdev_netifs[i] == phys) || ((other != state) && (other->phys_netif == phys)))
+			return ERR_ARG ;
+	}
+
+	if(state->phys_netif != NULL)
+		state->phys_netif->output = state->mapped_netif.output ;
+	state->phys_netif = phys ;
+	memcpy(&state->mapped_netif, phys, sizeof(struct netif)) ;
+	phys->output = (void *)ipsecdev_output ;
+	return ERR_OK ;
+}
+
 /**
  * Initialize the ipsec network device
  *
  * This function must be called prior to any other operation with this device.
+ * Up to IPSEC_NR_NETIFS instances can be initialized. Each instance keeps its own 
+ * databases and tunnel endpoints in netif->state. It is mapped to the physical device 
+ * added to lwIP just before it, unless this device is already mapped to another instance 
+ * (or is an ipsecdev instance); the device can be chosen with ipsecdev_set_phys().
+ * The first instance loads the built-in SPD and SA configuration. Further instances 
+ * must get their databases with ipsecdev_set_dbs().
  *
  * @param  netif  lwIP network interface data structure for this device. The structure must be
  *                initialized with IP, netmask and gateway address.
@@ -401,21 +860,35 @@ err_t ipsecdev_netlink_output(struct netif *netif, struct pbuf *p)
  */
 err_t ipsecdev_init(struct netif *netif)
 {
-	struct ipsecdev_stats *ipsecdev_stats;
+	struct ipsecdev_state *state;
+	struct ipsecdev_state *other;
+	int instance ;
+	int i ;
 
 	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
 	              "ipsecdev_init", 
 				  ("netif=%p", (void *)netif ) 
 				 );
 
+	for(instance = 0; instance < IPSEC_NR_NETIFS; instance++)
+	{
+		if(ipsecdev_netifs[instance] == NULL) break ;
+	}
+	if(instance >= IPSEC_NR_NETIFS)
+	{
+  		IPSEC_LOG_DBG("ipsecdev_init", IPSEC_STATUS_FAILURE, ("no more than %d ipsecdev instances (IPSEC_NR_NETIFS)", IPSEC_NR_NETIFS));
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_init", ("retcode = %d", ERR_MEM) );
+		return ERR_MEM;
+	}
 
-	ipsecdev_stats = mem_malloc(sizeof(struct ipsecdev_stats));
-	if (ipsecdev_stats == NULL)
+	state = mem_malloc(sizeof(struct ipsecdev_state));
+	if (state == NULL)
 	{
-  		IPSEC_LOG_DBG("ipsecdev_init", IPSEC_STATUS_DATA_SIZE_ERROR, ("out of memory for ipsecdev_stats"));
+  		IPSEC_LOG_DBG("ipsecdev_init", IPSEC_STATUS_DATA_SIZE_ERROR, ("out of memory for ipsecdev_state"));
 		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_init", ("retcode = %d", ERR_MEM) );
 		return ERR_MEM;
 	}
+	memset(state, 0, sizeof(struct ipsecdev_state)) ;
 
 	/* set the name of this interface */
 	netif->name[0] = IPSECDEV_NAME0;
@@ -425,25 +898,42 @@ err_t ipsecdev_init(struct netif *netif)
 	netif->output = (void *)ipsecdev_output;				/* usually called if the IP module wants to send data */
 	netif->linkoutput = (void *)ipsecdev_netlink_output;	/* usually called if the ARP module wants to send data "as-is" */
 
-	/**@todo this should be somewhere else */
-	/* initialize the db_sets structure */
-	memset(db_sets, 0, IPSEC_NR_NETIFS*sizeof(db_set_netif)) ;
+	/* swap output devices, by default with the device added last (see ipsecdev_set_phys()) */
+	if((netif_list == NULL) || (ipsecdev_map(state, netif_list) != ERR_OK))
+	{
+		IPSEC_LOG_MSG("ipsecdev_init", ("no free physical device to map, it must be set with ipsecdev_set_phys()") );
+	}
+
+	state->tunnel_src_addr = tunnel_src_default ;
+	state->tunnel_dst_addr = tunnel_dst_default ;
 
-	/* swap output devices */
-	/**@todo selecting the right interface for mapping must be replaced by an more generic method */
-	/* save mapped netif */
-	memcpy(&mapped_netif, netif_list, sizeof(struct netif)) ;
-	netif_list->output = (void *)ipsecdev_output;
+	/* instances may be served by different threads, so each one reads the databases as its own reader */
+	state->reader = instance ;
 
-	/* setup ipsec databases/configuration */
-	databases = ipsec_spd_load_dbs(inbound_spd_config, outbound_spd_config, inbound_sad_config, outbound_sad_config) ;
-	if (databases == NULL)
+	/* setup ipsec databases/configuration (the built-in configuration can only be used once) */
+	for(i = 0; i < IPSEC_NR_NETIFS; i++)
+	{
+		if(ipsecdev_netifs[i] == NULL) continue ;
+		other = (struct ipsecdev_state *)ipsecdev_netifs[i]->state ;
+		if((other->databases != NULL) && (other->databases->inbound_spd.table == inbound_spd_config)) break ;
+	}
+	if(i >= IPSEC_NR_NETIFS)
+	{
+		state->databases = ipsec_spd_load_dbs(inbound_spd_config, outbound_spd_config, inbound_sad_config, outbound_sad_config) ;
+		if (state->databases == NULL)
+		{
+			IPSEC_LOG_ERR("ipsecdev_init", -1, ("not able to load SPD and SA configuration for ipsec device")) ;
+		}
+		ipsecdev_update_templates(state) ;
+	}
+	else
 	{
-		IPSEC_LOG_ERR("ipsecdev_init", -1, ("not able to load SPD and SA configuration for ipsec device")) ;
+		IPSEC_LOG_MSG("ipsecdev_init", ("built-in configuration already in use, databases must be set with ipsecdev_set_dbs()") );
 	}
 
-	ipsecdev_stats->sentbytes = 0;			/* reset statistic */
-	netif->state = ipsecdev_stats;			/* assign statistic */
+	state->stats.sentbytes = 0;				/* reset statistic */
+	netif->state = state;					/* assign state and statistic */
+	ipsecdev_netifs[instance] = netif ;
   	netif->mtu = 1500;						/* set MTU */
 	netif->flags = NETIF_FLAG_LINK_UP | NETIF_FLAG_BROADCAST;	/* device is always connected and supports broadcasts */
   	netif->hwaddr_len = 6;					/* set hardware address (MAC address) */
@@ -471,16 +961,196 @@ err_t ipsecdev_init(struct netif *netif)
 	return IPSEC_STATUS_SUCCESS;
 }
 
+/**
+ * Sets the tunnel endpoints of an ipsecdev instance and of its pipeline.
+ *
+ * @param  state  state of the ipsecdev instance
+ * @param  src    tunnel source address (network order)
+ * @param  dst    tunnel destination address (network order)
+ * @return void
+ */
+static void ipsecdev_update_tunnel(struct ipsecdev_state *state, __u32 src, __u32 dst)
+{
+	state->tunnel_src_addr = src ;
+	state->tunnel_dst_addr = dst ;
+	if(state->pipeline != NULL)
+	{
+		state->pipeline->tunnel_src = src ;
+		state->pipeline->tunnel_dst = dst ;
+	}
+	ipsecdev_update_templates(state) ;
+}
+
 /**
  * Setter function for tunnel source and destination address
  *
+ * The addresses are used by all ipsecdev instances initialized afterwards and 
+ * by the first instance if it is already initialized. Use ipsecdev_set_tunnel() to 
+ * set the tunnel of one particular instance.
+ *
  * @param  src  source address as string (i.g. "192.168.1.3")
  * @param  dst  destination address as string (i.g. "192.168.1.5")
  * @return void
  */
 void ipsec_set_tunnel(char *src, char *dst)
 {
-	tunnel_src_addr = ipsec_inet_addr(src) ;
-	tunnel_dst_addr = ipsec_inet_addr(dst) ;
+	tunnel_src_default = ipsec_inet_addr(src) ;
+	tunnel_dst_default = ipsec_inet_addr(dst) ;
+	if(ipsecdev_netifs[0] != NULL)
+		ipsecdev_update_tunnel((struct ipsecdev_state *)ipsecdev_netifs[0]->state, tunnel_src_default, tunnel_dst_default) ;
 	return ;
 }
+
+/**
+ * Setter function for the tunnel source and destination address of one ipsecdev instance
+ *
+ * @param  netif  ipsecdev instance (initialized by ipsecdev_init())
+ * @param  src    source address as string (i.g. "192.168.1.3")
+ * @param  dst    destination address as string (i.g. "192.168.1.5")
+ * @return void
+ */
+void ipsecdev_set_tunnel(struct netif *netif, char *src, char *dst)
+{
+	struct ipsecdev_state *state ;
+
+	state = ipsecdev_get_state(netif) ;
+	if(state == NULL)
+	{
+		IPSEC_LOG_ERR("ipsecdev_set_tunnel", IPSEC_STATUS_FAILURE, ("interface '%c%c' is not an ipsecdev instance", netif->name[0], netif->name[1]) );
+		return ;
+	}
+	ipsecdev_update_tunnel(state, ipsec_inet_addr(src), ipsec_inet_addr(dst)) ;
+	return ;
+}
+
+/**
+ * Maps an ipsecdev instance to a physical network device
+ *
+ * The traffic of the instance is sent over this device from now on. A device can only 
+ * be mapped to one instance, a device previously mapped to this instance is restored.
+ *
+ * @param  netif  ipsecdev instance (initialized by ipsecdev_init())
+ * @param  phys   physical network device (added to lwIP)
+ * @return ERR_OK     if the device was mapped
+ * @return ERR_ARG    if netif is not an ipsecdev instance, or phys is already mapped to another 
+ *                    instance or is an ipsecdev instance itself
+ */
+err_t ipsecdev_set_phys(struct netif *netif, struct netif *phys)
+{
+	struct ipsecdev_state *state ;
+	err_t retcode ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsecdev_set_phys", 
+				  ("netif=%p, phys=%p", (void *)netif, (void *)phys ) 
+				 );
+
+	state = ipsecdev_get_state(netif) ;
+	if((state == NULL) || (state->phys_netif == netif) || (phys == NULL))
+	{
+		IPSEC_LOG_ERR("ipsecdev_set_phys", IPSEC_STATUS_FAILURE, ("interface '%c%c' is not an ipsecdev instance or no device given", netif->name[0], netif->name[1]) );
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_set_phys", ("retcode = %d", ERR_ARG) );
+		return ERR_ARG;
+	}
+
+	retcode = ipsecdev_map(state, phys) ;
+	if(retcode != ERR_OK)
+	{
+		IPSEC_LOG_ERR("ipsecdev_set_phys", IPSEC_STATUS_FAILURE, ("interface '%c%c' is already mapped to an ipsecdev instance", phys->name[0], phys->name[1]) );
+	}
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_set_phys", ("retcode = %d", retcode) );
+	return retcode;
+}
+
+/**
+ * Assigns a set of databases to an ipsecdev instance
+ *
+ * The databases (e.g. created with ipsec_spd_create_dbs()) are used for all traffic 
+ * of this instance from now on. A previously assigned set is not released.
+ *
+ * @param  netif      ipsecdev instance (initialized by ipsecdev_init())
+ * @param  databases  SPD and SA configuration of this instance
+ * @return ERR_OK     if the databases were assigned
+ * @return ERR_ARG    if netif is not an ipsecdev instance
+ */
+err_t ipsecdev_set_dbs(struct netif *netif, db_set_netif *databases)
+{
+	struct ipsecdev_state *state ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsecdev_set_dbs", 
+				  ("netif=%p, databases=%p", (void *)netif, (void *)databases ) 
+				 );
+
+	state = ipsecdev_get_state(netif) ;
+	if(state == NULL)
+	{
+		IPSEC_LOG_ERR("ipsecdev_set_dbs", IPSEC_STATUS_FAILURE, ("interface '%c%c' is not an ipsecdev instance", netif->name[0], netif->name[1]) );
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_set_dbs", ("retcode = %d", ERR_ARG) );
+		return ERR_ARG;
+	}
+	state->databases = databases ;
+	if(state->pipeline != NULL)
+		state->pipeline->databases = databases ;
+	ipsecdev_update_templates(state) ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_set_dbs", ("retcode = %d", ERR_OK) );
+	return ERR_OK;
+}
+
+/**
+ * Lets an ipsecdev instance process its IPsec packets in a pipeline of crypto workers
+ *
+ * The pipeline is initialized with the databases and the tunnel of the instance. From now on
+ * IPsec packets are only classified on the lwIP thread; IPSEC_PIPELINE_WORKERS threads of the
+ * port must call ipsec_pipeline_work() for the crypto processing, and ipsecdev_service() must 
+ * be called regularly to pass the processed packets on. The pipeline reads the databases as the
+ * reader of this instance (see ipsec_db_enter()), so deleted SPD entries and SAs are not reused
+ * while packets which may refer to them are in the pipeline.
+ * The jobs for the packets in the pipeline are allocated once per instance, so instances 
+ * with a pipeline each have their own IPSEC_PIPELINE_WINDOW jobs.
+ *
+ * @param  netif      ipsecdev instance (initialized by ipsecdev_init())
+ * @param  pipeline   pipeline to use, NULL to process the packets on the lwIP thread again
+ * @return ERR_OK     if the pipeline was assigned
+ * @return ERR_ARG    if netif is not an ipsecdev instance
+ * @return ERR_MEM    if there is no memory for the jobs
+ */
+err_t ipsecdev_set_pipeline(struct netif *netif, ipsec_pipeline *pipeline)
+{
+	struct ipsecdev_state *state ;
+	int i ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_ENTER, 
+	              "ipsecdev_set_pipeline", 
+				  ("netif=%p, pipeline=%p", (void *)netif, (void *)pipeline ) 
+				 );
+
+	state = ipsecdev_get_state(netif) ;
+	if(state == NULL)
+	{
+		IPSEC_LOG_ERR("ipsecdev_set_pipeline", IPSEC_STATUS_FAILURE, ("interface '%c%c' is not an ipsecdev instance", netif->name[0], netif->name[1]) );
+		IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_set_pipeline", ("retcode = %d", ERR_ARG) );
+		return ERR_ARG;
+	}
+	if((pipeline != NULL) && (state->jobs == NULL))
+	{
+		state->jobs = mem_malloc(IPSEC_PIPELINE_WINDOW * sizeof(ipsecdev_job)) ;
+		if(state->jobs == NULL)
+		{
+	  		IPSEC_LOG_DBG("ipsecdev_set_pipeline", IPSEC_STATUS_DATA_SIZE_ERROR, ("out of memory for the pipeline jobs"));
+			IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_set_pipeline", ("retcode = %d", ERR_MEM) );
+			return ERR_MEM;
+		}
+		for(i = 0; i < IPSEC_PIPELINE_WINDOW; i++)
+			state->jobs[i].next = (i + 1 < IPSEC_PIPELINE_WINDOW) ? &state->jobs[i+1] : NULL ;
+		state->free_jobs = &state->jobs[0] ;
+	}
+	if(pipeline != NULL)
+		ipsec_pipeline_init(pipeline, state->databases, state->tunnel_src_addr, state->tunnel_dst_addr, state->reader) ;
+	state->pipeline = pipeline ;
+
+	IPSEC_LOG_TRC(IPSEC_TRACE_RETURN, "ipsecdev_set_pipeline", ("retcode = %d", ERR_OK) );
+	return ERR_OK;
+}
@@ -0,0 +1,257 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file aes_test.c
+ *  @brief Test functions for the AES cipher (CBC and CTR mode)
+ *
+ *  <B>OUTLINE:</B>
+ *
+ *  This file contains test functions used to verify the AES code against the test vectors of
+ *  FIPS-197 (appendix C), RFC 3602 (CBC) and RFC 3686 (CTR).
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *
+ *  The block tests are run with both engines. If the AES-NI engine is not available, the
+ *  portable engine is tested twice.
+ *
+ *  <B>NOTES:</B>
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/util.h"
+#include "ipsec/aes.h"
+#include "ipsec/debug.h"
+#include "testing/structural/structural_test.h"
+
+
+/**
+ * Tests the AES block functions with the FIPS-197 vectors (AES-128 and AES-256)
+ * 9 tests are performed here.
+ * @return int number of tests failed in this function
+ */
+int aes_test_cipher_aes_block(void) 
+{
+	unsigned char key[32] ;
+	unsigned char plain[16] ;
+	const unsigned char cipher_128[16]	= { 0x69,0xc4,0xe0,0xd8,0x6a,0x7b,0x04,0x30,0xd8,0xcd,0xb7,0x80,0x70,0xb4,0xc5,0x5a } ;
+	const unsigned char cipher_256[16]	= { 0x8e,0xa2,0xb7,0xca,0x51,0x67,0x45,0xbf,0xea,0xfc,0x49,0x90,0x4b,0x49,0x60,0x89 } ;
+	unsigned char result[16] ;
+	aes_key ks ;
+	int local_error_count = 0;
+	int previous ;
+	int engine ;
+	int i ;
+
+	for(i = 0; i < (int)sizeof(key); i++)
+		key[i] = (unsigned char)i ;
+	for(i = 0; i < (int)sizeof(plain); i++)
+		plain[i] = (unsigned char)(i*0x11) ;
+
+	previous = cipher_aes_set_engine(CIPHER_AES_PORTABLE) ;
+	for(engine = CIPHER_AES_PORTABLE; engine <= CIPHER_AES_NI; engine++)
+	{
+		cipher_aes_set_engine(engine) ;
+
+		cipher_aes_set_key(key, 16, &ks) ;
+		cipher_aes_encrypt(&ks, plain, result) ;
+		if(memcmp(result, cipher_128, sizeof(result)) != 0) {
+			local_error_count++;
+			printf("aes_test_cipher_aes_block(): error - AES-128 encryption failed (engine %d)\n", ks.engine);
+		}
+		cipher_aes_decrypt(&ks, result, result) ;
+		if(memcmp(result, plain, sizeof(result)) != 0) {
+			local_error_count++;
+			printf("aes_test_cipher_aes_block(): error - AES-128 decryption failed (engine %d)\n", ks.engine);
+		}
+
+		cipher_aes_set_key(key, 32, &ks) ;
+		cipher_aes_encrypt(&ks, plain, result) ;
+		cipher_aes_decrypt(&ks, result, result) ;
+		if(memcmp(result, plain, sizeof(result)) != 0) {
+			local_error_count++;
+			printf("aes_test_cipher_aes_block(): error - AES-256 decryption failed (engine %d)\n", ks.engine);
+		}
+		cipher_aes_encrypt(&ks, plain, result) ;
+		if(memcmp(result, cipher_256, sizeof(result)) != 0) {
+			local_error_count++;
+			printf("aes_test_cipher_aes_block(): error - AES-256 encryption failed (engine %d)\n", ks.engine);
+		}
+	}
+	cipher_aes_set_engine(previous) ;
+
+	/* wrong key length */
+	if(cipher_aes_set_key(key, 20, &ks) != -1) {
+		local_error_count++;
+		printf("aes_test_cipher_aes_block(): error - cipher_aes_set_key() accepted a 20 byte key\n");
+	}
+
+	return local_error_count;
+}
+
+
+/**
+ * Tests AES-CBC with the vector of RFC 3602 (case #2) on a chain of buffers
+ * 2 tests are performed here.
+ * @return int number of tests failed in this function
+ */
+int aes_test_cipher_aes_cbc(void) 
+{
+	unsigned char key[16]				= { 0xc2,0x86,0x69,0x6d,0x88,0x7c,0x9a,0xa0,0x61,0x1b,0xbb,0x3e,0x20,0x25,0xa4,0x5a } ;
+	const unsigned char iv_orig[16]		= { 0x56,0x2e,0x17,0x99,0x6d,0x09,0x3d,0x28,0xdd,0xb3,0xba,0x69,0x5a,0x2e,0x6f,0x58 } ;
+	const unsigned char cipher[32]		= { 0xd2,0x96,0xcd,0x94,0xc2,0xcc,0xcf,0x8a,0x3a,0x86,0x30,0x28,0xb5,0xe1,0xdc,0x0a,
+											0x75,0x86,0x60,0x2d,0x25,0x3c,0xff,0xf9,0x1b,0x82,0x66,0xbe,0xa6,0xd6,0x1a,0xb1 } ;
+	unsigned char plain[32] ;
+	unsigned char data[32] ;
+	unsigned char iv[16] ;
+	ipsec_buffer segments[2] ;
+	aes_key ks ;
+	int local_error_count = 0;
+	int i ;
+
+	for(i = 0; i < (int)sizeof(plain); i++)
+		plain[i] = (unsigned char)i ;
+
+	/* the 1st block spans both segments */
+	memcpy(data, plain, sizeof(data)) ;
+	segments[0].next = &segments[1] ;
+	segments[0].data = data ;
+	segments[0].len = 5 ;
+	segments[1].next = NULL ;
+	segments[1].data = data + 5 ;
+	segments[1].len = sizeof(data) - 5 ;
+
+	cipher_aes_set_key(key, 16, &ks) ;
+	memcpy(iv, iv_orig, sizeof(iv)) ;
+	cipher_aes_cbc_chain(segments, 0, sizeof(data), &ks, iv, AES_ENCRYPT) ;
+	if(memcmp(data, cipher, sizeof(cipher)) != 0) {
+		local_error_count++;
+		printf("aes_test_cipher_aes_cbc(): error - AES-CBC encryption failed\n");
+		IPSEC_DUMP_BUFFER("   output  : ", data, 0, sizeof(data));
+	}
+
+	memcpy(iv, iv_orig, sizeof(iv)) ;
+	cipher_aes_cbc_chain(segments, 0, sizeof(data), &ks, iv, AES_DECRYPT) ;
+	if((memcmp(data, plain, sizeof(plain)) != 0) || (memcmp(iv, &cipher[16], sizeof(iv)) != 0)) {
+		local_error_count++;
+		printf("aes_test_cipher_aes_cbc(): error - AES-CBC decryption failed\n");
+	}
+
+	return local_error_count;
+}
+
+
+/**
+ * Tests AES-CTR with the vectors of RFC 3686 (#2: AES-128, 32 bytes and #7: AES-256, 16 bytes)
+ * 2 tests are performed here.
+ * @return int number of tests failed in this function
+ */
+int aes_test_cipher_aes_ctr(void) 
+{
+	unsigned char key_128[16]			= { 0x7e,0x24,0x06,0x78,0x17,0xfa,0xe0,0xd7,0x43,0xd6,0xce,0x1f,0x32,0x53,0x91,0x63 } ;
+	const unsigned char counter_128[16]	= { 0x00,0x6c,0xb6,0xdb,0xc0,0x54,0x3b,0x59,0xda,0x48,0xd9,0x0b,0x00,0x00,0x00,0x01 } ;
+	const unsigned char cipher_128[32]	= { 0x51,0x04,0xa1,0x06,0x16,0x8a,0x72,0xd9,0x79,0x0d,0x41,0xee,0x8e,0xda,0xd3,0x88,
+											0xeb,0x2e,0x1e,0xfc,0x46,0xda,0x57,0xc8,0xfc,0xe6,0x30,0xdf,0x91,0x41,0xbe,0x28 } ;
+	unsigned char key_256[32]			= { 0x77,0x6b,0xef,0xf2,0x85,0x1d,0xb0,0x6f,0x4c,0x8a,0x05,0x42,0xc8,0x69,0x6f,0x6c,
+											0x6a,0x81,0xaf,0x1e,0xec,0x96,0xb4,0xd3,0x7f,0xc1,0xd6,0x89,0xe6,0xc1,0xc1,0x04 } ;
+	const unsigned char counter_256[16]	= { 0x00,0x00,0x00,0x60,0xdb,0x56,0x72,0xc9,0x7a,0xa8,0xf0,0xb2,0x00,0x00,0x00,0x01 } ;
+	const unsigned char cipher_256[16]	= { 0x14,0x5a,0xd0,0x1d,0xbf,0x82,0x4e,0xc7,0x56,0x08,0x63,0xdc,0x71,0xe3,0xe0,0xc0 } ;
+	unsigned char data[32] ;
+	unsigned char counter[16] ;
+	ipsec_buffer segments[2] ;
+	aes_key ks ;
+	int local_error_count = 0;
+	int i ;
+
+	for(i = 0; i < (int)sizeof(data); i++)
+		data[i] = (unsigned char)i ;
+
+	/* the 2nd block spans both segments */
+	segments[0].next = &segments[1] ;
+	segments[0].data = data ;
+	segments[0].len = 21 ;
+	segments[1].next = NULL ;
+	segments[1].data = data + 21 ;
+	segments[1].len = sizeof(data) - 21 ;
+
+	cipher_aes_set_key(key_128, 16, &ks) ;
+	memcpy(counter, counter_128, sizeof(counter)) ;
+	cipher_aes_ctr_chain(segments, 0, sizeof(data), &ks, counter) ;
+	if((memcmp(data, cipher_128, sizeof(cipher_128)) != 0) || (counter[15] != 3)) {
+		local_error_count++;
+		printf("aes_test_cipher_aes_ctr(): error - AES-128-CTR failed\n");
+		IPSEC_DUMP_BUFFER("   output  : ", data, 0, sizeof(data));
+	}
+
+	memcpy(data, "Single block msg", 16) ;
+	cipher_aes_set_key(key_256, 32, &ks) ;
+	memcpy(counter, counter_256, sizeof(counter)) ;
+	cipher_aes_ctr(data, 16, &ks, counter, data) ;
+	if(memcmp(data, cipher_256, sizeof(cipher_256)) != 0) {
+		local_error_count++;
+		printf("aes_test_cipher_aes_ctr(): error - AES-256-CTR failed\n");
+	}
+
+	return local_error_count;
+}
+
+
+/**
+ * Main test function for the AES tests.
+ * It does nothing but calling the subtests one after the other.
+ */
+void aes_test(test_result *global_results)
+{
+	test_result 	sub_results	= {
+						 13,
+						  3,
+						  0,
+						  0, 
+					};
+
+	int retcode;
+
+	retcode = aes_test_cipher_aes_block();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "aes_test_cipher_aes_block()", ("FIPS-197"));
+
+	retcode = aes_test_cipher_aes_cbc();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "aes_test_cipher_aes_cbc()", ("RFC 3602"));
+
+	retcode = aes_test_cipher_aes_ctr();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "aes_test_cipher_aes_ctr()", ("RFC 3686"));
+
+	global_results->tests += sub_results.tests;
+	global_results->functions += sub_results.functions;
+	global_results->errors += sub_results.errors;
+	global_results->notimplemented += sub_results.notimplemented;
+}
@@ -68,15 +68,18 @@ int ah_test_ipsec_ah_check(void)
 								0x1010, 
 								IPSEC_PROTO_AH, IPSEC_TUNNEL, 
 								IPSEC_3DES, 
-								0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 
+								0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
 								IPSEC_HMAC_MD5,  
-								0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0)
+								0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)
 							};
 	int local_error_count	= 0;
 	int payload_size 		= 0;
 	int payload_offset		= 0;
 	int ret_val;
 
+	/* statically configured SA, set up on the control path like ipsec_spd_load_dbs() does */
+	ipsec_sad_prepare(&packet1_sa) ;
+
 	// feed valid AH packet
 	ret_val = ipsec_ah_check((ipsec_ip_header *)&ah_test_sample_ah_outer_packet, (int *)&payload_offset, (int *)&payload_size, (sad_entry *)&packet1_sa);
 	if(ret_val != IPSEC_STATUS_SUCCESS) {
@@ -104,9 +107,9 @@ int ah_test_ipsec_ah_encapsulate(void)
 								0x1016, 
 								IPSEC_PROTO_AH, IPSEC_TUNNEL, 
 								IPSEC_3DES, 
-								0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 
+								0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
 								IPSEC_HMAC_MD5,  
-								0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0)
+								0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)
 							};
 
 	static unsigned char encapsulated_ah_packet[104] =
@@ -140,6 +143,10 @@ int ah_test_ipsec_ah_encapsulate(void)
 	/* copy packet in a buffer where space for the new headers is left */
 	memcpy(buffer + 100, ah_test_sample_ah_inner_packet, sizeof(ah_test_sample_ah_inner_packet));
 
+	/* the IP ID is random per SA, fix it so that the first packet gets the ID of the sample packet */
+	ipsec_sad_prepare(&packet1_sa) ;
+	packet1_sa.ip_id_base = 0xE803 - 1 ;
+
 	ret_val = ipsec_ah_encapsulate((ipsec_ip_header *)(buffer + 100), 
 	                                      (int *)&payload_offset, (int *)&payload_size, 
 										  (sad_entry *)&packet1_sa,
@@ -174,6 +181,146 @@ int ah_test_ipsec_ah_encapsulate(void)
 	return local_error_count;
 }
 
+/**
+ * Checks if packets encapsulated with HMAC-SHA-256, HMAC-SHA-384 and HMAC-SHA-512 (16, 24 and 
+ * 32 byte ICVs) pass the check and if a modified packet is rejected.
+ * 4 tests
+ * @return int number of tests failed in this function
+ */
+int ah_test_sha2(void) 
+{
+	sad_entry sa =	{ 	SAD_ENTRY(	192,168,1,5, 255,255,255,255, 
+						0x1017, 
+						IPSEC_PROTO_AH, IPSEC_TUNNEL, 
+						0, 
+						0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
+						IPSEC_HMAC_SHA256,  
+						0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)
+					};
+	const __u8		auth_alg[3] = { IPSEC_HMAC_SHA256, IPSEC_HMAC_SHA384, IPSEC_HMAC_SHA512 } ;
+	const int		icv_len[3] = { 16, 24, 32 } ;
+	unsigned char	buffer[sizeof (ah_test_sample_ah_inner_packet) + 100];
+	int 			local_error_count = 0;
+	int 			payload_size ;
+	int 			payload_offset ;
+	int				headroom, tailroom ;
+	int 			i, j ;
+
+	for(i = 0; i < 3; i++)
+	{
+		sa.auth_alg = auth_alg[i] ;
+		for(j = 0; j < IPSEC_MAX_AUTHKEY_LEN; j++)
+			sa.authkey[j] = (__u8)(j*7+i) ;
+		ipsec_sad_prepare(&sa) ;
+		sa.sequence_number = 0 ;
+
+		ipsec_ah_get_overhead(&sa, &headroom, &tailroom) ;
+		memcpy(buffer + 100, ah_test_sample_ah_inner_packet, sizeof(ah_test_sample_ah_inner_packet));
+		if((ipsec_ah_encapsulate((ipsec_ip_header *)(buffer + 100), &payload_offset, &payload_size, &sa, 0x0301A8C0, 0x0501A8C0) != IPSEC_STATUS_SUCCESS) ||
+		   (headroom != 32 + icv_len[i]) || (payload_offset != -headroom) || (payload_size != (int)sizeof(ah_test_sample_ah_inner_packet) + headroom))
+		{
+			local_error_count++;
+			IPSEC_LOG_TST("ah_test_sha2", "FAILURE", ("encapsulation with algorithm %d failed (offset = %d, len = %d)", auth_alg[i], payload_offset, payload_size)) ;
+			continue ;
+		}
+
+		if((ipsec_ah_check((ipsec_ip_header *)(buffer + 100 - headroom), &payload_offset, &payload_size, &sa) != IPSEC_STATUS_SUCCESS) ||
+		   (payload_offset != headroom) || (memcmp(buffer + 100, ah_test_sample_ah_inner_packet, sizeof(ah_test_sample_ah_inner_packet)) != 0))
+		{
+			local_error_count++;
+			IPSEC_LOG_TST("ah_test_sha2", "FAILURE", ("check with algorithm %d failed (offset = %d)", auth_alg[i], payload_offset)) ;
+		}
+	}
+
+	/* a modified packet of the last SA must be rejected */
+	ipsec_ah_encapsulate((ipsec_ip_header *)(buffer + 100), &payload_offset, &payload_size, &sa, 0x0301A8C0, 0x0501A8C0) ;
+	buffer[110] ^= 0x01 ;
+	if(ipsec_ah_check((ipsec_ip_header *)(buffer + 100 + payload_offset), &payload_offset, &payload_size, &sa) != IPSEC_STATUS_FAILURE)
+	{
+		local_error_count++;
+		IPSEC_LOG_TST("ah_test_sha2", "FAILURE", ("modified packet was not rejected")) ;
+	}
+
+	return local_error_count;
+}
+
+/**
+ * Test ipsec_ah_check_batch() with HMAC-MD5 and HMAC-SHA1: a modified and a replayed packet of the
+ * batch must be rejected, the other ones accepted.
+ * 4 tests
+ * @return int number of tests failed in this function
+ */
+int ah_test_batch(void) 
+{
+	sad_entry sa =	{ 	SAD_ENTRY(	192,168,1,5, 255,255,255,255, 
+						0x1018, 
+						IPSEC_PROTO_AH, IPSEC_TUNNEL, 
+						0, 
+						0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
+						IPSEC_HMAC_MD5,  
+						0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)
+					};
+	const __u8		auth_alg[2] = { IPSEC_HMAC_MD5, IPSEC_HMAC_SHA1 } ;
+	const int		expected[5] = { IPSEC_STATUS_SUCCESS, IPSEC_STATUS_SUCCESS, IPSEC_STATUS_FAILURE, IPSEC_STATUS_SUCCESS, IPSEC_AUDIT_SEQ_MISMATCH } ;
+	unsigned char	buffer[5][sizeof (ah_test_sample_ah_inner_packet) + 100];
+	ipsec_buffer	segments[5] ;
+	ipsec_packet	packets[5] ;
+	ipsec_packet	*batch[5] ;
+	int 			local_error_count = 0;
+	int 			payload_size ;
+	int 			payload_offset ;
+	int				headroom, tailroom ;
+	int 			i, j ;
+
+	for(i = 0; i < 2; i++)
+	{
+		sa.auth_alg = auth_alg[i] ;
+		for(j = 0; j < IPSEC_MAX_AUTHKEY_LEN; j++)
+			sa.authkey[j] = (__u8)(j*11+i) ;
+		ipsec_sad_prepare(&sa) ;
+		sa.sequence_number = 0 ;
+		ipsec_ah_get_overhead(&sa, &headroom, &tailroom) ;
+
+		for(j = 0; j < 4; j++)
+		{
+			memcpy(buffer[j] + 100, ah_test_sample_ah_inner_packet, sizeof(ah_test_sample_ah_inner_packet));
+			ipsec_ah_encapsulate((ipsec_ip_header *)(buffer[j] + 100), &payload_offset, &payload_size, &sa, 0x0301A8C0, 0x0501A8C0) ;
+		}
+		/* packet 2 is modified, packet 4 is a copy of packet 3 */
+		buffer[2][110] ^= 0x01 ;
+		memcpy(buffer[4], buffer[3], sizeof(buffer[3])) ;
+
+		for(j = 0; j < 5; j++)
+		{
+			segments[j].next = NULL ;
+			segments[j].data = buffer[j] + 100 - headroom ;
+			segments[j].len = payload_size ;
+			packets[j].chain = &segments[j] ;
+			batch[j] = &packets[j] ;
+		}
+
+		ipsec_ah_check_batch(batch, 5, &sa) ;
+
+		for(j = 0; j < 5; j++)
+			if(packets[j].status != expected[j])
+				break ;
+		if(j != 5)
+		{
+			local_error_count++;
+			IPSEC_LOG_TST("ah_test_batch", "FAILURE", ("packet %d with algorithm %d: status %d instead of %d", j, auth_alg[i], packets[j].status, expected[j])) ;
+		}
+
+		if((packets[0].payload_offset != headroom) || (packets[0].payload_size != (int)sizeof(ah_test_sample_ah_inner_packet)) ||
+		   (packets[3].payload_offset != headroom) || (packets[3].payload_size != (int)sizeof(ah_test_sample_ah_inner_packet)))
+		{
+			local_error_count++;
+			IPSEC_LOG_TST("ah_test_batch", "FAILURE", ("wrong inner packet with algorithm %d (offset = %d, size = %d)", auth_alg[i], packets[0].payload_offset, packets[0].payload_size)) ;
+		}
+	}
+
+	return local_error_count;
+}
+
 /**
  * Main test function for the AH tests.
  * It does nothing but calling the subtests one after the other.
@@ -181,8 +328,8 @@ int ah_test_ipsec_ah_encapsulate(void)
 void ah_test(test_result *global_results)
 {
 	test_result 	sub_results	= {
-						  6, 			
-						  2,			
+						 14, 			
+						  4,			
 						  0, 			
 						  0, 			
 					};
@@ -195,6 +342,12 @@ void ah_test(test_result *global_results)
 	retcode = ah_test_ipsec_ah_encapsulate();
 	IPSEC_TESTING_EVALUATE(retcode, sub_results, "ah_test_ipsec_ah_encapsulate()", (""));
 
+	retcode = ah_test_sha2();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "ah_test_sha2()", (""));
+
+	retcode = ah_test_batch();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "ah_test_batch()", (""));
+
 	global_results->tests += sub_results.tests;
 	global_results->functions += sub_results.functions;
 	global_results->errors += sub_results.errors;
@@ -0,0 +1,213 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file chacha_test.c
+ *  @brief Test functions for ChaCha20 and ChaCha20-Poly1305
+ *
+ *  <B>OUTLINE:</B>
+ *
+ *  This file contains test functions used to verify the ChaCha20 and ChaCha20-Poly1305 code
+ *  against the test vectors of RFC 8439 (2.4.2 and 2.8.2).
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *
+ *  The vectors are run with all engines, engines which are not available are replaced by the
+ *  next slower one. The vectors are shorter than four blocks, so the SIMD engines are also 
+ *  compared with the portable engine on a longer buffer.
+ *
+ *  <B>NOTES:</B>
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/util.h"
+#include "ipsec/chacha.h"
+#include "ipsec/debug.h"
+#include "testing/structural/structural_test.h"
+
+
+/** plaintext of the RFC 8439 vectors (114 bytes) */
+static unsigned char chacha_test_plain[] = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it." ;
+
+
+/**
+ * Tests ChaCha20 with the vector of RFC 8439 (2.4.2) on all engines
+ * 3 tests are performed here.
+ * @return int number of tests failed in this function
+ */
+int chacha_test_chacha20(void) 
+{
+	unsigned char nonce[12]				= { 0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x4a,0x00,0x00,0x00,0x00 } ;
+	const unsigned char cipher[114]		= { 0x6e,0x2e,0x35,0x9a,0x25,0x68,0xf9,0x80,0x41,0xba,0x07,0x28,0xdd,0x0d,0x69,0x81,
+											0xe9,0x7e,0x7a,0xec,0x1d,0x43,0x60,0xc2,0x0a,0x27,0xaf,0xcc,0xfd,0x9f,0xae,0x0b,
+											0xf9,0x1b,0x65,0xc5,0x52,0x47,0x33,0xab,0x8f,0x59,0x3d,0xab,0xcd,0x62,0xb3,0x57,
+											0x16,0x39,0xd6,0x24,0xe6,0x51,0x52,0xab,0x8f,0x53,0x0c,0x35,0x9f,0x08,0x61,0xd8,
+											0x07,0xca,0x0d,0xbf,0x50,0x0d,0x6a,0x61,0x56,0xa3,0x8e,0x08,0x8a,0x22,0xb6,0x5e,
+											0x52,0xbc,0x51,0x4d,0x16,0xcc,0xf8,0x06,0x81,0x8c,0xe9,0x1a,0xb7,0x79,0x37,0x36,
+											0x5a,0xf9,0x0b,0xbf,0x74,0xa3,0x5b,0xe6,0xb4,0x0b,0x8e,0xed,0xf2,0x78,0x5e,0x42,
+											0x87,0x4d } ;
+	unsigned char key[32] ;
+	unsigned char data[114] ;
+	chacha_key ck ;
+	int local_error_count = 0;
+	int previous ;
+	int engine ;
+	int i ;
+
+	for(i = 0; i < (int)sizeof(key); i++)
+		key[i] = (unsigned char)i ;
+
+	previous = cipher_chacha_set_engine(CIPHER_CHACHA_PORTABLE) ;
+	for(engine = CIPHER_CHACHA_PORTABLE; engine <= CIPHER_CHACHA_AVX2; engine++)
+	{
+		cipher_chacha_set_engine(engine) ;
+		cipher_chacha_set_key(key, &ck) ;
+		cipher_chacha20(chacha_test_plain, sizeof(data), &ck, nonce, 1, data) ;
+		if(memcmp(data, cipher, sizeof(cipher)) != 0) {
+			local_error_count++;
+			printf("chacha_test_chacha20(): error - ChaCha20 encryption failed (engine %d)\n", ck.engine);
+			IPSEC_DUMP_BUFFER("   output  : ", data, 0, sizeof(data));
+		}
+	}
+	cipher_chacha_set_engine(previous) ;
+
+	return local_error_count;
+}
+
+
+/**
+ * Tests ChaCha20-Poly1305 with the vector of RFC 8439 (2.8.2), decrypts it on a chain of buffers and
+ * compares the engines on a buffer of 1000 bytes
+ * 3 tests are performed here.
+ * @return int number of tests failed in this function
+ */
+int chacha_test_chacha_poly(void) 
+{
+	unsigned char nonce[12]				= { 0x07,0x00,0x00,0x00,0x40,0x41,0x42,0x43,0x44,0x45,0x46,0x47 } ;
+	unsigned char aad[12]				= { 0x50,0x51,0x52,0x53,0xc0,0xc1,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7 } ;
+	const unsigned char cipher[114]		= { 0xd3,0x1a,0x8d,0x34,0x64,0x8e,0x60,0xdb,0x7b,0x86,0xaf,0xbc,0x53,0xef,0x7e,0xc2,
+											0xa4,0xad,0xed,0x51,0x29,0x6e,0x08,0xfe,0xa9,0xe2,0xb5,0xa7,0x36,0xee,0x62,0xd6,
+											0x3d,0xbe,0xa4,0x5e,0x8c,0xa9,0x67,0x12,0x82,0xfa,0xfb,0x69,0xda,0x92,0x72,0x8b,
+											0x1a,0x71,0xde,0x0a,0x9e,0x06,0x0b,0x29,0x05,0xd6,0xa5,0xb6,0x7e,0xcd,0x3b,0x36,
+											0x92,0xdd,0xbd,0x7f,0x2d,0x77,0x8b,0x8c,0x98,0x03,0xae,0xe3,0x28,0x09,0x1b,0x58,
+											0xfa,0xb3,0x24,0xe4,0xfa,0xd6,0x75,0x94,0x55,0x85,0x80,0x8b,0x48,0x31,0xd7,0xbc,
+											0x3f,0xf4,0xde,0xf0,0x8e,0x4b,0x7a,0x9d,0xe5,0x76,0xd2,0x65,0x86,0xce,0xc6,0x4b,
+											0x61,0x16 } ;
+	const unsigned char tag_ok[16]		= { 0x1a,0xe1,0x0b,0x59,0x4f,0x09,0xe2,0x6a,0x7e,0x90,0x2e,0xcb,0xd0,0x60,0x06,0x91 } ;
+	static unsigned char long_plain[1000] ;
+	static unsigned char long_cipher[1000] ;
+	static unsigned char long_data[1000] ;
+	unsigned char long_tag[16] ;
+	unsigned char key[32] ;
+	unsigned char data[114] ;
+	unsigned char tag[16] ;
+	ipsec_buffer segments[2] ;
+	chacha_key ck ;
+	int local_error_count = 0;
+	int previous ;
+	int engine ;
+	int i ;
+
+	for(i = 0; i < (int)sizeof(key); i++)
+		key[i] = (unsigned char)(0x80+i) ;
+
+	cipher_chacha_set_key(key, &ck) ;
+	cipher_chacha_poly(chacha_test_plain, sizeof(data), &ck, nonce, aad, sizeof(aad), CHACHA_ENCRYPT, data, tag) ;
+	if((memcmp(data, cipher, sizeof(cipher)) != 0) || (memcmp(tag, tag_ok, sizeof(tag)) != 0)) {
+		local_error_count++;
+		printf("chacha_test_chacha_poly(): error - ChaCha20-Poly1305 encryption failed (engine %d)\n", ck.engine);
+		IPSEC_DUMP_BUFFER("   tag     : ", tag, 0, sizeof(tag));
+	}
+
+	/* the 1st block spans both segments */
+	segments[0].next = &segments[1] ;
+	segments[0].data = data ;
+	segments[0].len = 50 ;
+	segments[1].next = NULL ;
+	segments[1].data = data + 50 ;
+	segments[1].len = sizeof(data) - 50 ;
+	cipher_chacha_poly_chain(segments, 0, sizeof(data), &ck, nonce, aad, sizeof(aad), CHACHA_DECRYPT, tag) ;
+	if((memcmp(data, chacha_test_plain, sizeof(data)) != 0) || (memcmp(tag, tag_ok, sizeof(tag)) != 0)) {
+		local_error_count++;
+		printf("chacha_test_chacha_poly(): error - ChaCha20-Poly1305 decryption failed (engine %d)\n", ck.engine);
+	}
+
+	/* all engines must give the same result as the portable one */
+	for(i = 0; i < (int)sizeof(long_plain); i++)
+		long_plain[i] = (unsigned char)(i*7) ;
+	previous = cipher_chacha_set_engine(CIPHER_CHACHA_PORTABLE) ;
+	cipher_chacha_set_key(key, &ck) ;
+	cipher_chacha_poly(long_plain, sizeof(long_plain), &ck, nonce, aad, sizeof(aad), CHACHA_ENCRYPT, long_cipher, long_tag) ;
+	for(engine = CIPHER_CHACHA_SSE2; engine <= CIPHER_CHACHA_AVX2; engine++)
+	{
+		cipher_chacha_set_engine(engine) ;
+		cipher_chacha_set_key(key, &ck) ;
+		cipher_chacha_poly(long_plain, sizeof(long_plain), &ck, nonce, aad, sizeof(aad), CHACHA_ENCRYPT, long_data, tag) ;
+		if((memcmp(long_data, long_cipher, sizeof(long_data)) != 0) || (memcmp(tag, long_tag, sizeof(tag)) != 0)) {
+			local_error_count++;
+			printf("chacha_test_chacha_poly(): error - engine %d differs from the portable engine\n", ck.engine);
+			break ;
+		}
+	}
+	cipher_chacha_set_engine(previous) ;
+
+	return local_error_count;
+}
+
+
+/**
+ * Main test function for the ChaCha20 tests.
+ * It does nothing but calling the subtests one after the other.
+ */
+void chacha_test(test_result *global_results)
+{
+	test_result 	sub_results	= {
+						  6,
+						  2,
+						  0,
+						  0, 
+					};
+
+	int retcode;
+
+	retcode = chacha_test_chacha20();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "chacha_test_chacha20()", ("RFC 8439, 2.4.2"));
+
+	retcode = chacha_test_chacha_poly();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "chacha_test_chacha_poly()", ("RFC 8439, 2.8.2"));
+
+	global_results->tests += sub_results.tests;
+	global_results->functions += sub_results.functions;
+	global_results->errors += sub_results.errors;
+	global_results->notimplemented += sub_results.notimplemented;
+}
@@ -0,0 +1,193 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file chksum_test.c
+ *  @brief Test functions for the Internet checksum
+ *
+ *  <B>OUTLINE:</B>
+ *
+ *  This file contains test functions used to verify the full and the incremental checksums.
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *
+ *  The sums of buffers of all lengths up to an Ethernet MTU at all alignments are compared 
+ *  with a sum of one 16 bit word at a time (RFC 1071), so the wide words, the SSE2 blocks and the 
+ *  odd bytes at the end are covered. The incremental updates are compared with a full checksum 
+ *  of the changed header and with the -0 example of RFC 1624.
+ *
+ *  <B>NOTES:</B>
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/util.h"
+#include "ipsec/chksum.h"
+#include "ipsec/debug.h"
+#include "testing/structural/structural_test.h"
+
+
+#define CHKSUM_TEST_SIZE	(1500)		/**< size of the largest buffer summed (an Ethernet MTU, so the SSE2 blocks are covered at all lengths and alignments) */
+
+static unsigned char chksum_test_buffer[CHKSUM_TEST_SIZE+4] ;
+
+/** IP header of enc_esp_packet1 (esp_test.c) with its checksum 0x9E90 */
+static unsigned char chksum_test_header[20] =
+{
+	0x45, 0x00, 0x01, 0xE4, 
+	0x56, 0xDC, 0x00, 0x00, 
+	0x40, 0x32, 0x9E, 0x90, 
+	0xC0, 0xA8, 0x01, 0x03,
+	0xC0, 0xA8, 0x01, 0x28
+} ;
+
+
+/**
+ * Reference checksum: one 16 bit word after the other (RFC 1071, 4.1).
+ */
+static __u16 chksum_test_reference(unsigned char *data, int len)
+{
+	__u32 sum = 0 ;
+
+	for(; len > 1; len -= 2, data += 2)
+		sum += ((__u32)data[0] << 8) | data[1] ;
+	if(len == 1)
+		sum += (__u32)data[0] << 8 ;
+	while(sum >> 16)
+		sum = (sum >> 16) + (sum & 0xffff) ;
+	return ipsec_htons((__u16)~sum) ;
+}
+
+/**
+ * Checks the full checksum: a known IP header and buffers of all lengths and alignments.
+ * 2 tests 
+ */
+int chksum_test_sum(void)
+{
+	int 	local_error_count = 0 ;
+	int		len, align, i ;
+	int		errors = 0 ;
+	__u16	stored ;
+
+	memcpy(&stored, &chksum_test_header[10], 2) ;
+	memset(&chksum_test_header[10], 0, 2) ;
+	if(ipsec_ip_chksum(chksum_test_header, 20) != stored)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("chksum_test_sum", "FAILURE", ("wrong checksum of the IP header (%04x)", ipsec_ip_chksum(chksum_test_header, 20))) ;
+	}
+	memcpy(&chksum_test_header[10], &stored, 2) ;
+
+	for(i = 0; i < CHKSUM_TEST_SIZE+4; i++)
+		chksum_test_buffer[i] = (unsigned char)(0xFF - i*7) ;
+	for(align = 0; align < 4; align++)
+		for(len = 0; len <= CHKSUM_TEST_SIZE; len++)
+			if(ipsec_ip_chksum(chksum_test_buffer + align, (__u16)len) != chksum_test_reference(chksum_test_buffer + align, len))
+				errors++ ;
+	/* a sum can be continued after an even number of bytes */
+	if((__u16)~ipsec_chksum_fold(ipsec_chksum_add(chksum_test_buffer + 100, 177, ipsec_chksum_add(chksum_test_buffer, 100, 0))) != 
+	   chksum_test_reference(chksum_test_buffer, 277))
+		errors++ ;
+	if(errors != 0)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("chksum_test_sum", "FAILURE", ("%d buffers have a wrong checksum", errors)) ;
+	}
+
+	return local_error_count ;
+}
+
+/**
+ * Checks the incremental updates: RFC 1624, 4 and TTL, length and ID of an IP header.
+ * 2 tests 
+ */
+int chksum_test_update(void)
+{
+	int 				local_error_count = 0 ;
+	int					errors = 0 ;
+	int					ttl ;
+	ipsec_ip_header		header ;
+
+	/* RFC 1624, 4: the sum of the other words is 0xCD7A, the word 0x5555 becomes 0x3285 */
+	if((ipsec_chksum_adjust(0xDD2F, 0x5555, 0x3285) != 0x0000) || (ipsec_chksum_adjust(0x0000, 0x3285, 0x5555) != 0xDD2F))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("chksum_test_update", "FAILURE", ("RFC 1624 example failed (%04x)", ipsec_chksum_adjust(0xDD2F, 0x5555, 0x3285))) ;
+	}
+
+	memcpy(&header, chksum_test_header, 20) ;
+	for(ttl = 255; ttl > 0; ttl--)
+	{
+		header.ttl = (__u8)ttl ;
+		header.chksum = 0 ;
+		header.chksum = ipsec_ip_chksum(&header, 20) ;
+		ipsec_ip_dec_ttl(&header) ;
+		ipsec_ip_set_word(&header, &header.len, ipsec_htons((__u16)(ttl*5))) ;
+		ipsec_ip_set_word(&header, &header.id, ipsec_htons((__u16)(ttl*257))) ;
+		if((header.ttl != ttl-1) || (ipsec_ip_chksum(&header, 20) != 0))
+			errors++ ;
+	}
+	if(errors != 0)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("chksum_test_update", "FAILURE", ("%d headers have a wrong checksum after the update", errors)) ;
+	}
+
+	return local_error_count ;
+}
+
+
+/**
+ * Main test function for the checksum tests.
+ * It does nothing but calling the subtests one after the other.
+ */
+void chksum_test(test_result *global_results)
+{
+	test_result 	sub_results	= {
+						  4, 			
+						  2,			
+						  0, 			
+						  0, 			
+					};
+	int retcode;
+
+	retcode = chksum_test_sum();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "chksum_test_sum()", ("IP header and RFC 1071"));
+
+	retcode = chksum_test_update();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "chksum_test_update()", ("RFC 1624"));
+
+	global_results->tests += sub_results.tests;
+	global_results->functions += sub_results.functions;
+	global_results->errors += sub_results.errors;
+	global_results->notimplemented += sub_results.notimplemented;
+}
@@ -211,6 +211,124 @@ int des_test_des_ede3_cbc_encrypt(void)
 }
 
 
+/**
+ * Tests the 3DES-CBC functions which use pre-expanded key schedules
+ * @return int number of tests failed in this function
+ */
+int des_test_cipher_3des_cbc_ks(void) 
+{
+	unsigned char _3des_key[8*3]		= { 0x01,0x23,0x45,0x67,0x01,0x23,0x45,0x67,0x01,0x23,0x45,0x67,0x01,0x23,0x45,0x67,0x01,0x23,0x45,0x67,0x01,0x23,0x45,0x67 };
+	unsigned char parityerror_key[8*3]	= { 0x01,0x23,0x45,0x67,0x01,0x23,0x45,0x67,0x01,0x23,0x45,0x67,0x03,0x23,0x45,0x67,0x01,0x23,0x45,0x67,0x01,0x23,0x45,0x67 };
+	const unsigned char iv_orig[8]		= { 0xD4,0xDB,0xAB,0x9A,0x9A,0xDB,0xD1,0x94 };
+	unsigned char iv[8] ;
+	unsigned char plain[64] ;
+	unsigned char cipher_expected[64] ;
+	unsigned char cipher_result[64] ;
+	DES_key_schedule ks[3] ;
+	int local_error_count = 0;
+	int ret_val;
+	int i;
+
+	for(i = 0; i < (int)sizeof(plain); i++)
+		plain[i] = (unsigned char)i ;
+
+	/* reference: key schedules are set up by cipher_3des_cbc() */
+	memcpy(iv, iv_orig, sizeof(iv)) ;
+	cipher_3des_cbc(plain, sizeof(plain), _3des_key, iv, DES_ENCRYPT, cipher_expected) ;
+
+	ret_val = cipher_3des_set_key(_3des_key, ks) ;
+	memcpy(iv, iv_orig, sizeof(iv)) ;
+	cipher_3des_cbc_ks(plain, sizeof(plain), ks, iv, DES_ENCRYPT, cipher_result) ;
+	if((ret_val != 0) || (memcmp(cipher_result, cipher_expected, sizeof(cipher_result)) != 0)) {
+		local_error_count++;
+		printf("des_test_cipher_3des_cbc_ks(): error - cipher_3des_cbc_ks() did not encrypt like cipher_3des_cbc() - ret_val = %d\n", ret_val);
+	}
+
+	memcpy(iv, iv_orig, sizeof(iv)) ;
+	cipher_3des_cbc_ks(cipher_result, sizeof(cipher_result), ks, iv, DES_DECRYPT, cipher_result) ;
+	if(memcmp(cipher_result, plain, sizeof(plain)) != 0) {
+		local_error_count++;
+		printf("des_test_cipher_3des_cbc_ks(): error - cipher_3des_cbc_ks() could not decrypt its own output\n");
+	}
+
+	ret_val = cipher_3des_set_key(parityerror_key, ks) ;
+	if(ret_val != -1) {
+		local_error_count++;
+		printf("des_test_cipher_3des_cbc_ks(): error - cipher_3des_set_key(parityerror_key) accepted key with parity error - ret_val = %d\n", ret_val);
+	}
+
+	return local_error_count;
+}
+
+
+/**
+ * Tests that the interleaved 3DES engine produces the same output as the serial one
+ * @return int number of tests failed in this function
+ */
+int des_test_cipher_3des_engines(void) 
+{
+	unsigned char key1[8*3]			= { 0x01,0x23,0x45,0x67,0x01,0x23,0x45,0x67,0x01,0x23,0x45,0x67,0x01,0x23,0x45,0x67,0x01,0x23,0x45,0x67,0x01,0x23,0x45,0x67 };
+	unsigned char key2[8*3]			= { 0x01,0x23,0x45,0x67,0x89,0xAB,0xCD,0xEF,0x23,0x45,0x67,0x89,0xAB,0xCD,0xEF,0x01,0x45,0x67,0x89,0xAB,0xCD,0xEF,0x01,0x23 };
+	const unsigned char iv_orig[8]	= { 0xD4,0xDB,0xAB,0x9A,0x9A,0xDB,0xD1,0x94 };
+	const int len[3]				= { 64, 40, 24 } ;
+	unsigned char plain[64] ;
+	unsigned char expected[3][64] ;
+	unsigned char result[3][64] ;
+	unsigned char iv_expected[3][8] ;
+	unsigned char iv[3][8] ;
+	DES_key_schedule ks1[3] ;
+	DES_key_schedule ks2[3] ;
+	cipher_3des_stream streams[3] ;
+	int local_error_count = 0;
+	int previous ;
+	int i;
+
+	for(i = 0; i < (int)sizeof(plain); i++)
+		plain[i] = (unsigned char)(i*7) ;
+
+	cipher_3des_set_key(key1, ks1) ;
+	cipher_3des_set_key(key2, ks2) ;
+
+	/* reference: every buffer on its own with the serial engine */
+	previous = cipher_3des_set_engine(CIPHER_3DES_SERIAL) ;
+	for(i = 0; i < 3; i++)
+	{
+		memcpy(iv_expected[i], iv_orig, 8) ;
+		cipher_3des_cbc_ks(plain, len[i], (i == 1) ? ks2 : ks1, iv_expected[i], DES_ENCRYPT, expected[i]) ;
+	}
+
+	/* three buffers with different lengths and keys: the first two are interleaved */
+	cipher_3des_set_engine(CIPHER_3DES_INTERLEAVED) ;
+	for(i = 0; i < 3; i++)
+	{
+		memcpy(iv[i], iv_orig, 8) ;
+		streams[i].text = plain ;
+		streams[i].output = result[i] ;
+		streams[i].len = len[i] ;
+		streams[i].ks = (i == 1) ? ks2 : ks1 ;
+		streams[i].iv = iv[i] ;
+	}
+	cipher_3des_cbc_multi(streams, 3, DES_ENCRYPT) ;
+	for(i = 0; i < 3; i++)
+	{
+		if((memcmp(result[i], expected[i], len[i]) != 0) || (memcmp(iv[i], iv_expected[i], 8) != 0)) {
+			local_error_count++;
+			printf("des_test_cipher_3des_engines(): error - cipher_3des_cbc_multi() did not encrypt buffer %d like cipher_3des_cbc_ks()\n", i);
+		}
+	}
+
+	/* in place decryption of an odd number of blocks */
+	memcpy(iv[0], iv_orig, 8) ;
+	cipher_3des_cbc_ks(expected[0], 56, ks1, iv[0], DES_DECRYPT, expected[0]) ;
+	cipher_3des_set_engine(previous) ;
+	if((memcmp(expected[0], plain, 56) != 0) || (memcmp(iv[0], &result[0][48], 8) != 0)) {
+		local_error_count++;
+		printf("des_test_cipher_3des_engines(): error - interleaved engine could not decrypt an odd number of blocks\n");
+	}
+
+	return local_error_count;
+}
+
 
 /**
  * Main test function for the DES/3DES CBC tests.
@@ -219,8 +337,8 @@ int des_test_des_ede3_cbc_encrypt(void)
 void des_test(test_result *global_results)
 {
 	test_result 	sub_results	= {
-						  5,
-						  2,
+						 12,
+						  4,
 						  0,
 						  0, 
 					};
@@ -233,6 +351,12 @@ void des_test(test_result *global_results)
 	retcode = des_test_des_ede3_cbc_encrypt();
 	IPSEC_TESTING_EVALUATE(retcode, sub_results, "des_test_des_ede3_cbc_encrypt()", ("ported from openssl.org"));
 
+	retcode = des_test_cipher_3des_cbc_ks();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "des_test_cipher_3des_cbc_ks()", (" "));
+
+	retcode = des_test_cipher_3des_engines();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "des_test_cipher_3des_engines()", (" "));
+
 	global_results->tests += sub_results.tests;
 	global_results->functions += sub_results.functions;
 	global_results->errors += sub_results.errors;
@@ -52,6 +52,7 @@
 #include "testing/structural/structural_test.h"
 
 #include "ipsec/sa.h"
+#include "ipsec/des.h"
 #include "ipsec/esp.h"
 
 
@@ -191,22 +192,35 @@ unsigned char dec_esp_packet2[64] =
 } ;
 
 unsigned char esp_packet_tmp [500] ;
+unsigned char esp_chain_tmp [700] ;
+unsigned char esp_batch_tmp [3][500] ;
+unsigned char esp_hmac_batch_tmp [6][200] ;
+unsigned char esp_stitch_tmp [1400] ;
+void *esp_test_arena[IPSEC_DB_ARENA_SIZE(2, 2)/sizeof(void *)+1] ;
 
 sad_entry packet1_sa = { 	SAD_ENTRY(	192,168,1,40, 255,255,255,255, 
 							0x001006, 
 							IPSEC_PROTO_ESP, IPSEC_TUNNEL, 
 							IPSEC_3DES, 
-							0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 
+							0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
 							0,  
-							0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)} ;
+							0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)} ;
 
 sad_entry packet2_sa = { 	SAD_ENTRY(	192,168,1,3, 255,255,255,255, 
 							0x001006, 
 							IPSEC_PROTO_ESP, IPSEC_TUNNEL, 
 							IPSEC_3DES, 
-							0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 
+							0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
 							0,  
-							0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)} ;
+							0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)} ;
+
+sad_entry chain_sa = { 	SAD_ENTRY(	192,168,1,40, 255,255,255,255, 
+							0x001007, 
+							IPSEC_PROTO_ESP, IPSEC_TUNNEL, 
+							IPSEC_3DES, 
+							0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
+							IPSEC_HMAC_SHA1,  
+							0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)} ;
 
 /**
  * Check if ESP decapsulation works (used for IPsec inbound processing).
@@ -282,11 +296,18 @@ int test_esp_encapsulate(void)
 	int			cmp_len ;
 	char		*cmp_buffer_result ;
 	char 		*cmp_buffer_expected ;
+	unsigned char zero_iv[IPSEC_ESP_IV_SIZE] ;
 	sad_entry	*sa ;
 
 	memset(esp_packet_tmp, 0, 500) ;
 	memcpy(&esp_packet_tmp[40], dec_esp_packet1, 441) ;
 	sa = &packet1_sa ;
+	/* the expected packet carries sequence number 2 */
+	sa->sequence_number = 1 ;
+	/* and the IV D4 DB AB 9A 9A DB D1 94: the IV salt is set to the decrypted IV XOR the sequence number */
+	memset(zero_iv, 0, IPSEC_ESP_IV_SIZE) ;
+	cipher_3des_cbc_ks(&enc_esp_packet1[28], IPSEC_ESP_IV_SIZE, sa->enc_ctx.des, zero_iv, DES_DECRYPT, sa->iv_salt) ;
+	sa->iv_salt[7] ^= 2 ;
 
 	ipsec_esp_encapsulate((ipsec_ip_header*)&esp_packet_tmp[40], &offset, &len, sa, ipsec_inet_addr("192.168.1.3"), ipsec_inet_addr("192.168.1.40")) ;
 	
@@ -347,6 +368,552 @@ int test_esp_encapsulate(void)
 	return local_error_count ;
 }
 
+/**
+ * Checks if the room advertised by ipsec_esp_get_overhead() is enough for ESP encapsulation
+ * 2 tests 
+ */
+int test_esp_get_overhead(void)
+{
+	int 		local_error_count = 0 ;
+	int			offset, len ;
+	int			headroom, tailroom ;
+	sad_entry	*sa ;
+
+	sa = &packet1_sa ;
+	ipsec_esp_get_overhead(sa, &headroom, &tailroom) ;
+	if((headroom != 36) || (tailroom != 9))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_get_overhead", "FAILURE", ("wrong overhead for ESP without authentication (%d/%d)", headroom, tailroom)) ;
+	}
+
+	memset(esp_packet_tmp, 0, 500) ;
+	memcpy(&esp_packet_tmp[headroom], dec_esp_packet2, 60) ;
+	ipsec_esp_encapsulate((ipsec_ip_header*)&esp_packet_tmp[headroom], &offset, &len, sa, ipsec_inet_addr("192.168.1.40"), ipsec_inet_addr("102.168.1.3")) ;
+	if((-offset > headroom) || (len + offset > 60 + tailroom))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_get_overhead", "FAILURE", ("encapsulation used more room than advertised (offset = %d, len = %d)", offset, len)) ;
+	}
+
+	return local_error_count ;
+}
+
+
+/**
+ * Checks if ESP works on packets which are split into several buffers at odd (not block aligned) offsets
+ * 4 tests 
+ */
+int test_esp_chain(void)
+{
+	int 			local_error_count = 0 ;
+	int				offset, len ;
+	int				chain_offset, chain_len ;
+	__u32			sequence_number ;
+	ipsec_buffer	segments[3] ;
+	sad_entry		*sa ;
+
+	/* decapsulate packet 1 stored in 3 segments (40, 101 and 343 bytes) */
+	memset(esp_chain_tmp, 0, 700) ;
+	memcpy(&esp_chain_tmp[0], enc_esp_packet1, 40) ;
+	memcpy(&esp_chain_tmp[100], &enc_esp_packet1[40], 101) ;
+	memcpy(&esp_chain_tmp[300], &enc_esp_packet1[141], 343) ;
+	segments[0].next = &segments[1] ; segments[0].data = &esp_chain_tmp[0] ; 	segments[0].len = 40 ;
+	segments[1].next = &segments[2] ; segments[1].data = &esp_chain_tmp[100] ; 	segments[1].len = 101 ;
+	segments[2].next = NULL ; 		  segments[2].data = &esp_chain_tmp[300] ; 	segments[2].len = 343 ;
+	sa = &packet1_sa ;
+
+	if((ipsec_esp_decapsulate_chain(segments, &offset, &len, sa) != IPSEC_STATUS_SUCCESS) || (offset != 36) || (len != 441))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_chain", "FAILURE", ("decapsulation of a chain failed (offset = %d, len = %d)", offset, len)) ;
+	}
+
+	memset(esp_packet_tmp, 0, 500) ;
+	ipsec_buffer_copy_out(segments, 36, 441, esp_packet_tmp) ;
+	if(memcmp(esp_packet_tmp, dec_esp_packet1, 441) != 0)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_chain", "FAILURE", ("chain was not decrypted properly")) ;
+	}
+
+	/* encapsulate packet 1 stored in 3 segments (45, 100 and 296 bytes) and compare it with the contiguous result */
+	sa = &chain_sa ;
+	sequence_number = sa->sequence_number ;
+	memset(esp_packet_tmp, 0, 500) ;
+	memcpy(&esp_packet_tmp[40], dec_esp_packet1, 441) ;
+	ipsec_esp_encapsulate((ipsec_ip_header*)&esp_packet_tmp[40], &offset, &len, sa, ipsec_inet_addr("192.168.1.3"), ipsec_inet_addr("192.168.1.40")) ;
+
+	sa->sequence_number = sequence_number ;
+	memset(esp_chain_tmp, 0, 700) ;
+	memcpy(&esp_chain_tmp[40], dec_esp_packet1, 45) ;
+	memcpy(&esp_chain_tmp[200], &dec_esp_packet1[45], 100) ;
+	memcpy(&esp_chain_tmp[380], &dec_esp_packet1[145], 296) ;
+	segments[0].next = &segments[1] ; segments[0].data = &esp_chain_tmp[40] ; 	segments[0].len = 45 ;
+	segments[1].next = &segments[2] ; segments[1].data = &esp_chain_tmp[200] ; 	segments[1].len = 100 ;
+	segments[2].next = NULL ; 		  segments[2].data = &esp_chain_tmp[380] ; 	segments[2].len = 296 ;
+	ipsec_esp_encapsulate_chain(segments, &chain_offset, &chain_len, sa, ipsec_inet_addr("192.168.1.3"), ipsec_inet_addr("192.168.1.40"), 0) ;
+
+	if((chain_offset != offset) || (chain_len != len) || (ipsec_buffer_len(segments) != len + offset) || 
+	   (memcmp(&esp_chain_tmp[40+chain_offset], &esp_packet_tmp[40+offset], 45-offset) != 0) ||
+	   (memcmp(&esp_chain_tmp[200], &esp_packet_tmp[40+45], 100) != 0) ||
+	   (memcmp(&esp_chain_tmp[380], &esp_packet_tmp[40+145], len+offset-145) != 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_chain", "FAILURE", ("encapsulation of a chain differs from the contiguous one (offset = %d, len = %d)", chain_offset, chain_len)) ;
+	}
+
+	/* the encapsulated chain must pass the inbound processing (including the ICV check) */
+	memset(esp_packet_tmp, 0, 500) ;
+	memcpy(esp_packet_tmp, &esp_chain_tmp[40+chain_offset], 45-chain_offset) ;
+	ipsec_buffer_copy_out(&segments[1], 0, chain_len-(45-chain_offset), &esp_packet_tmp[45-chain_offset]) ;
+	if((ipsec_esp_decapsulate((ipsec_ip_header*)esp_packet_tmp, &offset, &len, sa) != IPSEC_STATUS_SUCCESS) || 
+	   (len != 441) || (memcmp(&esp_packet_tmp[offset], dec_esp_packet1, 441) != 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_chain", "FAILURE", ("encapsulated chain was not accepted by ipsec_esp_decapsulate()")) ;
+	}
+
+	return local_error_count ;
+}
+
+
+/**
+ * Checks if ipsec_input_batch() processes the packets of a batch grouped by SA and returns a status per packet
+ * 4 tests 
+ */
+int test_esp_batch(void)
+{
+	int 			local_error_count = 0 ;
+	int				i, processed ;
+	db_set_netif	*databases ;
+	sad_entry		*sa ;
+	spd_entry		*spd ;
+	ipsec_buffer	segments[3] ;
+	ipsec_packet	packets[3] ;
+
+	databases = ipsec_spd_create_dbs(esp_test_arena, sizeof(esp_test_arena), 2, 2) ;
+	if(databases == NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_batch", "FAILURE", ("unable to create the databases")) ;
+		return local_error_count ;
+	}
+	sa = ipsec_sad_add(&packet1_sa, &databases->inbound_sad) ;
+	spd = ipsec_spd_add(ipsec_inet_addr("192.168.1.3"), ipsec_inet_addr("255.255.255.255"), 
+						ipsec_inet_addr("192.168.1.40"), ipsec_inet_addr("255.255.255.255"), 
+						IPSEC_PROTO_TCP, 0, 0, POLICY_APPLY, &databases->inbound_spd) ;
+	ipsec_spd_add_sa(spd, sa) ;
+
+	/* packet 1, a packet with an unknown SPI and packet 1 again (no replay check without authentication) */
+	for(i = 0; i < 3; i++)
+	{
+		memcpy(esp_batch_tmp[i], enc_esp_packet1, 484) ;
+		segments[i].next = NULL ;
+		segments[i].data = esp_batch_tmp[i] ;
+		segments[i].len = 484 ;
+		packets[i].chain = &segments[i] ;
+	}
+	esp_batch_tmp[1][23] = 0x07 ;
+
+	processed = ipsec_input_batch(packets, 3, databases) ;
+
+	if(processed != 2)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_batch", "FAILURE", ("%d packets processed instead of 2", processed)) ;
+	}
+
+	if((packets[0].status != IPSEC_STATUS_SUCCESS) || (packets[0].payload_offset != 36) || (packets[0].payload_size != 441) ||
+	   (memcmp(&esp_batch_tmp[0][36], dec_esp_packet1, 441) != 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_batch", "FAILURE", ("1st packet was not decrypted properly (status = %d)", packets[0].status)) ;
+	}
+
+	if(packets[1].status != IPSEC_STATUS_FAILURE)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_batch", "FAILURE", ("packet with an unknown SPI was not rejected (status = %d)", packets[1].status)) ;
+	}
+
+	if((packets[2].status != IPSEC_STATUS_SUCCESS) || (memcmp(&esp_batch_tmp[2][36], dec_esp_packet1, 441) != 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_batch", "FAILURE", ("3rd packet was not decrypted properly (status = %d)", packets[2].status)) ;
+	}
+
+	ipsec_spd_release_dbs(databases) ;
+
+	return local_error_count ;
+}
+
+
+/**
+ * Checks if ipsec_esp_encapsulate_batch() encrypts the packets of a 3DES-CBC SA like ipsec_esp_encapsulate_chain()
+ * 3 tests 
+ */
+int test_esp_encapsulate_batch(void)
+{
+	int 			local_error_count = 0 ;
+	int				i, offset, len ;
+	__u32			sequence ;
+	sad_entry		sa ;
+	ipsec_buffer	segments[3] ;
+	ipsec_packet	packets[3] ;
+	ipsec_packet	*batch[3] ;
+
+	memcpy(&sa, &chain_sa, sizeof(sa)) ;
+	ipsec_sad_next_sequence(&sa, 3, &sequence) ;
+
+	/* three copies of packet 1: the first two are encrypted side by side, the third one on its own */
+	for(i = 0; i < 3; i++)
+	{
+		memset(esp_batch_tmp[i], 0, 500) ;
+		memcpy(&esp_batch_tmp[i][40], dec_esp_packet1, 441) ;
+		segments[i].next = NULL ;
+		segments[i].data = &esp_batch_tmp[i][40] ;
+		segments[i].len = 441 ;
+		packets[i].chain = &segments[i] ;
+		batch[i] = &packets[i] ;
+	}
+	ipsec_esp_encapsulate_batch(batch, 3, &sa, ipsec_inet_addr("192.168.1.3"), ipsec_inet_addr("192.168.1.40"), sequence) ;
+
+	for(i = 0; i < 3; i++)
+	{
+		if((packets[i].status != IPSEC_STATUS_SUCCESS) || (packets[i].payload_offset != packets[0].payload_offset) || (packets[i].payload_size != packets[0].payload_size))
+		{
+			local_error_count++ ;
+			IPSEC_LOG_TST("test_esp_encapsulate_batch", "FAILURE", ("packet %d was not encapsulated (status = %d)", i, packets[i].status)) ;
+			return local_error_count ;
+		}
+	}
+
+	/* every packet is the one ipsec_esp_encapsulate_chain() builds with the same sequence number */
+	for(i = 0; i < 3; i++)
+	{
+		memset(esp_packet_tmp, 0, 500) ;
+		memcpy(&esp_packet_tmp[40], dec_esp_packet1, 441) ;
+		segments[0].next = NULL ;
+		segments[0].data = &esp_packet_tmp[40] ;
+		segments[0].len = 441 ;
+		ipsec_esp_encapsulate_chain(segments, &offset, &len, &sa, ipsec_inet_addr("192.168.1.3"), ipsec_inet_addr("192.168.1.40"), sequence + i) ;
+		if((offset != packets[i].payload_offset) || (len != packets[i].payload_size) || 
+		   (memcmp(&esp_packet_tmp[40+offset], &esp_batch_tmp[i][40+offset], len) != 0))
+		{
+			local_error_count++ ;
+			IPSEC_LOG_TST("test_esp_encapsulate_batch", "FAILURE", ("packet %d differs from the one of ipsec_esp_encapsulate_chain()", i)) ;
+			break ;
+		}
+	}
+
+	/* the last packet must pass the inbound processing (including the ICV check) */
+	memcpy(esp_packet_tmp, &esp_batch_tmp[2][40+packets[2].payload_offset], packets[2].payload_size) ;
+	if((ipsec_esp_decapsulate((ipsec_ip_header*)esp_packet_tmp, &offset, &len, &sa) != IPSEC_STATUS_SUCCESS) || 
+	   (len != 441) || (memcmp(&esp_packet_tmp[offset], dec_esp_packet1, 441) != 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_encapsulate_batch", "FAILURE", ("encapsulated packet was not accepted by ipsec_esp_decapsulate()")) ;
+	}
+
+	return local_error_count ;
+}
+
+
+/** one algorithm checked by test_esp_algorithms() */
+typedef struct esp_test_algorithm_struct
+{
+	__u8	enc_alg ;		/**< encryption algorithm (IPSEC_3DES keeps the key of chain_sa) */
+	__u8	auth_alg ;		/**< authentication algorithm (not used by the combined modes) */
+	__u8	key ;			/**< first key byte, byte j of the keys is key + 3*j */
+	int		len ;			/**< expected length of the encapsulated packet 2 */
+	int		tamper ;		/**< position (counted from the end) of a byte which is modified to check that the packet is rejected, 0 for no check */
+} esp_test_algorithm ;
+
+const esp_test_algorithm esp_test_algorithms[] = {
+	{ IPSEC_AES_128_CBC, 		IPSEC_HMAC_SHA1, 	1, 	120, 	0 },
+	{ IPSEC_AES_256_CBC, 		IPSEC_HMAC_SHA1, 	2, 	120, 	0 },
+	{ IPSEC_AES_128_CTR, 		IPSEC_HMAC_SHA1, 	3, 	112, 	0 },
+	{ IPSEC_AES_256_CTR, 		IPSEC_HMAC_SHA1, 	4, 	112, 	0 },
+	{ IPSEC_AES_128_GCM_8, 		IPSEC_HMAC_SHA1, 	5, 	108, 	0 },
+	{ IPSEC_AES_128_GCM_12, 	IPSEC_HMAC_SHA1, 	6, 	112, 	0 },
+	{ IPSEC_AES_128_GCM_16, 	IPSEC_HMAC_SHA1, 	7, 	116, 	0 },
+	{ IPSEC_AES_256_GCM_16, 	IPSEC_HMAC_SHA1, 	8, 	116, 	20 },
+	{ IPSEC_CHACHA20_POLY1305, 	IPSEC_HMAC_SHA1, 	9, 	116, 	20 },
+	{ IPSEC_3DES, 				IPSEC_HMAC_SHA256, 	10, 116, 	0 },
+	{ IPSEC_3DES, 				IPSEC_HMAC_SHA384, 	11, 124, 	0 },
+	{ IPSEC_3DES, 				IPSEC_HMAC_SHA512, 	12, 132, 	40 },
+} ;
+
+
+/**
+ * Encapsulates packet 2 with an algorithm of esp_test_algorithms[] and checks that it is decapsulated 
+ * again (2 tests). With a tamper position, a second packet is modified and must be rejected (1 test).
+ */
+int esp_test_algorithm_row(const esp_test_algorithm *row)
+{
+	int 			local_error_count = 0 ;
+	int				offset, len ;
+	int				headroom, tailroom ;
+	int				j ;
+	sad_entry		sa ;
+
+	memcpy(&sa, &chain_sa, sizeof(sa)) ;
+	sa.enc_alg = row->enc_alg ;
+	sa.auth_alg = row->auth_alg ;
+	if(row->enc_alg != IPSEC_3DES)
+	{
+		for(j = 0; j < IPSEC_MAX_ENCKEY_LEN; j++)
+			sa.enckey[j] = (__u8)(row->key + 3*j) ;
+	}
+	for(j = 0; j < IPSEC_MAX_AUTHKEY_LEN; j++)
+		sa.authkey[j] = (__u8)(row->key + 3*j) ;
+	ipsec_sad_prepare(&sa) ;
+	sa.sequence_number = 0 ;
+
+	ipsec_esp_get_overhead(&sa, &headroom, &tailroom) ;
+	memset(esp_packet_tmp, 0, 500) ;
+	memcpy(&esp_packet_tmp[headroom], dec_esp_packet2, 60) ;
+	if((ipsec_esp_encapsulate((ipsec_ip_header*)&esp_packet_tmp[headroom], &offset, &len, &sa, ipsec_inet_addr("192.168.1.40"), ipsec_inet_addr("192.168.1.3")) != IPSEC_STATUS_SUCCESS) ||
+	   (offset != -headroom) || (len != row->len) || (len + offset > 60 + tailroom) ||
+	   (memcmp(&esp_packet_tmp[headroom], dec_esp_packet2, 16) == 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_algorithms", "FAILURE", ("encapsulation with algorithms %d/%d failed (offset = %d, len = %d)", row->enc_alg, row->auth_alg, offset, len)) ;
+		return local_error_count ;
+	}
+
+	if((ipsec_esp_decapsulate((ipsec_ip_header*)esp_packet_tmp, &offset, &len, &sa) != IPSEC_STATUS_SUCCESS) ||
+	   (offset != headroom) || (len != 60) || (memcmp(&esp_packet_tmp[offset], dec_esp_packet2, 60) != 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_algorithms", "FAILURE", ("decapsulation with algorithms %d/%d failed (offset = %d, len = %d)", row->enc_alg, row->auth_alg, offset, len)) ;
+	}
+
+	if(row->tamper != 0)
+	{
+		memset(esp_packet_tmp, 0, 500) ;
+		memcpy(&esp_packet_tmp[headroom], dec_esp_packet2, 60) ;
+		ipsec_esp_encapsulate((ipsec_ip_header*)&esp_packet_tmp[headroom], &offset, &len, &sa, ipsec_inet_addr("192.168.1.40"), ipsec_inet_addr("192.168.1.3")) ;
+		esp_packet_tmp[len-row->tamper] ^= 0x01 ;
+		if(ipsec_esp_decapsulate((ipsec_ip_header*)esp_packet_tmp, &offset, &len, &sa) != IPSEC_STATUS_FAILURE)
+		{
+			local_error_count++ ;
+			IPSEC_LOG_TST("test_esp_algorithms", "FAILURE", ("modified packet with algorithms %d/%d was not rejected", row->enc_alg, row->auth_alg)) ;
+		}
+	}
+
+	return local_error_count ;
+}
+
+
+/**
+ * Checks every algorithm of esp_test_algorithms[]: AES-CBC and AES-CTR, AES-GCM (8, 12 and 16 byte ICVs, 
+ * the HMAC configured in the SA must not be used), ChaCha20-Poly1305 and HMAC-SHA-256/384/512 (16, 24 
+ * and 32 byte ICVs).
+ * 28 tests 
+ */
+int test_esp_algorithms(void)
+{
+	int 			local_error_count = 0 ;
+	int				i ;
+
+	for(i = 0; i < (int)(sizeof(esp_test_algorithms)/sizeof(esp_test_algorithms[0])); i++)
+		local_error_count += esp_test_algorithm_row(&esp_test_algorithms[i]) ;
+
+	return local_error_count ;
+}
+
+
+/**
+ * Checks if an unknown authentication algorithm is refused before the packet or the SA is changed.
+ * 1 test 
+ */
+int test_esp_unknown_auth(void)
+{
+	int 			local_error_count = 0 ;
+	int				offset, len ;
+	int				headroom, tailroom ;
+	sad_entry		sa ;
+
+	memcpy(&sa, &chain_sa, sizeof(sa)) ;
+	sa.auth_alg = IPSEC_HMAC_SHA512 + 1 ;
+	ipsec_sad_prepare(&sa) ;
+	sa.sequence_number = 7 ;
+
+	ipsec_esp_get_overhead(&sa, &headroom, &tailroom) ;
+	memset(esp_packet_tmp, 0, 500) ;
+	memcpy(&esp_packet_tmp[headroom], dec_esp_packet2, 60) ;
+	if((ipsec_esp_encapsulate((ipsec_ip_header*)&esp_packet_tmp[headroom], &offset, &len, &sa, ipsec_inet_addr("192.168.1.40"), ipsec_inet_addr("192.168.1.3")) != IPSEC_STATUS_FAILURE) ||
+	   (sa.sequence_number != 7) || (memcmp(&esp_packet_tmp[headroom], dec_esp_packet2, 60) != 0) || (esp_packet_tmp[headroom-1] != 0) || (esp_packet_tmp[headroom+60] != 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_esp_unknown_auth", "FAILURE", ("unknown algorithm changed the packet or the sequence number")) ;
+	}
+
+	return local_error_count ;
+}
+
+
+/**
+ * Checks if ipsec_esp_decapsulate_batch() decapsulates a batch of packets authenticated with HMAC-MD5 
+ * and HMAC-SHA1 (one packet split into two segments) and if a modified and a replayed packet are rejected.
+ * 4 tests 
+ */
+int test_esp_hmac_batch(void)
+{
+	int 			local_error_count = 0 ;
+	const __u8		auth_alg[2] = { IPSEC_HMAC_MD5, IPSEC_HMAC_SHA1 } ;
+	const int		expected[6] = { IPSEC_STATUS_SUCCESS, IPSEC_STATUS_SUCCESS, IPSEC_STATUS_FAILURE, IPSEC_STATUS_SUCCESS, IPSEC_STATUS_SUCCESS, IPSEC_AUDIT_SEQ_MISMATCH } ;
+	int				offset, len[6] ;
+	int				headroom, tailroom ;
+	int				i, j ;
+	sad_entry		sa ;
+	ipsec_buffer	segments[7] ;
+	ipsec_packet	packets[6] ;
+	ipsec_packet	*batch[6] ;
+
+	for(i = 0; i < 2; i++)
+	{
+		memcpy(&sa, &chain_sa, sizeof(sa)) ;
+		sa.auth_alg = auth_alg[i] ;
+		ipsec_sad_prepare(&sa) ;
+		sa.sequence_number = 0 ;
+		ipsec_esp_get_overhead(&sa, &headroom, &tailroom) ;
+
+		for(j = 0; j < 5; j++)
+		{
+			memset(esp_hmac_batch_tmp[j], 0, 200) ;
+			memcpy(&esp_hmac_batch_tmp[j][headroom], dec_esp_packet2, 60) ;
+			ipsec_esp_encapsulate((ipsec_ip_header*)&esp_hmac_batch_tmp[j][headroom], &offset, &len[j], &sa, ipsec_inet_addr("192.168.1.40"), ipsec_inet_addr("192.168.1.3")) ;
+		}
+		/* packet 2 is modified, packet 5 is a copy of packet 4 */
+		esp_hmac_batch_tmp[2][len[2]-30] ^= 0x01 ;
+		memcpy(esp_hmac_batch_tmp[5], esp_hmac_batch_tmp[4], 200) ;
+		len[5] = len[4] ;
+
+		for(j = 0; j < 6; j++)
+		{
+			segments[j].next = NULL ;
+			segments[j].data = esp_hmac_batch_tmp[j] ;
+			segments[j].len = len[j] ;
+			packets[j].chain = &segments[j] ;
+			batch[j] = &packets[j] ;
+		}
+		segments[1].len = 70 ;
+		segments[1].next = &segments[6] ;
+		segments[6].next = NULL ;
+		segments[6].data = &esp_hmac_batch_tmp[1][70] ;
+		segments[6].len = len[1] - 70 ;
+
+		ipsec_esp_decapsulate_batch(batch, 6, &sa) ;
+
+		for(j = 0; j < 6; j++)
+			if(packets[j].status != expected[j])
+				break ;
+		if(j != 6)
+		{
+			local_error_count++ ;
+			IPSEC_LOG_TST("test_esp_hmac_batch", "FAILURE", ("packet %d with algorithm %d: status %d instead of %d", j, auth_alg[i], packets[j].status, expected[j])) ;
+		}
+
+		for(j = 0; j < 5; j++)
+			if((j != 2) && ((packets[j].payload_offset != headroom) || (packets[j].payload_size != 60) || 
+			                (memcmp(&esp_hmac_batch_tmp[j][headroom], dec_esp_packet2, 60) != 0)))
+				break ;
+		if(j != 5)
+		{
+			local_error_count++ ;
+			IPSEC_LOG_TST("test_esp_hmac_batch", "FAILURE", ("packet %d with algorithm %d was not decrypted properly", j, auth_alg[i])) ;
+		}
+	}
+
+	return local_error_count ;
+}
+
+
+/**
+ * Checks if the one-pass encryption and authentication of large packets (several pieces of 
+ * IPSEC_ESP_STITCH_SIZE bytes, split into segments at odd offsets) gives the ICV of hmac_xxx_chain() 
+ * over the encrypted packet and if the packets are decapsulated again.
+ * 6 tests 
+ */
+int test_esp_stitch(void)
+{
+	int 			local_error_count = 0 ;
+	const __u8		enc_alg[3] = { IPSEC_3DES, IPSEC_AES_128_CBC, IPSEC_AES_256_CTR } ;
+	const __u8		auth_alg[3] = { IPSEC_HMAC_MD5, IPSEC_HMAC_SHA1, IPSEC_HMAC_SHA256 } ;
+	unsigned char	inner[1200] ;
+	unsigned char	digest[IPSEC_MAX_AUTHKEY_LEN] ;
+	int				offset, len, icv_len ;
+	int				i, j ;
+	ipsec_buffer	segments[3] ;
+	ipsec_buffer	flat ;
+	sad_entry		sa ;
+
+	memcpy(inner, dec_esp_packet2, 20) ;
+	for(j = 20; j < (int)sizeof(inner); j++)
+		inner[j] = (unsigned char)(j*13) ;
+	inner[2] = (unsigned char)(sizeof(inner) >> 8) ;
+	inner[3] = (unsigned char)sizeof(inner) ;
+
+	for(i = 0; i < 3; i++)
+	{
+		memcpy(&sa, &chain_sa, sizeof(sa)) ;
+		sa.enc_alg = enc_alg[i] ;
+		sa.auth_alg = auth_alg[i] ;
+		if(enc_alg[i] != IPSEC_3DES)	/* keep the 3DES key of chain_sa (odd parity) */
+			for(j = 0; j < IPSEC_MAX_ENCKEY_LEN; j++)
+				sa.enckey[j] = (__u8)(j*7+i) ;
+		for(j = 0; j < IPSEC_MAX_AUTHKEY_LEN; j++)
+			sa.authkey[j] = (__u8)(j*3+i) ;
+		ipsec_sad_prepare(&sa) ;
+		sa.sequence_number = 0 ;
+		icv_len = IPSEC_AUTH_ICV_LEN(auth_alg[i]) ;
+
+		/* 1200 bytes in segments of 100, 601 and 499 bytes (contiguous in memory) */
+		memset(esp_stitch_tmp, 0, sizeof(esp_stitch_tmp)) ;
+		memcpy(&esp_stitch_tmp[64], inner, sizeof(inner)) ;
+		segments[0].next = &segments[1] ; segments[0].data = &esp_stitch_tmp[64] ; 	segments[0].len = 100 ;
+		segments[1].next = &segments[2] ; segments[1].data = &esp_stitch_tmp[164] ; segments[1].len = 601 ;
+		segments[2].next = NULL ; 		  segments[2].data = &esp_stitch_tmp[765] ; segments[2].len = 499 ;
+		if(ipsec_esp_encapsulate_chain(segments, &offset, &len, &sa, ipsec_inet_addr("192.168.1.40"), ipsec_inet_addr("192.168.1.3"), 0) != IPSEC_STATUS_SUCCESS)
+		{
+			local_error_count += 2 ;
+			IPSEC_LOG_TST("test_esp_stitch", "FAILURE", ("encapsulation with algorithms %d/%d failed", enc_alg[i], auth_alg[i])) ;
+			continue ;
+		}
+
+		/* the ICV covers the ESP header, the IV and the encrypted payload */
+		flat.next = NULL ;
+		flat.data = &esp_stitch_tmp[64 + offset + IPSEC_MIN_IPHDR_SIZE] ;
+		flat.len = len - IPSEC_MIN_IPHDR_SIZE - icv_len ;
+		if(auth_alg[i] == IPSEC_HMAC_MD5)
+			hmac_md5_chain(&sa.auth_ctx.md5, &flat, 0, flat.len, digest) ;
+		else if(auth_alg[i] == IPSEC_HMAC_SHA1)
+			hmac_sha1_chain(&sa.auth_ctx.sha1, &flat, 0, flat.len, digest) ;
+		else
+			hmac_sha256_chain(&sa.auth_ctx.sha256, &flat, 0, flat.len, digest) ;
+		if((memcmp(&esp_stitch_tmp[64 + offset + len - icv_len], digest, icv_len) != 0) || 
+		   (memcmp(&esp_stitch_tmp[64 + 100], &inner[100], 100) == 0))
+		{
+			local_error_count++ ;
+			IPSEC_LOG_TST("test_esp_stitch", "FAILURE", ("wrong ICV or payload not encrypted with algorithms %d/%d", enc_alg[i], auth_alg[i])) ;
+		}
+
+		segments[0].data += offset ;
+		segments[0].len -= offset ;
+		if((ipsec_esp_decapsulate_chain(segments, &offset, &len, &sa) != IPSEC_STATUS_SUCCESS) || (len != (int)sizeof(inner)) ||
+		   (memcmp(segments[0].data + offset, inner, sizeof(inner)) != 0))
+		{
+			local_error_count++ ;
+			IPSEC_LOG_TST("test_esp_stitch", "FAILURE", ("decapsulation with algorithms %d/%d failed (offset = %d, len = %d)", enc_alg[i], auth_alg[i], offset, len)) ;
+		}
+	}
+
+	return local_error_count ;
+}
+
 
 /**
  * Main test function for the ESP tests.
@@ -355,20 +922,49 @@ int test_esp_encapsulate(void)
 void esp_test(test_result *global_results)
 {
 	test_result 	sub_results	= {
-						 12, 		
-						  2,			
+						 62, 		
+						 10,			
 						  0, 
 						  0, 			
 					};
 
 	int retcode;
 
+	/* the static SAs get their key schedules like ipsec_spd_load_dbs() would set them up */
+	ipsec_sad_prepare(&packet1_sa) ;
+	ipsec_sad_prepare(&packet2_sa) ;
+	ipsec_sad_prepare(&chain_sa) ;
+
 	retcode = test_esp_decapsulate() ;
 	IPSEC_TESTING_EVALUATE(retcode, sub_results, "test_esp_decapsulate", (" "));
 
 	retcode = test_esp_encapsulate() ;
 	IPSEC_TESTING_EVALUATE(retcode, sub_results, "test_esp_encapsulate", (" "));
 
+	retcode = test_esp_get_overhead() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "test_esp_get_overhead", (" "));
+
+	retcode = test_esp_chain() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "test_esp_chain", (" "));
+
+	retcode = test_esp_batch() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "test_esp_batch", (" "));
+
+	retcode = test_esp_encapsulate_batch() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "test_esp_encapsulate_batch", (" "));
+
+	retcode = test_esp_algorithms() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "test_esp_algorithms", (" "));
+
+	retcode = test_esp_unknown_auth() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "test_esp_unknown_auth", (" "));
+
+	retcode = test_esp_hmac_batch() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "test_esp_hmac_batch", (" "));
+
+	retcode = test_esp_stitch() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "test_esp_stitch", (" "));
+
 	global_results->tests += sub_results.tests;
 	global_results->functions += sub_results.functions;
 	global_results->errors += sub_results.errors;
@@ -0,0 +1,196 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file gcm_test.c
+ *  @brief Test functions for AES-GCM
+ *
+ *  <B>OUTLINE:</B>
+ *
+ *  This file contains test functions used to verify the AES-GCM code against the test cases of
+ *  the GCM specification (McGrew/Viega, appendix B).
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *
+ *  The vectors are run with both GHASH engines. If the PCLMULQDQ engine is not available, the
+ *  portable engine is tested twice.
+ *
+ *  <B>NOTES:</B>
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/util.h"
+#include "ipsec/gcm.h"
+#include "ipsec/debug.h"
+#include "testing/structural/structural_test.h"
+
+
+/** key of test cases 4 (AES-128, first 16 bytes) and 16 (AES-256) */
+static unsigned char gcm_test_key[32]		= { 0xfe,0xff,0xe9,0x92,0x86,0x65,0x73,0x1c,0x6d,0x6a,0x8f,0x94,0x67,0x30,0x83,0x08,
+												0xfe,0xff,0xe9,0x92,0x86,0x65,0x73,0x1c,0x6d,0x6a,0x8f,0x94,0x67,0x30,0x83,0x08 } ;
+static unsigned char gcm_test_iv[12]		= { 0xca,0xfe,0xba,0xbe,0xfa,0xce,0xdb,0xad,0xde,0xca,0xf8,0x88 } ;
+static unsigned char gcm_test_aad[20]		= { 0xfe,0xed,0xfa,0xce,0xde,0xad,0xbe,0xef,0xfe,0xed,0xfa,0xce,0xde,0xad,0xbe,0xef,
+												0xab,0xad,0xda,0xd2 } ;
+static unsigned char gcm_test_plain[60]		= { 0xd9,0x31,0x32,0x25,0xf8,0x84,0x06,0xe5,0xa5,0x59,0x09,0xc5,0xaf,0xf5,0x26,0x9a,
+												0x86,0xa7,0xa9,0x53,0x15,0x34,0xf7,0xda,0x2e,0x4c,0x30,0x3d,0x8a,0x31,0x8a,0x72,
+												0x1c,0x3c,0x0c,0x95,0x95,0x68,0x09,0x53,0x2f,0xcf,0x0e,0x24,0x49,0xa6,0xb5,0x25,
+												0xb1,0x6a,0xed,0xf5,0xaa,0x0d,0xe6,0x57,0xba,0x63,0x7b,0x39 } ;
+static unsigned char gcm_test_cipher_128[60] = { 0x42,0x83,0x1e,0xc2,0x21,0x77,0x74,0x24,0x4b,0x72,0x21,0xb7,0x84,0xd0,0xd4,0x9c,
+												0xe3,0xaa,0x21,0x2f,0x2c,0x02,0xa4,0xe0,0x35,0xc1,0x7e,0x23,0x29,0xac,0xa1,0x2e,
+												0x21,0xd5,0x14,0xb2,0x54,0x66,0x93,0x1c,0x7d,0x8f,0x6a,0x5a,0xac,0x84,0xaa,0x05,
+												0x1b,0xa3,0x0b,0x39,0x6a,0x0a,0xac,0x97,0x3d,0x58,0xe0,0x91 } ;
+static unsigned char gcm_test_tag_128[16]	= { 0x5b,0xc9,0x4f,0xbc,0x32,0x21,0xa5,0xdb,0x94,0xfa,0xe9,0x5a,0xe7,0x12,0x1a,0x47 } ;
+static unsigned char gcm_test_cipher_256[60] = { 0x52,0x2d,0xc1,0xf0,0x99,0x56,0x7d,0x07,0xf4,0x7f,0x37,0xa3,0x2a,0x84,0x42,0x7d,
+												0x64,0x3a,0x8c,0xdc,0xbf,0xe5,0xc0,0xc9,0x75,0x98,0xa2,0xbd,0x25,0x55,0xd1,0xaa,
+												0x8c,0xb0,0x8e,0x48,0x59,0x0d,0xbb,0x3d,0xa7,0xb0,0x8b,0x10,0x56,0x82,0x88,0x38,
+												0xc5,0xf6,0x1e,0x63,0x93,0xba,0x7a,0x0a,0xbc,0xc9,0xf6,0x62 } ;
+static unsigned char gcm_test_tag_256[16]	= { 0x76,0xfc,0x6e,0xce,0x0f,0x4e,0x17,0x68,0xcd,0xdf,0x88,0x53,0xbb,0x2d,0x55,0x1b } ;
+
+
+/**
+ * Tests AES-GCM encryption with test cases 4 (AES-128) and 16 (AES-256)
+ * 4 tests are performed here.
+ * @return int number of tests failed in this function
+ */
+int gcm_test_cipher_gcm(void) 
+{
+	unsigned char data[60] ;
+	unsigned char tag[16] ;
+	gcm_key gk ;
+	int local_error_count = 0;
+	int previous ;
+	int engine ;
+
+	previous = cipher_gcm_set_engine(CIPHER_GHASH_PORTABLE) ;
+	for(engine = CIPHER_GHASH_PORTABLE; engine <= CIPHER_GHASH_CLMUL; engine++)
+	{
+		cipher_gcm_set_engine(engine) ;
+
+		cipher_gcm_set_key(gcm_test_key, 16, &gk) ;
+		cipher_gcm(gcm_test_plain, sizeof(data), &gk, gcm_test_iv, gcm_test_aad, sizeof(gcm_test_aad), AES_ENCRYPT, data, tag) ;
+		if((memcmp(data, gcm_test_cipher_128, sizeof(data)) != 0) || (memcmp(tag, gcm_test_tag_128, sizeof(tag)) != 0)) {
+			local_error_count++;
+			printf("gcm_test_cipher_gcm(): error - AES-128-GCM encryption failed (engine %d)\n", gk.engine);
+			IPSEC_DUMP_BUFFER("   tag     : ", tag, 0, sizeof(tag));
+		}
+
+		cipher_gcm_set_key(gcm_test_key, 32, &gk) ;
+		cipher_gcm(gcm_test_plain, sizeof(data), &gk, gcm_test_iv, gcm_test_aad, sizeof(gcm_test_aad), AES_ENCRYPT, data, tag) ;
+		if((memcmp(data, gcm_test_cipher_256, sizeof(data)) != 0) || (memcmp(tag, gcm_test_tag_256, sizeof(tag)) != 0)) {
+			local_error_count++;
+			printf("gcm_test_cipher_gcm(): error - AES-256-GCM encryption failed (engine %d)\n", gk.engine);
+			IPSEC_DUMP_BUFFER("   tag     : ", tag, 0, sizeof(tag));
+		}
+	}
+	cipher_gcm_set_engine(previous) ;
+
+	return local_error_count;
+}
+
+
+/**
+ * Tests AES-GCM decryption of test case 4 on a chain of buffers and test case 2 (no data, no AAD)
+ * 2 tests are performed here.
+ * @return int number of tests failed in this function
+ */
+int gcm_test_cipher_gcm_chain(void) 
+{
+	const unsigned char tag_2[16]	= { 0xab,0x6e,0x47,0xd4,0x2c,0xec,0x13,0xbd,0xf5,0x3a,0x67,0xb2,0x12,0x57,0xbd,0xdf } ;
+	unsigned char zero[16] ;
+	unsigned char block[16] ;
+	unsigned char data[60] ;
+	unsigned char tag[16] ;
+	ipsec_buffer segments[3] ;
+	gcm_key gk ;
+	int local_error_count = 0;
+
+	/* the 1st block spans the 1st and the 2nd segment, the 3rd block the 2nd and the 3rd one */
+	memcpy(data, gcm_test_cipher_128, sizeof(data)) ;
+	segments[0].next = &segments[1] ;
+	segments[0].data = data ;
+	segments[0].len = 7 ;
+	segments[1].next = &segments[2] ;
+	segments[1].data = data + 7 ;
+	segments[1].len = 30 ;
+	segments[2].next = NULL ;
+	segments[2].data = data + 37 ;
+	segments[2].len = sizeof(data) - 37 ;
+
+	cipher_gcm_set_key(gcm_test_key, 16, &gk) ;
+	cipher_gcm_chain(segments, 0, sizeof(data), &gk, gcm_test_iv, gcm_test_aad, sizeof(gcm_test_aad), AES_DECRYPT, tag) ;
+	if((memcmp(data, gcm_test_plain, sizeof(data)) != 0) || (memcmp(tag, gcm_test_tag_128, sizeof(tag)) != 0)) {
+		local_error_count++;
+		printf("gcm_test_cipher_gcm_chain(): error - AES-128-GCM decryption failed\n");
+		IPSEC_DUMP_BUFFER("   output  : ", data, 0, sizeof(data));
+	}
+
+	/* test case 2: one block of zeros with a zero key and IV */
+	memset(zero, 0, sizeof(zero)) ;
+	cipher_gcm_set_key(zero, 16, &gk) ;
+	cipher_gcm(zero, sizeof(block), &gk, zero, NULL, 0, AES_ENCRYPT, block, tag) ;
+	if(memcmp(tag, tag_2, sizeof(tag)) != 0) {
+		local_error_count++;
+		printf("gcm_test_cipher_gcm_chain(): error - AES-128-GCM test case 2 failed\n");
+		IPSEC_DUMP_BUFFER("   tag     : ", tag, 0, sizeof(tag));
+	}
+
+	return local_error_count;
+}
+
+
+/**
+ * Main test function for the AES-GCM tests.
+ * It does nothing but calling the subtests one after the other.
+ */
+void gcm_test(test_result *global_results)
+{
+	test_result 	sub_results	= {
+						  6,
+						  2,
+						  0,
+						  0, 
+					};
+
+	int retcode;
+
+	retcode = gcm_test_cipher_gcm();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "gcm_test_cipher_gcm()", ("test cases 4 and 16"));
+
+	retcode = gcm_test_cipher_gcm_chain();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "gcm_test_cipher_gcm_chain()", ("test cases 4 and 2"));
+
+	global_results->tests += sub_results.tests;
+	global_results->functions += sub_results.functions;
+	global_results->errors += sub_results.errors;
+	global_results->notimplemented += sub_results.notimplemented;
+}
@@ -0,0 +1,240 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file hash_multi_test.c
+ *  @brief Test functions for the multi-buffer HMAC-MD5 and HMAC-SHA1
+ *
+ *  <B>OUTLINE:</B>
+ *
+ *  This file contains test functions used to verify the multi-buffer HMAC code.
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *
+ *  Every engine hashes the RFC 2202 test case 2 together with packets of many lengths (around 
+ *  the padding boundaries of 55/56 and 64 bytes) which are split into segments at different 
+ *  places. The results must be the ones of hmac_md5_chain() and hmac_sha1_chain(). An engine 
+ *  which is not available is replaced by the next slower one.
+ *
+ *  <B>NOTES:</B>
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/util.h"
+#include "ipsec/hash_multi.h"
+#include "ipsec/debug.h"
+#include "testing/structural/structural_test.h"
+
+
+#define HASH_MULTI_TEST_PACKETS	(21)		/**< number of packets hashed at a time (more than the largest number of lanes) */
+#define HASH_MULTI_TEST_SIZE	(300)		/**< size of the largest packet */
+
+static unsigned char hash_multi_test_data[HASH_MULTI_TEST_PACKETS][HASH_MULTI_TEST_SIZE] ;	/**< data of the packets */
+static ipsec_buffer hash_multi_test_seg[HASH_MULTI_TEST_PACKETS][3] ;						/**< every packet is split into three segments */
+static const int hash_multi_test_len[HASH_MULTI_TEST_PACKETS] = 
+	{ 28, 0, 1, 55, 56, 57, 63, 64, 65, 119, 120, 128, 183, 184, 200, 251, 256, 270, 280, 290, 299 } ;
+
+
+/**
+ * Sets up the packets: packet 0 holds RFC 2202 test case 2, the other ones hold pseudo-random data 
+ * which is hashed from an offset of i%5 and split into segments of different sizes.
+ */
+static void hash_multi_test_setup(hmac_multi_stream *streams, void *hctx, int size, unsigned char digest[][20])
+{
+	int i, j, offset, cut1, cut2 ;
+
+	for(i = 0; i < HASH_MULTI_TEST_PACKETS; i++)
+	{
+		for(j = 0; j < HASH_MULTI_TEST_SIZE; j++)
+			hash_multi_test_data[i][j] = (unsigned char)((i*31 + j*7) % 251) ;
+
+		offset = (i == 0) ? 0 : i % 5 ;
+		cut1 = (i*13) % (hash_multi_test_len[i] + offset + 1) ;
+		cut2 = cut1 + (hash_multi_test_len[i] + offset - cut1) / 2 ;
+
+		hash_multi_test_seg[i][0].data = hash_multi_test_data[i] ;
+		hash_multi_test_seg[i][0].len = cut1 ;
+		hash_multi_test_seg[i][0].next = &hash_multi_test_seg[i][1] ;
+		hash_multi_test_seg[i][1].data = hash_multi_test_data[i] + cut1 ;
+		hash_multi_test_seg[i][1].len = cut2 - cut1 ;
+		hash_multi_test_seg[i][1].next = &hash_multi_test_seg[i][2] ;
+		hash_multi_test_seg[i][2].data = hash_multi_test_data[i] + cut2 ;
+		hash_multi_test_seg[i][2].len = HASH_MULTI_TEST_SIZE - cut2 ;
+		hash_multi_test_seg[i][2].next = NULL ;
+
+		streams[i].hctx = (unsigned char *)hctx + i*size ;
+		streams[i].chain = hash_multi_test_seg[i] ;
+		streams[i].offset = offset ;
+		streams[i].len = hash_multi_test_len[i] ;
+		streams[i].digest = digest[i] ;
+	}
+	memcpy(hash_multi_test_data[0], "what do ya want for nothing?", 28) ;
+}
+
+
+/**
+ * Tests hmac_md5_multi() with every engine.
+ * @return int number of tests failed in this function
+ */
+int hash_multi_test_hmac_md5(void)
+{
+	unsigned char 		rfc_digest[16] = { 0x75, 0x0c, 0x78, 0x3e, 0x6a, 0xb0, 0xb5, 0x03, 0xea, 0xa8, 0x6e, 0x31, 0x0a, 0x5d, 0xb7, 0x38 } ;
+	unsigned char		key[16] ;
+	HMAC_MD5_CTX		hctx[HASH_MULTI_TEST_PACKETS] ;
+	hmac_multi_stream	streams[HASH_MULTI_TEST_PACKETS] ;
+	unsigned char		digest[HASH_MULTI_TEST_PACKETS][20] ;
+	unsigned char		expected[16] ;
+	int 				local_error_count = 0 ;
+	int					previous, engine ;
+	int					i ;
+
+	hmac_md5_init(&hctx[0], (unsigned char *)"Jefe", 4) ;
+	for(i = 1; i < HASH_MULTI_TEST_PACKETS; i++)
+	{
+		memset(key, i, sizeof(key)) ;
+		hmac_md5_init(&hctx[i], key, sizeof(key)) ;
+	}
+
+	previous = hash_multi_set_engine(HASH_MULTI_PORTABLE) ;
+	for(engine = HASH_MULTI_PORTABLE; engine <= HASH_MULTI_AVX512; engine++)
+	{
+		hash_multi_set_engine(engine) ;
+		hash_multi_test_setup(streams, hctx, sizeof(HMAC_MD5_CTX), digest) ;
+		hmac_md5_multi(streams, HASH_MULTI_TEST_PACKETS) ;
+
+		if(memcmp(digest[0], rfc_digest, sizeof(rfc_digest)) != 0)
+		{
+			local_error_count++ ;
+			IPSEC_LOG_TST("hash_multi_test_hmac_md5", "FAILURE", ("RFC 2202 test case 2 does not match (engine %d)", engine)) ;
+		}
+
+		for(i = 0; i < HASH_MULTI_TEST_PACKETS; i++)
+		{
+			hmac_md5_chain(&hctx[i], streams[i].chain, streams[i].offset, streams[i].len, expected) ;
+			if(memcmp(digest[i], expected, sizeof(expected)) != 0)
+				break ;
+		}
+		if(i != HASH_MULTI_TEST_PACKETS)
+		{
+			local_error_count++ ;
+			IPSEC_LOG_TST("hash_multi_test_hmac_md5", "FAILURE", ("digest of packet %d (%d bytes) does not match (engine %d)", i, hash_multi_test_len[i], engine)) ;
+		}
+	}
+	hash_multi_set_engine(previous) ;
+
+	return local_error_count ;
+}
+
+
+/**
+ * Tests hmac_sha1_multi() with every engine.
+ * @return int number of tests failed in this function
+ */
+int hash_multi_test_hmac_sha1(void)
+{
+	unsigned char 		rfc_digest[20] = { 0xef, 0xfc, 0xdf, 0x6a, 0xe5, 0xeb, 0x2f, 0xa2, 0xd2, 0x74, 0x16, 0xd5, 0xf1, 0x84, 0xdf, 0x9c, 0x25, 0x9a, 0x7c, 0x79 } ;
+	unsigned char		key[20] ;
+	HMAC_SHA1_CTX		hctx[HASH_MULTI_TEST_PACKETS] ;
+	hmac_multi_stream	streams[HASH_MULTI_TEST_PACKETS] ;
+	unsigned char		digest[HASH_MULTI_TEST_PACKETS][20] ;
+	unsigned char		expected[20] ;
+	int 				local_error_count = 0 ;
+	int					previous, previous_sha1, engine ;
+	int					i ;
+
+	hmac_sha1_init(&hctx[0], (unsigned char *)"Jefe", 4) ;
+	for(i = 1; i < HASH_MULTI_TEST_PACKETS; i++)
+	{
+		memset(key, i, sizeof(key)) ;
+		hmac_sha1_init(&hctx[i], key, sizeof(key)) ;
+	}
+
+	/* with the SHA extensions, only AVX-512 would be used */
+	previous_sha1 = sha1_set_engine(HASH_SHA1_PORTABLE) ;
+	previous = hash_multi_set_engine(HASH_MULTI_PORTABLE) ;
+	for(engine = HASH_MULTI_PORTABLE; engine <= HASH_MULTI_AVX512; engine++)
+	{
+		hash_multi_set_engine(engine) ;
+		hash_multi_test_setup(streams, hctx, sizeof(HMAC_SHA1_CTX), digest) ;
+		hmac_sha1_multi(streams, HASH_MULTI_TEST_PACKETS) ;
+
+		if(memcmp(digest[0], rfc_digest, sizeof(rfc_digest)) != 0)
+		{
+			local_error_count++ ;
+			IPSEC_LOG_TST("hash_multi_test_hmac_sha1", "FAILURE", ("RFC 2202 test case 2 does not match (engine %d)", engine)) ;
+		}
+
+		for(i = 0; i < HASH_MULTI_TEST_PACKETS; i++)
+		{
+			hmac_sha1_chain(&hctx[i], streams[i].chain, streams[i].offset, streams[i].len, expected) ;
+			if(memcmp(digest[i], expected, sizeof(expected)) != 0)
+				break ;
+		}
+		if(i != HASH_MULTI_TEST_PACKETS)
+		{
+			local_error_count++ ;
+			IPSEC_LOG_TST("hash_multi_test_hmac_sha1", "FAILURE", ("digest of packet %d (%d bytes) does not match (engine %d)", i, hash_multi_test_len[i], engine)) ;
+		}
+	}
+	hash_multi_set_engine(previous) ;
+	sha1_set_engine(previous_sha1) ;
+
+	return local_error_count ;
+}
+
+
+/**
+ * Main test function for the multi-buffer HMAC tests.
+ * It does nothing but calling the subtests one after the other.
+ */
+void hash_multi_test(test_result *global_results)
+{
+	test_result 	sub_results	= {
+						 16, 			
+						  2,			
+						  0, 			
+						  0, 			
+					};
+	int retcode;
+
+	retcode = hash_multi_test_hmac_md5();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "hash_multi_test_hmac_md5()", ("RFC 2202 and hmac_md5_chain()"));
+
+	retcode = hash_multi_test_hmac_sha1();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "hash_multi_test_hmac_sha1()", ("RFC 2202 and hmac_sha1_chain()"));
+
+	global_results->tests += sub_results.tests;
+	global_results->functions += sub_results.functions;
+	global_results->errors += sub_results.errors;
+	global_results->notimplemented += sub_results.notimplemented;
+}
@@ -0,0 +1,240 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file ivgen_test.c
+ *  @brief Test functions for the random number generator and the IV generator
+ *
+ *  <B>OUTLINE:</B>
+ *
+ *  This file contains test functions used to verify the CTR-DRBG and the per-packet IVs.
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *
+ *  The generators are seeded from a counter instead of the real entropy source, so two of them 
+ *  can be compared. Reading the same stream in pieces of different sizes must give the same 
+ *  bytes as reading it at once (across several refills of the buffer). The IVs of an SA must 
+ *  change with the sequence number and with the salt drawn by ipsec_sad_prepare().
+ *
+ *  <B>NOTES:</B>
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/util.h"
+#include "ipsec/ivgen.h"
+#include "ipsec/esp.h"
+#include "ipsec/debug.h"
+#include "testing/structural/structural_test.h"
+
+
+#define IVGEN_TEST_SIZE		(3*IPSEC_DRBG_BUFFER_SIZE+5)		/**< number of random bytes compared */
+
+extern sad_entry chain_sa ;
+
+static unsigned char ivgen_test_counter ;	/**< next byte returned by ivgen_test_entropy() */
+static unsigned char ivgen_test_a[IVGEN_TEST_SIZE] ;
+static unsigned char ivgen_test_b[IVGEN_TEST_SIZE] ;
+
+
+/**
+ * Entropy source of the tests: returns a counter.
+ */
+static int ivgen_test_entropy(unsigned char *buffer, int len)
+{
+	int i ;
+
+	for(i = 0; i < len; i++)
+		buffer[i] = ivgen_test_counter++ ;
+	return 0 ;
+}
+
+/**
+ * Entropy source of the tests: always fails.
+ */
+static int ivgen_test_no_entropy(unsigned char *buffer, int len)
+{
+	return -1 ;
+}
+
+
+/**
+ * Checks the buffered CTR-DRBG: the stream does not depend on the sizes of the requests, it 
+ * depends on the seed and a generator without entropy refuses to work.
+ * 4 tests 
+ */
+int ivgen_test_drbg(void)
+{
+	int 				local_error_count = 0 ;
+	const int			sizes[5] = { 1, 7, 16, 33, 130 } ;
+	ipsec_entropy_hook	previous ;
+	ipsec_drbg			a, b ;
+	int					pos, n, i ;
+
+	previous = ipsec_drbg_set_entropy(ivgen_test_entropy) ;
+
+	/* the same seed gives the same stream, no matter how it is read */
+	memset(&a, 0, sizeof(a)) ;
+	memset(&b, 0, sizeof(b)) ;
+	ivgen_test_counter = 0 ;
+	ipsec_drbg_seed(&a, NULL, 0) ;
+	ivgen_test_counter = 0 ;
+	ipsec_drbg_seed(&b, NULL, 0) ;
+	ipsec_drbg_generate(&a, ivgen_test_a, IVGEN_TEST_SIZE) ;
+	for(pos = 0, i = 0; pos < IVGEN_TEST_SIZE; pos += n, i++)
+	{
+		n = sizes[i % 5] ;
+		if(n > IVGEN_TEST_SIZE - pos)
+			n = IVGEN_TEST_SIZE - pos ;
+		ipsec_drbg_generate(&b, ivgen_test_b + pos, n) ;
+	}
+	if(memcmp(ivgen_test_a, ivgen_test_b, IVGEN_TEST_SIZE) != 0)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("ivgen_test_drbg", "FAILURE", ("stream depends on the sizes of the requests")) ;
+	}
+
+	/* the refills must not repeat the buffer */
+	if((memcmp(ivgen_test_a, ivgen_test_a + IPSEC_DRBG_BUFFER_SIZE, IPSEC_DRBG_BUFFER_SIZE) == 0) || 
+	   (memcmp(ivgen_test_a + AES_BLOCK_SIZE, ivgen_test_a, AES_BLOCK_SIZE) == 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("ivgen_test_drbg", "FAILURE", ("output repeats")) ;
+	}
+
+	/* another seed or a personalization string give another stream */
+	memset(&b, 0, sizeof(b)) ;
+	ivgen_test_counter = 0 ;
+	ipsec_drbg_seed(&b, (unsigned char *)"embedded IPsec", 14) ;
+	ipsec_drbg_generate(&b, ivgen_test_b, AES_BLOCK_SIZE) ;
+	ipsec_drbg_seed(&a, NULL, 0) ;
+	ipsec_drbg_generate(&a, ivgen_test_a + AES_BLOCK_SIZE, AES_BLOCK_SIZE) ;
+	if((memcmp(ivgen_test_a, ivgen_test_b, AES_BLOCK_SIZE) == 0) || 
+	   (memcmp(ivgen_test_a, ivgen_test_a + AES_BLOCK_SIZE, AES_BLOCK_SIZE) == 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("ivgen_test_drbg", "FAILURE", ("personalization string or reseed ignored")) ;
+	}
+
+	/* no entropy: no output */
+	ipsec_drbg_set_entropy(ivgen_test_no_entropy) ;
+	memset(&b, 0, sizeof(b)) ;
+	if((ipsec_drbg_seed(&b, NULL, 0) != IPSEC_STATUS_FAILURE) || (ipsec_drbg_generate(&b, ivgen_test_b, 1) != IPSEC_STATUS_FAILURE) ||
+	   (ipsec_ivgen_random(IPSEC_IVGEN_CONTEXTS, ivgen_test_b, 1) != IPSEC_STATUS_FAILURE))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("ivgen_test_drbg", "FAILURE", ("generator without entropy returned data")) ;
+	}
+
+	ipsec_drbg_set_entropy(previous) ;
+	return local_error_count ;
+}
+
+/**
+ * Checks the IVs of outbound packets: CBC IVs change with the sequence number and with the salt 
+ * of the SA, CTR IVs are the sequence number.
+ * 3 tests 
+ */
+int ivgen_test_packet(void)
+{
+	int 			local_error_count = 0 ;
+	unsigned char	iv[4][IPSEC_ESP_MAX_IV_SIZE] ;
+	unsigned char	ctr_iv[IPSEC_ESP_IV_SIZE] = { 0x00, 0x00, 0x00, 0x00, 0x12, 0x34, 0x56, 0x78 } ;
+	ipsec_entropy_hook	previous ;
+	sad_entry		sa ;
+
+	/* the target may have no entropy source */
+	previous = ipsec_drbg_set_entropy(ivgen_test_entropy) ;
+
+	/* 3DES: the same sequence number gives the same IV, the next one another IV */
+	memcpy(&sa, &chain_sa, sizeof(sa)) ;
+	sa.key_state = IPSEC_KEYS_UNSET ;
+	ipsec_sad_prepare(&sa) ;
+	ipsec_ivgen_packet(&sa, 1, iv[0]) ;
+	ipsec_ivgen_packet(&sa, 2, iv[1]) ;
+	ipsec_ivgen_packet(&sa, 1, iv[2]) ;
+	if((memcmp(iv[0], iv[2], IPSEC_ESP_IV_SIZE) != 0) || (memcmp(iv[0], iv[1], IPSEC_ESP_IV_SIZE) == 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("ivgen_test_packet", "FAILURE", ("3DES IVs do not follow the sequence number")) ;
+	}
+
+	/* setting the SA up again with the same key gives other IVs */
+	ipsec_sad_prepare(&sa) ;
+	ipsec_ivgen_packet(&sa, 1, iv[3]) ;
+	if(memcmp(iv[0], iv[3], IPSEC_ESP_IV_SIZE) == 0)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("ivgen_test_packet", "FAILURE", ("IVs repeat after the SA was set up again")) ;
+	}
+
+	/* AES-CTR: the IV is the sequence number */
+	sa.enc_alg = IPSEC_AES_128_CTR ;
+	sa.key_state = IPSEC_KEYS_UNSET ;
+	ipsec_sad_prepare(&sa) ;
+	ipsec_ivgen_packet(&sa, 0x12345678, iv[0]) ;
+	if(memcmp(iv[0], ctr_iv, IPSEC_ESP_IV_SIZE) != 0)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("ivgen_test_packet", "FAILURE", ("AES-CTR IV is not the sequence number")) ;
+	}
+
+	ipsec_drbg_set_entropy(previous) ;
+	return local_error_count ;
+}
+
+
+/**
+ * Main test function for the random number generator and IV tests.
+ * It does nothing but calling the subtests one after the other.
+ */
+void ivgen_test(test_result *global_results)
+{
+	test_result 	sub_results	= {
+						  7, 			
+						  2,			
+						  0, 			
+						  0, 			
+					};
+	int retcode;
+
+	retcode = ivgen_test_drbg();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "ivgen_test_drbg()", ("buffered CTR-DRBG"));
+
+	retcode = ivgen_test_packet();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "ivgen_test_packet()", ("IVs of 3DES and AES-CTR"));
+
+	global_results->tests += sub_results.tests;
+	global_results->functions += sub_results.functions;
+	global_results->errors += sub_results.errors;
+	global_results->notimplemented += sub_results.notimplemented;
+}
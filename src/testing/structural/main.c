@@ -68,12 +68,20 @@ extern void serinit(void) ;
 
 /* declare all test functions here */
 extern void util_debug_test(test_result *);
+extern void chksum_test(test_result *);
 extern void des_test(test_result *);
+extern void aes_test(test_result *);
+extern void gcm_test(test_result *);
+extern void chacha_test(test_result *);
 extern void md5_test(test_result *);
 extern void sha1_test(test_result *);
+extern void sha2_test(test_result *);
+extern void hash_multi_test(test_result *);
+extern void ivgen_test(test_result *);
 extern void sa_test(test_result *) ;
 extern void ah_test(test_result *) ;
 extern void esp_test(test_result *) ;
+extern void pipeline_test(test_result *) ;
 
 typedef struct test_set_struct
 {
@@ -84,12 +92,20 @@ typedef struct test_set_struct
 test_set test_function_set[] = 
 {
 			{ util_debug_test, 	"util_debug_test"	},
+			{ chksum_test,		"chksum_test"		},
 			{ des_test, 		"des_test"			},
+			{ aes_test, 		"aes_test"			},
+			{ gcm_test, 		"gcm_test"			},
+			{ chacha_test, 		"chacha_test"		},
 			{ md5_test, 		"md5_test"			}, 
 			{ sha1_test,		"sha1_test"			},
+			{ sha2_test,		"sha2_test"			},
+			{ hash_multi_test,	"hash_multi_test"	},
+			{ ivgen_test,		"ivgen_test"		},
 			{ sa_test, 			"sa_test"			},
 			{ ah_test, 			"ah_test"			},
-			{ esp_test,			"esp_test"			}
+			{ esp_test,			"esp_test"			},
+			{ pipeline_test,	"pipeline_test"		}
 } ;
 
 #define NR_OF_TESTFUNCTIONS sizeof(test_function_set)/sizeof(test_set) /**< defines the number of test functions */
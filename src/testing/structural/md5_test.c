@@ -211,6 +211,42 @@ int md5_test_MD5_Final()
 	return 0 ;
 }
 
+/**
+ * Testfunction for the precomputed HMAC-MD5 (RFC 2104 test case 2)
+ * The same precomputed state is used twice to make sure it is not modified.
+ * @return int number of tests failed in this function
+ */
+int md5_test_hmac_md5_precomputed(void)
+{
+	HMAC_MD5_CTX	hctx ;
+	unsigned char 	text[] = "what do ya want for nothing?" ;
+	unsigned char 	key[] = "Jefe" ;
+	unsigned char 	orig_digest[] = { 0x75, 0x0C, 0x78, 0x3E, 0x6A, 0xB0, 0xB5, 0x03, 0xEA, 0xA8, 0x6E, 0x31, 0x0A, 0x5D, 0xB7, 0x38 } ;
+	unsigned char 	digest[16] ;
+	int 			local_error_count = 0;
+	int				i ;
+
+	hmac_md5_init(&hctx, key, 4) ;
+
+	for(i = 0; i < 2; i++)
+	{
+		memset(digest, 0, sizeof(digest)) ;
+		hmac_md5_precomputed(&hctx, text, 28, digest) ;
+
+		if(memcmp(digest, orig_digest, sizeof(orig_digest)) != 0)
+		{
+			local_error_count++;
+			IPSEC_LOG_TST("md5_test_hmac_md5_precomputed", "FAILURE", ("digest %d does not match", i)) ;
+			printf("     OUTPUT:\n") ;
+			IPSEC_DUMP_BUFFER("          ", (char*)&digest, 0, sizeof(digest));
+			printf("     EXPECTED OUTPUT:\n") ;
+			IPSEC_DUMP_BUFFER("          ", (char*)&orig_digest, 0, sizeof(orig_digest));
+		}
+	}
+
+	return local_error_count;
+}
+
 /**
  * Main testfunction for the MD5 tests.
  * It does nothing but calling the subtests one after the other.
@@ -218,8 +254,8 @@ int md5_test_MD5_Final()
 void md5_test(test_result *global_results)
 {
 	test_result 	sub_results	= {
-						  3, 		
-						  3,		
+						  5, 		
+						  4,		
 						  0, 		
 						  0, 		
 					};
@@ -235,6 +271,9 @@ void md5_test(test_result *global_results)
 	retcode = md5_test_MD5_Final();
 	IPSEC_TESTING_EVALUATE(retcode, sub_results, "md5_test_MD5_Final()", ("ported from openssl.org"));
 
+	retcode = md5_test_hmac_md5_precomputed();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "md5_test_hmac_md5_precomputed()", (" "));
+
 
 	global_results->tests += sub_results.tests;
 	global_results->functions += sub_results.functions;
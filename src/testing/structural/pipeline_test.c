@@ -0,0 +1,368 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file pipeline_test.c
+ *  @brief Testing the pipelined IPsec engine
+ *
+ *  <B>OUTLINE:</B>
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *  The workers are called one after the other from the test thread, so the tests do not depend 
+ *  on a thread library.
+ *
+ *  <B>NOTES:</B>
+ *  The ESP test packets of esp_test.c are used.
+ *
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/util.h"
+#include "ipsec/debug.h"
+#include "testing/structural/structural_test.h"
+
+#include "ipsec/sa.h"
+#include "ipsec/pipeline.h"
+
+
+extern unsigned char enc_esp_packet1[] ;	/**< ESP packet (SPI 0x1006) from esp_test.c */
+extern unsigned char dec_esp_packet1[] ;	/**< decapsulated enc_esp_packet1 from esp_test.c */
+extern sad_entry packet1_sa ;				/**< SA of enc_esp_packet1 from esp_test.c */
+
+unsigned char pipeline_packet_tmp [3][600] ;
+void *pipeline_test_arena[IPSEC_DB_ARENA_SIZE(2, 2)/sizeof(void *)+1] ;
+ipsec_pipeline test_pipeline ;
+
+/**
+ * Checks the lock-free ring used between the pipeline stages
+ * 3 tests
+ */
+int test_ring(void)
+{
+	int 			local_error_count = 0 ;
+	int				i ;
+	int				items[IPSEC_PIPELINE_WINDOW] ;
+	ipsec_ring		ring ;
+
+	memset(&ring, 0, sizeof(ring)) ;
+
+	for(i = 0; i < IPSEC_PIPELINE_WINDOW; i++)
+		ipsec_ring_put(&ring, &items[i]) ;
+	if(ipsec_ring_put(&ring, &items[0]) != 0)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_ring", "FAILURE", ("item added to a full ring")) ;
+	}
+
+	for(i = 0; i < IPSEC_PIPELINE_WINDOW; i++)
+	{
+		if(ipsec_ring_get(&ring) != &items[i])
+		{
+			local_error_count++ ;
+			IPSEC_LOG_TST("test_ring", "FAILURE", ("item %d was not returned in order", i)) ;
+			break ;
+		}
+	}
+
+	if(ipsec_ring_get(&ring) != NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_ring", "FAILURE", ("item returned from an empty ring")) ;
+	}
+
+	return local_error_count ;
+}
+
+/**
+ * Checks if inbound packets pass the pipeline (dispatch, worker, collect) in the order of their SA
+ * 5 tests
+ */
+int test_pipeline_inbound(void)
+{
+	int 			local_error_count = 0 ;
+	int				i ;
+	db_set_netif	*databases ;
+	sad_entry		*sa ;
+	spd_entry		*spd ;
+	ipsec_buffer	segments[3] ;
+	ipsec_job		jobs[3] ;
+	ipsec_job		*job ;
+
+	databases = ipsec_spd_create_dbs(pipeline_test_arena, sizeof(pipeline_test_arena), 2, 2) ;
+	if(databases == NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_pipeline_inbound", "FAILURE", ("unable to create the databases")) ;
+		return local_error_count ;
+	}
+	sa = ipsec_sad_add(&packet1_sa, &databases->inbound_sad) ;
+	spd = ipsec_spd_add(ipsec_inet_addr("192.168.1.3"), ipsec_inet_addr("255.255.255.255"), 
+						ipsec_inet_addr("192.168.1.40"), ipsec_inet_addr("255.255.255.255"), 
+						IPSEC_PROTO_TCP, 0, 0, POLICY_APPLY, &databases->inbound_spd) ;
+	ipsec_spd_add_sa(spd, sa) ;
+	ipsec_pipeline_init(&test_pipeline, databases, 0, 0, 0) ;
+
+	/* packet 1, a packet with an unknown SPI and packet 1 again */
+	for(i = 0; i < 3; i++)
+	{
+		memcpy(pipeline_packet_tmp[i], enc_esp_packet1, 484) ;
+		segments[i].next = NULL ;
+		segments[i].data = pipeline_packet_tmp[i] ;
+		segments[i].len = 484 ;
+		memset(&jobs[i], 0, sizeof(ipsec_job)) ;
+		jobs[i].packet.chain = &segments[i] ;
+		jobs[i].direction = IPSEC_PIPELINE_INBOUND ;
+	}
+	pipeline_packet_tmp[1][23] = 0x07 ;
+
+	if((ipsec_pipeline_dispatch(&test_pipeline, &jobs[0]) != IPSEC_STATUS_SUCCESS) ||
+	   (ipsec_pipeline_dispatch(&test_pipeline, &jobs[1]) != IPSEC_STATUS_NO_SA_FOUND) ||
+	   (ipsec_pipeline_dispatch(&test_pipeline, &jobs[2]) != IPSEC_STATUS_SUCCESS))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_pipeline_inbound", "FAILURE", ("packets were not classified properly")) ;
+	}
+
+	if(ipsec_pipeline_collect(&test_pipeline) != NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_pipeline_inbound", "FAILURE", ("packet collected before it was processed")) ;
+	}
+
+	/* both packets use SPI 0x1006 and must be queued to the same worker */
+	if((ipsec_pipeline_work(&test_pipeline, 1) != 0) || (ipsec_pipeline_work(&test_pipeline, 0) != 2))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_pipeline_inbound", "FAILURE", ("packets were not queued to the worker of their SA")) ;
+	}
+
+	job = ipsec_pipeline_collect(&test_pipeline) ;
+	if((job != &jobs[0]) || (job->packet.status != IPSEC_STATUS_SUCCESS) || (job->packet.payload_offset != 36) || 
+	   (job->packet.payload_size != 441) || (memcmp(&pipeline_packet_tmp[0][36], dec_esp_packet1, 441) != 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_pipeline_inbound", "FAILURE", ("1st packet was not processed properly")) ;
+	}
+
+	job = ipsec_pipeline_collect(&test_pipeline) ;
+	if((job != &jobs[2]) || (job->packet.status != IPSEC_STATUS_SUCCESS) || (ipsec_pipeline_collect(&test_pipeline) != NULL) ||
+	   (test_pipeline.in_flight != 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_pipeline_inbound", "FAILURE", ("2nd packet was not returned in order")) ;
+	}
+
+	ipsec_spd_release_dbs(databases) ;
+
+	return local_error_count ;
+}
+
+
+/**
+ * Checks if an SA deleted while packets are in the pipeline is reused as soon as the packets 
+ * dispatched before the deletion are collected, although the pipeline never runs empty
+ * 3 tests
+ */
+int test_pipeline_reclaim(void)
+{
+	int 			local_error_count = 0 ;
+	int				i ;
+	db_set_netif	*databases ;
+	sad_entry		other_sa ;
+	sad_entry		*sa ;
+	ipsec_buffer	segments[2] ;
+	ipsec_job		jobs[2] ;
+
+	databases = ipsec_spd_create_dbs(pipeline_test_arena, sizeof(pipeline_test_arena), 2, 2) ;
+	if(databases == NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_pipeline_reclaim", "FAILURE", ("unable to create the databases")) ;
+		return local_error_count ;
+	}
+	memcpy(&other_sa, &packet1_sa, sizeof(sad_entry)) ;
+	other_sa.spi = ipsec_htonl(0x1007) ;
+	ipsec_sad_add(&packet1_sa, &databases->inbound_sad) ;
+	sa = ipsec_sad_add(&other_sa, &databases->inbound_sad) ;
+	ipsec_pipeline_init(&test_pipeline, databases, 0, 0, 0) ;
+
+	for(i = 0; i < 2; i++)
+	{
+		memcpy(pipeline_packet_tmp[i], enc_esp_packet1, 484) ;
+		segments[i].next = NULL ;
+		segments[i].data = pipeline_packet_tmp[i] ;
+		segments[i].len = 484 ;
+		memset(&jobs[i], 0, sizeof(ipsec_job)) ;
+		jobs[i].packet.chain = &segments[i] ;
+		jobs[i].direction = IPSEC_PIPELINE_INBOUND ;
+	}
+
+	/* the 1st packet was dispatched before the SA was deleted and may still refer to it */
+	ipsec_pipeline_dispatch(&test_pipeline, &jobs[0]) ;
+	ipsec_sad_del(sa, &databases->inbound_sad) ;
+	if(ipsec_sad_get_free(&databases->inbound_sad) != NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_pipeline_reclaim", "FAILURE", ("deleted SA reused while an older packet is in the pipeline")) ;
+	}
+
+	/* the 2nd packet can not have found the deleted SA */
+	ipsec_pipeline_dispatch(&test_pipeline, &jobs[1]) ;
+	ipsec_pipeline_work(&test_pipeline, 0) ;
+	ipsec_pipeline_work(&test_pipeline, 1) ;
+	if((ipsec_pipeline_collect(&test_pipeline) != &jobs[0]) || (ipsec_sad_get_free(&databases->inbound_sad) != sa))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_pipeline_reclaim", "FAILURE", ("deleted SA not reused after the older packets were collected")) ;
+	}
+
+	if((ipsec_pipeline_collect(&test_pipeline) != &jobs[1]) || (test_pipeline.epochs != 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_pipeline_reclaim", "FAILURE", ("epoch of the last packet still held")) ;
+	}
+
+	ipsec_spd_release_dbs(databases) ;
+
+	return local_error_count ;
+}
+
+
+/**
+ * Checks if outbound packets are encapsulated with the SA they were dispatched with, even if the 
+ * SPD entry gets a new SA before the workers process them
+ * 2 tests
+ */
+int test_pipeline_rekey(void)
+{
+	int 			local_error_count = 0 ;
+	int				i ;
+	db_set_netif	*databases ;
+	sad_entry		new_sa ;
+	sad_entry		*sa ;
+	spd_entry		*spd ;
+	ipsec_buffer	segments[2] ;
+	ipsec_job		jobs[2] ;
+	ipsec_job		*job ;
+
+	databases = ipsec_spd_create_dbs(pipeline_test_arena, sizeof(pipeline_test_arena), 2, 2) ;
+	if(databases == NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_pipeline_rekey", "FAILURE", ("unable to create the databases")) ;
+		return local_error_count ;
+	}
+	memcpy(&new_sa, &packet1_sa, sizeof(sad_entry)) ;
+	new_sa.spi = ipsec_htonl(0x1007) ;
+	sa = ipsec_sad_add(&packet1_sa, &databases->outbound_sad) ;
+	spd = ipsec_spd_add(ipsec_inet_addr("192.168.1.40"), ipsec_inet_addr("255.255.255.255"), 
+						ipsec_inet_addr("192.168.1.3"), ipsec_inet_addr("255.255.255.255"), 
+						IPSEC_PROTO_TCP, 0, 0, POLICY_APPLY, &databases->outbound_spd) ;
+	ipsec_spd_add_sa(spd, sa) ;
+	ipsec_pipeline_init(&test_pipeline, databases, ipsec_inet_addr("192.168.1.40"), ipsec_inet_addr("192.168.1.3"), 0) ;
+
+	for(i = 0; i < 2; i++)
+	{
+		memset(pipeline_packet_tmp[i], 0, 600) ;
+		memcpy(&pipeline_packet_tmp[i][64], dec_esp_packet1, 441) ;
+		segments[i].next = NULL ;
+		segments[i].data = &pipeline_packet_tmp[i][64] ;
+		segments[i].len = 441 ;
+		memset(&jobs[i], 0, sizeof(ipsec_job)) ;
+		jobs[i].packet.chain = &segments[i] ;
+		jobs[i].packet.spd = spd ;
+		jobs[i].direction = IPSEC_PIPELINE_OUTBOUND ;
+	}
+
+	/* the SA is replaced between the two packets, before any of them is processed */
+	ipsec_pipeline_dispatch(&test_pipeline, &jobs[0]) ;
+	ipsec_spd_add_sa(spd, ipsec_sad_add(&new_sa, &databases->outbound_sad)) ;
+	ipsec_pipeline_dispatch(&test_pipeline, &jobs[1]) ;
+
+	/* SPI 0x1006 belongs to worker 0, SPI 0x1007 to worker 1 */
+	if((ipsec_pipeline_work(&test_pipeline, 0) != 1) || (ipsec_pipeline_work(&test_pipeline, 1) != 1))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_pipeline_rekey", "FAILURE", ("packets were not queued to the worker of the SA they were dispatched with")) ;
+	}
+
+	for(i = 0; i < 2; i++)
+	{
+		job = ipsec_pipeline_collect(&test_pipeline) ;
+		if((job == NULL) || (job->packet.status != IPSEC_STATUS_SUCCESS) ||
+		   (ipsec_sad_get_spi((ipsec_ip_header *)&pipeline_packet_tmp[job - jobs][64 + job->packet.payload_offset]) != ((sad_entry *)job->sa)->spi))
+		{
+			local_error_count++ ;
+			IPSEC_LOG_TST("test_pipeline_rekey", "FAILURE", ("packet was not encapsulated with the SA it was dispatched with")) ;
+			break ;
+		}
+	}
+
+	ipsec_spd_release_dbs(databases) ;
+
+	return local_error_count ;
+}
+
+
+/**
+ * Main test function for the pipeline tests.
+ * It does nothing but calling the subtests one after the other.
+ */
+void pipeline_test(test_result *global_results)
+{
+	test_result 	sub_results	= {
+						 13, 		
+						  4,			
+						  0, 
+						  0, 			
+					};
+
+	int retcode;
+
+	retcode = test_ring() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "test_ring", (" "));
+
+	retcode = test_pipeline_inbound() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "test_pipeline_inbound", (" "));
+
+	retcode = test_pipeline_reclaim() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "test_pipeline_reclaim", (" "));
+
+	retcode = test_pipeline_rekey() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "test_pipeline_rekey", (" "));
+
+	global_results->tests += sub_results.tests;
+	global_results->functions += sub_results.functions;
+	global_results->errors += sub_results.errors;
+	global_results->notimplemented += sub_results.notimplemented;
+}
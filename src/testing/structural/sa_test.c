@@ -62,25 +62,25 @@ sad_entry inbound_sad_test[IPSEC_MAX_SAD_ENTRIES] = {
 				0x1001, 
 				IPSEC_PROTO_ESP, IPSEC_TUNNEL, 
 				IPSEC_3DES, 
-				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45 , 0x67, 0x01, 0x23, 0x45, 0x67, 
+				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45 , 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
 				0,  
-				0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+				0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)},
 
-	SAD_ENTRY(	192,168,1,2, 255,255,255,255, 
+{	SAD_ENTRY(	192,168,1,2, 255,255,255,255, 
 				0x1002, 
 				IPSEC_PROTO_AH, IPSEC_TUNNEL, 
 				0, 
-				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45 , 0x67, 0x01, 0x23, 0x45, 0x67,  
+				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45 , 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  
 				IPSEC_HMAC_MD5,  
-				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0),
+				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)},
 
-	SAD_ENTRY(	192,168,156,189, 255,255,255,255, 
+{	SAD_ENTRY(	192,168,156,189, 255,255,255,255, 
 				0x0010002, 
 				IPSEC_PROTO_AH, IPSEC_TUNNEL, 
 				0, 
-				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45 , 0x67, 0x01, 0x23, 0x45, 0x67, 
+				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45 , 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
 				IPSEC_HMAC_SHA1,  
-				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0)}
+				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)}
 } ;
 
 /* SPD configuration data */
@@ -103,25 +103,25 @@ sad_entry outbound_sad_test[IPSEC_MAX_SAD_ENTRIES] = {
 				0x100000, 
 				IPSEC_PROTO_AH, IPSEC_TUNNEL, 
 				IPSEC_3DES, 
-				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45 , 0x67, 0x01, 0x23, 0x45, 0x67, 
+				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45 , 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
 				IPSEC_HMAC_SHA1,  
-				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0),
+				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)},
 
-	SAD_ENTRY(	192,168,156,189, 255,255,255,255, 
+{	SAD_ENTRY(	192,168,156,189, 255,255,255,255, 
 				0x100000, 
 				IPSEC_PROTO_ESP, IPSEC_TUNNEL, 
 				IPSEC_3DES, 
-				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45 , 0x67, 0x01, 0x23, 0x45, 0x67, 
+				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45 , 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
 				IPSEC_HMAC_SHA1,  
-				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0),
+				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)},
 
-	SAD_ENTRY(	192,168,156,189, 255,255,255,255, 
+{	SAD_ENTRY(	192,168,156,189, 255,255,255,255, 
 				0x100000, 
 				IPSEC_PROTO_AH, IPSEC_TUNNEL, 
 				0, 
-				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45 , 0x67, 0x01, 0x23, 0x45, 0x67, 
+				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45 , 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
 				IPSEC_HMAC_SHA1,  
-				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0)}
+				0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0x01, 0x23, 0x45, 0x67, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)}
 } ;
 
 /* SPD configuration data */
@@ -340,6 +340,8 @@ int test_spd_init(void)
 
 /**
  * Check if SPD lookup for free entries works.
+ * The free entries are taken from the free list of the table, so entries are used and
+ * released by ipsec_spd_add() and ipsec_spd_del().
  * 4 tests are performed here.
  */
 int test_spd_get_free(void)
@@ -350,7 +352,7 @@ int test_spd_get_free(void)
 	db_set_netif	*databases ;
 
 	/* init the config data */
-	memset(inbound_spd, 0, IPSEC_MAX_SPD_ENTRIES) ;
+	memset(inbound_spd, 0, IPSEC_MAX_SPD_ENTRIES*sizeof(spd_entry)) ;
 
 	/* init the table */
 	databases = ipsec_spd_load_dbs(inbound_spd, outbound_spd, inbound_sad, outbound_sad) ;
@@ -358,12 +360,7 @@ int test_spd_get_free(void)
 	{
 		local_error_count++ ;
 		IPSEC_LOG_TST("test_spd_get_free", "FAILURE", ("spd_inbound: unable to initialize the databases")) ;
-	}
-
-	/* set all entries to FREE */
-	for(index = 0; index < IPSEC_MAX_SPD_ENTRIES; index++)
-	{
-		databases->inbound_spd.table[index].use_flag = IPSEC_FREE ;
+		return local_error_count ;
 	}
 
 	/* test if we get the first entry out of the datapool */
@@ -374,9 +371,12 @@ int test_spd_get_free(void)
 			IPSEC_LOG_TST("test_spd_get_first", "FAILURE", ("unable to get the first entry from SPD data pool")) ;
 	}
 
-	/* lets mark two entries as used */
-	inbound_spd[0].use_flag = IPSEC_USED ;
-	inbound_spd[2].use_flag = IPSEC_USED ;
+	/* lets use three entries and release the one in the middle */
+	for(index = 0; index < 3; index++)
+	{
+		ipsec_spd_add(0, 0, 0, 0, 0, 0, 0, POLICY_BYPASS, &databases->inbound_spd) ;
+	}
+	ipsec_spd_del(&inbound_spd[1], &databases->inbound_spd) ;
 		
 	/* test if we get the right entry */
 	free_entry = ipsec_spd_get_free(&databases->inbound_spd) ;
@@ -386,10 +386,10 @@ int test_spd_get_free(void)
 			IPSEC_LOG_TST("test_spd_get_first", "FAILURE", ("unable to get the right free entry")) ;
 	}
 
-	/* lets mark all entries as used, EXCEPT the last one */
-	for(index = 0; index < IPSEC_MAX_SPD_ENTRIES-1; index++)
+	/* lets use all entries, EXCEPT the last one (two of them are already used) */
+	for(index = 3; index < IPSEC_MAX_SPD_ENTRIES; index++)
 	{
-		inbound_spd[index].use_flag = IPSEC_USED ;
+		ipsec_spd_add(0, 0, 0, 0, 0, 0, 0, POLICY_BYPASS, &databases->inbound_spd) ;
 	}
 	
 	/* check if we got the last entry out of the pool */
@@ -400,8 +400,8 @@ int test_spd_get_free(void)
 			IPSEC_LOG_TST("test_spd_get_first", "FAILURE", ("unable to get the last free entry")) ;
 	}
 
-	/* mark also the last free entry */
-	inbound_spd[IPSEC_MAX_SPD_ENTRIES-1].use_flag = IPSEC_USED ; 
+	/* use also the last free entry */
+	ipsec_spd_add(0, 0, 0, 0, 0, 0, 0, POLICY_BYPASS, &databases->inbound_spd) ;
 
 	/* now there is no free entry */
 	free_entry = ipsec_spd_get_free(&databases->inbound_spd) ;
@@ -417,7 +417,6 @@ int test_spd_get_free(void)
 	return local_error_count ;
 }
 
-
 /**
  * Test adding of SPD entries
  * 5 tests are performed here
@@ -698,7 +697,7 @@ int test_spd_del(void)
 
 /**
  * Check if the Security Policy Database (SPD) lookup function works.
- * 6 tests are performed here.
+ * 8 tests are performed here.
  */
 int test_spd_lookup(void)
 {
@@ -764,12 +763,455 @@ int test_spd_lookup(void)
 		IPSEC_LOG_TST("test_spd_lookup", "FALIURE", ("SPD lookup for default packet failed")) ;
 	}
 
+	/* without the 1st entry, the 1st FTP packet must hit the default entry */
+	ipsec_spd_del(&databases->inbound_spd.table[0], &databases->inbound_spd) ;
+	tmp_entry = ipsec_spd_lookup((ipsec_ip_header*)ip_ftp_1, &databases->inbound_spd) ;
+	if(tmp_entry != &databases->inbound_spd.table[5])
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_lookup", "FALIURE", ("SPD lookup for 1st FTP packet after deleting its entry failed")) ;
+	}
+
+	/* an entry added behind the default entry must never match */
+	ipsec_spd_add(ipsec_inet_addr("204.152.189.0"),
+				  ipsec_inet_addr("255.255.255.0"),
+				  ipsec_inet_addr("147.87.70.105"),
+				  ipsec_inet_addr("255.255.255.255"),
+				  IPSEC_PROTO_TCP,
+				  ipsec_htons(21),
+				  ipsec_htons(0),
+				  POLICY_DISCARD,
+				  &databases->inbound_spd) ;
+	tmp_entry = ipsec_spd_lookup((ipsec_ip_header*)ip_ftp_1, &databases->inbound_spd) ;
+	if(tmp_entry != &databases->inbound_spd.table[5])
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_lookup", "FALIURE", ("SPD lookup did not return the first matching entry")) ;
+	}
+
 	if(databases)
 		ipsec_spd_release_dbs(databases) ;
 
 	return local_error_count ;
 }
 
+/**
+ * Check if the SPD lookup cache is used for repeated lookups of the same flow and if
+ * it is invalidated when the databases are changed and while another reader stores a result.
+ * 6 tests are performed here.
+ */
+int test_spd_cache(void)
+{
+	int 			local_error_count = 0 ;
+	spd_entry 		*tmp_entry ;
+	db_set_netif	*databases ;
+	int				i ;
+
+	/* init the config data */
+	memcpy(inbound_spd, inbound_spd_test, IPSEC_MAX_SPD_ENTRIES*sizeof(spd_entry)) ;
+	memcpy(outbound_spd, outbound_spd_test, IPSEC_MAX_SPD_ENTRIES*sizeof(spd_entry)) ;
+	memcpy(inbound_sad, inbound_sad_test, IPSEC_MAX_SAD_ENTRIES*sizeof(sad_entry)) ;
+	memcpy(outbound_sad, outbound_sad_test, IPSEC_MAX_SAD_ENTRIES*sizeof(sad_entry)) ;
+
+	/* init the table */
+	databases = ipsec_spd_load_dbs(inbound_spd, outbound_spd, inbound_sad, outbound_sad) ;	
+	if(databases == NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_cache", "FAILURE", ("unable to initialize the databases")) ;
+		return local_error_count ;
+	}
+
+	ipsec_spd_lookup((ipsec_ip_header*)ip_ftp_2, &databases->inbound_spd) ;
+	tmp_entry = ipsec_spd_lookup((ipsec_ip_header*)ip_ftp_2, &databases->inbound_spd) ;
+	if(tmp_entry != &databases->inbound_spd.table[1])
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_cache", "FAILURE", ("cached SPD lookup for 2nd FTP packet failed")) ;
+	}
+	if((databases->inbound_spd.cache_hits != 1) || (databases->inbound_spd.cache_misses != 1))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_cache", "FAILURE", ("expected 1 hit and 1 miss, got %lu hits and %lu misses", 
+		              databases->inbound_spd.cache_hits, databases->inbound_spd.cache_misses)) ;
+	}
+
+	/* changing an SA must invalidate the cache */
+	ipsec_spd_add_sa(&databases->inbound_spd.table[1], &databases->inbound_sad.table[0]) ;
+	ipsec_spd_lookup((ipsec_ip_header*)ip_ftp_2, &databases->inbound_spd) ;
+	if(databases->inbound_spd.cache_misses != 2)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_cache", "FAILURE", ("cache was not invalidated by ipsec_spd_add_sa()")) ;
+	}
+
+	/* deleting the matching entry must not leave a stale result in the cache */
+	ipsec_spd_del(&databases->inbound_spd.table[1], &databases->inbound_spd) ;
+	tmp_entry = ipsec_spd_lookup((ipsec_ip_header*)ip_ftp_2, &databases->inbound_spd) ;
+	if(tmp_entry != &databases->inbound_spd.table[5])
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_cache", "FAILURE", ("cache returned a deleted SPD entry")) ;
+	}
+	if(databases->inbound_spd.cache_misses != 3)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_cache", "FAILURE", ("cache was not invalidated by ipsec_spd_del()")) ;
+	}
+
+	/* entries which another reader is storing (odd sequence count) are neither used nor overwritten */
+	for(i = 0; i < IPSEC_SPD_CACHE_SIZE; i++)
+		databases->inbound_spd.cache[i].sequence++ ;
+	tmp_entry = ipsec_spd_lookup((ipsec_ip_header*)ip_ftp_2, &databases->inbound_spd) ;
+	for(i = 0; i < IPSEC_SPD_CACHE_SIZE; i++)
+		if((databases->inbound_spd.cache[i].sequence & 1) == 0)
+			break ;
+	if((tmp_entry != &databases->inbound_spd.table[5]) || (databases->inbound_spd.cache_misses != 4) || (i != IPSEC_SPD_CACHE_SIZE))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_cache", "FAILURE", ("cache entry being stored by another reader was used")) ;
+	}
+
+	ipsec_spd_release_dbs(databases) ;
+
+	return local_error_count ;
+}
+
+#define TEST_ARENA_SPD_ENTRIES	(4)
+#define TEST_ARENA_SAD_ENTRIES	(16)
+
+void *test_arena[IPSEC_DB_ARENA_SIZE(TEST_ARENA_SPD_ENTRIES, TEST_ARENA_SAD_ENTRIES)/sizeof(void *)+1] ;
+
+/**
+ * Check if databases with a run-time size can be created in a memory arena and if entries 
+ * are properly recycled by the free lists.
+ * 7 tests are performed here.
+ */
+int test_spd_create_dbs(void)
+{
+	int 			local_error_count = 0 ;
+	int				index ;
+	int				errors ;
+	sad_entry		sa ;
+	db_set_netif	*databases ;
+
+	databases = ipsec_spd_create_dbs(test_arena, IPSEC_DB_ARENA_SIZE(TEST_ARENA_SPD_ENTRIES, TEST_ARENA_SAD_ENTRIES)-1, TEST_ARENA_SPD_ENTRIES, TEST_ARENA_SAD_ENTRIES) ;
+	if(databases != NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_create_dbs", "FAILURE", ("databases were created in a too small arena")) ;
+		ipsec_spd_release_dbs(databases) ;
+	}
+
+	databases = ipsec_spd_create_dbs(test_arena, sizeof(test_arena), TEST_ARENA_SPD_ENTRIES, TEST_ARENA_SAD_ENTRIES) ;
+	if(databases == NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_create_dbs", "FAILURE", ("unable to create the databases")) ;
+		return local_error_count ;
+	}
+
+	/* fill up the inbound SAD */
+	memset(&sa, 0, sizeof(sa)) ;
+	sa.dest = ipsec_inet_addr("192.168.1.3") ;
+	sa.dest_netaddr = ipsec_inet_addr("255.255.255.255") ;
+	sa.protocol = IPSEC_PROTO_ESP ;
+	sa.mode = IPSEC_TUNNEL ;
+	for(errors = 0, index = 0; index < TEST_ARENA_SAD_ENTRIES; index++)
+	{
+		sa.spi = ipsec_htonl(0x2000 + index) ;
+		if(ipsec_sad_add(&sa, &databases->inbound_sad) == NULL)
+			errors++ ;
+	}
+	if(errors)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_create_dbs", "FAILURE", ("unable to add %d SAs", errors)) ;
+	}
+
+	sa.spi = ipsec_htonl(0x2000 + TEST_ARENA_SAD_ENTRIES) ;
+	if(ipsec_sad_add(&sa, &databases->inbound_sad) != NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_create_dbs", "FAILURE", ("added more SAs than the table size")) ;
+	}
+
+	/* release every 2nd SA */
+	for(index = 0; index < TEST_ARENA_SAD_ENTRIES; index += 2)
+	{
+		ipsec_sad_del(ipsec_sad_lookup(sa.dest, IPSEC_PROTO_ESP, ipsec_htonl(0x2000 + index), &databases->inbound_sad), &databases->inbound_sad) ;
+	}
+	for(errors = 0, index = 0; index < TEST_ARENA_SAD_ENTRIES; index++)
+	{
+		if((ipsec_sad_lookup(sa.dest, IPSEC_PROTO_ESP, ipsec_htonl(0x2000 + index), &databases->inbound_sad) == NULL) != ((index % 2) == 0))
+			errors++ ;
+	}
+	if(errors)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_create_dbs", "FAILURE", ("%d lookups failed after deleting SAs", errors)) ;
+	}
+
+	/* the released entries must be used again */
+	for(errors = 0, index = TEST_ARENA_SAD_ENTRIES; index < TEST_ARENA_SAD_ENTRIES + TEST_ARENA_SAD_ENTRIES/2; index++)
+	{
+		sa.spi = ipsec_htonl(0x2000 + index) ;
+		if(ipsec_sad_add(&sa, &databases->inbound_sad) != ipsec_sad_lookup(sa.dest, IPSEC_PROTO_ESP, sa.spi, &databases->inbound_sad))
+			errors++ ;
+	}
+	if(errors || (ipsec_sad_get_free(&databases->inbound_sad) != NULL))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_create_dbs", "FAILURE", ("released SAs were not used again")) ;
+	}
+
+	/* the SPD has its own size */
+	for(errors = 0, index = 0; index < TEST_ARENA_SPD_ENTRIES; index++)
+	{
+		if(ipsec_spd_add(0, 0, 0, 0, 0, 0, 0, POLICY_BYPASS, &databases->outbound_spd) == NULL)
+			errors++ ;
+	}
+	if(errors || (ipsec_spd_add(0, 0, 0, 0, 0, 0, 0, POLICY_BYPASS, &databases->outbound_spd) != NULL))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_create_dbs", "FAILURE", ("SPD does not hold %d entries", TEST_ARENA_SPD_ENTRIES)) ;
+	}
+
+	ipsec_spd_release_dbs(databases) ;
+
+	return local_error_count ;
+}
+
+/**
+ * Check if several database sets (one per network interface) can be used at the same time
+ * without affecting each other.
+ * 3 tests are performed here.
+ */
+int test_spd_multi_dbs(void)
+{
+	int 			local_error_count = 0 ;
+	sad_entry		sa ;
+	db_set_netif	*databases ;
+	db_set_netif	*databases_2 ;
+
+	/* fill the tables with the test data */
+	memcpy(inbound_spd, inbound_spd_test, IPSEC_MAX_SPD_ENTRIES*sizeof(spd_entry)) ;
+	memcpy(outbound_spd, outbound_spd_test, IPSEC_MAX_SPD_ENTRIES*sizeof(spd_entry)) ;
+	memcpy(inbound_sad, inbound_sad_test, IPSEC_MAX_SAD_ENTRIES*sizeof(sad_entry)) ;
+	memcpy(outbound_sad, outbound_sad_test, IPSEC_MAX_SAD_ENTRIES*sizeof(sad_entry)) ;
+
+	databases = ipsec_spd_load_dbs(inbound_spd, outbound_spd, inbound_sad, outbound_sad) ;
+	databases_2 = ipsec_spd_create_dbs(test_arena, sizeof(test_arena), TEST_ARENA_SPD_ENTRIES, TEST_ARENA_SAD_ENTRIES) ;
+	if((databases == NULL) || (databases_2 == NULL) || (databases == databases_2))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_multi_dbs", "FAILURE", ("unable to set up two database sets")) ;
+		if(databases) ipsec_spd_release_dbs(databases) ;
+		if(databases_2) ipsec_spd_release_dbs(databases_2) ;
+		return local_error_count ;
+	}
+
+	/* an SA added to the 2nd set must not be visible in the 1st set */
+	memset(&sa, 0, sizeof(sa)) ;
+	sa.dest = ipsec_inet_addr("192.168.1.3") ;
+	sa.dest_netaddr = ipsec_inet_addr("255.255.255.255") ;
+	sa.protocol = IPSEC_PROTO_ESP ;
+	sa.mode = IPSEC_TUNNEL ;
+	sa.spi = ipsec_htonl(0x3000) ;
+	if((ipsec_sad_add(&sa, &databases_2->inbound_sad) == NULL) ||
+	   (ipsec_sad_lookup(sa.dest, IPSEC_PROTO_ESP, sa.spi, &databases_2->inbound_sad) == NULL) ||
+	   (ipsec_sad_lookup(sa.dest, IPSEC_PROTO_ESP, sa.spi, &databases->inbound_sad) != NULL))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_multi_dbs", "FAILURE", ("SAs of the two database sets are not separated")) ;
+	}
+
+	/* the 1st set still holds its own configuration */
+	if(ipsec_sad_lookup(ipsec_inet_addr("192.168.1.1"), IPSEC_PROTO_ESP, IPSEC_HTONL(0x1001), &databases->inbound_sad) != &databases->inbound_sad.table[0])
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_spd_multi_dbs", "FAILURE", ("configuration of the 1st database set was changed")) ;
+	}
+
+	ipsec_spd_release_dbs(databases_2) ;
+	ipsec_spd_release_dbs(databases) ;
+
+	return local_error_count ;
+}
+
+/**
+ * Check if adding appends the entries at the end of the SPD and SAD lists and if deleting the 
+ * last entry moves the end back.
+ * 4 tests are performed here.
+ */
+int test_db_last(void)
+{
+	int 			local_error_count = 0 ;
+	spd_entry		*policy[3] ;
+	sad_entry		sa ;
+	sad_entry		*added_sa[3] ;
+	db_set_netif	*databases ;
+	int				i ;
+
+	databases = ipsec_spd_create_dbs(test_arena, sizeof(test_arena), TEST_ARENA_SPD_ENTRIES, TEST_ARENA_SAD_ENTRIES) ;
+	if(databases == NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_db_last", "FAILURE", ("unable to create the databases")) ;
+		return local_error_count ;
+	}
+
+	memset(&sa, 0, sizeof(sa)) ;
+	sa.dest = ipsec_inet_addr("192.168.1.3") ;
+	sa.dest_netaddr = ipsec_inet_addr("255.255.255.255") ;
+	sa.protocol = IPSEC_PROTO_ESP ;
+	sa.mode = IPSEC_TUNNEL ;
+	for(i = 0; i < 3; i++)
+	{
+		policy[i] = ipsec_spd_add(0, 0, ipsec_inet_addr("192.168.1.3")+i, 0xFFFFFFFF, 0, 0, 0, POLICY_BYPASS, &databases->outbound_spd) ;
+		sa.spi = ipsec_htonl(0x6000+i) ;
+		added_sa[i] = ipsec_sad_add(&sa, &databases->outbound_sad) ;
+	}
+
+	if((policy[2] == NULL) || (databases->outbound_spd.last != policy[2]) || (policy[1]->next != policy[2]) || (policy[2]->prev != policy[1]))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_db_last", "FAILURE", ("3rd SPD entry is not the last one")) ;
+	}
+
+	if((added_sa[2] == NULL) || (databases->outbound_sad.last != added_sa[2]) || (added_sa[1]->next != added_sa[2]) || (added_sa[2]->prev != added_sa[1]))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_db_last", "FAILURE", ("3rd SA is not the last one")) ;
+	}
+
+	if((ipsec_spd_del(policy[2], &databases->outbound_spd) != IPSEC_STATUS_SUCCESS) || 
+	   (databases->outbound_spd.last != policy[1]) || (policy[1]->next != NULL))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_db_last", "FAILURE", ("end of the SPD list was not moved back")) ;
+	}
+
+	if((ipsec_sad_del(added_sa[2], &databases->outbound_sad) != IPSEC_STATUS_SUCCESS) || 
+	   (databases->outbound_sad.last != added_sa[1]) || (added_sa[1]->next != NULL))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_db_last", "FAILURE", ("end of the SAD list was not moved back")) ;
+	}
+
+	ipsec_spd_release_dbs(databases) ;
+
+	return local_error_count ;
+}
+
+/**
+ * Check if entries which are deleted while a reader looks up the tables stay valid and are not 
+ * reused before the reader has left.
+ * 7 tests are performed here.
+ */
+int test_db_readers(void)
+{
+	int 			local_error_count = 0 ;
+	sad_entry		sa ;
+	sad_entry		*entry ;
+	sad_entry		*other ;
+	spd_entry		*policy ;
+	spd_entry		def_policy ;
+	ipsec_ip_header	header ;
+	db_set_netif	*databases ;
+
+	databases = ipsec_spd_create_dbs(test_arena, sizeof(test_arena), TEST_ARENA_SPD_ENTRIES, TEST_ARENA_SAD_ENTRIES) ;
+	if(databases == NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_db_readers", "FAILURE", ("unable to create the databases")) ;
+		return local_error_count ;
+	}
+
+	memset(&sa, 0, sizeof(sa)) ;
+	sa.dest = ipsec_inet_addr("192.168.1.3") ;
+	sa.dest_netaddr = ipsec_inet_addr("255.255.255.255") ;
+	sa.protocol = IPSEC_PROTO_ESP ;
+	sa.mode = IPSEC_TUNNEL ;
+	sa.spi = ipsec_htonl(0x4000) ;
+	entry = ipsec_sad_add(&sa, &databases->inbound_sad) ;
+
+	memset(&header, 0, sizeof(header)) ;
+	header.src = ipsec_inet_addr("192.168.1.1") ;
+	header.dest = ipsec_inet_addr("192.168.1.3") ;
+	header.protocol = IPSEC_PROTO_ICMP ;
+	memset(&def_policy, 0, sizeof(def_policy)) ;
+
+	/* reader 1 starts looking up the tables */
+	ipsec_db_enter(1) ;
+	if((entry == NULL) || (ipsec_sad_lookup(sa.dest, IPSEC_PROTO_ESP, sa.spi, &databases->inbound_sad) != entry))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_db_readers", "FAILURE", ("SA was not found by the reader")) ;
+	}
+
+	/* the SA is deleted while the reader may still use it */
+	if((ipsec_sad_del(entry, &databases->inbound_sad) != IPSEC_STATUS_SUCCESS) ||
+	   (ipsec_sad_lookup(sa.dest, IPSEC_PROTO_ESP, sa.spi, &databases->inbound_sad) != NULL) ||
+	   (entry->spi != sa.spi))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_db_readers", "FAILURE", ("deleted SA was still found or was changed")) ;
+	}
+
+	sa.spi = ipsec_htonl(0x4001) ;
+	other = ipsec_sad_add(&sa, &databases->inbound_sad) ;
+	if((other == NULL) || (other == entry))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_db_readers", "FAILURE", ("SA used by a reader was reused")) ;
+	}
+
+	/* the SPD can be changed once, then the previous classifier version is still used by the reader */
+	policy = ipsec_spd_add(0, 0, 0, 0, 0, 0, 0, POLICY_BYPASS, &databases->outbound_spd) ;
+	if((policy == NULL) || (ipsec_spd_lookup(&header, &databases->outbound_spd) != policy) ||
+	   (ipsec_spd_add(0, 0, 0, 0, 0, 0, 0, POLICY_DISCARD, &databases->outbound_spd) != NULL) ||
+	   (ipsec_spd_del(policy, &databases->outbound_spd) != IPSEC_STATUS_BUSY))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_db_readers", "FAILURE", ("SPD was changed while the previous classifier was in use")) ;
+	}
+
+	/* a flush which has to wait for the reader leaves the table as it is */
+	def_policy.policy = POLICY_DISCARD ;
+	if((ipsec_spd_flush(&databases->outbound_spd, &def_policy) != IPSEC_STATUS_BUSY) ||
+	   (ipsec_spd_lookup(&header, &databases->outbound_spd) != policy))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_db_readers", "FAILURE", ("SPD was flushed while the previous classifier was in use")) ;
+	}
+	ipsec_db_leave(1) ;
+
+	/* once the reader has left, the deleted SA is reused and the SPD can be changed again */
+	sa.spi = ipsec_htonl(0x4002) ;
+	if((ipsec_sad_add(&sa, &databases->inbound_sad) != entry) ||
+	   (ipsec_spd_del(policy, &databases->outbound_spd) != IPSEC_STATUS_SUCCESS) ||
+	   (ipsec_spd_lookup(&header, &databases->outbound_spd) != NULL))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_db_readers", "FAILURE", ("tables could not be changed after the reader has left")) ;
+	}
+
+	/* the flush publishes the default entry together with the removal of the flushed entries */
+	policy = ipsec_spd_add(0, 0, 0, 0, 0, 0, 0, POLICY_BYPASS, &databases->outbound_spd) ;
+	if((policy == NULL) || (ipsec_spd_flush(&databases->outbound_spd, &def_policy) != IPSEC_STATUS_SUCCESS) ||
+	   (ipsec_spd_lookup(&header, &databases->outbound_spd) == NULL) ||
+	   (ipsec_spd_lookup(&header, &databases->outbound_spd)->policy != POLICY_DISCARD))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_db_readers", "FAILURE", ("default entry was not published by the flush")) ;
+	}
+
+	ipsec_spd_release_dbs(databases) ;
+
+	return local_error_count ;
+}
+
 /**
  * Check if the Security Association Database (SAD) lookup function works.
  * 4 tests are performed here
@@ -855,6 +1297,127 @@ int test_sad_get_spi(void)
 	return local_error_count ;
 }
 
+/**
+ * Check if blocks of sequence numbers are reserved and if an SA refuses to cycle its sequence number.
+ * 5 tests are performed here.
+ */
+int test_sad_next_sequence(void)
+{
+	int 		local_error_count = 0 ;
+	sad_entry	sa ;
+	__u32		first = 0 ;
+
+	memset(&sa, 0, sizeof(sa)) ;
+	sa.spi = ipsec_htonl(0x5000) ;
+	sa.sequence_number = 10 ;
+
+	/* IPSEC_ATOMIC_CAS() needs naturally aligned counters (the SAs must not be packed) */
+	if((((unsigned long)&sa.sequence_number) % sizeof(__u32) != 0) || (((unsigned long)&sa.seq_exhausted) % sizeof(__u32) != 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_next_sequence", "FAILURE", ("sequence number of the SA is not aligned")) ;
+	}
+
+	if((ipsec_sad_next_sequence(&sa, 4, &first) != IPSEC_STATUS_SUCCESS) || (first != 11) || (sa.sequence_number != 14))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_next_sequence", "FAILURE", ("block of 4 sequence numbers was not reserved (first=%lu)", first)) ;
+	}
+
+	/* only one sequence number is left */
+	sa.sequence_number = 0xFFFFFFFEUL ;
+	if((ipsec_sad_next_sequence(&sa, 2, &first) != IPSEC_STATUS_SEQ_EXHAUSTED) || 
+	   (sa.sequence_number != 0xFFFFFFFEUL) || (sa.seq_exhausted != 2))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_next_sequence", "FAILURE", ("sequence number was allowed to cycle")) ;
+	}
+
+	if((ipsec_sad_next_sequence(&sa, 1, &first) != IPSEC_STATUS_SUCCESS) || (first != 0xFFFFFFFFUL) ||
+	   (ipsec_sad_next_sequence(&sa, 1, &first) != IPSEC_STATUS_SEQ_EXHAUSTED) || (sa.seq_exhausted != 3))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_next_sequence", "FAILURE", ("last sequence number was not handed out exactly once")) ;
+	}
+
+	/* the counter of the refused packets must not wrap to 0, which would report the SA again */
+	sa.seq_exhausted = 0xFFFFFFFEUL ;
+	if((ipsec_sad_next_sequence(&sa, 4, &first) != IPSEC_STATUS_SEQ_EXHAUSTED) || (sa.seq_exhausted != 0xFFFFFFFFUL))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_next_sequence", "FAILURE", ("counter of the refused packets wrapped")) ;
+	}
+
+	return local_error_count ;
+}
+
+
+/**
+ * Check the outer headers built from the template of an SA: the ID follows the sequence number, the checksum
+ * is valid, the headers for other tunnel addresses do not change the template and a template used by a reader 
+ * is not rebuilt.
+ * 4 tests are performed here.
+ */
+int test_sad_outer_header(void)
+{
+	int 			local_error_count = 0 ;
+	sad_entry		sa ;
+	sad_table		table ;
+	__u32			buffer[2][(IPSEC_MIN_IPHDR_SIZE + 4)/4] ;
+	ipsec_ip_header	*header[2] ;
+
+	header[0] = (ipsec_ip_header *)buffer[0] ;
+	header[1] = (ipsec_ip_header *)buffer[1] ;
+
+	memset(&sa, 0, sizeof(sa)) ;
+	sa.spi = ipsec_htonl(0x5000) ;
+	sa.protocol = IPSEC_PROTO_ESP ;
+	sa.ip_id_base = 0xFFFF ;
+	memset(&table, 0, sizeof(table)) ;
+	table.first = &sa ;
+
+	/* reader 1 may copy the templates which are replaced by the 1st change of the tunnel */
+	ipsec_db_enter(1) ;
+	if((ipsec_sad_set_tunnel(&table, 0x0301A8C0, 0x0501A8C0) != IPSEC_STATUS_SUCCESS) ||
+	   (ipsec_sad_set_tunnel(&table, 0x0301A8C0, 0x0601A8C0) != IPSEC_STATUS_BUSY) ||
+	   (sa.outer[sa.outer_version].ip.dest != 0x0501A8C0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_outer_header", "FAILURE", ("template used by a reader was rebuilt")) ;
+	}
+	ipsec_db_leave(1) ;
+
+	ipsec_sad_outer_header(&sa, header[0], 0x0301A8C0, 0x0501A8C0, 100, 1) ;
+	header[0]->tos = 0x10 ;
+	ipsec_sad_outer_chksum(&sa, header[0]) ;
+	ipsec_sad_outer_header(&sa, header[1], 0x0301A8C0, 0x0501A8C0, 1500, 2) ;
+	ipsec_sad_outer_chksum(&sa, header[1]) ;
+
+	if((header[0]->id != 0) || (header[1]->id != ipsec_htons(1)) || (header[0]->len != ipsec_htons(100)) || 
+	   (header[0]->ttl != IPSEC_OUTER_TTL) || (header[0]->protocol != IPSEC_PROTO_ESP) || (buffer[0][IPSEC_MIN_IPHDR_SIZE/4] != sa.spi))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_outer_header", "FAILURE", ("outer headers were not built from the template")) ;
+	}
+
+	if((ipsec_ip_chksum(header[0], IPSEC_MIN_IPHDR_SIZE) != 0) || (ipsec_ip_chksum(header[1], IPSEC_MIN_IPHDR_SIZE) != 0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_outer_header", "FAILURE", ("checksum of the outer header is wrong")) ;
+	}
+
+	ipsec_sad_outer_header(&sa, header[1], 0x0301A8C0, 0x0601A8C0, 1500, 2) ;
+	ipsec_sad_outer_chksum(&sa, header[1]) ;
+	if((header[1]->dest != 0x0601A8C0) || (ipsec_ip_chksum(header[1], IPSEC_MIN_IPHDR_SIZE) != 0) ||
+	   (sa.outer[sa.outer_version].ip.dest != 0x0501A8C0))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_outer_header", "FAILURE", ("header for another tunnel destination is wrong or changed the template")) ;
+	}
+
+	return local_error_count ;
+}
+
 
 int test_spd_flush(void)
 {
@@ -874,9 +1437,126 @@ int test_sad_add(void)
 }
 
 
+/**
+ * Check if deleting, adding and flushing SAs keeps the SPI index of the SAD and the SPD entries in sync.
+ * 8 tests are performed here.
+ */
 int test_sad_del(void)
 {
-	return IPSEC_STATUS_NOT_IMPLEMENTED ;
+	int local_error_count = 0 ;
+	sad_entry	sa ;
+	sad_entry	*added_sa ;
+
+	db_set_netif *databases ;
+
+	/* init the config data */
+	memcpy(inbound_spd, inbound_spd_test, IPSEC_MAX_SPD_ENTRIES*sizeof(spd_entry)) ;
+	memcpy(outbound_spd, outbound_spd_test, IPSEC_MAX_SPD_ENTRIES*sizeof(spd_entry)) ;
+	memcpy(inbound_sad, inbound_sad_test, IPSEC_MAX_SAD_ENTRIES*sizeof(sad_entry)) ;
+	memcpy(outbound_sad, outbound_sad_test, IPSEC_MAX_SAD_ENTRIES*sizeof(sad_entry)) ;
+
+	/* init the table */
+	databases = ipsec_spd_load_dbs(inbound_spd, outbound_spd, inbound_sad, outbound_sad) ;
+	if(databases == NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_del", "FAILURE", ("unable to initialize the databases")) ;
+		return local_error_count ;
+	}
+
+	/* same SPI as the 1st SA, so it ends up in the same bucket */
+	memset(&sa, 0, sizeof(sa)) ;
+	sa.dest = ipsec_inet_addr("192.168.1.7") ;
+	sa.dest_netaddr = ipsec_inet_addr("255.255.255.255") ;
+	sa.spi = IPSEC_HTONL(0x1001) ;
+	sa.protocol = IPSEC_PROTO_AH ;
+	sa.mode = IPSEC_TUNNEL ;
+	added_sa = ipsec_sad_add(&sa, &databases->inbound_sad) ;
+	if(added_sa == NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_del", "FAILURE", ("unable to add an SA")) ;
+	}
+
+	if (ipsec_sad_lookup(ipsec_inet_addr("192.168.1.7"), IPSEC_PROTO_AH, IPSEC_HTONL(0x1001), &databases->inbound_sad) != added_sa)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_del", "FAILURE", ("lookup of the added SA failed")) ;
+	}
+
+	/* the policies must not keep the deleted SAs */
+	ipsec_spd_add_sa(databases->inbound_spd.first, &databases->inbound_sad.table[0]) ;
+	ipsec_spd_add_sa(databases->inbound_spd.first->next, &databases->inbound_sad.table[1]) ;
+
+	if (ipsec_sad_del(&databases->inbound_sad.table[0], &databases->inbound_sad) != IPSEC_STATUS_SUCCESS)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_del", "FAILURE", ("unable to delete the 1st SA")) ;
+	}
+
+	if (ipsec_sad_lookup(ipsec_inet_addr("192.168.1.1"), IPSEC_PROTO_ESP, IPSEC_HTONL(0x1001), &databases->inbound_sad) != NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_del", "FAILURE", ("deleted SA was still found")) ;
+	}
+
+	if (ipsec_sad_lookup(ipsec_inet_addr("192.168.1.7"), IPSEC_PROTO_AH, IPSEC_HTONL(0x1001), &databases->inbound_sad) != added_sa)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_del", "FAILURE", ("added SA was lost when deleting the 1st SA")) ;
+	}
+
+	if (ipsec_sad_lookup(ipsec_inet_addr("192.168.1.2"), IPSEC_PROTO_AH, IPSEC_HTONL(0x1002), &databases->inbound_sad) != &databases->inbound_sad.table[1])
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_del", "FAILURE", ("2nd SA was lost when deleting the 1st SA")) ;
+	}
+
+	ipsec_sad_flush(&databases->inbound_sad) ;
+	if (ipsec_sad_lookup(ipsec_inet_addr("192.168.1.2"), IPSEC_PROTO_AH, IPSEC_HTONL(0x1002), &databases->inbound_sad) != NULL)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_del", "FAILURE", ("SA was still found after flushing the SAD")) ;
+	}
+
+	if ((databases->inbound_spd.first->sa != NULL) || (databases->inbound_spd.first->next->sa != NULL))
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_del", "FAILURE", ("SPD entry still refers to a deleted SA")) ;
+	}
+
+	ipsec_spd_release_dbs(databases) ;
+
+	return local_error_count ;
+}
+
+
+/**
+ * Check if a statically configured SA keeps all bytes of a 64 byte authentication key (HMAC-SHA-512).
+ * 1 test is performed here.
+ */
+int test_sad_entry_authkey(void)
+{
+	int 		local_error_count = 0 ;
+	int			i ;
+	sad_entry	sa = { SAD_ENTRY(	192,168,1,1, 255,255,255,255, 
+									0x1001, 
+									IPSEC_PROTO_AH, IPSEC_TUNNEL, 
+									0, 
+									0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
+									IPSEC_HMAC_SHA512, 
+									0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F, 0x40) } ;
+
+	for(i = 0; i < IPSEC_AUTH_SHA512_KEY_LEN; i++)
+		if(sa.authkey[i] != i + 1)
+			break ;
+	if(i != IPSEC_AUTH_SHA512_KEY_LEN)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST("test_sad_entry_authkey", "FAILURE", ("byte %d of the authentication key is not configured", i)) ;
+	}
+
+	return local_error_count ;
 }
 
 
@@ -887,8 +1567,8 @@ int test_sad_del(void)
 void sa_test(test_result *global_results)
 {
 	test_result 	sub_results	= {
-						 47, 			
-						 10,			
+						 94, 			
+						 19,			
 						  0, 			
 						  0, 		
 					};
@@ -907,6 +1587,24 @@ void sa_test(test_result *global_results)
 	retcode = test_spd_del() ;
 	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sa_test_spd_del()", (" "));
 
+	retcode = test_spd_lookup() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sa_test_spd_lookup()", (" "));
+
+	retcode = test_spd_cache() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sa_test_spd_cache()", (" "));
+
+	retcode = test_spd_create_dbs() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sa_test_spd_create_dbs()", (" "));
+
+	retcode = test_spd_multi_dbs() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sa_test_spd_multi_dbs()", (" "));
+
+	retcode = test_db_readers() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sa_test_db_readers()", (" "));
+
+	retcode = test_db_last() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sa_test_db_last()", (" "));
+
 	retcode = test_sad_add() ;
 	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sa_test_sad_add()", (" "));
 
@@ -919,6 +1617,15 @@ void sa_test(test_result *global_results)
 	retcode = test_sad_get_spi() ;
 	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sa_test_sad_get_spi()", (" "));
 
+	retcode = test_sad_next_sequence() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sa_test_sad_next_sequence()", (" "));
+
+	retcode = test_sad_outer_header() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sa_test_sad_outer_header()", (" "));
+
+	retcode = test_sad_entry_authkey() ;
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sa_test_sad_entry_authkey()", (" "));
+
 	retcode = test_spd_flush() ;
 	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sa_test_spd_flush()", (" "));
 
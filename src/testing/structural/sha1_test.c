@@ -261,6 +261,93 @@ int sha1_test_SHA1_Final(void)
 
 
 
+/**
+ * Testfunction for the precomputed HMAC-SHA1 (RFC 2104 test case 2)
+ * The same precomputed state is used twice to make sure it is not modified.
+ * @return int number of tests failed in this function
+ */
+int sha1_test_hmac_sha1_precomputed(void)
+{
+	HMAC_SHA1_CTX	hctx ;
+	unsigned char 	text[] = "what do ya want for nothing?" ;
+	unsigned char 	key[] = "Jefe" ;
+	unsigned char 	orig_digest[] = { 0xEF, 0xFC, 0xDF, 0x6A, 0xE5, 0xEB, 0x2F, 0xA2, 0xD2, 0x74, 0x16, 0xD5, 0xF1, 0x84, 0xDF, 0x9C, 0x25, 0x9A, 0x7C, 0x79 } ;
+	unsigned char 	digest[20] ;
+	int 			local_error_count = 0;
+	int				i ;
+
+	hmac_sha1_init(&hctx, key, 4) ;
+
+	for(i = 0; i < 2; i++)
+	{
+		memset(digest, 0, sizeof(digest)) ;
+		hmac_sha1_precomputed(&hctx, text, 28, digest) ;
+
+		if(memcmp(digest, orig_digest, sizeof(orig_digest)) != 0)
+		{
+			local_error_count++;
+			IPSEC_LOG_TST("sha1_test_hmac_sha1_precomputed", "FAILURE", ("digest %d does not match", i)) ;
+			printf("     OUTPUT:\n") ;
+			IPSEC_DUMP_BUFFER("          ", (char*)&digest, 0, sizeof(digest));
+			printf("     EXPECTED OUTPUT:\n") ;
+			IPSEC_DUMP_BUFFER("          ", (char*)&orig_digest, 0, sizeof(orig_digest));
+		}
+	}
+
+	return local_error_count;
+}
+
+/**
+ * Tests all SHA1 engines with the FIPS 180-2 example "abc" (one block hashed from the context) 
+ * and with 1000 bytes which are passed in pieces, so blocks are hashed from the context and 
+ * directly from the data. An engine which is not available is replaced by the portable one.
+ * @return int number of tests failed in this function
+ */
+int sha1_test_engines(void)
+{
+	unsigned char 	abc_digest[20] = { 0xA9, 0x99, 0x3E, 0x36, 0x47, 0x06, 0x81, 0x6A, 0xBA, 0x3E, 0x25, 0x71, 0x78, 0x50, 0xC2, 0x6C, 0x9C, 0xD0, 0xD8, 0x9D } ;
+	unsigned char 	long_digest[20] = { 0x33, 0xF2, 0x33, 0xC9, 0x7A, 0x80, 0x3D, 0x84, 0xA0, 0xDB, 0x9F, 0x3D, 0xBC, 0x05, 0xB6, 0x3F, 0xF2, 0x04, 0x5D, 0x92 } ;
+	unsigned char 	text[1000] ;
+	unsigned char 	digest[20] ;
+	SHA_CTX 		context ;
+	int 			local_error_count = 0;
+	int				previous, engine ;
+	int				i ;
+
+	for(i = 0; i < (int)sizeof(text); i++)
+		text[i] = (unsigned char)((i*7) % 251) ;
+
+	previous = sha1_set_engine(HASH_SHA1_PORTABLE) ;
+	for(engine = HASH_SHA1_PORTABLE; engine <= HASH_SHA1_NI; engine++)
+	{
+		sha1_set_engine(engine) ;
+
+		SHA1_Init(&context) ;
+		SHA1_Update(&context, "abc", 3) ;
+		SHA1_Final(digest, &context) ;
+		if(memcmp(digest, abc_digest, sizeof(abc_digest)) != 0)
+		{
+			local_error_count++;
+			IPSEC_LOG_TST("sha1_test_engines", "FAILURE", ("digest of \"abc\" does not match (engine %d)", engine)) ;
+		}
+
+		SHA1_Init(&context) ;
+		SHA1_Update(&context, text, 1) ;
+		SHA1_Update(&context, text+1, 63) ;
+		SHA1_Update(&context, text+64, 200) ;
+		SHA1_Update(&context, text+264, 736) ;
+		SHA1_Final(digest, &context) ;
+		if(memcmp(digest, long_digest, sizeof(long_digest)) != 0)
+		{
+			local_error_count++;
+			IPSEC_LOG_TST("sha1_test_engines", "FAILURE", ("digest of 1000 bytes does not match (engine %d)", engine)) ;
+		}
+	}
+	sha1_set_engine(previous) ;
+
+	return local_error_count;
+}
+
 /**
  * Main test function for the SHA1 tests.
  * It does nothing but calling the subtests one after the other.
@@ -268,8 +355,8 @@ int sha1_test_SHA1_Final(void)
 void sha1_test(test_result *global_results)
 {
 	test_result 	sub_results	= {
-						 13, 			
-						  3,			
+						 19, 			
+						  5,			
 						  0, 			
 						  0, 			
 					};
@@ -284,6 +371,12 @@ void sha1_test(test_result *global_results)
 	retcode = sha1_test_SHA1_Final();
 	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sha1_test_SHA1_Final()", ("ported from openssl.org"));
 
+	retcode = sha1_test_hmac_sha1_precomputed();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sha1_test_hmac_sha1_precomputed()", (" "));
+
+	retcode = sha1_test_engines();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sha1_test_engines()", (" "));
+
 	global_results->tests += sub_results.tests;
 	global_results->functions += sub_results.functions;
 	global_results->errors += sub_results.errors;
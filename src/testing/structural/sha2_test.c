@@ -0,0 +1,264 @@
+/*
+ * embedded IPsec
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+/** @file sha2_test.c
+ *  @brief Test functions for SHA-256, SHA-384 and SHA-512
+ *
+ *  <B>OUTLINE:</B>
+ *
+ *  This file contains test functions used to verify the SHA-2 code against the examples of 
+ *  FIPS 180-2 (appendix B, C and D) and the HMAC test cases of RFC 4231.
+ *
+ *  <B>IMPLEMENTATION:</B>
+ *
+ *  SHA-256 is tested with both engines, an engine which is not available is replaced by the
+ *  portable one.
+ *
+ *  <B>NOTES:</B>
+ *
+ * This document is part of <EM>embedded IPsec<BR>
+ * Copyright (c) 2003 Niklaus Schild and Christian Scheurer, HTI Biel/Bienne<BR>
+ * All rights reserved.</EM><HR>
+ */
+
+#include <string.h>
+
+#include "ipsec/util.h"
+#include "ipsec/sha2.h"
+#include "ipsec/debug.h"
+#include "testing/structural/structural_test.h"
+
+
+/**
+ * Tests SHA-256 with the one and the two block example of FIPS 180-2 on both engines. The 
+ * second message is hashed in three pieces.
+ * 4 tests are performed here.
+ * @return int number of tests failed in this function
+ */
+int sha2_test_sha256(void)
+{
+	unsigned char	text1[] = "abc" ;
+	unsigned char	text2[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq" ;
+	unsigned char	digest1[32] = { 0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23, 
+									0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad } ;
+	unsigned char	digest2[32] = { 0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39, 
+									0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1 } ;
+	unsigned char	digest[32] ;
+	SHA256_CTX		context ;
+	int 			local_error_count = 0;
+	int				previous ;
+	int				engine ;
+
+	previous = sha256_set_engine(HASH_SHA256_PORTABLE) ;
+	for(engine = HASH_SHA256_PORTABLE; engine <= HASH_SHA256_NI; engine++)
+	{
+		sha256_set_engine(engine) ;
+
+		SHA256_Init(&context) ;
+		SHA256_Update(&context, text1, 3) ;
+		SHA256_Final(digest, &context) ;
+		if(memcmp(digest, digest1, sizeof(digest)) != 0)
+		{
+			local_error_count++;
+			IPSEC_LOG_TST("sha2_test_sha256", "FAILURE", ("digest of \"abc\" does not match (engine %d)", engine)) ;
+			IPSEC_DUMP_BUFFER("          ", (char*)&digest, 0, sizeof(digest));
+		}
+
+		SHA256_Init(&context) ;
+		SHA256_Update(&context, text2, 5) ;
+		SHA256_Update(&context, text2+5, 40) ;
+		SHA256_Update(&context, text2+45, 11) ;
+		SHA256_Final(digest, &context) ;
+		if(memcmp(digest, digest2, sizeof(digest)) != 0)
+		{
+			local_error_count++;
+			IPSEC_LOG_TST("sha2_test_sha256", "FAILURE", ("digest of the two block message does not match (engine %d)", engine)) ;
+			IPSEC_DUMP_BUFFER("          ", (char*)&digest, 0, sizeof(digest));
+		}
+	}
+	sha256_set_engine(previous) ;
+
+	return local_error_count;
+}
+
+
+/**
+ * Tests SHA-384 and SHA-512 with the one block example of FIPS 180-2.
+ * 2 tests are performed here.
+ * @return int number of tests failed in this function
+ */
+int sha2_test_sha512(void)
+{
+	unsigned char	text[] = "abc" ;
+	unsigned char	digest384[48] = { 0xcb, 0x00, 0x75, 0x3f, 0x45, 0xa3, 0x5e, 0x8b, 0xb5, 0xa0, 0x3d, 0x69, 0x9a, 0xc6, 0x50, 0x07, 
+									  0x27, 0x2c, 0x32, 0xab, 0x0e, 0xde, 0xd1, 0x63, 0x1a, 0x8b, 0x60, 0x5a, 0x43, 0xff, 0x5b, 0xed, 
+									  0x80, 0x86, 0x07, 0x2b, 0xa1, 0xe7, 0xcc, 0x23, 0x58, 0xba, 0xec, 0xa1, 0x34, 0xc8, 0x25, 0xa7 } ;
+	unsigned char	digest512[64] = { 0xdd, 0xaf, 0x35, 0xa1, 0x93, 0x61, 0x7a, 0xba, 0xcc, 0x41, 0x73, 0x49, 0xae, 0x20, 0x41, 0x31, 
+									  0x12, 0xe6, 0xfa, 0x4e, 0x89, 0xa9, 0x7e, 0xa2, 0x0a, 0x9e, 0xee, 0xe6, 0x4b, 0x55, 0xd3, 0x9a, 
+									  0x21, 0x92, 0x99, 0x2a, 0x27, 0x4f, 0xc1, 0xa8, 0x36, 0xba, 0x3c, 0x23, 0xa3, 0xfe, 0xeb, 0xbd, 
+									  0x45, 0x4d, 0x44, 0x23, 0x64, 0x3c, 0xe8, 0x0e, 0x2a, 0x9a, 0xc9, 0x4f, 0xa5, 0x4c, 0xa4, 0x9f } ;
+	unsigned char	digest[64] ;
+	SHA512_CTX		context ;
+	int 			local_error_count = 0;
+
+	SHA384_Init(&context) ;
+	SHA512_Update(&context, text, 3) ;
+	SHA512_Final(digest, &context) ;
+	if(memcmp(digest, digest384, sizeof(digest384)) != 0)
+	{
+		local_error_count++;
+		IPSEC_LOG_TST("sha2_test_sha512", "FAILURE", ("SHA-384 digest does not match")) ;
+		IPSEC_DUMP_BUFFER("          ", (char*)&digest, 0, sizeof(digest384));
+	}
+
+	SHA512_Init(&context) ;
+	SHA512_Update(&context, text, 3) ;
+	SHA512_Final(digest, &context) ;
+	if(memcmp(digest, digest512, sizeof(digest512)) != 0)
+	{
+		local_error_count++;
+		IPSEC_LOG_TST("sha2_test_sha512", "FAILURE", ("SHA-512 digest does not match")) ;
+		IPSEC_DUMP_BUFFER("          ", (char*)&digest, 0, sizeof(digest512));
+	}
+
+	return local_error_count;
+}
+
+
+/**
+ * Tests HMAC-SHA-256, HMAC-SHA-384 and HMAC-SHA-512 with RFC 4231 test case 2, and HMAC-SHA-256 
+ * and HMAC-SHA-512 with test case 6 (key longer than a block) on a chain of two buffers.
+ * 5 tests are performed here.
+ * @return int number of tests failed in this function
+ */
+int sha2_test_hmac(void)
+{
+	unsigned char	text2[] = "what do ya want for nothing?" ;
+	unsigned char	key2[] = "Jefe" ;
+	unsigned char	text6[] = "Test Using Larger Than Block-Size Key - Hash Key First" ;
+	unsigned char	hmac256_2[32] = { 0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7, 
+									  0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43 } ;
+	unsigned char	hmac384_2[48] = { 0xaf, 0x45, 0xd2, 0xe3, 0x76, 0x48, 0x40, 0x31, 0x61, 0x7f, 0x78, 0xd2, 0xb5, 0x8a, 0x6b, 0x1b, 
+									  0x9c, 0x7e, 0xf4, 0x64, 0xf5, 0xa0, 0x1b, 0x47, 0xe4, 0x2e, 0xc3, 0x73, 0x63, 0x22, 0x44, 0x5e, 
+									  0x8e, 0x22, 0x40, 0xca, 0x5e, 0x69, 0xe2, 0xc7, 0x8b, 0x32, 0x39, 0xec, 0xfa, 0xb2, 0x16, 0x49 } ;
+	unsigned char	hmac512_2[64] = { 0x16, 0x4b, 0x7a, 0x7b, 0xfc, 0xf8, 0x19, 0xe2, 0xe3, 0x95, 0xfb, 0xe7, 0x3b, 0x56, 0xe0, 0xa3, 
+									  0x87, 0xbd, 0x64, 0x22, 0x2e, 0x83, 0x1f, 0xd6, 0x10, 0x27, 0x0c, 0xd7, 0xea, 0x25, 0x05, 0x54, 
+									  0x97, 0x58, 0xbf, 0x75, 0xc0, 0x5a, 0x99, 0x4a, 0x6d, 0x03, 0x4f, 0x65, 0xf8, 0xf0, 0xe6, 0xfd, 
+									  0xca, 0xea, 0xb1, 0xa3, 0x4d, 0x4a, 0x6b, 0x4b, 0x63, 0x6e, 0x07, 0x0a, 0x38, 0xbc, 0xe7, 0x37 } ;
+	unsigned char	hmac256_6[32] = { 0x60, 0xe4, 0x31, 0x59, 0x1e, 0xe0, 0xb6, 0x7f, 0x0d, 0x8a, 0x26, 0xaa, 0xcb, 0xf5, 0xb7, 0x7f, 
+									  0x8e, 0x0b, 0xc6, 0x21, 0x37, 0x28, 0xc5, 0x14, 0x05, 0x46, 0x04, 0x0f, 0x0e, 0xe3, 0x7f, 0x54 } ;
+	unsigned char	hmac512_6[64] = { 0x80, 0xb2, 0x42, 0x63, 0xc7, 0xc1, 0xa3, 0xeb, 0xb7, 0x14, 0x93, 0xc1, 0xdd, 0x7b, 0xe8, 0xb4, 
+									  0x9b, 0x46, 0xd1, 0xf4, 0x1b, 0x4a, 0xee, 0xc1, 0x12, 0x1b, 0x01, 0x37, 0x83, 0xf8, 0xf3, 0x52, 
+									  0x6b, 0x56, 0xd0, 0x37, 0xe0, 0x5f, 0x25, 0x98, 0xbd, 0x0f, 0xd2, 0x21, 0x5d, 0x6a, 0x1e, 0x52, 
+									  0x95, 0xe6, 0x4f, 0x73, 0xf6, 0x3f, 0x0a, 0xec, 0x8b, 0x91, 0x5a, 0x98, 0x5d, 0x78, 0x65, 0x98 } ;
+	unsigned char	key6[131] ;
+	unsigned char	digest[64] ;
+	HMAC_SHA256_CTX	hctx256 ;
+	HMAC_SHA512_CTX	hctx512 ;
+	ipsec_buffer	segments[2] ;
+	int 			local_error_count = 0;
+
+	hmac_sha256(text2, 28, key2, 4, digest) ;
+	if(memcmp(digest, hmac256_2, sizeof(hmac256_2)) != 0)
+	{
+		local_error_count++;
+		IPSEC_LOG_TST("sha2_test_hmac", "FAILURE", ("HMAC-SHA-256 digest does not match")) ;
+	}
+
+	hmac_sha384(text2, 28, key2, 4, digest) ;
+	if(memcmp(digest, hmac384_2, sizeof(hmac384_2)) != 0)
+	{
+		local_error_count++;
+		IPSEC_LOG_TST("sha2_test_hmac", "FAILURE", ("HMAC-SHA-384 digest does not match")) ;
+	}
+
+	hmac_sha512(text2, 28, key2, 4, digest) ;
+	if(memcmp(digest, hmac512_2, sizeof(hmac512_2)) != 0)
+	{
+		local_error_count++;
+		IPSEC_LOG_TST("sha2_test_hmac", "FAILURE", ("HMAC-SHA-512 digest does not match")) ;
+	}
+
+	/* the key is hashed first, the text is split into two segments */
+	memset(key6, 0xaa, sizeof(key6)) ;
+	segments[0].next = &segments[1] ;
+	segments[0].data = text6 ;
+	segments[0].len = 20 ;
+	segments[1].next = NULL ;
+	segments[1].data = text6 + 20 ;
+	segments[1].len = 34 ;
+
+	hmac_sha256_init(&hctx256, key6, sizeof(key6)) ;
+	hmac_sha256_chain(&hctx256, segments, 0, 54, digest) ;
+	if(memcmp(digest, hmac256_6, sizeof(hmac256_6)) != 0)
+	{
+		local_error_count++;
+		IPSEC_LOG_TST("sha2_test_hmac", "FAILURE", ("HMAC-SHA-256 digest with a long key does not match")) ;
+	}
+
+	hmac_sha512_init(&hctx512, key6, sizeof(key6)) ;
+	hmac_sha512_chain(&hctx512, segments, 0, 54, digest) ;
+	if(memcmp(digest, hmac512_6, sizeof(hmac512_6)) != 0)
+	{
+		local_error_count++;
+		IPSEC_LOG_TST("sha2_test_hmac", "FAILURE", ("HMAC-SHA-512 digest with a long key does not match")) ;
+	}
+
+	return local_error_count;
+}
+
+
+/**
+ * Main test function for the SHA-2 tests.
+ * It does nothing but calling the subtests one after the other.
+ */
+void sha2_test(test_result *global_results)
+{
+	test_result 	sub_results	= {
+						 11, 			
+						  3,			
+						  0, 			
+						  0, 			
+					};
+	int retcode;
+
+	retcode = sha2_test_sha256();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sha2_test_sha256()", ("FIPS 180-2"));
+
+	retcode = sha2_test_sha512();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sha2_test_sha512()", ("FIPS 180-2"));
+
+	retcode = sha2_test_hmac();
+	IPSEC_TESTING_EVALUATE(retcode, sub_results, "sha2_test_hmac()", ("RFC 4231"));
+
+	global_results->tests += sub_results.tests;
+	global_results->functions += sub_results.functions;
+	global_results->errors += sub_results.errors;
+	global_results->notimplemented += sub_results.notimplemented;
+}
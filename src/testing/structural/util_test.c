@@ -121,32 +121,31 @@ int util_test_ipsec_update_replay_window()
 {
 	int local_error_count = 0;
 	int i, errors;
-	__u32 bitmap;   			/* saved session state to detect replays - must be 32 bits. */
-	__u32 lastSeq;        		/* saved session state to detect replays */
+	ipsec_replay_state state;	/* saved session state to detect replays */
+	__u32 window;
 	__u32 test_sequence;
 
 
 
 	/* Test 1: sequence number is increasing strictly from 1 to 101 */
 	/* Expected result: checks and updates should pass error free   */
-	bitmap 			= 0;
-	lastSeq 		= 0;
+	ipsec_init_replay_window(&state, IPSEC_SEQ_MIN_WINDOW);
 	test_sequence 	= 1;
 	errors 			= 0;
 	
 	for(i = 0; i < 100; i++) 
 	{
 		/* check window */	   
-		if(ipsec_check_replay_window(test_sequence, lastSeq, bitmap) != IPSEC_AUDIT_SUCCESS)
+		if(ipsec_check_replay_window(test_sequence, &state) != IPSEC_AUDIT_SUCCESS)
 		{
-//			IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay check (lastSeq=%08lx, seq=%08lx, window size=%d)", lastSeq, test_sequence, IPSEC_SEQ_MAX_WINDOW) );
+//			IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay check (lastSeq=%08lx, seq=%08lx, window size=%d)", state.last_seq, test_sequence, state.window) );
 			errors++;
 		}
 
 		/* update window */
-		if(ipsec_update_replay_window(test_sequence, (__u32 *)&lastSeq, (__u32 *)&bitmap) != IPSEC_AUDIT_SUCCESS)
+		if(ipsec_update_replay_window(test_sequence, &state) != IPSEC_AUDIT_SUCCESS)
 		{
-//			IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay update (lastSeq=%08lx, seq=%08lx, window size=%d)", lastSeq, test_sequence, IPSEC_SEQ_MAX_WINDOW) );
+//			IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay update (lastSeq=%08lx, seq=%08lx, window size=%d)", state.last_seq, test_sequence, state.window) );
 			errors++;
 		}
 
@@ -164,9 +163,9 @@ int util_test_ipsec_update_replay_window()
 
 	/* Test 2: replay detection - sequence counting from 0..100, then repeating 90..95 */
 	/* Expected result: 6 packets should fail  */
-	bitmap 			= 0xFFFFFFFF;
-	lastSeq 		= 0x00000064;
-	test_sequence 	= 0x00000065;
+	ipsec_init_replay_window(&state, IPSEC_SEQ_MIN_WINDOW);
+	for(test_sequence = 1; test_sequence <= 0x00000064; test_sequence++)
+		ipsec_update_replay_window(test_sequence, &state);
 	errors 			= 0;
 
  	// Simulate Replay of packet 90 to 95
@@ -174,16 +173,16 @@ int util_test_ipsec_update_replay_window()
 	for(i = 0; i < 6; i++) 
 	{
 		/* check window */	   
-		if(ipsec_check_replay_window(test_sequence, lastSeq, bitmap) != IPSEC_AUDIT_SUCCESS)
+		if(ipsec_check_replay_window(test_sequence, &state) != IPSEC_AUDIT_SUCCESS)
 		{
-//			IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay check (lastSeq=%08lx, seq=%08lx, window size=%d)", lastSeq, test_sequence, IPSEC_SEQ_MAX_WINDOW) );
+//			IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay check (lastSeq=%08lx, seq=%08lx, window size=%d)", state.last_seq, test_sequence, state.window) );
 			errors++;
 		}
 
 		/* update window */
-		if(ipsec_update_replay_window(test_sequence, (__u32 *)&lastSeq, (__u32 *)&bitmap) != IPSEC_AUDIT_SUCCESS)
+		if(ipsec_update_replay_window(test_sequence, &state) != IPSEC_AUDIT_SUCCESS)
 		{
-//			IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay update (lastSeq=%08lx, seq=%08lx, window size=%d)", lastSeq, test_sequence, IPSEC_SEQ_MAX_WINDOW) );
+//			IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay update (lastSeq=%08lx, seq=%08lx, window size=%d)", state.last_seq, test_sequence, state.window) );
 			errors++;
 		}
 
@@ -201,41 +200,41 @@ int util_test_ipsec_update_replay_window()
 
 	/* Test 3: out of window tests */
 	/* Expected result: sequence numbers outside the window should be rejected */
-	bitmap 			= 0xFFFFFFFF;
-	lastSeq 		= IPSEC_SEQ_MAX_WINDOW * 5 - 1;
-	test_sequence 	= IPSEC_SEQ_MAX_WINDOW * 5;
+	window 			= IPSEC_SEQ_MIN_WINDOW;
+	ipsec_init_replay_window(&state, window);
+	ipsec_update_replay_window(window * 5 - 1, &state);
 	errors 			= 0;
 
 
 	// Test packet with too low  sequence number
-	test_sequence 	= IPSEC_SEQ_MAX_WINDOW * 2;
+	test_sequence 	= window * 2;
 	
 	/* check window */	   
-	if(ipsec_check_replay_window(test_sequence, lastSeq, bitmap) != IPSEC_AUDIT_SUCCESS)
+	if(ipsec_check_replay_window(test_sequence, &state) != IPSEC_AUDIT_SUCCESS)
 	{
-//		IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay check (lastSeq=%08lx, seq=%08lx, window size=%d)", lastSeq, test_sequence, IPSEC_SEQ_MAX_WINDOW) );
+//		IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay check (lastSeq=%08lx, seq=%08lx, window size=%d)", state.last_seq, test_sequence, state.window) );
 		errors++;
 	}
 	/* update window */
-	if(ipsec_update_replay_window(test_sequence, (__u32 *)&lastSeq, (__u32 *)&bitmap) != IPSEC_AUDIT_SUCCESS)
+	if(ipsec_update_replay_window(test_sequence, &state) != IPSEC_AUDIT_SUCCESS)
 	{
-//		IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay update (lastSeq=%08lx, seq=%08lx, window size=%d)", lastSeq, test_sequence, IPSEC_SEQ_MAX_WINDOW) );
+//		IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay update (lastSeq=%08lx, seq=%08lx, window size=%d)", state.last_seq, test_sequence, state.window) );
 		errors++;
 	}
 
 	// Test packet with too high sequence number
-	test_sequence 	= IPSEC_SEQ_MAX_WINDOW * 8;
+	test_sequence 	= window * 8;
 	
 	/* check window */	   
-	if(ipsec_check_replay_window(test_sequence, lastSeq, bitmap) != IPSEC_AUDIT_SUCCESS)
+	if(ipsec_check_replay_window(test_sequence, &state) != IPSEC_AUDIT_SUCCESS)
 	{
-//		IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay check (lastSeq=%08lx, seq=%08lx, window size=%d)", lastSeq, test_sequence, IPSEC_SEQ_MAX_WINDOW) );
+//		IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay check (lastSeq=%08lx, seq=%08lx, window size=%d)", state.last_seq, test_sequence, state.window) );
 		errors++;
 	}
 	/* update window */
-	if(ipsec_update_replay_window(test_sequence, (__u32 *)&lastSeq, (__u32 *)&bitmap) != IPSEC_AUDIT_SUCCESS)
+	if(ipsec_update_replay_window(test_sequence, &state) != IPSEC_AUDIT_SUCCESS)
 	{
-//		IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay update (lastSeq=%08lx, seq=%08lx, window size=%d)", lastSeq, test_sequence, IPSEC_SEQ_MAX_WINDOW) );
+//		IPSEC_LOG_TST("util_test_ipsec_update_replay_window", "FAILURE", ("packet rejected by anti-replay update (lastSeq=%08lx, seq=%08lx, window size=%d)", state.last_seq, test_sequence, state.window) );
 		errors++;
 	}
 	
@@ -247,6 +246,40 @@ int util_test_ipsec_update_replay_window()
 
 
 
+	/* Test 4: large window with reordering across several bitmap words */
+	/* Expected result: every packet inside the window is accepted exactly once */
+	ipsec_init_replay_window(&state, IPSEC_SEQ_MAX_WINDOW);
+	errors 			= 0;
+
+	/* every second packet first, then the missing ones in reverse order */
+	for(test_sequence = 2; test_sequence <= IPSEC_SEQ_MAX_WINDOW; test_sequence += 2)
+		if(ipsec_update_replay_window(test_sequence, &state) != IPSEC_AUDIT_SUCCESS) errors++;
+	for(i = IPSEC_SEQ_MAX_WINDOW - 1; i >= 1; i -= 2)
+		if(ipsec_update_replay_window(i, &state) != IPSEC_AUDIT_SUCCESS) errors++;
+
+	/* all of them must now be detected as replays */
+	for(test_sequence = 1; test_sequence <= IPSEC_SEQ_MAX_WINDOW; test_sequence++)
+		if(ipsec_check_replay_window(test_sequence, &state) == IPSEC_AUDIT_SUCCESS) errors++;
+
+	/* slide the window by 100 packets: packet 100 drops out of the window, 101 is still inside */
+	if(ipsec_update_replay_window(IPSEC_SEQ_MAX_WINDOW + 100, &state) != IPSEC_AUDIT_SUCCESS) errors++;
+	if(ipsec_check_replay_window(100, &state) == IPSEC_AUDIT_SUCCESS) errors++;
+	if(ipsec_check_replay_window(101, &state) == IPSEC_AUDIT_SUCCESS) errors++;
+	if(ipsec_check_replay_window(IPSEC_SEQ_MAX_WINDOW + 50, &state) != IPSEC_AUDIT_SUCCESS) errors++;
+
+	/* window sizes are rounded up to whole words and limited */
+	ipsec_init_replay_window(&state, 100);
+	if(state.window != 128) errors++;
+	ipsec_init_replay_window(&state, 0);
+	if(state.window != IPSEC_SEQ_DEFAULT_WINDOW) errors++;
+
+	if(errors != 0)
+	{
+		local_error_count++ ;
+		IPSEC_LOG_TST(util_test_ipsec_update_replay_window, "FAILURE", ("Large window tests failed - %d errors detected", errors)) ;
+	}
+
+
 	return local_error_count;
 }
 
@@ -257,7 +290,7 @@ int util_test_ipsec_update_replay_window()
 void util_debug_test(test_result *global_results)
 {
 	test_result 	sub_results	= {
-						  9,
+						 10,
 						  2,			
 						  0, 		
 						  0, 	